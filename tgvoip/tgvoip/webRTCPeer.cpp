@@ -516,7 +516,10 @@ void webRTCPeer_t::OnIceCandidate(const webrtc::IceCandidateInterface *_candidat
         setState(peerState_t::CALL_HANGUP);
         return;
     }
-    m_cbIceCandidate(_candidate->sdp_mid(), _candidate->sdp_mline_index(), sdp, m_ctx);
+    if (!m_cbIceCandidate(_candidate->sdp_mid(), _candidate->sdp_mline_index(), sdp, m_ctx)) {
+        RTC_LOG(INFO) << "OnIceCandidate: failed to send ICE candidate";
+        setState(peerState_t::CALL_HANGUP);
+    }
 }
 
 // Ice candidates have been removed.
@@ -627,7 +630,10 @@ void webRTCPeer_t::OnSuccess(webrtc::SessionDescriptionInterface *_desc) {
                     ";maxaveragebitrate=" + bitRateStr);
     }
 
-    m_cbSdpSessionDescription(type, sdp, m_ctx);
+    if (!m_cbSdpSessionDescription(type, sdp, m_ctx)) {
+        RTC_LOG(INFO) << "webRTCPeer: failed to send SDP message";
+        setState(peerState_t::CALL_HANGUP);
+    }
 }
 
 void webRTCPeer_t::OnFailure(webrtc::RTCError _error) {
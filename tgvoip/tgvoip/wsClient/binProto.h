@@ -0,0 +1,160 @@
+/**
+* @file wsClient/binProto.h
+* @brief compact binary signaling protocol ("tgwss-bin")
+* @author Max Fomichev
+* @date 29.01.2020
+* @copyright Apache License v.2 (http://www.apache.org/licenses/LICENSE-2.0)
+*/
+
+#ifndef TESTWEBRTC_BINPROTO_H
+#define TESTWEBRTC_BINPROTO_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+/**
+ * Binary message: message type byte followed by fields, each field is 16 bit big endian length
+ * and the field's bytes. Fields of 0xffff bytes & longer have 0xffff length followed by 32 bit
+ * big endian length. Integers are 4 bytes big endian fields, booleans are 1 byte fields.
+ * The message types and the fields must be kept in sync with wss/binProto.h of tgwss.
+ */
+namespace binProto {
+    enum class msgType_t: uint8_t {
+        MT_LOGON = 1,       // token
+        MT_LOGON_STATUS,    // status
+        MT_CALL,            // to
+        MT_CALL_FROM,       // from
+        MT_CALL_STATUS,     // status
+        MT_OFFER,           // sdp
+        MT_ANSWER,          // sdp
+        MT_CANDIDATE,       // sdpMid, sdpMLineIndex, candidate
+        MT_INFO,            // subscriber
+        MT_ERROR,           // error
+        MT_JOIN,            // room
+        MT_JOIN_FROM,       // from
+        MT_JOIN_STATUS,     // status
+        MT_LEAVE,           // no fields
+        MT_LEAVE_FROM       // from
+    };
+
+    class reader_t final {
+    private:
+        const unsigned char *m_data;
+        std::size_t m_size;
+        std::size_t m_pos = 0;
+
+    public:
+        reader_t(const void *_data, std::size_t _size):
+                m_data(static_cast<const unsigned char *>(_data)), m_size(_size) {}
+
+        bool type(msgType_t &_type) noexcept {
+            if (m_pos + 1 > m_size) {
+                return false;
+            }
+            _type = static_cast<msgType_t>(m_data[m_pos++]);
+            return true;
+        }
+
+        bool field(std::string &_value) {
+            if (m_pos + 2 > m_size) {
+                return false;
+            }
+            std::size_t size = (static_cast<std::size_t>(m_data[m_pos]) << 8) | m_data[m_pos + 1];
+            m_pos += 2;
+            if (size == 0xffff) {
+                if (m_pos + 4 > m_size) {
+                    return false;
+                }
+                size = (static_cast<std::size_t>(m_data[m_pos]) << 24) |
+                       (static_cast<std::size_t>(m_data[m_pos + 1]) << 16) |
+                       (static_cast<std::size_t>(m_data[m_pos + 2]) << 8) |
+                       static_cast<std::size_t>(m_data[m_pos + 3]);
+                m_pos += 4;
+            }
+            if (size > m_size - m_pos) {
+                return false;
+            }
+            _value.assign(reinterpret_cast<const char *>(m_data + m_pos), size);
+            m_pos += size;
+            return true;
+        }
+
+        bool number(int32_t &_value) noexcept {
+            if ((m_pos + 6 > m_size) || (m_data[m_pos] != 0) || (m_data[m_pos + 1] != 4)) {
+                return false;
+            }
+            auto bytes = m_data + m_pos + 2;
+            _value = static_cast<int32_t>((static_cast<uint32_t>(bytes[0]) << 24) |
+                                          (static_cast<uint32_t>(bytes[1]) << 16) |
+                                          (static_cast<uint32_t>(bytes[2]) << 8) |
+                                          static_cast<uint32_t>(bytes[3]));
+            m_pos += 6;
+            return true;
+        }
+
+        bool flag(bool &_value) noexcept {
+            if ((m_pos + 3 > m_size) || (m_data[m_pos] != 0) || (m_data[m_pos + 1] != 1)) {
+                return false;
+            }
+            _value = (m_data[m_pos + 2] != 0);
+            m_pos += 3;
+            return true;
+        }
+    };
+
+    class writer_t final {
+    private:
+        std::vector<unsigned char> m_buf;
+
+    public:
+        explicit writer_t(msgType_t _type, std::size_t _sizeHint = 0) {
+            m_buf.reserve(1 + _sizeHint);
+            m_buf.push_back(static_cast<unsigned char>(_type));
+        }
+
+        /// @returns false if the field is too long to be encoded
+        bool field(const std::string &_value) {
+            if (static_cast<uint64_t>(_value.size()) > 0xffffffff) {
+                return false;
+            }
+            if (_value.size() < 0xffff) {
+                m_buf.push_back(static_cast<unsigned char>(_value.size() >> 8));
+                m_buf.push_back(static_cast<unsigned char>(_value.size() & 0xff));
+            } else {
+                // 0xffff is the escape of 32 bit length
+                auto size = static_cast<uint32_t>(_value.size());
+                const unsigned char bytes[6] = {0xff, 0xff,
+                                                static_cast<unsigned char>(size >> 24),
+                                                static_cast<unsigned char>((size >> 16) & 0xff),
+                                                static_cast<unsigned char>((size >> 8) & 0xff),
+                                                static_cast<unsigned char>(size & 0xff)};
+                m_buf.insert(m_buf.end(), bytes, bytes + sizeof(bytes));
+            }
+            m_buf.insert(m_buf.end(), _value.begin(), _value.end());
+            return true;
+        }
+
+        void number(int32_t _value) {
+            auto value = static_cast<uint32_t>(_value);
+            const unsigned char bytes[6] = {0, 4,
+                                            static_cast<unsigned char>(value >> 24),
+                                            static_cast<unsigned char>((value >> 16) & 0xff),
+                                            static_cast<unsigned char>((value >> 8) & 0xff),
+                                            static_cast<unsigned char>(value & 0xff)};
+            m_buf.insert(m_buf.end(), bytes, bytes + sizeof(bytes));
+        }
+
+        void flag(bool _value) {
+            m_buf.push_back(0);
+            m_buf.push_back(1);
+            m_buf.push_back(_value ? 1 : 0);
+        }
+
+        const unsigned char *data() const noexcept {return m_buf.data();}
+        std::size_t size() const noexcept {return m_buf.size();}
+    };
+} // namespace binProto
+
+#endif //TESTWEBRTC_BINPROTO_H
@@ -7,6 +7,7 @@
 */
 
 #include <cstring>
+#include <algorithm>
 
 #pragma GCC diagnostic push
 #pragma GCC diagnostic ignored "-Wunused-parameter"
@@ -16,10 +17,15 @@
 #include <rapidjson/document.h>
 #include <rapidjson/writer.h>
 
+#include "binProto.h"
 #include "wsClient.h"
 
 static uint32_t g_msgSizeLimit = 64 * 1024;
 static uint32_t g_packetSize = 1024;
+// max time the event processing thread waits for events (ms), commands of other threads wake it up earlier
+static const int g_serviceTimeout = 1000;
+// lws_protocols::id of the binary subprotocol
+static const unsigned int g_binProtoId = 1;
 
 wsClient_t::wsClient_t(std::string _host, uint16_t _port, std::string _path,
                        bool _ssl, uint16_t _ioTimeout,
@@ -30,11 +36,15 @@ wsClient_t::wsClient_t(std::string _host, uint16_t _port, std::string _path,
     RTC_LOG(INFO) << "wsClient: launching...";
     lws_set_log_level(0, nullptr);
 
-    std::memset(&m_wsProtocol, 0, sizeof(m_wsProtocol));
-    m_wsProtocol.name = m_protoName.c_str();
-    m_wsProtocol.callback = wsClient_t::cbService;
-    m_wsProtocol.tx_packet_size = g_packetSize;
-    m_wsProtocol.rx_buffer_size = g_packetSize;
+    std::memset(&m_wsProtocols, 0, sizeof(m_wsProtocols));
+    m_wsProtocols[0].name = m_binProtoName.c_str();
+    m_wsProtocols[0].callback = wsClient_t::cbService;
+    m_wsProtocols[0].tx_packet_size = g_packetSize;
+    m_wsProtocols[0].rx_buffer_size = g_packetSize;
+    m_wsProtocols[0].id = g_binProtoId;
+    m_wsProtocols[1] = m_wsProtocols[0];
+    m_wsProtocols[1].name = m_protoName.c_str();
+    m_wsProtocols[1].id = 0;
 
     memset(&m_contextInfo, 0, sizeof(m_contextInfo));
     m_contextInfo.port = CONTEXT_PORT_NO_LISTEN;
@@ -44,8 +54,17 @@ wsClient_t::wsClient_t(std::string _host, uint16_t _port, std::string _path,
     m_contextInfo.timeout_secs = static_cast<uint16_t>(_ioTimeout);
 //    m_contextInfo.ws_ping_pong_interval = static_cast<uint16_t>(_ioTimeout);
     m_contextInfo.ws_ping_pong_interval = static_cast<uint16_t>(_ioTimeout / 2);
-    m_contextInfo.protocols = &m_wsProtocol;
+    m_contextInfo.protocols = m_wsProtocols;
+#if !defined(LWS_WITHOUT_EXTENSIONS)
+    // SDP offers & answers compress well, the server may decline the extension
+    std::memset(&m_wsExtensions, 0, sizeof(m_wsExtensions));
+    m_wsExtensions[0].name = "permessage-deflate";
+    m_wsExtensions[0].callback = lws_extension_callback_pm_deflate;
+    m_wsExtensions[0].client_offer = "permessage-deflate; client_max_window_bits";
+    m_contextInfo.extensions = m_wsExtensions;
+#else
     m_contextInfo.extensions = nullptr;
+#endif
     m_contextInfo.gid = -1;
     m_contextInfo.uid = -1;
     m_contextInfo.user = this;
@@ -89,7 +108,7 @@ bool wsClient_t::start(cbOnRegistered_t _cbOnRegistered,
     m_connectInfo.context = m_context;
     m_connectInfo.host = m_connectInfo.address;
     m_connectInfo.origin = m_connectInfo.address;
-    m_connectInfo.protocol = m_protoName.c_str();
+    m_connectInfo.protocol = m_protoList.c_str();
     m_connectInfo.ietf_version_or_minus_one = -1;
     if (m_contextInfo.options & LWS_SERVER_OPTION_DO_SSL_GLOBAL_INIT) {
         m_connectInfo.ssl_connection = 1;
@@ -110,6 +129,9 @@ bool wsClient_t::start(cbOnRegistered_t _cbOnRegistered,
 
 void wsClient_t::stop() {
     m_stopFlag = true;
+    if (m_context != nullptr) {
+        lws_cancel_service(m_context);
+    }
     if (m_eventProcessingThread) {
         m_eventProcessingThread->join();
     }
@@ -139,21 +161,94 @@ bool wsClient_t::connect() noexcept {
 
 void wsClient_t::eventProcessingWorker(wsClient_t *_wsClient) {
     while (!_wsClient->m_stopFlag) {
-        // process lws events
-        lws_service(_wsClient->m_context, 0);
+        // process lws events, blocks till an event, a command of another thread or the timeout
+        lws_service(_wsClient->m_context, g_serviceTimeout);
+    }
+}
 
-        switch (_wsClient->state()) {
-            case wsClient_t::wsState_t::REGISTERED: {
-                if (!_wsClient->m_calleeToken.empty()) {
-                    _wsClient->callRequest();
-                }
+bool wsClient_t::serviceThread() const noexcept {
+    return m_eventProcessingThread && (m_eventProcessingThread->get_id() == std::this_thread::get_id());
+}
+
+void wsClient_t::callTo(std::string _to) {
+    if (serviceThread()) {
+        m_calleeToken = std::move(_to);
+        if (m_wsState == wsState_t::REGISTERED) {
+            callRequest();
+        }
+        return;
+    }
+    command_t callCmd;
+    callCmd.type = command_t::type_t::CALL;
+    callCmd.to = std::move(_to);
+    command(std::move(callCmd));
+}
+
+bool wsClient_t::command(command_t &&_command) noexcept {
+    try {
+        std::unique_lock<std::mutex> lck(m_commandsMtx);
+        if ((_command.type == command_t::type_t::WRITE) && !m_writable) {
+            RTC_LOG(INFO) << "wsClient: message sending failed, not connected";
+            return false;
+        }
+        m_commands.emplace_back(std::move(_command));
+    } catch (...) {
+        RTC_LOG(INFO) << "wsClient: failed to queue command (out of memory?)";
+        return false;
+    }
+    // LWS_CALLBACK_EVENT_WAIT_CANCELLED is called on the event processing thread
+    if (m_context != nullptr) {
+        lws_cancel_service(m_context);
+    }
+    return true;
+}
+
+void wsClient_t::writable(bool _writable) noexcept {
+    std::size_t dropped = 0;
+    {
+        std::unique_lock<std::mutex> lck(m_commandsMtx);
+        m_writable = _writable;
+        if (!_writable) {
+            // the callers were told the messages are sent, they learn it's not so by the disconnected callback
+            auto i = std::remove_if(m_commands.begin(), m_commands.end(), [](const command_t &_command) {
+                return _command.type == command_t::type_t::WRITE;
+            });
+            dropped = static_cast<std::size_t>(m_commands.end() - i);
+            m_commands.erase(i, m_commands.end());
+        }
+    }
+    if (dropped > 0) {
+        RTC_LOG(INFO) << "wsClient: connection closed, " << dropped << " queued message(s) dropped";
+    }
+}
+
+void wsClient_t::processCommands() {
+    std::vector<command_t> commands;
+    {
+        // the whole batch is taken at once, producers are never blocked by sending
+        std::unique_lock<std::mutex> lck(m_commandsMtx);
+        commands.swap(m_commands);
+    }
+    bool written = false;
+    for (auto &i:commands) {
+        switch (i.type) {
+            case command_t::type_t::WRITE: {
+                // WRITE commands are accepted & kept while the connection is writable only
+                m_writeBufQueue.emplace(std::move(i.buf));
+                written = true;
                 break;
             }
-            default: {
+            case command_t::type_t::CALL: {
+                m_calleeToken = std::move(i.to);
+                if (m_wsState == wsState_t::REGISTERED) {
+                    callRequest();
+                }
                 break;
             }
         }
-
+    }
+    if (written && (m_lws != nullptr)) {
+        lws_callback_on_writable(m_lws);
     }
 }
 
@@ -165,6 +260,15 @@ int wsClient_t::cbService(struct lws *_wsi, enum lws_callback_reasons _reason,
     }
 
     switch (_reason) {
+        case LWS_CALLBACK_EVENT_WAIT_CANCELLED: {
+            // another thread has queued commands
+            try {
+                wsClient->processCommands();
+            } catch (...) {
+                RTC_LOG(INFO) << "cbService: failed to process commands (out of memory?)";
+            }
+            break;
+        }
         case LWS_CALLBACK_OPENSSL_PERFORM_SERVER_CERT_VERIFICATION: {
             // !!! remove this callback processing from production code !!!
             X509_STORE_CTX_set_error(reinterpret_cast<X509_STORE_CTX *>(_user), X509_V_OK);
@@ -173,7 +277,10 @@ int wsClient_t::cbService(struct lws *_wsi, enum lws_callback_reasons _reason,
         case LWS_CALLBACK_CLIENT_ESTABLISHED: {
             wsClient->m_wsState = wsState_t::CONNECTED;
             wsClient->m_connectAttempts = 0;
-            RTC_LOG(INFO) << "cbService: connected to server";
+            wsClient->writable(true);
+            wsClient->m_binary = (lws_get_protocol(_wsi) != nullptr) && (lws_get_protocol(_wsi)->id == g_binProtoId);
+            RTC_LOG(INFO) << "cbService: connected to server, protocol "
+                          << (wsClient->m_binary ? wsClient->m_binProtoName : wsClient->m_protoName);
 
             wsClient->m_started = std::chrono::high_resolution_clock::now();
 
@@ -223,15 +330,9 @@ int wsClient_t::cbService(struct lws *_wsi, enum lws_callback_reasons _reason,
                 return 0; // no - wait for more data
             }
 
-            std::vector<char> jsonMsg = std::move(wsClient->m_readBuf);
-            if (!wsClient->parse(jsonMsg)) {
-                // callee is offline, trying to repeat 5 call attempts with 2 sec delay
-                if ((wsClient->state() == wsState_t::CALL_PENDING) && (wsClient->m_callAttempts < 5)) {
-                    std::this_thread::sleep_for(std::chrono::seconds(2));
-                    wsClient->m_callAttempts++;
-                    wsClient->callRequest();
-                    break;
-                }
+            std::vector<char> msg = std::move(wsClient->m_readBuf);
+            if (!(wsClient->m_binary ? wsClient->parseBin(msg) : wsClient->parse(msg))) {
+                // the server keeps the call until the callee logs on, so the callee is offline for good
                 return -1;
             }
             break;
@@ -248,7 +349,8 @@ int wsClient_t::cbService(struct lws *_wsi, enum lws_callback_reasons _reason,
                               << std::string(reinterpret_cast<char *>(buf.data()) + LWS_PRE,
                                              buf.size() - LWS_PRE);
 
-                if (lws_write(_wsi, buf.data() + LWS_PRE, buf.size() - LWS_PRE, LWS_WRITE_TEXT) < 0) {
+                if (lws_write(_wsi, buf.data() + LWS_PRE, buf.size() - LWS_PRE,
+                              wsClient->m_binary ? LWS_WRITE_BINARY : LWS_WRITE_TEXT) < 0) {
                     RTC_LOG(INFO) << "write: client " << _wsi << ", failed";
                     return -1;
                 }
@@ -271,18 +373,21 @@ int wsClient_t::cbService(struct lws *_wsi, enum lws_callback_reasons _reason,
                 return wsClient->connect();
             }
             wsClient->m_wsState = wsState_t::DISCONNECTED;
+            wsClient->writable(false);
             wsClient->m_cbOnDisconnected(wsClient->m_ctx);
             RTC_LOG(INFO) << "cbService: callback client connection error";
             break;
         }
         case LWS_CALLBACK_CLOSED: {
             wsClient->m_wsState = wsState_t::DISCONNECTED;
+            wsClient->writable(false);
             wsClient->m_cbOnDisconnected(wsClient->m_ctx);
             RTC_LOG(INFO) << "cbService: connection closed";
             break;
         }
         case LWS_CALLBACK_CLIENT_CLOSED: {
             wsClient->m_wsState = wsState_t::DISCONNECTED;
+            wsClient->writable(false);
             wsClient->m_cbOnDisconnected(wsClient->m_ctx);
             RTC_LOG(INFO) << "cbService: client's connection closed";
             break;
@@ -296,12 +401,21 @@ int wsClient_t::cbService(struct lws *_wsi, enum lws_callback_reasons _reason,
 
 bool wsClient_t::write(const void *_message, std::size_t _size) noexcept {
     if ((m_wsState == wsState_t::DISCONNECTED) || (m_wsState == wsState_t::CONNECTING)) {
+        // messages are encoded for the subprotocol selected by the server, so they can't wait for the connection
+        RTC_LOG(INFO) << "wsClient: message sending failed, not connected";
         return false;
     }
     try {
         std::vector<unsigned char> buf(LWS_PRE + _size, 0);
         std::memmove(buf.data() + LWS_PRE, _message, _size);
-        m_writeBufQueue.emplace(buf);
+        if (!serviceThread()) {
+            // WebRTC threads don't touch lws, the message is sent by the event processing thread
+            command_t writeCmd;
+            writeCmd.type = command_t::type_t::WRITE;
+            writeCmd.buf = std::move(buf);
+            return command(std::move(writeCmd));
+        }
+        m_writeBufQueue.emplace(std::move(buf));
         lws_callback_on_writable(m_lws);
         return true;
     } catch (...) {
@@ -323,6 +437,14 @@ bool wsClient_t::login() {
     if (m_wsState != wsState_t::CONNECTED) {
         return false;
     }
+    if (m_binary) {
+        binProto::writer_t writer(binProto::msgType_t::MT_LOGON, 2 + m_token.length());
+        if (writer.field(m_token) && write(writer.data(), writer.size())) {
+            m_wsState = wsState_t::REGISTERING;
+            return true;
+        }
+        return false;
+    }
     rapidjson::Document jsonMessage;
     jsonMessage.SetObject();
 
@@ -370,41 +492,14 @@ bool wsClient_t::parse(const std::vector<char> &_msg) {
             RTC_LOG(INFO) << "parse: subscriber disconnected";
             return false;
         }
-        if ((type == "logon") &&  json.HasMember("status") &&
-            json["status"].IsBool() && json["status"].GetBool()) {
-            RTC_LOG(INFO) << "parse: registered on signaling server";
-            m_wsState = wsState_t::REGISTERED;
-            m_cbOnRegistered(wsClient_t::sdpSessionDescription,
-                             wsClient_t::iceCandidate,
-                             this,
-                             m_ctx);
-            return true;
+        if ((type == "logon") &&  json.HasMember("status") && json["status"].IsBool()) {
+            return onLogon(json["status"].GetBool());
         }
         if ((type == "call") &&  json.HasMember("from") && json["from"].IsString()) {
-            m_remoteToken =  json["from"].GetString();
-            RTC_LOG(INFO) << "parse: call requested from " << m_remoteToken;
-            m_wsState = wsState_t::CALL_REQUESTED;
-
-            std::string reply = R"({"type": "call", "status": true})";
-            if (write(reply.c_str(), reply.length())) {
-                m_wsState = wsState_t::CALL_REQUESTED;
-                m_cbOnCall(false, m_ctx);
-                return true;
-            }
-
-            return true;
+            return onCallFrom(json["from"].GetString());
         }
         if ((type == "call") &&  json.HasMember("status") && json["status"].IsBool()) {
-            if (json["status"].GetBool()) {
-                RTC_LOG(INFO) << "parse: call requested";
-                m_wsState = wsState_t::CALL_CONFIRMED;
-                m_cbOnCall(true, m_ctx);
-                return true;
-            } else {
-                RTC_LOG(INFO) << "parse: subscriber is offline";
-                m_wsState = wsState_t::CALL_PENDING;
-                return false;
-            }
+            return onCallStatus(json["status"].GetBool());
         }
         if ((type == "offer") &&  (json.HasMember("sdp") && json["sdp"].IsString())) {
             RTC_LOG(INFO) << "parse: SDP offer received";
@@ -457,7 +552,136 @@ bool wsClient_t::parse(const std::vector<char> &_msg) {
     return false;
 }
 
+bool wsClient_t::parseBin(const std::vector<char> &_msg) {
+    RTC_LOG(INFO) << "parseBin: new message received from signaling server, size " << _msg.size();
+
+    binProto::reader_t reader(_msg.data(), _msg.size());
+    binProto::msgType_t type;
+    if (!reader.type(type)) {
+        RTC_LOG(INFO) << "parseBin: failed to parse server's message";
+        return false;
+    }
+
+    std::string value;
+    bool status;
+    switch (type) {
+        case binProto::msgType_t::MT_ERROR: {
+            if (reader.field(value)) {
+                RTC_LOG(INFO) << "parseBin: " << value;
+            }
+            return false;
+        }
+        case binProto::msgType_t::MT_INFO: {
+            RTC_LOG(INFO) << "parseBin: subscriber disconnected";
+            return false;
+        }
+        case binProto::msgType_t::MT_LOGON_STATUS: {
+            if (reader.flag(status)) {
+                return onLogon(status);
+            }
+            break;
+        }
+        case binProto::msgType_t::MT_CALL_FROM: {
+            if (reader.field(value)) {
+                return onCallFrom(std::move(value));
+            }
+            break;
+        }
+        case binProto::msgType_t::MT_CALL_STATUS: {
+            if (reader.flag(status)) {
+                return onCallStatus(status);
+            }
+            break;
+        }
+        case binProto::msgType_t::MT_OFFER:
+        case binProto::msgType_t::MT_ANSWER: {
+            if (reader.field(value)) {
+                bool isOffer = (type == binProto::msgType_t::MT_OFFER);
+                RTC_LOG(INFO) << "parseBin: SDP " << (isOffer ? "offer" : "answer") << " received";
+                m_wsState = wsState_t::SDP_NEGOTIATED;
+                return m_cbOnSdp(isOffer, value, m_ctx);
+            }
+            break;
+        }
+        case binProto::msgType_t::MT_CANDIDATE: {
+            std::string sdpMid;
+            int32_t sdpMLineIndex;
+            if (reader.field(sdpMid) && reader.number(sdpMLineIndex) && reader.field(value)) {
+                RTC_LOG(INFO) << "parseBin: ICE candidate description received";
+                m_wsState = wsState_t::ICE_NEGOTIATED;
+                return m_cbOnIce(sdpMid, sdpMLineIndex, value, m_ctx);
+            }
+            break;
+        }
+        default: {
+            break;
+        }
+    }
+
+    RTC_LOG(INFO) << "parseBin: failed to process reply";
+    return false;
+}
+
+bool wsClient_t::onLogon(bool _status) {
+    if (!_status) {
+        return false;
+    }
+    RTC_LOG(INFO) << "parse: registered on signaling server";
+    m_wsState = wsState_t::REGISTERED;
+    m_cbOnRegistered(wsClient_t::sdpSessionDescription,
+                     wsClient_t::iceCandidate,
+                     this,
+                     m_ctx);
+    if (!m_calleeToken.empty()) {
+        return callRequest();
+    }
+    return true;
+}
+
+bool wsClient_t::onCallFrom(std::string _from) {
+    m_remoteToken = std::move(_from);
+    RTC_LOG(INFO) << "parse: call requested from " << m_remoteToken;
+    m_wsState = wsState_t::CALL_REQUESTED;
+
+    bool sent;
+    if (m_binary) {
+        binProto::writer_t writer(binProto::msgType_t::MT_CALL_STATUS, 3);
+        writer.flag(true);
+        sent = write(writer.data(), writer.size());
+    } else {
+        std::string reply = R"({"type": "call", "status": true})";
+        sent = write(reply.c_str(), reply.length());
+    }
+    if (sent) {
+        m_wsState = wsState_t::CALL_REQUESTED;
+        m_cbOnCall(false, m_ctx);
+        return true;
+    }
+
+    return true;
+}
+
+bool wsClient_t::onCallStatus(bool _status) {
+    if (_status) {
+        RTC_LOG(INFO) << "parse: call requested";
+        m_wsState = wsState_t::CALL_CONFIRMED;
+        m_cbOnCall(true, m_ctx);
+        return true;
+    }
+    RTC_LOG(INFO) << "parse: subscriber is offline (call request expired)";
+    m_wsState = wsState_t::CALL_PENDING;
+    return false;
+}
+
 bool wsClient_t::callRequest() {
+    if (m_binary) {
+        binProto::writer_t writer(binProto::msgType_t::MT_CALL, 2 + m_calleeToken.length());
+        if (writer.field(m_calleeToken) && write(writer.data(), writer.size())) {
+            m_wsState = wsState_t::CALL_REQUESTED;
+            return true;
+        }
+        return false;
+    }
     rapidjson::Document jsonMessage;
     jsonMessage.SetObject();
 
@@ -483,6 +707,21 @@ bool wsClient_t::callRequest() {
 bool wsClient_t::sdpSessionDescription(const std::string &_type,
                                        const std::string &_sdpMsg,
                                        void *_ctx) {
+    auto wsClient = reinterpret_cast<wsClient_t *>(_ctx);
+    if (wsClient->m_binary) {
+        if ((_type != "offer") && (_type != "answer")) {
+            RTC_LOG(INFO) << "sdpSessionDescription: unsupported SDP type " << _type;
+            return false;
+        }
+        binProto::writer_t writer((_type == "offer") ? binProto::msgType_t::MT_OFFER : binProto::msgType_t::MT_ANSWER,
+                                  2 + _sdpMsg.length());
+        if (writer.field(_sdpMsg) && wsClient->write(writer.data(), writer.size())) {
+            wsClient->m_wsState = wsState_t::SDP_NEGOTIATING;
+            return true;
+        }
+        return false;
+    }
+
     rapidjson::Document jsonMessage;
     jsonMessage.SetObject();
 
@@ -502,7 +741,6 @@ bool wsClient_t::sdpSessionDescription(const std::string &_type,
     rapidjson::Writer<rapidjson::StringBuffer> writer(jsonStr);
     jsonMessage.Accept(writer);
 
-    auto wsClient = reinterpret_cast<wsClient_t *>(_ctx);
     if (wsClient->write(jsonStr.GetString(), jsonStr.GetLength())) {
         wsClient->m_wsState = wsState_t::SDP_NEGOTIATING;
         return true;
@@ -515,6 +753,18 @@ bool wsClient_t::iceCandidate(const std::string &_sdpMID,
                               int _sdpMLineIndex,
                               const std::string &_sdpCandidate,
                               void *_ctx) {
+    auto wsClient = reinterpret_cast<wsClient_t *>(_ctx);
+    if (wsClient->m_binary) {
+        binProto::writer_t writer(binProto::msgType_t::MT_CANDIDATE, 12 + _sdpMID.length() + _sdpCandidate.length());
+        bool encoded = writer.field(_sdpMID);
+        writer.number(_sdpMLineIndex);
+        if (encoded && writer.field(_sdpCandidate) && wsClient->write(writer.data(), writer.size())) {
+            wsClient->m_wsState = wsState_t::ICE_NEGOTIATING;
+            return true;
+        }
+        return false;
+    }
+
     rapidjson::Document jsonMessage;
     jsonMessage.SetObject();
 
@@ -538,7 +788,6 @@ bool wsClient_t::iceCandidate(const std::string &_sdpMID,
     rapidjson::Writer<rapidjson::StringBuffer> writer(jsonStr);
     jsonMessage.Accept(writer);
 
-    auto wsClient = reinterpret_cast<wsClient_t *>(_ctx);
     if (wsClient->write(jsonStr.GetString(), jsonStr.GetLength())) {
         wsClient->m_wsState = wsState_t::ICE_NEGOTIATING;
         return true;
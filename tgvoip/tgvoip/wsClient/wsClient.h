@@ -15,6 +15,7 @@
 #include <chrono>
 #include <atomic>
 #include <thread>
+#include <mutex>
 #include <functional>
 
 #include <libwebsockets.h>
@@ -69,17 +70,43 @@ private:
 
     std::atomic<wsState_t> m_wsState {wsState_t::DISCONNECTED};
 
-    struct lws_protocols m_wsProtocol {};
+    // "tgwss-bin" (binary) & "tgwss" (JSON) subprotocols, null terminated
+    struct lws_protocols m_wsProtocols[3] {};
+    // permessage-deflate, offered to the server, null terminated
+    struct lws_extension m_wsExtensions[2] {};
     lws_context_creation_info m_contextInfo {};
     lws_client_connect_info m_connectInfo {};
     lws *m_lws = nullptr;
 
     lws_context *m_context = nullptr;
     std::string m_protoName = "tgwss";
+    std::string m_binProtoName = "tgwss-bin";
+    // subprotocols offered to the server, the binary one is preferred
+    std::string m_protoList = m_binProtoName + "," + m_protoName;
+    // the server has selected the binary subprotocol
+    bool m_binary = false;
 
     std::vector<char> m_readBuf;
+    // messages to send, accessed by the event processing thread only
     std::queue<std::vector<unsigned char>> m_writeBufQueue;
 
+    // commands of other threads (WebRTC signaling & the owner) to the event processing thread
+    struct command_t {
+        enum class type_t {
+            WRITE,
+            CALL
+        };
+        type_t type;
+        // LWS_PRE + message to send (WRITE)
+        std::vector<unsigned char> buf;
+        // callee token (CALL)
+        std::string to;
+    };
+    std::mutex m_commandsMtx;
+    std::vector<command_t> m_commands;
+    // the connection is established & not closed, WRITE commands are refused otherwise (guarded by m_commandsMtx)
+    bool m_writable = false;
+
     std::unique_ptr<std::thread> m_eventProcessingThread;
     std::atomic<bool> m_stopFlag {false};
 
@@ -93,7 +120,6 @@ private:
     std::string m_calleeToken;
 
     uint8_t m_connectAttempts = 0;
-    uint8_t m_callAttempts = 0;
 
     std::chrono::time_point<std::chrono::high_resolution_clock> m_started;
 
@@ -118,11 +144,14 @@ public:
 //    void processEvents();
 
     wsState_t state() const noexcept {return m_wsState;}
-    void callTo(std::string _to) {m_calleeToken = std::move(_to);}
+    /// requests a call to _to once registered on the server (or right away if registered already)
+    void callTo(std::string _to);
 
+    /// @returns false if the message can't be sent: the connection is not established yet or is closed
     static bool sdpSessionDescription(const std::string &_type,
                                       const std::string &_sdpMsg,
                                       void *_ctx);
+    /// @returns false if the message can't be sent: the connection is not established yet or is closed
     static bool iceCandidate(const std::string &_sdpMID,
                              int _sdpMLineIndex,
                              const std::string &_sdpCandidate,
@@ -135,8 +164,20 @@ private:
 
     bool connect() noexcept;
     bool write(const void *_message, std::size_t _size) noexcept;
+    /// queues _command to the event processing thread & wakes it up,
+    /// @returns false if it's a WRITE command & the connection is not writable
+    bool command(command_t &&_command) noexcept;
+    /// sets the connection writable or not, the WRITE commands of a closed connection are dropped
+    void writable(bool _writable) noexcept;
+    /// runs the commands queued by other threads, called by the event processing thread
+    void processCommands();
+    bool serviceThread() const noexcept;
     bool login();
     bool parse(const std::vector<char> &_msg);
+    bool parseBin(const std::vector<char> &_msg);
+    bool onLogon(bool _status);
+    bool onCallFrom(std::string _from);
+    bool onCallStatus(bool _status);
     bool callRequest();
 };
 
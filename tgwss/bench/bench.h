@@ -0,0 +1,54 @@
+/**
+* @file bench/bench.h
+* @brief micro benchmarks helpers
+* @author Max Fomichev
+* @date 29.01.2020
+* @copyright Apache License v.2 (http://www.apache.org/licenses/LICENSE-2.0)
+*/
+
+#ifndef TGWSS_BENCH_H
+#define TGWSS_BENCH_H
+
+#include <cstdint>
+#include <cstdlib>
+#include <chrono>
+#include <string>
+#include <iostream>
+#include <iomanip>
+
+namespace tgwss {
+    namespace bench {
+        /// @returns nanoseconds _func takes
+        template<typename func_t>
+        uint64_t measure(func_t &&_func) {
+            auto started = std::chrono::steady_clock::now();
+            _func();
+            return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                    std::chrono::steady_clock::now() - started).count());
+        }
+
+        /// prints time per operation & throughput of _ops operations taken _ns nanoseconds
+        inline void report(const std::string &_name, uint64_t _ops, uint64_t _ns) {
+            double nsPerOp = (_ops > 0) ? static_cast<double>(_ns) / static_cast<double>(_ops) : 0;
+            double opsPerSec = (_ns > 0) ? static_cast<double>(_ops) * 1e9 / static_cast<double>(_ns) : 0;
+            std::cout << std::left << std::setw(40) << _name << std::right
+                      << std::setw(12) << _ops << " ops "
+                      << std::fixed << std::setprecision(1)
+                      << std::setw(12) << nsPerOp << " ns/op "
+                      << std::setw(12) << opsPerSec / 1e6 << " Mops/s" << std::endl;
+        }
+
+        /// @returns the numeric value of option argument _arg, exits if it's not a number in [_min, _max]
+        inline uint64_t number(const char *_arg, uint64_t _min, uint64_t _max) {
+            char *end = nullptr;
+            auto value = std::strtoull(_arg, &end, 10);
+            if ((end == _arg) || (*end != '\0') || (value < _min) || (value > _max)) {
+                std::cerr << "wrong option value: " << _arg << std::endl;
+                std::exit(EXIT_FAILURE);
+            }
+            return value;
+        }
+    } // namespace bench
+} // namespace tgwss
+
+#endif //TGWSS_BENCH_H
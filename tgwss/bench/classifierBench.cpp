@@ -0,0 +1,173 @@
+/**
+* @file bench/classifierBench.cpp
+* @brief signaling message classification benchmark: logon & call messages parsed into a rapidjson DOM
+* as before msgClassifier_t vs msgClassifier_t SAX & binary parsing, with heap allocations per message
+* @author Max Fomichev
+* @date 29.01.2020
+* @copyright Apache License v.2 (http://www.apache.org/licenses/LICENSE-2.0)
+*/
+
+#include <getopt.h>
+
+#include <cstdint>
+#include <cstdlib>
+#include <new>
+#include <vector>
+#include <string>
+#include <iostream>
+
+#include <rapidjson/document.h>
+
+#include "json/msgClassifier.h"
+#include "bench/bench.h"
+
+// heap allocations of the process, the benchmark is single threaded
+static uint64_t g_allocations = 0;
+
+void *operator new(std::size_t _size) {
+    ++g_allocations;
+    if (auto p = std::malloc((_size > 0) ? _size : 1)) {
+        return p;
+    }
+    throw std::bad_alloc();
+}
+
+void operator delete(void *_p) noexcept {
+    std::free(_p);
+}
+
+void operator delete(void *_p, std::size_t) noexcept {
+    std::free(_p);
+}
+
+static void usage(const char *_name) {
+    std::cout  << _name << " [options]" << std::endl
+               << "  Options:" << std::endl
+               << "    -n, --messages <number>" << std::endl
+               << "      Messages of each kind parsed (default 1000000)" << std::endl
+               << "    -h, --help" << std::endl
+               << "      Show usage information and exit" << std::endl;
+}
+
+static struct option longopts[] = {
+        {"messages",    required_argument, nullptr, 'n'},
+        {"help",        no_argument,       nullptr, 'h'},
+        {nullptr,       0,                 nullptr, 0}
+};
+
+// a binary protocol message of one field: type byte, 16 bit big endian length & the field
+static std::string binMessage(uint8_t _type, const std::string &_field) {
+    std::string msg;
+    msg.push_back(static_cast<char>(_type));
+    msg.push_back(static_cast<char>((_field.size() >> 8) & 0xff));
+    msg.push_back(static_cast<char>(_field.size() & 0xff));
+    msg.append(_field);
+    return msg;
+}
+
+// logon & the new call branch of retransmit as they were before msgClassifier_t
+static bool domLogon(const std::string &_msg, std::string &_token) {
+    rapidjson::Document json;
+    json.Parse(_msg.data(), _msg.size());
+    if (json.HasParseError() || !json.HasMember("type") || !json["type"].IsString() ||
+        (std::string(json["type"].GetString()) != "logon") || !json.HasMember("token") ||
+        !json["token"].IsString()) {
+        return false;
+    }
+    _token = json["token"].GetString();
+    return true;
+}
+
+static bool domCall(const std::string &_msg, std::string &_to) {
+    rapidjson::Document json;
+    json.Parse(_msg.data(), _msg.size());
+    if (json.HasParseError() || !json.HasMember("type") || !json["type"].IsString() ||
+        (std::string(json["type"].GetString()) != "call") || !json.HasMember("to") ||
+        !json["to"].IsString()) {
+        return false;
+    }
+    _to = json["to"].GetString();
+    return true;
+}
+
+// runs _parse _messages times, prints time & heap allocations per message
+template<typename parse_t>
+static void run(const std::string &_name, uint64_t _messages, uint64_t &_matches, parse_t &&_parse) {
+    auto allocations = g_allocations;
+    auto ns = tgwss::bench::measure([&]() {
+        for (uint64_t i = 0; i < _messages; ++i) {
+            _matches += _parse() ? 1 : 0;
+        }
+    });
+    allocations = g_allocations - allocations;
+    tgwss::bench::report(_name, _messages, ns);
+    std::cout << "    heap allocations per message: "
+              << static_cast<double>(allocations) / static_cast<double>(_messages) << std::endl;
+}
+
+int main(int argc, char *argv[]) {
+    uint64_t messages = 1000000;
+
+    int ch;
+    while ((ch = getopt_long(argc, argv, "n:h", longopts, nullptr)) != -1) {
+        switch (ch) {
+            case 'n':
+                messages = tgwss::bench::number(optarg, 1, 1000000000);
+                break;
+            case 'h':
+                usage(argv[0]);
+                return EXIT_SUCCESS;
+            default:
+                usage(argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+
+    try {
+        // the messages of wsClient_t::login & callRequest, 32 hex digits tokens
+        const std::string token = "0123456789abcdef0123456789abcdef";
+        const std::string logon = R"({"type": "logon", "token": ")" + token + R"("})";
+        const std::string call = R"({"type": "call", "to": ")" + token + R"("})";
+        const std::string logonBin = binMessage(1, token);
+        const std::string callBin = binMessage(3, token);
+
+        uint64_t matches = 0;
+        std::string field;
+        tgwss::msgClassifier_t classifier;
+
+        run("logon, DOM (before)", messages, matches, [&]() {
+            return domLogon(logon, field);
+        });
+        run("logon, msgClassifier_t", messages, matches, [&]() {
+            return classifier.parse(logon.data(), logon.size()) &&
+                   (classifier.msgType() == tgwss::msgClassifier_t::msgType_t::MT_LOGON) &&
+                   classifier.token().present();
+        });
+        run("logon, msgClassifier_t binary", messages, matches, [&]() {
+            return classifier.parseBin(logonBin.data(), logonBin.size()) &&
+                   (classifier.msgType() == tgwss::msgClassifier_t::msgType_t::MT_LOGON) &&
+                   classifier.token().present();
+        });
+
+        run("call, DOM (before)", messages, matches, [&]() {
+            return domCall(call, field);
+        });
+        run("call, msgClassifier_t", messages, matches, [&]() {
+            return classifier.parse(call.data(), call.size()) &&
+                   (classifier.msgType() == tgwss::msgClassifier_t::msgType_t::MT_CALL) &&
+                   classifier.to().present();
+        });
+        run("call, msgClassifier_t binary", messages, matches, [&]() {
+            return classifier.parseBin(callBin.data(), callBin.size()) &&
+                   (classifier.msgType() == tgwss::msgClassifier_t::msgType_t::MT_CALL) &&
+                   classifier.to().present();
+        });
+
+        std::cout << "classified: " << matches << " of " << 6 * messages << std::endl;
+    } catch (const std::exception &_e) {
+        std::cerr << _e.what() << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    return EXIT_SUCCESS;
+}
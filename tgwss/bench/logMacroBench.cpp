@@ -0,0 +1,124 @@
+/**
+* @file bench/logMacroBench.cpp
+* @brief receive path logging benchmark at "notice" level: debug records with eagerly built arguments vs
+* TGWSS_LOG, which evaluates the arguments of enabled records only
+* @author Max Fomichev
+* @date 29.01.2020
+* @copyright Apache License v.2 (http://www.apache.org/licenses/LICENSE-2.0)
+*/
+
+#include <getopt.h>
+
+#include <cstdint>
+#include <vector>
+#include <string>
+#include <iostream>
+
+#include "logger/logger.h"
+#include "bench/bench.h"
+
+static void usage(const char *_name) {
+    std::cout  << _name << " [options]" << std::endl
+               << "  Options:" << std::endl
+               << "    -n, --messages <number>" << std::endl
+               << "      Received messages (default 1000000)" << std::endl
+               << "    -z, --size <bytes>" << std::endl
+               << "      Size of a received message (default 2048, SDP)" << std::endl
+               << "    -l, --level <level>" << std::endl
+               << "      Logging level, critical...debug (default notice)" << std::endl
+               << "    -f, --file <name>" << std::endl
+               << "      Log file (default /dev/null)" << std::endl
+               << "    -h, --help" << std::endl
+               << "      Show usage information and exit" << std::endl;
+}
+
+static struct option longopts[] = {
+        {"messages",    required_argument, nullptr, 'n'},
+        {"size",        required_argument, nullptr, 'z'},
+        {"level",       required_argument, nullptr, 'l'},
+        {"file",        required_argument, nullptr, 'f'},
+        {"help",        no_argument,       nullptr, 'h'},
+        {nullptr,       0,                 nullptr, 0}
+};
+
+// the debug records of a relayed message (received from a peer & written to its subscriber) as they were before
+// TGWSS_LOG: the level is checked by log() when the arguments are already built
+static void eager(tgwss::logger_t &_logger, const void *_lws, const char *_data, std::size_t _size) {
+    _logger.log(tgwss::logger_t::logLevel_t::LL_DEBUG,
+                "wscbService: data received, client {:p}, message: {:s}, size {:d}, remaining size: {:d}",
+                _lws, std::string(_data, _size), _size, 0);
+    _logger.log(tgwss::logger_t::logLevel_t::LL_DEBUG,
+                "write: client {:p}, message: {:s}, size {:d}",
+                _lws, std::string(_data, _size), _size);
+}
+
+// the same records through TGWSS_LOG
+static void lazy(tgwss::logger_t &_logger, const void *_lws, const char *_data, std::size_t _size) {
+    TGWSS_LOG(&_logger, LL_DEBUG,
+              FMT_STRING("wscbService: data received, client {:p}, message: {:s}, size {:d}, remaining size: {:d}"),
+              _lws, fmt::string_view(_data, _size), _size, 0);
+    TGWSS_LOG(&_logger, LL_DEBUG,
+              FMT_STRING("write: client {:p}, message: {:s}, size {:d}"),
+              _lws, fmt::string_view(_data, _size), _size);
+}
+
+int main(int argc, char *argv[]) {
+    uint64_t messages = 1000000;
+    uint64_t size = 2048;
+    std::string level = "notice";
+    std::string fileName = "/dev/null";
+
+    int ch;
+    while ((ch = getopt_long(argc, argv, "n:z:l:f:h", longopts, nullptr)) != -1) {
+        switch (ch) {
+            case 'n':
+                messages = tgwss::bench::number(optarg, 1, 1000000000);
+                break;
+            case 'z':
+                size = tgwss::bench::number(optarg, 1, 16 * 1024 * 1024);
+                break;
+            case 'l':
+                level = optarg;
+                break;
+            case 'f':
+                fileName = optarg;
+                break;
+            case 'h':
+                usage(argv[0]);
+                return EXIT_SUCCESS;
+            default:
+                usage(argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+
+    try {
+        auto &logger = tgwss::logger_t::logger();
+        logger.init("bench", fileName, level);
+
+        std::vector<char> data(size, 'x');
+        const int peer = 0;
+        // the functions are called by pointer, so the records aren't optimized out as unused
+        using receive_t = void (*)(tgwss::logger_t &, const void *, const char *, std::size_t);
+        volatile receive_t receive = eager;
+        auto ns = tgwss::bench::measure([&]() {
+            for (uint64_t i = 0; i < messages; ++i) {
+                receive(logger, &peer, data.data(), data.size());
+            }
+        });
+        tgwss::bench::report("eager arguments, level " + level, messages, ns);
+
+        receive = lazy;
+        ns = tgwss::bench::measure([&]() {
+            for (uint64_t i = 0; i < messages; ++i) {
+                receive(logger, &peer, data.data(), data.size());
+            }
+        });
+        tgwss::bench::report("TGWSS_LOG, level " + level, messages, ns);
+    } catch (const std::exception &_e) {
+        std::cerr << _e.what() << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,254 @@
+/**
+* @file bench/loggerBench.cpp
+* @brief logger benchmark: producers' cost of a record with the per-thread record rings of logger_t vs
+* the mutex protected queue of the previous logger
+* @author Max Fomichev
+* @date 29.01.2020
+* @copyright Apache License v.2 (http://www.apache.org/licenses/LICENSE-2.0)
+*/
+
+#include <getopt.h>
+
+#include <cstdint>
+#include <ctime>
+#include <vector>
+#include <string>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <queue>
+#include <map>
+#include <tuple>
+#include <fstream>
+#include <iostream>
+
+#include "logger/logger.h"
+#include "bench/bench.h"
+
+static void usage(const char *_name) {
+    std::cout  << _name << " [options]" << std::endl
+               << "  Options:" << std::endl
+               << "    -t, --threads <number>" << std::endl
+               << "      Logging threads (default 8)" << std::endl
+               << "    -n, --records <number>" << std::endl
+               << "      Records logged by each thread (default 100000)" << std::endl
+               << "    -b, --burst <number>" << std::endl
+               << "      Records logged by a thread at once, 0 - all at once (default 32)" << std::endl
+               << "    -p, --pause <us>" << std::endl
+               << "      Pause of a thread between bursts (default 1000)" << std::endl
+               << "    -f, --file <name>" << std::endl
+               << "      Log file, truncated (default /tmp/tgwss-bench-logger.log)" << std::endl
+               << "    -h, --help" << std::endl
+               << "      Show usage information and exit" << std::endl;
+}
+
+static struct option longopts[] = {
+        {"threads",     required_argument, nullptr, 't'},
+        {"records",     required_argument, nullptr, 'n'},
+        {"burst",       required_argument, nullptr, 'b'},
+        {"pause",       required_argument, nullptr, 'p'},
+        {"file",        required_argument, nullptr, 'f'},
+        {"help",        no_argument,       nullptr, 'h'},
+        {nullptr,       0,                 nullptr, 0}
+};
+
+// the previous logger_t: records are formatted into strings & pushed to one queue under the lock,
+// the worker writes them one by one
+class mutexLogger_t final {
+private:
+    using logRecord_t = std::tuple<std::chrono::time_point<std::chrono::system_clock>, int, std::string>;
+    std::queue<logRecord_t> m_logQueue;
+    std::mutex m_mtxLog;
+    std::condition_variable m_cvLog;
+    bool m_checkQueueFlag = false;
+    bool m_workFlag = true;
+    std::map<std::thread::id, uint64_t> m_dispatchThreads;
+    std::ofstream m_ofs;
+    std::thread m_workerThread;
+
+public:
+    explicit mutexLogger_t(const std::string &_fileName):
+            m_ofs(_fileName, std::ofstream::out | std::ofstream::trunc) {
+        m_workerThread = std::thread(&mutexLogger_t::worker, this);
+    }
+    ~mutexLogger_t() {
+        {
+            std::unique_lock<std::mutex> lck(m_mtxLog);
+            m_workFlag = false;
+            m_checkQueueFlag = true;
+            m_cvLog.notify_one();
+        }
+        m_workerThread.join();
+    }
+
+    mutexLogger_t(const mutexLogger_t &) = delete;
+    void operator=(const mutexLogger_t &) = delete;
+    mutexLogger_t(const mutexLogger_t &&) = delete;
+    void operator=(const mutexLogger_t &&) = delete;
+
+    template<typename... args_t>
+    void log(const std::string &_fmt, const args_t &..._args) noexcept {
+        auto timeStamp = std::chrono::system_clock::now();
+        try {
+            std::unique_lock<std::mutex> lck(m_mtxLog);
+            if (m_dispatchThreads.find(std::this_thread::get_id()) == m_dispatchThreads.end()) {
+                m_dispatchThreads[std::this_thread::get_id()] = m_dispatchThreads.size();
+            }
+            std::string buffer = "[bench] [THR#" + std::to_string(m_dispatchThreads[std::this_thread::get_id()]) +
+                                 "] [INFO] " + _fmt;
+            m_logQueue.push(logRecord_t(timeStamp, 0, fmt::vformat(buffer, fmt::make_format_args(_args...))));
+            m_checkQueueFlag = true;
+            m_cvLog.notify_one();
+        } catch (...) {}
+    }
+
+private:
+    void worker() noexcept {
+        while (true) {
+            logRecord_t logRecord;
+            {
+                std::unique_lock<std::mutex> lck(m_mtxLog);
+                while (!m_checkQueueFlag) {
+                    m_cvLog.wait(lck);
+                }
+                if (m_logQueue.empty()) {
+                    m_checkQueueFlag = false;
+                    if (!m_workFlag) {
+                        break;
+                    }
+                    continue;
+                }
+                logRecord = std::move(m_logQueue.front());
+                m_logQueue.pop();
+            }
+            auto recTime = std::chrono::duration_cast<std::chrono::milliseconds>(
+                    std::get<0>(logRecord).time_since_epoch()).count();
+            auto recTimeInSec = static_cast<long>(recTime / 1000);
+            struct tm timeInfo{};
+            localtime_r(&recTimeInSec, &timeInfo);
+            m_ofs << 1900 + timeInfo.tm_year << "." << timeInfo.tm_mon + 1 << "." << timeInfo.tm_mday << " "
+                  << timeInfo.tm_hour << ":" << timeInfo.tm_min << ":" << timeInfo.tm_sec << "."
+                  << recTime % 1000 << ": " << std::get<2>(logRecord) << std::endl;
+        }
+    }
+};
+
+struct params_t {
+    uint64_t threads = 8;
+    uint64_t records = 100000;
+    uint64_t burst = 32;
+    uint64_t pause = 1000;
+    std::string fileName = "/tmp/tgwss-bench-logger.log";
+};
+
+// runs the logging threads, @returns the nanoseconds they spent in _log in total
+template<typename log_t>
+static uint64_t run(const params_t &_params, log_t &&_log) {
+    std::vector<uint64_t> threadNs(_params.threads, 0);
+    std::vector<std::thread> threads;
+    for (uint64_t t = 0; t < _params.threads; ++t) {
+        threads.emplace_back([&, t]() {
+            uint64_t ns = 0;
+            auto burst = (_params.burst > 0) ? _params.burst : _params.records;
+            for (uint64_t i = 0; i < _params.records; i += burst) {
+                auto n = std::min(burst, _params.records - i);
+                ns += tgwss::bench::measure([&]() {
+                    for (uint64_t j = 0; j < n; ++j) {
+                        _log(i + j);
+                    }
+                });
+                if (_params.pause > 0) {
+                    std::this_thread::sleep_for(std::chrono::microseconds(_params.pause));
+                }
+            }
+            threadNs[t] = ns;
+        });
+    }
+    for (auto &i:threads) {
+        i.join();
+    }
+    uint64_t ns = 0;
+    for (auto i:threadNs) {
+        ns += i;
+    }
+    return ns;
+}
+
+static uint64_t lines(const std::string &_fileName) {
+    std::ifstream ifs(_fileName);
+    uint64_t lines = 0;
+    std::string line;
+    while (std::getline(ifs, line)) {
+        ++lines;
+    }
+    return lines;
+}
+
+int main(int argc, char *argv[]) {
+    params_t params;
+
+    int ch;
+    while ((ch = getopt_long(argc, argv, "t:n:b:p:f:h", longopts, nullptr)) != -1) {
+        switch (ch) {
+            case 't':
+                params.threads = tgwss::bench::number(optarg, 1, 256);
+                break;
+            case 'n':
+                params.records = tgwss::bench::number(optarg, 1, 100000000);
+                break;
+            case 'b':
+                params.burst = tgwss::bench::number(optarg, 0, 100000000);
+                break;
+            case 'p':
+                params.pause = tgwss::bench::number(optarg, 0, 1000000);
+                break;
+            case 'f':
+                params.fileName = optarg;
+                break;
+            case 'h':
+                usage(argv[0]);
+                return EXIT_SUCCESS;
+            default:
+                usage(argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+
+    try {
+        const auto total = params.threads * params.records;
+        // a typical record of the receive path
+        const int peer = 0;
+
+        uint64_t ns;
+        {
+            mutexLogger_t logger(params.fileName);
+            ns = run(params, [&](uint64_t _i) {
+                logger.log("retransmit: waiting for more data, client peer {:p}, message {:d}", fmt::ptr(&peer), _i);
+            });
+        }
+        tgwss::bench::report("mutex & queue (before)", total, ns);
+        std::cout << "    written " << lines(params.fileName) << " of " << total << " records" << std::endl;
+
+        { // truncate
+            std::ofstream ofs(params.fileName, std::ofstream::out | std::ofstream::trunc);
+        }
+        auto &logger = tgwss::logger_t::logger();
+        logger.init("bench", params.fileName, "info");
+        ns = run(params, [&](uint64_t _i) {
+            TGWSS_LOG(&logger, LL_INFO, FMT_STRING("retransmit: waiting for more data, client peer {:p}, message {:d}"),
+                      fmt::ptr(&peer), _i);
+        });
+        tgwss::bench::report("per-thread rings", total, ns);
+        // the batch is written within the max latency of the logger
+        std::this_thread::sleep_for(std::chrono::milliseconds(500));
+        auto written = lines(params.fileName);
+        std::cout << "    written " << written << " lines of " << total
+                  << " records (dropped records are reported by a warning line)" << std::endl;
+    } catch (const std::exception &_e) {
+        std::cerr << _e.what() << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    return EXIT_SUCCESS;
+}
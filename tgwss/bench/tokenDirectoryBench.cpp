@@ -0,0 +1,183 @@
+/**
+* @file bench/tokenDirectoryBench.cpp
+* @brief token directory benchmark: logon, call lookup & logoff at millions of online tokens
+* @author Max Fomichev
+* @date 29.01.2020
+* @copyright Apache License v.2 (http://www.apache.org/licenses/LICENSE-2.0)
+*/
+
+#include <getopt.h>
+
+#include <cstdint>
+#include <cstdio>
+#include <vector>
+#include <string>
+#include <thread>
+#include <random>
+#include <algorithm>
+#include <iostream>
+
+#include "wss/tokenDirectory.h"
+#include "bench/bench.h"
+
+static void usage(const char *_name) {
+    std::cout  << _name << " [options]" << std::endl
+               << "  Options:" << std::endl
+               << "    -n, --tokens <number>" << std::endl
+               << "      Online tokens (default 1000000)" << std::endl
+               << "    -t, --threads <number>" << std::endl
+               << "      Threads looking tokens up concurrently (default 4)" << std::endl
+               << "    -s, --scans <number>" << std::endl
+               << "      Lookups by full scan of the peers, as before the directory (default 100)" << std::endl
+               << "    -h, --help" << std::endl
+               << "      Show usage information and exit" << std::endl;
+}
+
+static struct option longopts[] = {
+        {"tokens",      required_argument, nullptr, 'n'},
+        {"threads",     required_argument, nullptr, 't'},
+        {"scans",       required_argument, nullptr, 's'},
+        {"help",        no_argument,       nullptr, 'h'},
+        {nullptr,       0,                 nullptr, 0}
+};
+
+// 32 hex digits, as the tokens of the clients
+static std::string token(uint64_t _seed, uint64_t _i) {
+    char buf[33];
+    std::snprintf(buf, sizeof(buf), "%016llx%016llx", static_cast<unsigned long long>(_seed),
+                  static_cast<unsigned long long>(_i * 0x9e3779b97f4a7c15ULL));
+    return std::string(buf, 32);
+}
+
+int main(int argc, char *argv[]) {
+    uint64_t tokensNum = 1000000;
+    uint64_t threadsNum = 4;
+    uint64_t scansNum = 100;
+
+    int ch;
+    while ((ch = getopt_long(argc, argv, "n:t:s:h", longopts, nullptr)) != -1) {
+        switch (ch) {
+            case 'n':
+                tokensNum = tgwss::bench::number(optarg, 1, 100000000);
+                break;
+            case 't':
+                threadsNum = tgwss::bench::number(optarg, 1, 256);
+                break;
+            case 's':
+                scansNum = tgwss::bench::number(optarg, 0, 1000000);
+                break;
+            case 'h':
+                usage(argv[0]);
+                return EXIT_SUCCESS;
+            default:
+                usage(argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+
+    std::vector<std::string> tokens;
+    tokens.reserve(tokensNum);
+    for (uint64_t i = 0; i < tokensNum; ++i) {
+        tokens.emplace_back(token(1, i));
+    }
+    // lookups come in no particular order
+    std::vector<std::size_t> order(tokensNum);
+    for (std::size_t i = 0; i < order.size(); ++i) {
+        order[i] = i;
+    }
+    std::shuffle(order.begin(), order.end(), std::mt19937_64(42));
+
+    tgwss::tokenDirectory_t directory;
+    directory.reserve(tokensNum);
+    std::size_t found = 0;
+
+    auto ns = tgwss::bench::measure([&]() {
+        for (uint64_t i = 0; i < tokensNum; ++i) {
+            tgwss::tokenDirectory_t::entry_t entry;
+            entry.lws = reinterpret_cast<struct lws *>(static_cast<uintptr_t>(i + 1) * 16);
+            entry.shard = i % 8;
+            entry.id = i + 1;
+            found += directory.insert(tokens[i], entry) ? 1 : 0;
+        }
+    });
+    tgwss::bench::report("insert (logon)", tokensNum, ns);
+
+    ns = tgwss::bench::measure([&]() {
+        for (auto i:order) {
+            found += directory.insert(tokens[i], tgwss::tokenDirectory_t::entry_t()) ? 1 : 0;
+        }
+    });
+    tgwss::bench::report("insert duplicate (logon rejected)", tokensNum, ns);
+
+    ns = tgwss::bench::measure([&]() {
+        tgwss::tokenDirectory_t::entry_t entry;
+        for (auto i:order) {
+            found += directory.find(tokens[i], entry) ? 1 : 0;
+        }
+    });
+    tgwss::bench::report("find online (call)", tokensNum, ns);
+
+    std::vector<std::string> offline;
+    offline.reserve(tokensNum);
+    for (uint64_t i = 0; i < tokensNum; ++i) {
+        offline.emplace_back(token(2, i));
+    }
+    ns = tgwss::bench::measure([&]() {
+        tgwss::tokenDirectory_t::entry_t entry;
+        for (const auto &i:offline) {
+            found += directory.find(i, entry) ? 1 : 0;
+        }
+    });
+    tgwss::bench::report("find offline (call)", tokensNum, ns);
+
+    // service threads look tokens up at once, each its own part of the lookups
+    std::vector<std::size_t> threadFound(threadsNum, 0);
+    ns = tgwss::bench::measure([&]() {
+        std::vector<std::thread> threads;
+        for (uint64_t t = 0; t < threadsNum; ++t) {
+            threads.emplace_back([&, t]() {
+                tgwss::tokenDirectory_t::entry_t entry;
+                std::size_t n = 0;
+                for (std::size_t i = t; i < order.size(); i += threadsNum) {
+                    n += directory.find(tokens[order[i]], entry) ? 1 : 0;
+                }
+                threadFound[t] = n;
+            });
+        }
+        for (auto &i:threads) {
+            i.join();
+        }
+    });
+    tgwss::bench::report("find online, " + std::to_string(threadsNum) + " threads", tokensNum, ns);
+    for (auto i:threadFound) {
+        found += i;
+    }
+
+    // the lookup replaced by the directory: all the peers are scanned for the token
+    if (scansNum > 0) {
+        ns = tgwss::bench::measure([&]() {
+            for (uint64_t i = 0; i < scansNum; ++i) {
+                const auto &wanted = tokens[order[i % order.size()]];
+                for (const auto &j:tokens) {
+                    if (j == wanted) {
+                        ++found;
+                        break;
+                    }
+                }
+            }
+        });
+        tgwss::bench::report("find online by scan (before)", scansNum, ns);
+    }
+
+    ns = tgwss::bench::measure([&]() {
+        for (auto i:order) {
+            auto lws = reinterpret_cast<struct lws *>(static_cast<uintptr_t>(i + 1) * 16);
+            found += directory.remove(tokens[i], lws) ? 1 : 0;
+        }
+    });
+    tgwss::bench::report("remove (logoff)", tokensNum, ns);
+
+    std::cout << "online after remove: " << directory.size() << ", matches: " << found << std::endl;
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,266 @@
+/**
+* @file bench/writeBatchBench.cpp
+* @brief writeable callback simulation: a burst of SDP & ICE candidate frames written to a plain loopback socket
+* one frame per callback vs the corked batch of network.write_batch frames, lws & TLS are not involved
+* @author Max Fomichev
+* @date 29.01.2020
+* @copyright Apache License v.2 (http://www.apache.org/licenses/LICENSE-2.0)
+*/
+
+#include <unistd.h>
+#include <getopt.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#if defined(__linux__)
+#include <linux/tcp.h>
+#else
+#include <netinet/tcp.h>
+#endif
+
+#include <cstdint>
+#include <cstring>
+#include <vector>
+#include <string>
+#include <thread>
+#include <atomic>
+#include <stdexcept>
+#include <iostream>
+
+#include "bench/bench.h"
+
+static void usage(const char *_name) {
+    std::cout  << _name << " [options]" << std::endl
+               << "  Options:" << std::endl
+               << "    -n, --bursts <number>" << std::endl
+               << "      Bursts written (default 10000)" << std::endl
+               << "    -i, --candidates <number>" << std::endl
+               << "      ICE candidates following the SDP in a burst (default 8)" << std::endl
+               << "    -z, --sdp-size <bytes>" << std::endl
+               << "      Size of the SDP (default 2048)" << std::endl
+               << "    -c, --candidate-size <bytes>" << std::endl
+               << "      Size of an ICE candidate message (default 180)" << std::endl
+               << "    -b, --write-batch <frames>" << std::endl
+               << "      network.write_batch of the batched mode (default 16)" << std::endl
+               << "    -h, --help" << std::endl
+               << "      Show usage information and exit" << std::endl;
+}
+
+static struct option longopts[] = {
+        {"bursts",          required_argument, nullptr, 'n'},
+        {"candidates",      required_argument, nullptr, 'i'},
+        {"sdp-size",        required_argument, nullptr, 'z'},
+        {"candidate-size",  required_argument, nullptr, 'c'},
+        {"write-batch",     required_argument, nullptr, 'b'},
+        {"help",            no_argument,       nullptr, 'h'},
+        {nullptr,           0,                 nullptr, 0}
+};
+
+// a server to client websocket frame: unmasked header & payload
+static std::string frame(std::size_t _size, char _fill) {
+    std::string frame;
+    frame.push_back(static_cast<char>(0x81));
+    if (_size < 126) {
+        frame.push_back(static_cast<char>(_size));
+    } else {
+        frame.push_back(static_cast<char>(126));
+        frame.push_back(static_cast<char>((_size >> 8) & 0xff));
+        frame.push_back(static_cast<char>(_size & 0xff));
+    }
+    frame.append(_size, _fill);
+    return frame;
+}
+
+static void setOpt(int _fd, int _level, int _name, int _value) {
+    if (setsockopt(_fd, _level, _name, &_value, sizeof(_value)) != 0) {
+        throw std::runtime_error("setsockopt failed");
+    }
+}
+
+static uint64_t segsOut(int _fd) {
+#if defined(__linux__)
+    struct tcp_info info;
+    socklen_t size = sizeof(info);
+    std::memset(&info, 0, sizeof(info));
+    if (getsockopt(_fd, IPPROTO_TCP, TCP_INFO, &info, &size) == 0) {
+        return info.tcpi_segs_out;
+    }
+#else
+    (void) _fd;
+#endif
+    return 0;
+}
+
+// a connected loopback TCP pair, the server side is set up as libwebsockets does (TCP_NODELAY)
+struct connection_t {
+    int server = -1;
+    int client = -1;
+
+    connection_t() {
+        int listener = socket(AF_INET, SOCK_STREAM, 0);
+        struct sockaddr_in addr;
+        std::memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        socklen_t addrSize = sizeof(addr);
+        if ((listener < 0) ||
+            (bind(listener, reinterpret_cast<struct sockaddr *>(&addr), sizeof(addr)) != 0) ||
+            (listen(listener, 1) != 0) ||
+            (getsockname(listener, reinterpret_cast<struct sockaddr *>(&addr), &addrSize) != 0)) {
+            throw std::runtime_error("failed to listen on loopback");
+        }
+        client = socket(AF_INET, SOCK_STREAM, 0);
+        if ((client < 0) || (connect(client, reinterpret_cast<struct sockaddr *>(&addr), sizeof(addr)) != 0)) {
+            throw std::runtime_error("failed to connect");
+        }
+        server = accept(listener, nullptr, nullptr);
+        close(listener);
+        if (server < 0) {
+            throw std::runtime_error("failed to accept");
+        }
+        setOpt(server, IPPROTO_TCP, TCP_NODELAY, 1);
+    }
+    ~connection_t() {
+        close(server);
+        close(client);
+    }
+
+    connection_t(const connection_t &) = delete;
+    void operator=(const connection_t &) = delete;
+};
+
+struct result_t {
+    uint64_t ns = 0;
+    uint64_t callbacks = 0;
+    uint64_t syscalls = 0;
+    uint64_t segments = 0;
+};
+
+// writes _bursts bursts of _frames, _batch frames per writeable callback (TCP_CORK around the batch if it's above 1)
+static result_t run(const std::vector<std::string> &_frames, uint64_t _bursts, std::size_t _batch) {
+    connection_t conn;
+    std::size_t burstSize = 0;
+    for (const auto &i:_frames) {
+        burstSize += i.size();
+    }
+
+    // the client reads everything, each burst is written when the previous one is received
+    std::atomic<uint64_t> received {0};
+    std::thread reader([&]() {
+        std::vector<char> buf(256 * 1024);
+        ssize_t rc;
+        while ((rc = read(conn.client, buf.data(), buf.size())) > 0) {
+            received.fetch_add(static_cast<uint64_t>(rc), std::memory_order_release);
+        }
+    });
+
+    result_t result;
+    auto segments = segsOut(conn.server);
+    result.ns = tgwss::bench::measure([&]() {
+        uint64_t sent = 0;
+        for (uint64_t b = 0; b < _bursts; ++b) {
+            for (std::size_t i = 0; i < _frames.size();) {
+                // the writeable callback
+                struct pollfd pfd = {conn.server, POLLOUT, 0};
+                if (poll(&pfd, 1, -1) != 1) {
+                    throw std::runtime_error("poll failed");
+                }
+                ++result.callbacks;
+                ++result.syscalls;
+                bool cork = (_batch > 1);
+#if defined(TCP_CORK)
+                if (cork) {
+                    setOpt(conn.server, IPPROTO_TCP, TCP_CORK, 1);
+                    ++result.syscalls;
+                }
+#endif
+                for (std::size_t n = 0; (n < _batch) && (i < _frames.size()); ++n, ++i) {
+                    // one write() per frame, as lws_write() of a plain connection
+                    const auto &f = _frames[i];
+                    if (write(conn.server, f.data(), f.size()) != static_cast<ssize_t>(f.size())) {
+                        throw std::runtime_error("write failed");
+                    }
+                    ++result.syscalls;
+                }
+#if defined(TCP_CORK)
+                if (cork) {
+                    setOpt(conn.server, IPPROTO_TCP, TCP_CORK, 0);
+                    ++result.syscalls;
+                }
+#endif
+            }
+            sent += burstSize;
+            while (received.load(std::memory_order_acquire) < sent) {
+                std::this_thread::yield();
+            }
+        }
+    });
+    result.segments = segsOut(conn.server) - segments;
+
+    shutdown(conn.server, SHUT_WR);
+    reader.join();
+    return result;
+}
+
+static void report(const std::string &_name, const result_t &_result, uint64_t _bursts) {
+    tgwss::bench::report(_name, _bursts, _result.ns);
+    auto perBurst = [_bursts](uint64_t _value) {return static_cast<double>(_value) / static_cast<double>(_bursts);};
+    std::cout << "    per burst: " << perBurst(_result.callbacks) << " writeable callbacks, "
+              << perBurst(_result.syscalls) << " syscalls, "
+              << perBurst(_result.segments) << " TCP segments" << std::endl;
+}
+
+int main(int argc, char *argv[]) {
+    uint64_t bursts = 10000;
+    uint64_t candidates = 8;
+    uint64_t sdpSize = 2048;
+    uint64_t candidateSize = 180;
+    uint64_t writeBatch = 16;
+
+    int ch;
+    while ((ch = getopt_long(argc, argv, "n:i:z:c:b:h", longopts, nullptr)) != -1) {
+        switch (ch) {
+            case 'n':
+                bursts = tgwss::bench::number(optarg, 1, 10000000);
+                break;
+            case 'i':
+                candidates = tgwss::bench::number(optarg, 0, 1024);
+                break;
+            case 'z':
+                sdpSize = tgwss::bench::number(optarg, 1, 65535);
+                break;
+            case 'c':
+                candidateSize = tgwss::bench::number(optarg, 1, 65535);
+                break;
+            case 'b':
+                writeBatch = tgwss::bench::number(optarg, 1, 1024);
+                break;
+            case 'h':
+                usage(argv[0]);
+                return EXIT_SUCCESS;
+            default:
+                usage(argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+
+    try {
+        // an offer or an answer followed by trickle ICE candidates, as queued to the other side of a call
+        std::vector<std::string> frames;
+        frames.emplace_back(frame(sdpSize, 's'));
+        for (uint64_t i = 0; i < candidates; ++i) {
+            frames.emplace_back(frame(candidateSize, 'c'));
+        }
+
+        // the writeable callback is simulated over raw sockets, with ssl every frame is still its own TLS record:
+        // lws_write() makes one SSL_write() per frame in both modes
+        report("one frame per callback", run(frames, bursts, 1), bursts);
+        report("write_batch " + std::to_string(writeBatch) + ", corked", run(frames, bursts, writeBatch), bursts);
+    } catch (const std::exception &_e) {
+        std::cerr << _e.what() << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    return EXIT_SUCCESS;
+}
@@ -8,6 +8,8 @@
 
 #include <vector>
 #include <fstream>
+#include <thread>
+#include <algorithm>
 
 #include "rapidjson/error/en.h"
 
@@ -36,6 +38,17 @@ namespace tgwss {
     }
 
     void confParser_t::init(const std::string &_confFile) {
+        auto conf = m_conf;
+        m_conf = conf_t();
+        try {
+            parse(_confFile);
+        } catch (...) {
+            m_conf = std::move(conf);
+            throw;
+        }
+    }
+
+    void confParser_t::parse(const std::string &_confFile) {
         loadFile(_confFile);
 
         if (!m_parser) {
@@ -54,7 +67,7 @@ namespace tgwss {
         if ((tmpBindPort < 1) || (tmpBindPort > 65535)) {
             throw std::runtime_error("confParser: wrong \"bind_port\" value");
         }
-        m_bindPort = static_cast<uint16_t>(tmpBindPort);
+        m_conf.bindPort = static_cast<uint16_t>(tmpBindPort);
 
         if (!m_parser->json()["network"].HasMember("conn_limit") ||
             !m_parser->json()["network"]["conn_limit"].IsUint()) {
@@ -64,7 +77,38 @@ namespace tgwss {
         if ((tmpConnLimit < 1) || (tmpConnLimit > 65535)) {
             throw std::runtime_error("confParser: wrong \"conn_limit\" value");
         }
-        m_connLimit = static_cast<uint16_t>(tmpConnLimit);
+        m_conf.connLimit = static_cast<uint16_t>(tmpConnLimit);
+
+        // optional, 0 - no limit
+        if (m_parser->json()["network"].HasMember("conn_limit_per_ip")) {
+            if (!m_parser->json()["network"]["conn_limit_per_ip"].IsUint()) {
+                throw std::runtime_error("confParser: failed to parse \"conn_limit_per_ip\" parameter");
+            }
+            uint32_t tmpConnLimitPerIp = m_parser->json()["network"]["conn_limit_per_ip"].GetUint();
+            if (tmpConnLimitPerIp > m_conf.connLimit) {
+                throw std::runtime_error("confParser: wrong \"conn_limit_per_ip\" value");
+            }
+            m_conf.connLimitPerIp = static_cast<uint16_t>(tmpConnLimitPerIp);
+        }
+
+        // optional, new connections per second, 0 - no limit
+        if (m_parser->json()["network"].HasMember("conn_rate")) {
+            if (!m_parser->json()["network"]["conn_rate"].IsUint()) {
+                throw std::runtime_error("confParser: failed to parse \"conn_rate\" parameter");
+            }
+            m_conf.connRate = m_parser->json()["network"]["conn_rate"].GetUint();
+            m_conf.connBurst = m_conf.connRate;
+        }
+
+        if (m_parser->json()["network"].HasMember("conn_burst")) {
+            if (!m_parser->json()["network"]["conn_burst"].IsUint()) {
+                throw std::runtime_error("confParser: failed to parse \"conn_burst\" parameter");
+            }
+            m_conf.connBurst = m_parser->json()["network"]["conn_burst"].GetUint();
+            if (m_conf.connBurst < m_conf.connRate) {
+                throw std::runtime_error("confParser: wrong \"conn_burst\" value");
+            }
+        }
 
         if (!m_parser->json()["network"].HasMember("io_timeout") ||
             !m_parser->json()["network"]["io_timeout"].IsUint()) {
@@ -74,21 +118,185 @@ namespace tgwss {
         if ((tmpIOTimeout < 1) || (tmpIOTimeout > 65535)) {
             throw std::runtime_error("confParser: wrong \"io_timeout\" value");
         }
-        m_ioTimeout = static_cast<uint16_t>(tmpIOTimeout);
+        m_conf.ioTimeout = static_cast<uint16_t>(tmpIOTimeout);
+
+        // optional, 0 - one service thread per CPU core
+        if (m_parser->json()["network"].HasMember("threads")) {
+            if (!m_parser->json()["network"]["threads"].IsUint()) {
+                throw std::runtime_error("confParser: failed to parse \"threads\" parameter");
+            }
+            uint32_t tmpThreads = m_parser->json()["network"]["threads"].GetUint();
+            if (tmpThreads == 0) {
+                tmpThreads = std::max(std::thread::hardware_concurrency(), 1U);
+            }
+            if (tmpThreads > 256) {
+                throw std::runtime_error("confParser: wrong \"threads\" value");
+            }
+            m_conf.threads = static_cast<uint16_t>(tmpThreads);
+        }
+
+        // optional, number of worker processes sharing bind_port, 0 - one worker per CPU core
+        if (m_parser->json()["network"].HasMember("workers")) {
+            if (!m_parser->json()["network"]["workers"].IsUint()) {
+                throw std::runtime_error("confParser: failed to parse \"workers\" parameter");
+            }
+            uint32_t tmpWorkers = m_parser->json()["network"]["workers"].GetUint();
+            if (tmpWorkers == 0) {
+                tmpWorkers = std::max(std::thread::hardware_concurrency(), 1U);
+            }
+            if (tmpWorkers > 256) {
+                throw std::runtime_error("confParser: wrong \"workers\" value");
+            }
+            m_conf.workers = static_cast<uint16_t>(tmpWorkers);
+        }
+
+        // optional, per peer write queue limits
+        if (m_parser->json()["network"].HasMember("queue_msg_limit")) {
+            if (!m_parser->json()["network"]["queue_msg_limit"].IsUint()) {
+                throw std::runtime_error("confParser: failed to parse \"queue_msg_limit\" parameter");
+            }
+            uint32_t tmpQueueMsgLimit = m_parser->json()["network"]["queue_msg_limit"].GetUint();
+            if ((tmpQueueMsgLimit < 1) || (tmpQueueMsgLimit > 65535)) {
+                throw std::runtime_error("confParser: wrong \"queue_msg_limit\" value");
+            }
+            m_conf.queueMsgLimit = static_cast<uint16_t>(tmpQueueMsgLimit);
+        }
+
+        if (m_parser->json()["network"].HasMember("queue_size_limit")) {
+            if (!m_parser->json()["network"]["queue_size_limit"].IsUint()) {
+                throw std::runtime_error("confParser: failed to parse \"queue_size_limit\" parameter");
+            }
+            m_conf.queueSizeLimit = m_parser->json()["network"]["queue_size_limit"].GetUint();
+            if (m_conf.queueSizeLimit < 1024) {
+                throw std::runtime_error("confParser: wrong \"queue_size_limit\" value");
+            }
+        }
+
+        if (m_parser->json()["network"].HasMember("queue_policy")) {
+            if (!m_parser->json()["network"]["queue_policy"].IsString()) {
+                throw std::runtime_error("confParser: failed to parse \"queue_policy\" parameter");
+            }
+            std::string tmpQueuePolicy = m_parser->json()["network"]["queue_policy"].GetString();
+            if (tmpQueuePolicy == "drop_oldest") {
+                m_conf.queueDropOldest = true;
+            } else if (tmpQueuePolicy == "close") {
+                m_conf.queueDropOldest = false;
+            } else {
+                throw std::runtime_error("confParser: wrong \"queue_policy\" value");
+            }
+        }
+
+        // optional, max number of messages sent at once, 1 - one message per socket writeable event
+        if (m_parser->json()["network"].HasMember("write_batch")) {
+            if (!m_parser->json()["network"]["write_batch"].IsUint()) {
+                throw std::runtime_error("confParser: failed to parse \"write_batch\" parameter");
+            }
+            uint32_t tmpWriteBatch = m_parser->json()["network"]["write_batch"].GetUint();
+            if ((tmpWriteBatch < 1) || (tmpWriteBatch > 1024)) {
+                throw std::runtime_error("confParser: wrong \"write_batch\" value");
+            }
+            m_conf.writeBatch = static_cast<uint16_t>(tmpWriteBatch);
+        }
+
+        // optional, calls to offline tokens wait for the callee that long (sec), 0 - rejected at once
+        if (m_parser->json()["network"].HasMember("call_ttl")) {
+            if (!m_parser->json()["network"]["call_ttl"].IsUint()) {
+                throw std::runtime_error("confParser: failed to parse \"call_ttl\" parameter");
+            }
+            uint32_t tmpCallTtl = m_parser->json()["network"]["call_ttl"].GetUint();
+            if (tmpCallTtl > 3600) {
+                throw std::runtime_error("confParser: wrong \"call_ttl\" value");
+            }
+            m_conf.callTtl = static_cast<uint16_t>(tmpCallTtl);
+        }
+
+        // optional, max size of a client's message (bytes)
+        if (m_parser->json()["network"].HasMember("msg_size_limit")) {
+            if (!m_parser->json()["network"]["msg_size_limit"].IsUint()) {
+                throw std::runtime_error("confParser: failed to parse \"msg_size_limit\" parameter");
+            }
+            uint32_t tmpMsgSizeLimit = m_parser->json()["network"]["msg_size_limit"].GetUint();
+            if ((tmpMsgSizeLimit < 1024) || (tmpMsgSizeLimit > 16 * 1024 * 1024)) {
+                throw std::runtime_error("confParser: wrong \"msg_size_limit\" value");
+            }
+            m_conf.msgSizeLimit = tmpMsgSizeLimit;
+        }
+
+        // optional, messages of paired peers are relayed as their parts are received
+        if (m_parser->json()["network"].HasMember("cut_through")) {
+            if (!m_parser->json()["network"]["cut_through"].IsBool()) {
+                throw std::runtime_error("confParser: failed to parse \"cut_through\" parameter");
+            }
+            m_conf.cutThrough = m_parser->json()["network"]["cut_through"].GetBool();
+        }
+
+        // optional, max number of members of a group call room, 0 - rooms are disabled
+        if (m_parser->json()["network"].HasMember("room_size_limit")) {
+            if (!m_parser->json()["network"]["room_size_limit"].IsUint()) {
+                throw std::runtime_error("confParser: failed to parse \"room_size_limit\" parameter");
+            }
+            uint32_t tmpRoomSizeLimit = m_parser->json()["network"]["room_size_limit"].GetUint();
+            if (tmpRoomSizeLimit > 10000) {
+                throw std::runtime_error("confParser: wrong \"room_size_limit\" value");
+            }
+            m_conf.roomSizeLimit = static_cast<uint16_t>(tmpRoomSizeLimit);
+        }
+
+        // optional, HTTP port of /metrics endpoint, 0 - disabled
+        if (m_parser->json()["network"].HasMember("metrics_port")) {
+            if (!m_parser->json()["network"]["metrics_port"].IsUint()) {
+                throw std::runtime_error("confParser: failed to parse \"metrics_port\" parameter");
+            }
+            uint32_t tmpMetricsPort = m_parser->json()["network"]["metrics_port"].GetUint();
+            if ((tmpMetricsPort > 65535) || (tmpMetricsPort == m_conf.bindPort)) {
+                throw std::runtime_error("confParser: wrong \"metrics_port\" value");
+            }
+            m_conf.metricsPort = static_cast<uint16_t>(tmpMetricsPort);
+        }
+
+        // optional, permessage-deflate extension
+        if (m_parser->json()["network"].HasMember("deflate")) {
+            if (!m_parser->json()["network"]["deflate"].IsBool()) {
+                throw std::runtime_error("confParser: failed to parse \"deflate\" parameter");
+            }
+            m_conf.deflate = m_parser->json()["network"]["deflate"].GetBool();
+        }
+
+        if (m_parser->json()["network"].HasMember("deflate_window_bits")) {
+            if (!m_parser->json()["network"]["deflate_window_bits"].IsUint()) {
+                throw std::runtime_error("confParser: failed to parse \"deflate_window_bits\" parameter");
+            }
+            uint32_t tmpWindowBits = m_parser->json()["network"]["deflate_window_bits"].GetUint();
+            if ((tmpWindowBits < 9) || (tmpWindowBits > 15)) {
+                throw std::runtime_error("confParser: wrong \"deflate_window_bits\" value");
+            }
+            m_conf.deflateWindowBits = static_cast<uint8_t>(tmpWindowBits);
+        }
+
+        if (m_parser->json()["network"].HasMember("deflate_mem_level")) {
+            if (!m_parser->json()["network"]["deflate_mem_level"].IsUint()) {
+                throw std::runtime_error("confParser: failed to parse \"deflate_mem_level\" parameter");
+            }
+            uint32_t tmpMemLevel = m_parser->json()["network"]["deflate_mem_level"].GetUint();
+            if ((tmpMemLevel < 1) || (tmpMemLevel > 9)) {
+                throw std::runtime_error("confParser: wrong \"deflate_mem_level\" value");
+            }
+            m_conf.deflateMemLevel = static_cast<uint8_t>(tmpMemLevel);
+        }
 
         if (!m_parser->json()["network"].HasMember("ssl") ||
             !m_parser->json()["network"]["ssl"].IsBool()) {
             throw std::runtime_error("confParser: failed to parse \"ssl\" parameter");
         }
-        m_ssl = m_parser->json()["network"]["ssl"].GetBool();
+        m_conf.ssl = m_parser->json()["network"]["ssl"].GetBool();
 
-        if (m_ssl) {
+        if (m_conf.ssl) {
             if (!m_parser->json()["network"].HasMember("cert_file") ||
                 !m_parser->json()["network"]["cert_file"].IsString()) {
                 throw std::runtime_error("confParser: failed to parse \"cert_file\" parameter");
             }
-            m_certFile = m_parser->json()["network"]["cert_file"].GetString();
-            if (m_certFile.empty()) {
+            m_conf.certFile = m_parser->json()["network"]["cert_file"].GetString();
+            if (m_conf.certFile.empty()) {
                 throw std::runtime_error("confParser: wrong \"cert_file\" value");
             }
 
@@ -96,10 +304,116 @@ namespace tgwss {
                 !m_parser->json()["network"]["pkey_file"].IsString()) {
                 throw std::runtime_error("confParser: failed to parse \"pkey_file\" parameter");
             }
-            m_pkeyFile = m_parser->json()["network"]["pkey_file"].GetString();
-            if (m_pkeyFile.empty()) {
+            m_conf.pkeyFile = m_parser->json()["network"]["pkey_file"].GetString();
+            if (m_conf.pkeyFile.empty()) {
                 throw std::runtime_error("confParser: wrong \"pkey_file\" value");
             }
+
+            // optional, 0 - server side session cache is disabled
+            if (m_parser->json()["network"].HasMember("tls_session_cache")) {
+                if (!m_parser->json()["network"]["tls_session_cache"].IsUint()) {
+                    throw std::runtime_error("confParser: failed to parse \"tls_session_cache\" parameter");
+                }
+                m_conf.tlsSessionCache = m_parser->json()["network"]["tls_session_cache"].GetUint();
+                if (m_conf.tlsSessionCache > 1024 * 1024) {
+                    throw std::runtime_error("confParser: wrong \"tls_session_cache\" value");
+                }
+            }
+
+            if (m_parser->json()["network"].HasMember("tls_session_lifetime")) {
+                if (!m_parser->json()["network"]["tls_session_lifetime"].IsUint()) {
+                    throw std::runtime_error("confParser: failed to parse \"tls_session_lifetime\" parameter");
+                }
+                m_conf.tlsSessionLifetime = m_parser->json()["network"]["tls_session_lifetime"].GetUint();
+                if ((m_conf.tlsSessionLifetime == 0) || (m_conf.tlsSessionLifetime > 86400)) {
+                    throw std::runtime_error("confParser: wrong \"tls_session_lifetime\" value");
+                }
+            }
+
+            if (m_parser->json()["network"].HasMember("tls_session_tickets")) {
+                if (!m_parser->json()["network"]["tls_session_tickets"].IsBool()) {
+                    throw std::runtime_error("confParser: failed to parse \"tls_session_tickets\" parameter");
+                }
+                m_conf.tlsSessionTickets = m_parser->json()["network"]["tls_session_tickets"].GetBool();
+            }
+
+            // a ticket is decrypted by the current or the previous key, so it outlives its key by a period
+            if (m_parser->json()["network"].HasMember("tls_ticket_key_rotation")) {
+                if (!m_parser->json()["network"]["tls_ticket_key_rotation"].IsUint()) {
+                    throw std::runtime_error("confParser: failed to parse \"tls_ticket_key_rotation\" parameter");
+                }
+                m_conf.tlsTicketKeyRotation = m_parser->json()["network"]["tls_ticket_key_rotation"].GetUint();
+            }
+            if ((m_conf.tlsTicketKeyRotation < m_conf.tlsSessionLifetime) ||
+                (m_conf.tlsTicketKeyRotation > 7 * 86400)) {
+                throw std::runtime_error("confParser: wrong \"tls_ticket_key_rotation\" value");
+            }
+
+            if (m_parser->json()["network"].HasMember("ktls")) {
+                if (!m_parser->json()["network"]["ktls"].IsBool()) {
+                    throw std::runtime_error("confParser: failed to parse \"ktls\" parameter");
+                }
+                m_conf.ktls = m_parser->json()["network"]["ktls"].GetBool();
+            }
+        }
+
+        // optional, Unix socket the listening socket is handed off over to a new tgwss process
+        if (m_parser->json()["network"].HasMember("upgrade_socket")) {
+            if (!m_parser->json()["network"]["upgrade_socket"].IsString()) {
+                throw std::runtime_error("confParser: failed to parse \"upgrade_socket\" parameter");
+            }
+            m_conf.upgradeSocket = m_parser->json()["network"]["upgrade_socket"].GetString();
+            if (m_conf.upgradeSocket.empty() || (m_conf.upgradeSocket.length() >= 108)) {
+                throw std::runtime_error("confParser: wrong \"upgrade_socket\" value");
+            }
+        }
+
+        if (m_parser->json()["network"].HasMember("drain_timeout")) {
+            if (!m_parser->json()["network"]["drain_timeout"].IsUint()) {
+                throw std::runtime_error("confParser: failed to parse \"drain_timeout\" parameter");
+            }
+            uint32_t tmpDrainTimeout = m_parser->json()["network"]["drain_timeout"].GetUint();
+            if (tmpDrainTimeout > 65535) {
+                throw std::runtime_error("confParser: wrong \"drain_timeout\" value");
+            }
+            m_conf.drainTimeout = static_cast<uint16_t>(tmpDrainTimeout);
+        }
+
+        // optional, 0 - cluster mode is disabled
+        if (m_parser->json().HasMember("cluster")) {
+            loadCluster();
+        }
+
+        // the ports of cluster links can't be shared by two processes
+        if (!m_conf.upgradeSocket.empty() && ((m_conf.workers > 1) || (m_conf.clusterNodeId != 0))) {
+            throw std::runtime_error("confParser: \"upgrade_socket\" can't be combined with workers or cluster");
+        }
+
+        // worker processes are linked by loopback ports worker_port...worker_port + workers - 1
+        if (m_conf.workers > 1) {
+            if (m_conf.clusterNodeId != 0) {
+                throw std::runtime_error("confParser: \"workers\" and cluster section are mutually exclusive");
+            }
+            if (!m_parser->json()["network"].HasMember("worker_port") ||
+                !m_parser->json()["network"]["worker_port"].IsUint()) {
+                throw std::runtime_error("confParser: failed to parse \"worker_port\" parameter");
+            }
+            uint32_t tmpWorkerPort = m_parser->json()["network"]["worker_port"].GetUint();
+            // ranges of one port per worker
+            auto inRange = [this](uint32_t _port, uint32_t _first) {
+                return (_port >= _first) && (_port < _first + m_conf.workers);
+            };
+            if ((tmpWorkerPort < 1) || (tmpWorkerPort + m_conf.workers - 1 > 65535) ||
+                inRange(m_conf.bindPort, tmpWorkerPort) ||
+                ((m_conf.metricsPort != 0) &&
+                 (inRange(m_conf.metricsPort, tmpWorkerPort) || inRange(tmpWorkerPort, m_conf.metricsPort)))) {
+                throw std::runtime_error("confParser: wrong \"worker_port\" value");
+            }
+            if ((m_conf.metricsPort != 0) &&
+                ((m_conf.metricsPort + m_conf.workers - 1 > 65535) || inRange(m_conf.bindPort, m_conf.metricsPort))) {
+                throw std::runtime_error("confParser: wrong \"metrics_port\" value");
+            }
+            m_conf.workerPort = static_cast<uint16_t>(tmpWorkerPort);
         }
 
         if (!m_parser->json().HasMember("log") || !m_parser->json()["log"].IsObject()) {
@@ -109,17 +423,110 @@ namespace tgwss {
         if (!m_parser->json()["log"].HasMember("destination") || !m_parser->json()["log"]["destination"].IsString()) {
             throw std::runtime_error("failed to parse \"destination\" parameter");
         }
-        m_logDst = m_parser->json()["log"]["destination"].GetString();
-        if (m_logDst.empty()) {
+        m_conf.logDst = m_parser->json()["log"]["destination"].GetString();
+        if (m_conf.logDst.empty()) {
             throw std::runtime_error("wrong \"destination\" value");
         }
 
         if (!m_parser->json()["log"].HasMember("level") || !m_parser->json()["log"]["level"].IsString()) {
             throw std::runtime_error("failed to parse \"level\" parameter");
         }
-        m_logLevel = m_parser->json()["log"]["level"].GetString();
-        if (m_logLevel.empty()) {
+        m_conf.logLevel = m_parser->json()["log"]["level"].GetString();
+        if (m_conf.logLevel.empty()) {
             throw std::runtime_error("wrong \"level\" value");
         }
+
+        // optional, log records are written in batches
+        if (m_parser->json()["log"].HasMember("flush_interval")) {
+            if (!m_parser->json()["log"]["flush_interval"].IsUint()) {
+                throw std::runtime_error("failed to parse \"flush_interval\" parameter");
+            }
+            m_conf.logFlushInterval = m_parser->json()["log"]["flush_interval"].GetUint();
+            if ((m_conf.logFlushInterval < 1) || (m_conf.logFlushInterval > 10000)) {
+                throw std::runtime_error("wrong \"flush_interval\" value");
+            }
+        }
+
+        if (m_parser->json()["log"].HasMember("max_latency")) {
+            if (!m_parser->json()["log"]["max_latency"].IsUint()) {
+                throw std::runtime_error("failed to parse \"max_latency\" parameter");
+            }
+            m_conf.logMaxLatency = m_parser->json()["log"]["max_latency"].GetUint();
+            if (m_conf.logMaxLatency > 60000) {
+                throw std::runtime_error("wrong \"max_latency\" value");
+            }
+        }
+    }
+
+    void confParser_t::worker(uint16_t _idx) {
+        m_conf.clusterNodeId = static_cast<uint16_t>(_idx + 1);
+        m_conf.clusterPort = static_cast<uint16_t>(m_conf.workerPort + _idx);
+        m_conf.clusterNodes.clear();
+        for (uint16_t i = 0; i < m_conf.workers; ++i) {
+            if (i != _idx) {
+                clusterNode_t node;
+                node.id = static_cast<uint16_t>(i + 1);
+                node.address = "127.0.0.1";
+                node.port = static_cast<uint16_t>(m_conf.workerPort + i);
+                m_conf.clusterNodes.emplace_back(std::move(node));
+            }
+        }
+        // every worker serves its own metrics
+        if (m_conf.metricsPort != 0) {
+            m_conf.metricsPort = static_cast<uint16_t>(m_conf.metricsPort + _idx);
+        }
+    }
+
+    void confParser_t::loadCluster() {
+        const auto &cluster = m_parser->json()["cluster"];
+        if (!cluster.IsObject()) {
+            throw std::runtime_error("confParser: failed to parse cluster config section");
+        }
+
+        if (!cluster.HasMember("node_id") || !cluster["node_id"].IsUint()) {
+            throw std::runtime_error("confParser: failed to parse \"node_id\" parameter");
+        }
+        uint32_t tmpNodeId = cluster["node_id"].GetUint();
+        if ((tmpNodeId < 1) || (tmpNodeId > 65535)) {
+            throw std::runtime_error("confParser: wrong \"node_id\" value");
+        }
+
+        if (!cluster.HasMember("bind_port") || !cluster["bind_port"].IsUint()) {
+            throw std::runtime_error("confParser: failed to parse cluster \"bind_port\" parameter");
+        }
+        uint32_t tmpPort = cluster["bind_port"].GetUint();
+        if ((tmpPort < 1) || (tmpPort > 65535) || (tmpPort == m_conf.bindPort) || (tmpPort == m_conf.metricsPort)) {
+            throw std::runtime_error("confParser: wrong cluster \"bind_port\" value");
+        }
+
+        if (!cluster.HasMember("nodes") || !cluster["nodes"].IsArray()) {
+            throw std::runtime_error("confParser: failed to parse \"nodes\" parameter");
+        }
+        std::vector<clusterNode_t> tmpNodes;
+        for (const auto *i = cluster["nodes"].Begin(); i != cluster["nodes"].End(); ++i) {
+            if (!i->IsObject() ||
+                !i->HasMember("id") || !(*i)["id"].IsUint() ||
+                !i->HasMember("address") || !(*i)["address"].IsString() ||
+                !i->HasMember("port") || !(*i)["port"].IsUint()) {
+                throw std::runtime_error("confParser: failed to parse \"nodes\" parameter");
+            }
+            clusterNode_t node;
+            uint32_t tmpId = (*i)["id"].GetUint();
+            uint32_t tmpNodePort = (*i)["port"].GetUint();
+            node.address = (*i)["address"].GetString();
+            if ((tmpId < 1) || (tmpId > 65535) || (tmpId == tmpNodeId) ||
+                (tmpNodePort < 1) || (tmpNodePort > 65535) || node.address.empty() ||
+                std::any_of(tmpNodes.begin(), tmpNodes.end(),
+                            [tmpId](const clusterNode_t &_node) {return _node.id == tmpId;})) {
+                throw std::runtime_error("confParser: wrong \"nodes\" value");
+            }
+            node.id = static_cast<uint16_t>(tmpId);
+            node.port = static_cast<uint16_t>(tmpNodePort);
+            tmpNodes.emplace_back(std::move(node));
+        }
+
+        m_conf.clusterNodeId = static_cast<uint16_t>(tmpNodeId);
+        m_conf.clusterPort = static_cast<uint16_t>(tmpPort);
+        m_conf.clusterNodes = std::move(tmpNodes);
     }
 } // namespace tgwss
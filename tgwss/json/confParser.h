@@ -11,26 +11,70 @@
 
 #include <string>
 #include <unordered_set>
+#include <vector>
 #include <memory>
 
 #include "parser.h"
 
 namespace tgwss {
     class confParser_t {
+    public:
+        struct clusterNode_t {
+            uint16_t id = 0;
+            std::string address;
+            uint16_t port = 0;
+        };
+
     private:
         std::unique_ptr<parser_t> m_parser;
 
-        // network
-        uint16_t m_bindPort = 8080;
-        uint16_t m_connLimit = 8;
-        uint16_t m_ioTimeout = 30;
-        bool m_ssl = false;
-        std::string m_certFile;
-        std::string m_pkeyFile;
+        // parsed values, replaced as a whole by init()
+        struct conf_t {
+            // network
+            uint16_t bindPort = 8080;
+            uint16_t connLimit = 8;
+            uint16_t connLimitPerIp = 0;
+            uint32_t connRate = 0;
+            uint32_t connBurst = 0;
+            uint16_t ioTimeout = 30;
+            uint16_t threads = 1;
+            uint16_t workers = 1;
+            uint16_t workerPort = 0;
+            uint16_t queueMsgLimit = 256;
+            uint32_t queueSizeLimit = 1024 * 1024;
+            bool queueDropOldest = true;
+            uint16_t writeBatch = 16;
+            uint16_t callTtl = 10;
+            uint32_t msgSizeLimit = 64 * 1024;
+            bool cutThrough = false;
+            uint16_t roomSizeLimit = 100;
+            uint16_t metricsPort = 0;
+            bool deflate = false;
+            uint8_t deflateWindowBits = 15;
+            uint8_t deflateMemLevel = 8;
+            bool ssl = false;
+            std::string certFile;
+            std::string pkeyFile;
+            uint32_t tlsSessionCache = 10240;
+            uint32_t tlsSessionLifetime = 300;
+            bool tlsSessionTickets = true;
+            uint32_t tlsTicketKeyRotation = 3600;
+            bool ktls = false;
+            std::string upgradeSocket;
+            uint16_t drainTimeout = 60;
 
-        // log
-        std::string m_logDst;
-        std::string m_logLevel;
+            // cluster
+            uint16_t clusterNodeId = 0;
+            uint16_t clusterPort = 0;
+            std::vector<clusterNode_t> clusterNodes;
+
+            // log
+            std::string logDst;
+            std::string logLevel;
+            uint32_t logFlushInterval = 20;
+            uint32_t logMaxLatency = 100;
+        };
+        conf_t m_conf;
 
     public:
         static confParser_t &confParser() {
@@ -44,22 +88,57 @@ namespace tgwss {
         confParser_t(const confParser_t &&) = delete;
         void operator=(const confParser_t &&) = delete;
 
+        /// (re)loads the config, the current values are kept if it fails
         void init(const std::string &_confFile);
+        /// turns the config into the config of worker process _idx, the workers are the nodes of a cluster
+        void worker(uint16_t _idx);
+
+        uint16_t bindPort() const {return m_conf.bindPort;}
+        uint16_t connLimit() const {return m_conf.connLimit;}
+        uint16_t connLimitPerIp() const {return m_conf.connLimitPerIp;}
+        uint32_t connRate() const {return m_conf.connRate;}
+        uint32_t connBurst() const {return m_conf.connBurst;}
+        uint16_t ioTimeout() const {return  m_conf.ioTimeout;}
+        uint16_t threads() const {return m_conf.threads;}
+        uint16_t workers() const {return m_conf.workers;}
+        uint16_t queueMsgLimit() const {return m_conf.queueMsgLimit;}
+        uint32_t queueSizeLimit() const {return m_conf.queueSizeLimit;}
+        bool queueDropOldest() const {return m_conf.queueDropOldest;}
+        uint16_t writeBatch() const {return m_conf.writeBatch;}
+        uint16_t callTtl() const {return m_conf.callTtl;}
+        uint32_t msgSizeLimit() const {return m_conf.msgSizeLimit;}
+        bool cutThrough() const {return m_conf.cutThrough;}
+        uint16_t roomSizeLimit() const {return m_conf.roomSizeLimit;}
+        uint16_t metricsPort() const {return m_conf.metricsPort;}
+        bool deflate() const {return m_conf.deflate;}
+        uint8_t deflateWindowBits() const {return m_conf.deflateWindowBits;}
+        uint8_t deflateMemLevel() const {return m_conf.deflateMemLevel;}
+        bool ssl() const {return  m_conf.ssl;}
+        const std::string &certFile() const {return m_conf.certFile;}
+        const std::string &pkeyFile() const {return m_conf.pkeyFile;}
+        uint32_t tlsSessionCache() const {return m_conf.tlsSessionCache;}
+        uint32_t tlsSessionLifetime() const {return m_conf.tlsSessionLifetime;}
+        bool tlsSessionTickets() const {return m_conf.tlsSessionTickets;}
+        uint32_t tlsTicketKeyRotation() const {return m_conf.tlsTicketKeyRotation;}
+        bool ktls() const {return m_conf.ktls;}
+        const std::string &upgradeSocket() const {return m_conf.upgradeSocket;}
+        uint16_t drainTimeout() const {return m_conf.drainTimeout;}
 
-        uint16_t bindPort() const {return m_bindPort;}
-        uint16_t connLimit() const {return m_connLimit;}
-        uint16_t ioTimeout() const {return  m_ioTimeout;}
-        bool ssl() const {return  m_ssl;}
-        const std::string &certFile() const {return m_certFile;}
-        const std::string &pkeyFile() const {return m_pkeyFile;}
+        uint16_t clusterNodeId() const {return m_conf.clusterNodeId;}
+        uint16_t clusterPort() const {return m_conf.clusterPort;}
+        const std::vector<clusterNode_t> &clusterNodes() const {return m_conf.clusterNodes;}
 
-        const std::string &logDst() const {return  m_logDst;}
-        const std::string &logLevel () const {return m_logLevel;}
+        const std::string &logDst() const {return  m_conf.logDst;}
+        const std::string &logLevel () const {return m_conf.logLevel;}
+        uint32_t logFlushInterval() const {return m_conf.logFlushInterval;}
+        uint32_t logMaxLatency() const {return m_conf.logMaxLatency;}
 
     private:
         confParser_t() = default;
 
+        void parse(const std::string &_confFile);
         void loadFile(const std::string &_fileName);
+        void loadCluster();
     };
 } // namespace tgwss
 
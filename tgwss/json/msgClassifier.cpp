@@ -0,0 +1,248 @@
+/**
+* @file json/msgClassifier.cpp
+* @brief allocation free classification of signaling messages
+* @author Max Fomichev
+* @date 29.01.2020
+* @copyright Apache License v.2 (http://www.apache.org/licenses/LICENSE-2.0)
+*/
+
+#include <cstring>
+
+#include <rapidjson/reader.h>
+#include <rapidjson/memorystream.h>
+#include <rapidjson/encodedstream.h>
+#include <rapidjson/error/en.h>
+
+#include "wss/binProto.h"
+#include "msgClassifier.h"
+
+namespace tgwss {
+    bool msgClassifier_t::field_t::equals(const char *_str, std::size_t _size) const noexcept {
+        return m_present && (m_size == _size) && (std::memcmp(m_data, _str, _size) == 0);
+    }
+
+    void msgClassifier_t::field_t::set(const char *_str, std::size_t _size) noexcept {
+        if (_size > m_fieldSize) {
+            m_present = false;
+            return;
+        }
+        std::memcpy(m_data, _str, _size);
+        m_size = _size;
+        m_present = true;
+    }
+
+    class msgClassifier_t::handler_t {
+    private:
+        msgClassifier_t &m_classifier;
+        std::size_t m_depth = 0;
+        field_t *m_field = nullptr; // top level member value to be kept
+        bool m_candidate = false;
+
+    public:
+        explicit handler_t(msgClassifier_t &_classifier): m_classifier(_classifier) {}
+
+        bool candidate() const noexcept {return m_candidate;}
+
+        bool Null() {return value();}
+        bool Bool(bool) {return value();}
+        bool Int(int) {return value();}
+        bool Uint(unsigned) {return value();}
+        bool Int64(int64_t) {return value();}
+        bool Uint64(uint64_t) {return value();}
+        bool Double(double) {return value();}
+        bool RawNumber(const char *, rapidjson::SizeType, bool) {return value();}
+        bool String(const char *_str, rapidjson::SizeType _size, bool) {
+            if (m_field != nullptr) {
+                m_field->set(_str, _size);
+            }
+            return value();
+        }
+        bool StartObject() {
+            m_field = nullptr;
+            ++m_depth;
+            return true;
+        }
+        bool Key(const char *_str, rapidjson::SizeType _size, bool) {
+            if (m_depth != 1) {
+                return true;
+            }
+            if ((_size == 4) && (std::memcmp(_str, "type", 4) == 0)) {
+                m_field = &m_classifier.m_type;
+            } else if ((_size == 5) && (std::memcmp(_str, "token", 5) == 0)) {
+                m_field = &m_classifier.m_token;
+            } else if ((_size == 2) && (std::memcmp(_str, "to", 2) == 0)) {
+                m_field = &m_classifier.m_to;
+            } else if ((_size == 4) && (std::memcmp(_str, "room", 4) == 0)) {
+                m_field = &m_classifier.m_room;
+            } else if ((_size == 9) && (std::memcmp(_str, "candidate", 9) == 0)) {
+                m_candidate = true;
+            }
+            return true;
+        }
+        bool EndObject(rapidjson::SizeType) {
+            --m_depth;
+            return true;
+        }
+        bool StartArray() {
+            m_field = nullptr;
+            ++m_depth;
+            return true;
+        }
+        bool EndArray(rapidjson::SizeType) {
+            --m_depth;
+            return true;
+        }
+
+    private:
+        bool value() {
+            m_field = nullptr;
+            return true;
+        }
+    };
+
+    void msgClassifier_t::reset() noexcept {
+        m_msgType = msgType_t::MT_UNKNOWN;
+        m_type.m_present = false;
+        m_token.m_present = false;
+        m_to.m_present = false;
+        m_room.m_present = false;
+        m_errorCode = rapidjson::kParseErrorNone;
+        m_errorOffset = 0;
+        m_binError = false;
+    }
+
+    bool msgClassifier_t::parse(const char *_data, std::size_t _size) noexcept {
+        reset();
+
+        // the reader's stack lives on the stack, heap is touched only by unusually long strings
+        using allocator_t = rapidjson::MemoryPoolAllocator<>;
+        char allocatorBuf[2048];
+        allocator_t allocator(allocatorBuf, sizeof(allocatorBuf));
+        rapidjson::GenericReader<rapidjson::UTF8<>, rapidjson::UTF8<>, allocator_t> reader(&allocator, 1024);
+
+        rapidjson::MemoryStream memoryStream(_data, _size);
+        rapidjson::EncodedInputStream<rapidjson::UTF8<>, rapidjson::MemoryStream> stream(memoryStream);
+        handler_t handler(*this);
+        try {
+            auto result = reader.Parse<rapidjson::kParseDefaultFlags>(stream, handler);
+            if (result.IsError()) {
+                m_errorCode = result.Code();
+                m_errorOffset = result.Offset();
+                return false;
+            }
+        } catch (...) {
+            m_errorCode = rapidjson::kParseErrorTermination;
+            return false;
+        }
+
+        if (m_type.equals("logon", 5)) {
+            m_msgType = msgType_t::MT_LOGON;
+        } else if (m_type.equals("call", 4)) {
+            m_msgType = msgType_t::MT_CALL;
+        } else if (m_type.equals("offer", 5)) {
+            m_msgType = msgType_t::MT_OFFER;
+        } else if (m_type.equals("answer", 6)) {
+            m_msgType = msgType_t::MT_ANSWER;
+        } else if (m_type.equals("info", 4)) {
+            m_msgType = msgType_t::MT_INFO;
+        } else if (m_type.equals("join", 4)) {
+            m_msgType = msgType_t::MT_JOIN;
+        } else if (m_type.equals("leave", 5)) {
+            m_msgType = msgType_t::MT_LEAVE;
+        } else if (!m_type.present() && handler.candidate()) {
+            m_msgType = msgType_t::MT_CANDIDATE;
+        }
+
+        return true;
+    }
+
+    bool msgClassifier_t::parseBin(const void *_data, std::size_t _size) noexcept {
+        reset();
+
+        binProto_t::reader_t reader(_data, _size);
+        binProto_t::msgType_t type;
+        if (!reader.type(type)) {
+            m_binError = true;
+            return false;
+        }
+        const char *field;
+        std::size_t size;
+        switch (type) {
+            case binProto_t::msgType_t::MT_LOGON: {
+                if (!reader.field(field, size)) {
+                    m_binError = true;
+                    return false;
+                }
+                m_token.set(field, size);
+                m_msgType = msgType_t::MT_LOGON;
+                break;
+            }
+            case binProto_t::msgType_t::MT_CALL: {
+                if (!reader.field(field, size)) {
+                    m_binError = true;
+                    return false;
+                }
+                m_to.set(field, size);
+                m_msgType = msgType_t::MT_CALL;
+                break;
+            }
+            case binProto_t::msgType_t::MT_LOGON_STATUS: {
+                m_msgType = msgType_t::MT_LOGON;
+                break;
+            }
+            case binProto_t::msgType_t::MT_CALL_FROM:
+            case binProto_t::msgType_t::MT_CALL_STATUS: {
+                m_msgType = msgType_t::MT_CALL;
+                break;
+            }
+            case binProto_t::msgType_t::MT_OFFER: {
+                m_msgType = msgType_t::MT_OFFER;
+                break;
+            }
+            case binProto_t::msgType_t::MT_ANSWER: {
+                m_msgType = msgType_t::MT_ANSWER;
+                break;
+            }
+            case binProto_t::msgType_t::MT_CANDIDATE: {
+                m_msgType = msgType_t::MT_CANDIDATE;
+                break;
+            }
+            case binProto_t::msgType_t::MT_INFO: {
+                m_msgType = msgType_t::MT_INFO;
+                break;
+            }
+            case binProto_t::msgType_t::MT_JOIN: {
+                if (!reader.field(field, size)) {
+                    m_binError = true;
+                    return false;
+                }
+                m_room.set(field, size);
+                m_msgType = msgType_t::MT_JOIN;
+                break;
+            }
+            case binProto_t::msgType_t::MT_JOIN_FROM:
+            case binProto_t::msgType_t::MT_JOIN_STATUS: {
+                m_msgType = msgType_t::MT_JOIN;
+                break;
+            }
+            case binProto_t::msgType_t::MT_LEAVE:
+            case binProto_t::msgType_t::MT_LEAVE_FROM: {
+                m_msgType = msgType_t::MT_LEAVE;
+                break;
+            }
+            default: {
+                break;
+            }
+        }
+
+        return true;
+    }
+
+    std::string msgClassifier_t::error() const {
+        if (m_binError) {
+            return "failed to parse binary message";
+        }
+        return std::string("failed to parse JSON. ") + rapidjson::GetParseError_En(m_errorCode)
+               + " Offset " + std::to_string(m_errorOffset);
+    }
+} // namespace tgwss
@@ -0,0 +1,99 @@
+/**
+* @file json/msgClassifier.h
+* @brief allocation free classification of signaling messages
+* @author Max Fomichev
+* @date 29.01.2020
+* @copyright Apache License v.2 (http://www.apache.org/licenses/LICENSE-2.0)
+*/
+
+#ifndef TGWSS_MSGCLASSIFIER_H
+#define TGWSS_MSGCLASSIFIER_H
+
+#include <cstddef>
+#include <string>
+
+#include <rapidjson/document.h>
+
+namespace tgwss {
+    // extracts message type and routing fields from a signaling message with rapidjson SAX reader,
+    // only top level string members "type", "token", "to" and "room" are kept, all other content is skipped;
+    // messages of the binary protocol are classified by their type byte and fields
+    class msgClassifier_t final {
+    public:
+        enum class msgType_t {
+            MT_UNKNOWN,
+            MT_LOGON,
+            MT_CALL,
+            MT_OFFER,
+            MT_ANSWER,
+            MT_CANDIDATE,
+            MT_INFO,
+            MT_JOIN,
+            MT_LEAVE
+        };
+
+        // inline string value, values longer than m_fieldSize are treated as missed
+        class field_t {
+            friend class msgClassifier_t;
+
+        public:
+            static const std::size_t m_fieldSize = 128;
+
+        private:
+            char m_data[m_fieldSize];
+            std::size_t m_size = 0;
+            bool m_present = false;
+
+        public:
+            bool present() const noexcept {return m_present;}
+            const char *data() const noexcept {return m_data;}
+            std::size_t size() const noexcept {return m_size;}
+            std::string str() const {return std::string(m_data, m_size);}
+            bool equals(const char *_str, std::size_t _size) const noexcept;
+
+        private:
+            void set(const char *_str, std::size_t _size) noexcept;
+        };
+
+    private:
+        msgType_t m_msgType = msgType_t::MT_UNKNOWN;
+        field_t m_type;
+        field_t m_token;
+        field_t m_to;
+        field_t m_room;
+        rapidjson::ParseErrorCode m_errorCode = rapidjson::kParseErrorNone;
+        std::size_t m_errorOffset = 0;
+        bool m_binError = false;
+
+    public:
+        msgClassifier_t() = default;
+        ~msgClassifier_t() = default;
+
+        msgClassifier_t(const msgClassifier_t &) = delete;
+        void operator=(const msgClassifier_t &) = delete;
+        msgClassifier_t(const msgClassifier_t &&) = delete;
+        void operator=(const msgClassifier_t &&) = delete;
+
+        /// @returns false if _data is not a valid JSON
+        bool parse(const char *_data, std::size_t _size) noexcept;
+        /// @returns false if _data is not a valid binary protocol message
+        bool parseBin(const void *_data, std::size_t _size) noexcept;
+
+        msgType_t msgType() const noexcept {return m_msgType;}
+        const field_t &type() const noexcept {return m_type;}
+        const field_t &token() const noexcept {return m_token;}
+        const field_t &to() const noexcept {return m_to;}
+        const field_t &room() const noexcept {return m_room;}
+
+        /// parse error description in the form of "failed to parse JSON. <reason> Offset <offset>"
+        /// or "failed to parse binary message"
+        std::string error() const;
+
+    private:
+        void reset() noexcept;
+
+        class handler_t;
+    };
+} // namespace tgwss
+
+#endif //TGWSS_MSGCLASSIFIER_H
@@ -0,0 +1,1051 @@
+/**
+* @file loadgen/loadGen.cpp
+* @brief signaling load generator, drives tgwss with scripted calls
+* @author Max Fomichev
+* @date 29.01.2020
+* @copyright Apache License v.2 (http://www.apache.org/licenses/LICENSE-2.0)
+*/
+
+#include <unistd.h>
+
+#include <cstring>
+#include <cstdlib>
+#include <fstream>
+#include <sstream>
+#include <thread>
+#include <chrono>
+
+#include <rapidjson/document.h>
+#include <rapidjson/writer.h>
+#include <rapidjson/stringbuffer.h>
+
+#include "fmt/format.h"
+
+#include "loadGen.h"
+
+namespace tgwss {
+    static const uint32_t g_msgSizeLimit = 64 * 1024;
+    static const uint32_t g_packetSize = 1024;
+    // service loop wakeup interval, new calls & timers are processed on wakeups
+    static const std::chrono::milliseconds g_tickInterval {1};
+    static const uint64_t g_reportInterval = 1000000000;
+
+    loadGen_t::loadGen_t(options_t _options): m_options(std::move(_options)) {
+        lws_set_log_level(0, nullptr);
+
+        std::memset(&m_wsProtocols, 0, sizeof(m_wsProtocols));
+        m_wsProtocols[0].name = m_options.binary ? "tgwss-bin" : "tgwss";
+        m_wsProtocols[0].callback = loadGen_t::wscbService;
+        m_wsProtocols[0].tx_packet_size = g_packetSize;
+        m_wsProtocols[0].rx_buffer_size = g_packetSize;
+
+        std::memset(&m_wsInfo, 0, sizeof(m_wsInfo));
+        m_wsInfo.port = CONTEXT_PORT_NO_LISTEN;
+        m_wsInfo.protocols = m_wsProtocols;
+        m_wsInfo.timeout_secs = static_cast<unsigned int>(m_options.timeout / 1000 + 1);
+        m_wsInfo.gid = -1;
+        m_wsInfo.uid = -1;
+        m_wsInfo.user = this;
+        if (m_options.ssl) {
+            m_wsInfo.options = LWS_SERVER_OPTION_DO_SSL_GLOBAL_INIT;
+        }
+
+        m_wsContext = lws_create_context(&m_wsInfo);
+        if (m_wsContext == nullptr) {
+            throw std::runtime_error("loadGen: failed to create LWS context");
+        }
+
+        // synthetic session description of the requested size
+        m_sdp = "v=0\r\no=- 4611731400430051336 2 IN IP4 127.0.0.1\r\ns=-\r\nt=0 0\r\n"
+                "m=audio 9 UDP/TLS/RTP/SAVPF 111\r\nc=IN IP4 0.0.0.0\r\na=rtpmap:111 opus/48000/2\r\n";
+        while (m_sdp.length() < m_options.sdpSize) {
+            m_sdp += "a=x-tgwss-loadgen:0123456789abcdef0123456789abcdef\r\n";
+        }
+        m_sdp.resize(m_options.sdpSize);
+
+        // tokens of concurrent load generators must not collide
+        m_tokenPrefix = fmt::format(FMT_STRING("lg{:d}-"), getpid());
+        m_room = m_tokenPrefix + "room";
+    }
+
+    loadGen_t::~loadGen_t() {
+        m_stopFlag = true;
+        lws_context_destroy(m_wsContext);
+    }
+
+    bool loadGen_t::run() {
+        m_baseRss = rss(m_options.serverPid);
+        m_started = metrics_t::now();
+        m_lastReport = m_started;
+
+        std::thread ticker(loadGen_t::tickerWorker, this);
+        while (!m_stopFlag) {
+            lws_service(m_wsContext, 0);
+        }
+        ticker.join();
+
+        summary();
+
+        for (auto i:m_errors) {
+            if (i > 0) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    void loadGen_t::tickerWorker(loadGen_t *_loadGen) {
+        while (!_loadGen->m_stopFlag) {
+            std::this_thread::sleep_for(g_tickInterval);
+            lws_cancel_service(_loadGen->m_wsContext);
+        }
+    }
+
+    int loadGen_t::wscbService(struct lws *_lws, enum lws_callback_reasons _reason,
+                               void *_user, void *_data, size_t _size) noexcept {
+        auto loadGen = static_cast<loadGen_t *>(lws_context_user(lws_get_context(_lws)));
+        if (loadGen == nullptr) {
+            return 0;
+        }
+
+        try {
+            switch (_reason) {
+                case LWS_CALLBACK_EVENT_WAIT_CANCELLED: {
+                    loadGen->tick();
+                    break;
+                }
+                case LWS_CALLBACK_CLIENT_ESTABLISHED: {
+                    auto peer = static_cast<peer_t *>(_user);
+                    if (peer->state == state_t::CLOSING) {
+                        // the call has failed while connecting
+                        lws_callback_on_writable(_lws);
+                        break;
+                    }
+                    peer->state = state_t::LOGGING_ON;
+                    if (!loadGen->sendLogon(*peer)) {
+                        loadGen->fail(*peer, ERR_PROTOCOL);
+                    }
+                    break;
+                }
+                case LWS_CALLBACK_CLIENT_RECEIVE: {
+                    auto peer = static_cast<peer_t *>(_user);
+                    loadGen->receive(*peer, _data, _size);
+                    break;
+                }
+                case LWS_CALLBACK_CLIENT_WRITEABLE: {
+                    auto peer = static_cast<peer_t *>(_user);
+                    while (!peer->writeQueue.empty()) {
+                        auto frame = peer->writeQueue.pop();
+                        if (lws_write(_lws, frame->data(), frame->size(),
+                                      peer->binary ? LWS_WRITE_BINARY : LWS_WRITE_TEXT) < 0) {
+                            return -1;
+                        }
+                        ++loadGen->m_sentMsgs;
+                        loadGen->m_sentBytes += frame->size();
+                        if (!peer->writeQueue.empty() && lws_send_pipe_choked(_lws)) {
+                            lws_callback_on_writable(_lws);
+                            return 0;
+                        }
+                    }
+                    if (peer->state == state_t::CLOSING) {
+                        lws_close_reason(_lws, LWS_CLOSE_STATUS_NORMAL, nullptr, 0);
+                        return -1;
+                    }
+                    break;
+                }
+                case LWS_CALLBACK_CLIENT_CONNECTION_ERROR:
+                case LWS_CALLBACK_CLIENT_CLOSED: {
+                    // connections left at exit are closed with the context
+                    if ((_user != nullptr) && !loadGen->m_stopFlag) {
+                        loadGen->closed(*static_cast<peer_t *>(_user));
+                    }
+                    break;
+                }
+                default: {
+                    break;
+                }
+            }
+        } catch (...) {
+            fmt::print(stderr, FMT_STRING("loadGen: internal error (out of memory?)\n"));
+            return -1;
+        }
+
+        return 0;
+    }
+
+    void loadGen_t::tick() {
+        auto now = metrics_t::now();
+        if ((m_options.roomSize > 0) || (m_options.idlePeers > 0)) {
+            roomTick(now);
+            return;
+        }
+
+        if (m_interrupted && m_launching) {
+            // no new calls, the active ones are closed and not counted
+            m_launching = false;
+            for (auto &i:m_calls) {
+                i.second->failed = true;
+                close(i.second->callee);
+                close(i.second->caller);
+            }
+        }
+
+        if (m_launching) {
+            auto elapsed = now - m_started;
+            // the first call starts right away
+            auto target = static_cast<uint64_t>(static_cast<double>(m_options.rate) * elapsed / 1e9) + 1;
+            if (m_options.calls > 0) {
+                target = std::min<uint64_t>(target, m_options.calls);
+            }
+            while ((m_launched < target) && (m_calls.size() < m_options.concurrency)) {
+                launch();
+            }
+            if (((m_options.calls > 0) && (m_launched >= m_options.calls)) ||
+                ((m_options.duration > 0) && (elapsed >= m_options.duration * 1000000000ULL))) {
+                m_launching = false;
+            }
+        }
+
+        while (!m_events.empty() && (m_events.top().time <= now)) {
+            auto event = m_events.top();
+            m_events.pop();
+            auto call = m_calls.find(event.callId);
+            if ((call == m_calls.end()) || call->second->failed) {
+                continue;
+            }
+            if (event.hangup) {
+                hangup(*call->second);
+            } else if (!call->second->established) {
+                fail(*call->second, ERR_TIMEOUT);
+            }
+        }
+
+        // calls with both connections closed are done
+        for (auto i:m_done) {
+            auto call = m_calls.find(i);
+            if ((call != m_calls.end()) &&
+                (call->second->callee.state == state_t::CLOSED) && (call->second->caller.state == state_t::CLOSED)) {
+                if (!call->second->failed) {
+                    ++m_completed;
+                }
+                m_calls.erase(call);
+            }
+        }
+        m_done.clear();
+
+        if (now - m_lastReport >= g_reportInterval) {
+            report(now);
+        }
+
+        if (!m_launching && m_calls.empty()) {
+            m_stopFlag = true;
+        }
+    }
+
+    void loadGen_t::roomTick(uint64_t _now) {
+        if (m_interrupted && !m_roomClosing) {
+            closeRoom();
+        }
+
+        const bool idle = (m_options.idlePeers > 0);
+        if (m_launching && m_members.empty()) {
+            // all the members connect at once, the broadcasts start when the last one has joined
+            for (uint32_t i = 0; i < (idle ? m_options.idlePeers : m_options.roomSize); ++i) {
+                m_members.emplace_back(std::make_unique<peer_t>());
+                m_members.back()->token = fmt::format(FMT_STRING("{:s}{:d}-member"), m_tokenPrefix, i + 1);
+            }
+            for (auto &i:m_members) {
+                if (!connect(*i)) {
+                    fail(*i, ERR_CONNECT);
+                    break;
+                }
+            }
+        }
+
+        if (m_launching && (m_joined < m_members.size()) && (_now - m_started >= m_options.timeout * 1000000ULL)) {
+            fail(*m_members.front(), ERR_TIMEOUT);
+        }
+
+        if (idle) {
+            if (m_launching && (m_joined == m_members.size())) {
+                if (m_broadcastStarted == 0) {
+                    // the hold time starts when all the peers are online
+                    m_broadcastStarted = _now;
+                }
+                if (_now - m_broadcastStarted >= m_options.holdTime * 1000000ULL) {
+                    // RSS is sampled at the full number of connections before they are closed
+                    report(_now);
+                    closeRoom();
+                }
+            }
+        } else if (m_launching && (m_joined == m_members.size())) {
+            if (m_broadcastStarted == 0) {
+                m_broadcastStarted = _now;
+                m_cpuStarted = cpuTime(m_options.serverPid);
+            }
+            auto elapsed = _now - m_broadcastStarted;
+            // the first broadcast is sent right away
+            auto target = static_cast<uint64_t>(static_cast<double>(m_options.rate) * elapsed / 1e9) + 1;
+            if (m_options.calls > 0) {
+                target = std::min<uint64_t>(target, m_options.calls);
+            }
+            while (m_launching && (m_broadcastSent.size() < target)) {
+                if (!sendBroadcast(*m_members.front())) {
+                    fail(*m_members.front(), ERR_PROTOCOL);
+                }
+            }
+            if (((m_options.calls > 0) && (m_broadcastSent.size() >= m_options.calls)) ||
+                ((m_options.duration > 0) && (elapsed >= m_options.duration * 1000000000ULL))) {
+                m_launching = false;
+                m_broadcastFinished = _now;
+            }
+        }
+
+        if (!idle && !m_launching && !m_roomClosing &&
+            ((m_completed == m_broadcastSent.size()) ||
+             (_now - m_broadcastFinished >= m_options.timeout * 1000000ULL))) {
+            // broadcasts which have not reached all the members in time are failed
+            m_errors[ERR_TIMEOUT] += m_broadcastSent.size() - m_completed;
+            auto cpu = cpuTime(m_options.serverPid);
+            m_cpuUsed = (cpu > m_cpuStarted) ? cpu - m_cpuStarted : 0;
+            closeRoom();
+        }
+
+        if (_now - m_lastReport >= g_reportInterval) {
+            report(_now);
+        }
+
+        if (m_roomClosing && (m_connections == 0)) {
+            m_stopFlag = true;
+        }
+    }
+
+    void loadGen_t::closeRoom() {
+        m_launching = false;
+        m_roomClosing = true;
+        for (auto &i:m_members) {
+            close(*i);
+        }
+    }
+
+    void loadGen_t::launch() {
+        auto call = std::make_unique<call_t>();
+        call->id = ++m_launched;
+        call->callee.call = call.get();
+        call->callee.token = fmt::format(FMT_STRING("{:s}{:d}-callee"), m_tokenPrefix, call->id);
+        call->caller.call = call.get();
+        call->caller.caller = true;
+        call->caller.token = fmt::format(FMT_STRING("{:s}{:d}-caller"), m_tokenPrefix, call->id);
+
+        auto &callRef = *call;
+        m_calls.emplace(call->id, std::move(call));
+        m_events.push({metrics_t::now() + m_options.timeout * 1000000ULL, callRef.id, false});
+
+        // the caller connects when the callee is online
+        if (!connect(callRef.callee)) {
+            fail(callRef, ERR_CONNECT);
+        }
+    }
+
+    bool loadGen_t::connect(peer_t &_peer) {
+        struct lws_client_connect_info connectInfo {};
+        std::memset(&connectInfo, 0, sizeof(connectInfo));
+        connectInfo.context = m_wsContext;
+        connectInfo.address = m_options.host.c_str();
+        connectInfo.port = m_options.port;
+        connectInfo.path = m_options.path.c_str();
+        connectInfo.host = connectInfo.address;
+        connectInfo.origin = connectInfo.address;
+        connectInfo.protocol = m_wsProtocols[0].name;
+        connectInfo.ietf_version_or_minus_one = -1;
+        connectInfo.userdata = &_peer;
+        if (m_options.ssl) {
+            // loopback tests run against self-signed certificates
+            connectInfo.ssl_connection = LCCSCF_USE_SSL | LCCSCF_ALLOW_SELFSIGNED |
+                                         LCCSCF_SKIP_SERVER_CERT_HOSTNAME_CHECK;
+        }
+
+        _peer.state = state_t::CONNECTING;
+        _peer.binary = m_options.binary;
+        _peer.connectStarted = metrics_t::now();
+        ++m_connections;
+        _peer.lws = lws_client_connect_via_info(&connectInfo);
+        if (_peer.lws == nullptr) {
+            if (_peer.state != state_t::CLOSED) {
+                // no connection error callback
+                _peer.state = state_t::CLOSED;
+                --m_connections;
+                if (_peer.call != nullptr) {
+                    m_done.push_back(_peer.call->id);
+                }
+            }
+            return false;
+        }
+
+        m_peakConnections = std::max(m_peakConnections, m_connections);
+        return true;
+    }
+
+    void loadGen_t::receive(peer_t &_peer, const void *_data, std::size_t _size) {
+        std::size_t msgSize = (_peer.readFrame ? _peer.readFrame->size() : 0) + _size;
+        if (msgSize > g_msgSizeLimit) {
+            fail(_peer, ERR_PROTOCOL);
+            return;
+        }
+        m_framePool.reserve(_peer.readFrame, _size + lws_remaining_packet_payload(_peer.lws));
+        _peer.readFrame->append(_data, _size);
+        if (!lws_is_final_fragment(_peer.lws) || (lws_remaining_packet_payload(_peer.lws) > 0)) {
+            return; // waiting for more data
+        }
+
+        framePtr_t msg = std::move(_peer.readFrame);
+        ++m_receivedMsgs;
+        m_receivedBytes += msg->size();
+        if (_peer.call == nullptr) {
+            if (_peer.state != state_t::CLOSING) {
+                processRoom(_peer, *msg);
+            }
+        } else if ((_peer.state != state_t::CLOSING) && !_peer.call->failed) {
+            process(_peer, *msg);
+        }
+    }
+
+    void loadGen_t::process(peer_t &_peer, const frame_t &_msg) {
+        auto &call = *_peer.call;
+        binProto_t::msgType_t type;
+        bool status = false;
+        if (!decode(_peer, _msg, type, status)) {
+            fail(call, ERR_PROTOCOL);
+            return;
+        }
+
+        auto now = metrics_t::now();
+        switch (type) {
+            case binProto_t::msgType_t::MT_LOGON_STATUS: {
+                if (_peer.state != state_t::LOGGING_ON) {
+                    break;
+                }
+                if (!status) {
+                    fail(call, ERR_LOGON);
+                    return;
+                }
+                m_logonTime.observe((now - _peer.connectStarted) / 1000);
+                _peer.state = state_t::ONLINE;
+                if (!_peer.caller) {
+                    if (!connect(call.caller)) {
+                        fail(call, ERR_CONNECT);
+                    }
+                } else if (sendCall(_peer)) {
+                    call.callSent = now;
+                    _peer.state = state_t::CALLING;
+                } else {
+                    fail(call, ERR_PROTOCOL);
+                }
+                return;
+            }
+            case binProto_t::msgType_t::MT_CALL_FROM: {
+                if (_peer.caller || (_peer.state != state_t::ONLINE)) {
+                    break;
+                }
+                _peer.state = state_t::NEGOTIATING;
+                if (!sendCallStatus(_peer)) {
+                    fail(call, ERR_PROTOCOL);
+                }
+                return;
+            }
+            case binProto_t::msgType_t::MT_CALL_STATUS: {
+                if (!_peer.caller || (_peer.state != state_t::CALLING)) {
+                    break;
+                }
+                if (!status) {
+                    fail(call, ERR_OFFLINE);
+                    return;
+                }
+                _peer.state = state_t::NEGOTIATING;
+                if (!sendSdp(_peer, true)) {
+                    fail(call, ERR_PROTOCOL);
+                }
+                return;
+            }
+            case binProto_t::msgType_t::MT_OFFER: {
+                if (_peer.caller || (_peer.state != state_t::NEGOTIATING) || _peer.sdpReceived) {
+                    break;
+                }
+                _peer.sdpReceived = true;
+                if (!sendSdp(_peer, false)) {
+                    fail(call, ERR_PROTOCOL);
+                }
+                return;
+            }
+            case binProto_t::msgType_t::MT_ANSWER: {
+                if (!_peer.caller || (_peer.state != state_t::NEGOTIATING) || _peer.sdpReceived) {
+                    break;
+                }
+                _peer.sdpReceived = true;
+                m_setupTime.observe((now - call.callSent) / 1000);
+                return;
+            }
+            case binProto_t::msgType_t::MT_CANDIDATE: {
+                if (!_peer.sdpReceived) {
+                    break;
+                }
+                ++_peer.candidatesReceived;
+                if (!call.established &&
+                    call.caller.sdpReceived && (call.caller.candidatesReceived >= m_options.candidates) &&
+                    call.callee.sdpReceived && (call.callee.candidatesReceived >= m_options.candidates)) {
+                    established(call);
+                }
+                return;
+            }
+            case binProto_t::msgType_t::MT_INFO: {
+                // the other side is gone, normal after hangup
+                if (call.established) {
+                    close(_peer);
+                } else {
+                    fail(call, ERR_CLOSED);
+                }
+                return;
+            }
+            case binProto_t::msgType_t::MT_ERROR: {
+                fail(call, ERR_SERVER);
+                return;
+            }
+            default: {
+                break;
+            }
+        }
+
+        fail(call, ERR_PROTOCOL);
+    }
+
+    void loadGen_t::processRoom(peer_t &_peer, const frame_t &_msg) {
+        binProto_t::msgType_t type;
+        bool status = false;
+        std::string sdpMid;
+        if (!decode(_peer, _msg, type, status, &sdpMid)) {
+            fail(_peer, ERR_PROTOCOL);
+            return;
+        }
+
+        auto now = metrics_t::now();
+        switch (type) {
+            case binProto_t::msgType_t::MT_LOGON_STATUS: {
+                if (_peer.state != state_t::LOGGING_ON) {
+                    break;
+                }
+                if (!status) {
+                    fail(_peer, ERR_LOGON);
+                    return;
+                }
+                m_logonTime.observe((now - _peer.connectStarted) / 1000);
+                if (m_options.idlePeers > 0) {
+                    _peer.state = state_t::ONLINE;
+                    ++m_joined;
+                    return;
+                }
+                _peer.state = state_t::JOINING;
+                if (!sendJoin(_peer)) {
+                    fail(_peer, ERR_PROTOCOL);
+                }
+                return;
+            }
+            case binProto_t::msgType_t::MT_JOIN_STATUS: {
+                if (_peer.state != state_t::JOINING) {
+                    break;
+                }
+                if (!status) {
+                    fail(_peer, ERR_JOIN);
+                    return;
+                }
+                m_joinTime.observe((now - _peer.connectStarted) / 1000);
+                _peer.state = state_t::JOINED;
+                ++m_joined;
+                return;
+            }
+            case binProto_t::msgType_t::MT_JOIN_FROM:
+            case binProto_t::msgType_t::MT_LEAVE_FROM: {
+                // the others joining & leaving
+                return;
+            }
+            case binProto_t::msgType_t::MT_CANDIDATE: {
+                // sdpMid of a broadcast is its sequence number
+                char *end = nullptr;
+                auto seq = std::strtoull(sdpMid.c_str(), &end, 10);
+                if ((_peer.state != state_t::JOINED) || sdpMid.empty() || (*end != '\0') ||
+                    (seq >= m_broadcastSent.size())) {
+                    break;
+                }
+                m_deliveryTime.observe((now - m_broadcastSent[seq]) / 1000);
+                if (++m_broadcastDelivered[seq] == m_members.size() - 1) {
+                    m_fanOutTime.observe((now - m_broadcastSent[seq]) / 1000);
+                    ++m_completed;
+                }
+                return;
+            }
+            case binProto_t::msgType_t::MT_ERROR: {
+                fail(_peer, ERR_SERVER);
+                return;
+            }
+            default: {
+                break;
+            }
+        }
+
+        fail(_peer, ERR_PROTOCOL);
+    }
+
+    bool loadGen_t::decode(const peer_t &_peer, const frame_t &_msg,
+                           binProto_t::msgType_t &_type, bool &_status, std::string *_sdpMid) const {
+        if (_peer.binary) {
+            binProto_t::reader_t reader(_msg.data(), _msg.size());
+            if (!reader.type(_type)) {
+                return false;
+            }
+            if ((_type == binProto_t::msgType_t::MT_LOGON_STATUS) || (_type == binProto_t::msgType_t::MT_CALL_STATUS) ||
+                (_type == binProto_t::msgType_t::MT_JOIN_STATUS)) {
+                return reader.flag(_status);
+            }
+            if ((_type == binProto_t::msgType_t::MT_CANDIDATE) && (_sdpMid != nullptr)) {
+                const char *data;
+                std::size_t size;
+                if (!reader.field(data, size)) {
+                    return false;
+                }
+                _sdpMid->assign(data, size);
+            }
+            return true;
+        }
+
+        rapidjson::Document json;
+        json.Parse(reinterpret_cast<const char *>(_msg.data()), _msg.size());
+        if (json.HasParseError() || !json.IsObject()) {
+            return false;
+        }
+        if (json.HasMember("error")) {
+            _type = binProto_t::msgType_t::MT_ERROR;
+            return true;
+        }
+        if (!json.HasMember("type") || !json["type"].IsString()) {
+            if (json.HasMember("candidate")) {
+                _type = binProto_t::msgType_t::MT_CANDIDATE;
+                if ((_sdpMid != nullptr) && json.HasMember("sdpMid") && json["sdpMid"].IsString()) {
+                    _sdpMid->assign(json["sdpMid"].GetString(), json["sdpMid"].GetStringLength());
+                }
+                return true;
+            }
+            return false;
+        }
+
+        std::string type = json["type"].GetString();
+        bool hasStatus = json.HasMember("status") && json["status"].IsBool();
+        if (hasStatus) {
+            _status = json["status"].GetBool();
+        }
+        if ((type == "logon") && hasStatus) {
+            _type = binProto_t::msgType_t::MT_LOGON_STATUS;
+        } else if ((type == "call") && json.HasMember("from")) {
+            _type = binProto_t::msgType_t::MT_CALL_FROM;
+        } else if ((type == "call") && hasStatus) {
+            _type = binProto_t::msgType_t::MT_CALL_STATUS;
+        } else if (type == "offer") {
+            _type = binProto_t::msgType_t::MT_OFFER;
+        } else if (type == "answer") {
+            _type = binProto_t::msgType_t::MT_ANSWER;
+        } else if (type == "info") {
+            _type = binProto_t::msgType_t::MT_INFO;
+        } else if ((type == "join") && hasStatus) {
+            _type = binProto_t::msgType_t::MT_JOIN_STATUS;
+        } else if ((type == "join") && json.HasMember("from")) {
+            _type = binProto_t::msgType_t::MT_JOIN_FROM;
+        } else if ((type == "leave") && json.HasMember("from")) {
+            _type = binProto_t::msgType_t::MT_LEAVE_FROM;
+        } else {
+            return false;
+        }
+
+        return true;
+    }
+
+    void loadGen_t::established(call_t &_call) {
+        auto now = metrics_t::now();
+        _call.established = true;
+        m_iceTime.observe((now - _call.callSent) / 1000);
+        m_events.push({now + m_options.holdTime * 1000000ULL, _call.id, true});
+    }
+
+    void loadGen_t::hangup(call_t &_call) {
+        // the server notifies the callee, the callee closes its connection then
+        close(_call.caller);
+    }
+
+    void loadGen_t::fail(call_t &_call, error_t _error) {
+        if (_call.failed) {
+            return;
+        }
+        _call.failed = true;
+        ++m_errors[_error];
+        close(_call.callee);
+        close(_call.caller);
+    }
+
+    void loadGen_t::fail(peer_t &_peer, error_t _error) {
+        if (_peer.call != nullptr) {
+            fail(*_peer.call, _error);
+            return;
+        }
+        // a room test is over with the first failure
+        if (!m_roomClosing) {
+            ++m_errors[_error];
+            closeRoom();
+        }
+    }
+
+    void loadGen_t::close(peer_t &_peer) {
+        switch (_peer.state) {
+            case state_t::IDLE: {
+                _peer.state = state_t::CLOSED;
+                if (_peer.call != nullptr) {
+                    m_done.push_back(_peer.call->id);
+                }
+                break;
+            }
+            case state_t::CLOSING:
+            case state_t::CLOSED: {
+                break;
+            }
+            case state_t::CONNECTING: {
+                // closed as soon as it is established
+                _peer.state = state_t::CLOSING;
+                break;
+            }
+            default: {
+                // the connection is closed by its writeable callback when the queued messages are sent
+                _peer.state = state_t::CLOSING;
+                lws_callback_on_writable(_peer.lws);
+                break;
+            }
+        }
+    }
+
+    void loadGen_t::closed(peer_t &_peer) {
+        if (_peer.state == state_t::CLOSED) {
+            return;
+        }
+        if ((_peer.state != state_t::CLOSING) && ((_peer.call == nullptr) || !_peer.call->failed)) {
+            fail(_peer, (_peer.state == state_t::CONNECTING) ? ERR_CONNECT : ERR_CLOSED);
+        }
+        _peer.state = state_t::CLOSED;
+        _peer.lws = nullptr;
+        _peer.writeQueue.clear();
+        --m_connections;
+        if (_peer.call != nullptr) {
+            m_done.push_back(_peer.call->id);
+        }
+    }
+
+    bool loadGen_t::send(peer_t &_peer, framePtr_t _frame) {
+        if (!_frame || (_peer.lws == nullptr) || !_peer.writeQueue.push(std::move(_frame))) {
+            return false;
+        }
+        lws_callback_on_writable(_peer.lws);
+        return true;
+    }
+
+    static framePtr_t jsonFrame(framePool_t &_framePool, const rapidjson::StringBuffer &_json) {
+        auto frame = _framePool.get(_json.GetSize());
+        frame->append(_json.GetString(), _json.GetSize());
+        return frame;
+    }
+
+    bool loadGen_t::sendLogon(peer_t &_peer) {
+        if (_peer.binary) {
+            return send(_peer, binProto_t::writer_t(m_framePool, binProto_t::msgType_t::MT_LOGON,
+                                                    2 + _peer.token.length()).field(_peer.token).frame());
+        }
+        // {"type": "logon", "token": "token_value"}
+        rapidjson::StringBuffer jsonStr;
+        rapidjson::Writer<rapidjson::StringBuffer> writer(jsonStr);
+        writer.StartObject();
+        writer.Key("type");
+        writer.String("logon");
+        writer.Key("token");
+        writer.String(_peer.token.c_str(), static_cast<rapidjson::SizeType>(_peer.token.length()));
+        writer.EndObject();
+        return send(_peer, jsonFrame(m_framePool, jsonStr));
+    }
+
+    bool loadGen_t::sendCall(peer_t &_peer) {
+        const auto &to = _peer.call->callee.token;
+        if (_peer.binary) {
+            return send(_peer, binProto_t::writer_t(m_framePool, binProto_t::msgType_t::MT_CALL,
+                                                    2 + to.length()).field(to).frame());
+        }
+        // {"type": "call", "to": "token_value"}
+        rapidjson::StringBuffer jsonStr;
+        rapidjson::Writer<rapidjson::StringBuffer> writer(jsonStr);
+        writer.StartObject();
+        writer.Key("type");
+        writer.String("call");
+        writer.Key("to");
+        writer.String(to.c_str(), static_cast<rapidjson::SizeType>(to.length()));
+        writer.EndObject();
+        return send(_peer, jsonFrame(m_framePool, jsonStr));
+    }
+
+    bool loadGen_t::sendCallStatus(peer_t &_peer) {
+        if (_peer.binary) {
+            return send(_peer, binProto_t::writer_t(m_framePool, binProto_t::msgType_t::MT_CALL_STATUS, 3)
+                    .flag(true).frame());
+        }
+        static const char reply[] = R"({"type": "call", "status": true})";
+        auto frame = m_framePool.get(sizeof(reply) - 1);
+        frame->append(reply, sizeof(reply) - 1);
+        return send(_peer, std::move(frame));
+    }
+
+    bool loadGen_t::sendSdp(peer_t &_peer, bool _offer) {
+        // session description followed by ICE candidates, as WebRTC peers trickle them
+        if (_peer.binary) {
+            if (!send(_peer, binProto_t::writer_t(m_framePool, _offer ? binProto_t::msgType_t::MT_OFFER :
+                                                              binProto_t::msgType_t::MT_ANSWER,
+                                                  2 + m_sdp.length()).field(m_sdp).frame())) {
+                return false;
+            }
+        } else {
+            rapidjson::StringBuffer jsonStr;
+            rapidjson::Writer<rapidjson::StringBuffer> writer(jsonStr);
+            writer.StartObject();
+            writer.Key("type");
+            writer.String(_offer ? "offer" : "answer");
+            writer.Key("sdp");
+            writer.String(m_sdp.c_str(), static_cast<rapidjson::SizeType>(m_sdp.length()));
+            writer.EndObject();
+            if (!send(_peer, jsonFrame(m_framePool, jsonStr))) {
+                return false;
+            }
+        }
+
+        static const std::string sdpMid = "0";
+        for (uint16_t i = 0; i < m_options.candidates; ++i) {
+            if (!send(_peer, candidateMsg(_peer.binary, sdpMid, i))) {
+                return false;
+            }
+        }
+
+        return true;
+    }
+
+    bool loadGen_t::sendJoin(peer_t &_peer) {
+        if (_peer.binary) {
+            return send(_peer, binProto_t::writer_t(m_framePool, binProto_t::msgType_t::MT_JOIN,
+                                                    2 + m_room.length()).field(m_room).frame());
+        }
+        // {"type": "join", "room": "room_name"}
+        rapidjson::StringBuffer jsonStr;
+        rapidjson::Writer<rapidjson::StringBuffer> writer(jsonStr);
+        writer.StartObject();
+        writer.Key("type");
+        writer.String("join");
+        writer.Key("room");
+        writer.String(m_room.c_str(), static_cast<rapidjson::SizeType>(m_room.length()));
+        writer.EndObject();
+        return send(_peer, jsonFrame(m_framePool, jsonStr));
+    }
+
+    bool loadGen_t::sendBroadcast(peer_t &_peer) {
+        // the sequence number goes as sdpMid, the members match the candidate with its send time by it
+        auto seq = m_broadcastSent.size();
+        m_broadcastSent.push_back(metrics_t::now());
+        m_broadcastDelivered.push_back(0);
+        return send(_peer, candidateMsg(_peer.binary, std::to_string(seq), static_cast<uint16_t>(seq)));
+    }
+
+    framePtr_t loadGen_t::candidateMsg(bool _binary, const std::string &_sdpMid, uint16_t _idx) {
+        auto candidate = fmt::format(FMT_STRING("candidate:{:d} 1 udp 2122260223 127.0.0.1 {:d} typ host "
+                                                "generation 0 ufrag lgen network-id 1"),
+                                     _idx + 1, 50000 + (_idx % 10000));
+        if (_binary) {
+            return binProto_t::writer_t(m_framePool, binProto_t::msgType_t::MT_CANDIDATE,
+                                        10 + _sdpMid.length() + candidate.length()).field(_sdpMid).number(0)
+                    .field(candidate).frame();
+        }
+        rapidjson::StringBuffer jsonStr;
+        rapidjson::Writer<rapidjson::StringBuffer> writer(jsonStr);
+        writer.StartObject();
+        writer.Key("sdpMid");
+        writer.String(_sdpMid.c_str(), static_cast<rapidjson::SizeType>(_sdpMid.length()));
+        writer.Key("sdpMLineIndex");
+        writer.Int(0);
+        writer.Key("candidate");
+        writer.String(candidate.c_str(), static_cast<rapidjson::SizeType>(candidate.length()));
+        writer.EndObject();
+        return jsonFrame(m_framePool, jsonStr);
+    }
+
+    uint64_t loadGen_t::rss(pid_t _pid) {
+        if (_pid <= 0) {
+            return 0;
+        }
+        std::ifstream status(fmt::format(FMT_STRING("/proc/{:d}/status"), _pid));
+        std::string line;
+        while (std::getline(status, line)) {
+            // VmRSS:     12345 kB
+            if (line.compare(0, 6, "VmRSS:") == 0) {
+                return std::stoull(line.substr(6)) * 1024;
+            }
+        }
+        return 0;
+    }
+
+    uint64_t loadGen_t::cpuTime(pid_t _pid) {
+        if (_pid <= 0) {
+            return 0;
+        }
+        std::ifstream stat(fmt::format(FMT_STRING("/proc/{:d}/stat"), _pid));
+        std::string line;
+        if (!std::getline(stat, line)) {
+            return 0;
+        }
+        // pid (comm) state ppid ... utime stime, the command may contain spaces
+        auto pos = line.rfind(')');
+        if (pos == std::string::npos) {
+            return 0;
+        }
+        std::istringstream fields(line.substr(pos + 1));
+        std::string field;
+        uint64_t ticks = 0;
+        for (int i = 0; (i < 13) && (fields >> field); ++i) {
+            if (i >= 11) {
+                ticks += std::stoull(field);
+            }
+        }
+        return ticks * 1000000000ULL / static_cast<uint64_t>(sysconf(_SC_CLK_TCK));
+    }
+
+    void loadGen_t::report(uint64_t _now) {
+        double interval = static_cast<double>(_now - m_lastReport) / 1e9;
+        uint64_t failed = 0;
+        for (auto i:m_errors) {
+            failed += i;
+        }
+
+        std::string rssStr;
+        auto serverRss = rss(m_options.serverPid);
+        if (serverRss > 0) {
+            if (m_connections >= m_rssConnections) {
+                m_peakRss = serverRss;
+                m_rssConnections = m_connections;
+            }
+            rssStr = fmt::format(FMT_STRING(" | server RSS {:.1f} MB"), static_cast<double>(serverRss) / 1048576);
+            if ((m_connections > 0) && (serverRss > m_baseRss)) {
+                rssStr += fmt::format(FMT_STRING(", {:.1f} KB/conn"),
+                                      static_cast<double>(serverRss - m_baseRss) / 1024 / m_connections);
+            }
+        }
+
+        if (m_options.idlePeers > 0) {
+            fmt::print(FMT_STRING("[{:5.0f}s] idle: logged on {:d}/{:d}, failed {:d} | connections {:d}{:s}\n"),
+                       static_cast<double>(_now - m_started) / 1e9,
+                       m_joined, m_members.size(), failed, m_connections, rssStr);
+        } else if (m_options.roomSize > 0) {
+            fmt::print(FMT_STRING("[{:5.0f}s] room: joined {:d}/{:d}, broadcasts sent {:d}, delivered to all {:d} "
+                                  "({:.0f}/s), failed {:d} | connections {:d} | msgs/s tx {:.0f}, rx {:.0f} | "
+                                  "delivery p50 {:.2f} ms, p99 {:.2f} ms{:s}\n"),
+                       static_cast<double>(_now - m_started) / 1e9,
+                       m_joined, m_members.size(), m_broadcastSent.size(), m_completed,
+                       static_cast<double>(m_completed - m_lastCompleted) / interval, failed,
+                       m_connections,
+                       static_cast<double>(m_sentMsgs - m_lastSentMsgs) / interval,
+                       static_cast<double>(m_receivedMsgs - m_lastReceivedMsgs) / interval,
+                       static_cast<double>(m_deliveryTime.quantile(0.5)) / 1000,
+                       static_cast<double>(m_deliveryTime.quantile(0.99)) / 1000,
+                       rssStr);
+        } else {
+            fmt::print(FMT_STRING("[{:5.0f}s] calls: launched {:d}, active {:d}, completed {:d} ({:.0f}/s), "
+                                  "failed {:d} | connections {:d} | msgs/s tx {:.0f}, rx {:.0f} | "
+                                  "setup p50 {:.2f} ms, p99 {:.2f} ms{:s}\n"),
+                       static_cast<double>(_now - m_started) / 1e9,
+                       m_launched, m_calls.size(), m_completed,
+                       static_cast<double>(m_completed - m_lastCompleted) / interval, failed,
+                       m_connections,
+                       static_cast<double>(m_sentMsgs - m_lastSentMsgs) / interval,
+                       static_cast<double>(m_receivedMsgs - m_lastReceivedMsgs) / interval,
+                       static_cast<double>(m_setupTime.quantile(0.5)) / 1000,
+                       static_cast<double>(m_setupTime.quantile(0.99)) / 1000,
+                       rssStr);
+        }
+        std::fflush(stdout);
+
+        m_lastReport = _now;
+        m_lastSentMsgs = m_sentMsgs;
+        m_lastReceivedMsgs = m_receivedMsgs;
+        m_lastCompleted = m_completed;
+    }
+
+    void loadGen_t::summary() {
+        static const char *errors[ERR_NUM] = {"connect", "logon", "offline", "server error", "protocol",
+                                              "closed", "timeout", "join"};
+        double elapsed = static_cast<double>(metrics_t::now() - m_started) / 1e9;
+
+        if (m_options.idlePeers > 0) {
+            fmt::print(FMT_STRING("\nduration {:.1f} s, idle peers {:d} ({:d} logged on), peak connections {:d}\n"),
+                       elapsed, m_members.size(), m_joined, m_peakConnections);
+        } else if (m_options.roomSize > 0) {
+            fmt::print(FMT_STRING("\nduration {:.1f} s, room of {:d} members ({:d} joined), broadcasts sent {:d}, "
+                                  "delivered to all members {:d}, peak connections {:d}\n"),
+                       elapsed, m_members.size(), m_joined, m_broadcastSent.size(), m_completed, m_peakConnections);
+        } else {
+            fmt::print(FMT_STRING("\nduration {:.1f} s, calls launched {:d}, completed {:d} ({:.1f}/s), "
+                                  "peak connections {:d}\n"),
+                       elapsed, m_launched, m_completed, static_cast<double>(m_completed) / elapsed,
+                       m_peakConnections);
+        }
+
+        std::string errorsStr;
+        for (std::size_t i = 0; i < ERR_NUM; ++i) {
+            errorsStr += fmt::format(FMT_STRING("{:s}{:s} {:d}"), errorsStr.empty() ? "" : ", ", errors[i], m_errors[i]);
+        }
+        fmt::print(FMT_STRING("errors: {:s}\n"), errorsStr);
+
+        auto latency = [](const char *_name, const hdrHistogram_t &_histogram) {
+            fmt::print(FMT_STRING("{:s} (ms): count {:d}, p50 {:.2f}, p90 {:.2f}, p99 {:.2f}, p99.9 {:.2f}, max {:.2f}\n"),
+                       _name, _histogram.count(),
+                       static_cast<double>(_histogram.quantile(0.5)) / 1000,
+                       static_cast<double>(_histogram.quantile(0.9)) / 1000,
+                       static_cast<double>(_histogram.quantile(0.99)) / 1000,
+                       static_cast<double>(_histogram.quantile(0.999)) / 1000,
+                       static_cast<double>(_histogram.maxUs()) / 1000);
+        };
+        latency("logon (connect to logon status)", m_logonTime);
+        if (m_options.roomSize > 0) {
+            latency("join (connect to join status)", m_joinTime);
+            latency("delivery (broadcast to a member)", m_deliveryTime);
+            latency("fan-out (broadcast to the last member)", m_fanOutTime);
+        } else {
+            latency("call setup (call request to answer)", m_setupTime);
+            latency("ICE exchange (call request to the last candidate)", m_iceTime);
+        }
+
+        fmt::print(FMT_STRING("throughput: tx {:.0f} msgs/s, {:.1f} KB/s, rx {:.0f} msgs/s, {:.1f} KB/s\n"),
+                   static_cast<double>(m_sentMsgs) / elapsed, static_cast<double>(m_sentBytes) / 1024 / elapsed,
+                   static_cast<double>(m_receivedMsgs) / elapsed, static_cast<double>(m_receivedBytes) / 1024 / elapsed);
+
+        if ((m_options.roomSize > 0) && (m_cpuUsed > 0) && !m_broadcastSent.empty() && (m_deliveryTime.count() > 0)) {
+            // everything the server does for a broadcast: receive, parse, fan-out & the members' writes
+            fmt::print(FMT_STRING("server CPU: {:.1f} ms for {:d} broadcasts, {:.1f} us per broadcast, "
+                                  "{:.2f} us per delivery\n"),
+                       static_cast<double>(m_cpuUsed) / 1e6, m_broadcastSent.size(),
+                       static_cast<double>(m_cpuUsed) / 1e3 / m_broadcastSent.size(),
+                       static_cast<double>(m_cpuUsed) / 1e3 / m_deliveryTime.count());
+        }
+
+        if ((m_peakRss > 0) && (m_rssConnections > 0)) {
+            fmt::print(FMT_STRING("server RSS: {:.1f} MB before the test, {:.1f} MB at {:d} connections, "
+                                  "{:.1f} KB per connection\n"),
+                       static_cast<double>(m_baseRss) / 1048576, static_cast<double>(m_peakRss) / 1048576,
+                       m_rssConnections,
+                       (m_peakRss > m_baseRss) ?
+                       static_cast<double>(m_peakRss - m_baseRss) / 1024 / m_rssConnections : 0.0);
+        }
+    }
+} // namespace tgwss
@@ -0,0 +1,258 @@
+/**
+* @file loadgen/loadGen.h
+* @brief signaling load generator, drives tgwss with scripted calls
+* @author Max Fomichev
+* @date 29.01.2020
+* @copyright Apache License v.2 (http://www.apache.org/licenses/LICENSE-2.0)
+*/
+
+#ifndef TGWSS_LOADGEN_H
+#define TGWSS_LOADGEN_H
+
+#include <sys/types.h>
+
+#include <string>
+#include <vector>
+#include <queue>
+#include <unordered_map>
+#include <array>
+#include <atomic>
+#include <memory>
+
+#include <libwebsockets.h>
+
+#include "wss/frameBuffer.h"
+#include "wss/writeQueue.h"
+#include "wss/binProto.h"
+#include "wss/metrics.h"
+
+namespace tgwss {
+    /**
+     * Every call is a pair of connections speaking the same wire protocol as wsClient_t of tgvoip:
+     * callee logon, caller logon, call request, call confirmation, offer & N ICE candidates,
+     * answer & N ICE candidates, hangup after the hold time. All connections are served by one lws
+     * context and one thread, new calls are started at the target rate.
+     * Room mode measures group call fan-out instead: N connections log on and join one room, then
+     * the first member broadcasts ICE candidates at the target rate and every other member reports
+     * the delivery of each one.
+     * Idle mode measures the memory of idle peers: N connections log on, stay idle for the hold time & close,
+     * the server RSS per connection is sampled when all of them are online.
+     */
+    class loadGen_t final {
+    public:
+        struct options_t {
+            std::string host = "127.0.0.1";
+            uint16_t port = 8080;
+            std::string path = "/";
+            bool ssl = false;
+            // "tgwss-bin" subprotocol instead of "tgwss"
+            bool binary = false;
+            // new calls per second
+            uint32_t rate = 10;
+            // total number of calls, 0 - until the duration is over
+            uint32_t calls = 100;
+            // test duration (sec), 0 - until all the calls are done
+            uint32_t duration = 0;
+            // max number of active calls, each call takes two connections
+            uint32_t concurrency = 1000;
+            // ICE candidates sent by each side
+            uint16_t candidates = 4;
+            // size of SDP offers & answers (bytes)
+            uint32_t sdpSize = 2048;
+            // established calls are hung up after (ms)
+            uint32_t holdTime = 1000;
+            // calls not established within (ms) are failed
+            uint32_t timeout = 10000;
+            // tgwss process to sample RSS & CPU time of, 0 - do not sample
+            pid_t serverPid = 0;
+            // room members, 0 - calls are made instead; rate & calls are the broadcasts into the room then
+            uint32_t roomSize = 0;
+            // idle peers, 0 - off; they are logged on & held for holdTime, rate & calls are not used
+            uint32_t idlePeers = 0;
+        };
+
+        enum error_t: std::size_t {
+            ERR_CONNECT,        // connection failed
+            ERR_LOGON,          // logon rejected
+            ERR_OFFLINE,        // callee reported offline
+            ERR_SERVER,         // error message received
+            ERR_PROTOCOL,       // malformed or unexpected message
+            ERR_CLOSED,         // connection closed before hangup
+            ERR_TIMEOUT,        // call was not established in time
+            ERR_JOIN,           // room join rejected
+            ERR_NUM
+        };
+
+    private:
+        enum class state_t {
+            IDLE,
+            CONNECTING,
+            LOGGING_ON,
+            ONLINE,
+            CALLING,
+            NEGOTIATING,
+            JOINING,
+            JOINED,
+            CLOSING,
+            CLOSED
+        };
+
+        struct call_t;
+
+        struct peer_t {
+            // null if the peer is a room member
+            call_t *call = nullptr;
+            bool caller = false;
+            std::string token;
+            struct lws *lws = nullptr;
+            state_t state = state_t::IDLE;
+            bool binary = false;
+            framePtr_t readFrame;
+            writeQueue_t writeQueue;
+            // SDP offer or answer & candidates received from the remote side
+            bool sdpReceived = false;
+            uint16_t candidatesReceived = 0;
+            uint64_t connectStarted = 0;
+
+            peer_t(): writeQueue(256) {}
+        };
+
+        struct call_t {
+            uint64_t id = 0;
+            peer_t callee;
+            peer_t caller;
+            uint64_t callSent = 0;
+            bool established = false;
+            bool failed = false;
+        };
+
+        // hangup & timeout events, ordered by time
+        struct event_t {
+            uint64_t time;
+            uint64_t callId;
+            bool hangup;
+
+            bool operator>(const event_t &_other) const noexcept {return time > _other.time;}
+        };
+
+        options_t m_options;
+
+        // "tgwss" or "tgwss-bin" subprotocol, null terminated
+        struct lws_protocols m_wsProtocols[2] {};
+        struct lws_context_creation_info m_wsInfo {};
+        struct lws_context *m_wsContext = nullptr;
+
+        framePool_t m_framePool;
+        std::string m_sdp;
+        std::string m_tokenPrefix;
+
+        std::unordered_map<uint64_t, std::unique_ptr<call_t>> m_calls;
+        std::priority_queue<event_t, std::vector<event_t>, std::greater<event_t>> m_events;
+        // calls with a connection closed since the last tick
+        std::vector<uint64_t> m_done;
+
+        // room & idle modes, the first room member broadcasts
+        std::vector<std::unique_ptr<peer_t>> m_members;
+        std::string m_room;
+        // members joined the room or idle peers logged on
+        std::size_t m_joined = 0;
+        bool m_roomClosing = false;
+        // send time of every broadcast (by its sequence number) & the number of members it has reached
+        std::vector<uint64_t> m_broadcastSent;
+        std::vector<uint32_t> m_broadcastDelivered;
+        uint64_t m_broadcastStarted = 0;
+        uint64_t m_broadcastFinished = 0;
+        // server CPU time (ns) spent from the first broadcast till the last delivery
+        uint64_t m_cpuStarted = 0;
+        uint64_t m_cpuUsed = 0;
+
+        uint64_t m_started = 0;
+        uint64_t m_launched = 0;
+        uint64_t m_completed = 0;
+        std::size_t m_connections = 0;
+        std::size_t m_peakConnections = 0;
+        bool m_launching = true;
+
+        // connect to logon status, call request to answer, call request to the last ICE candidate
+        hdrHistogram_t m_logonTime;
+        hdrHistogram_t m_setupTime;
+        hdrHistogram_t m_iceTime;
+        // connect to join status, broadcast to a member, broadcast to the last member
+        hdrHistogram_t m_joinTime;
+        hdrHistogram_t m_deliveryTime;
+        hdrHistogram_t m_fanOutTime;
+        std::array<uint64_t, ERR_NUM> m_errors {};
+        uint64_t m_sentMsgs = 0;
+        uint64_t m_sentBytes = 0;
+        uint64_t m_receivedMsgs = 0;
+        uint64_t m_receivedBytes = 0;
+
+        // server RSS before the test & at the max number of connections it was sampled with
+        uint64_t m_baseRss = 0;
+        uint64_t m_peakRss = 0;
+        std::size_t m_rssConnections = 0;
+
+        uint64_t m_lastReport = 0;
+        uint64_t m_lastSentMsgs = 0;
+        uint64_t m_lastReceivedMsgs = 0;
+        uint64_t m_lastCompleted = 0;
+
+        std::atomic<bool> m_stopFlag {false};
+        std::atomic<bool> m_interrupted {false};
+
+    public:
+        explicit loadGen_t(options_t _options);
+        ~loadGen_t();
+
+        loadGen_t(const loadGen_t &) = delete;
+        void operator=(const loadGen_t &) = delete;
+        loadGen_t(const loadGen_t &&) = delete;
+        void operator=(const loadGen_t &&) = delete;
+
+        /// runs the test, @returns false if some calls failed
+        bool run();
+        /// stops starting new calls and hangs up the active ones, may be called from any thread
+        void interrupt() noexcept {m_interrupted = true;}
+
+    private:
+        static int wscbService(struct lws *_lws, enum lws_callback_reasons _reason,
+                               void *_user, void *_data, size_t _size) noexcept;
+        static void tickerWorker(loadGen_t *_loadGen);
+
+        void tick();
+        void roomTick(uint64_t _now);
+        void launch();
+        bool connect(peer_t &_peer);
+        void receive(peer_t &_peer, const void *_data, std::size_t _size);
+        void process(peer_t &_peer, const frame_t &_msg);
+        void processRoom(peer_t &_peer, const frame_t &_msg);
+        /// _sdpMid is set to the sdpMid of candidates if not null
+        bool decode(const peer_t &_peer, const frame_t &_msg, binProto_t::msgType_t &_type, bool &_status,
+                    std::string *_sdpMid = nullptr) const;
+        void established(call_t &_call);
+        void closed(peer_t &_peer);
+        void fail(call_t &_call, error_t _error);
+        void fail(peer_t &_peer, error_t _error);
+        /// stops the room test, all the members are closed
+        void closeRoom();
+        void hangup(call_t &_call);
+        void close(peer_t &_peer);
+
+        bool send(peer_t &_peer, framePtr_t _frame);
+        bool sendLogon(peer_t &_peer);
+        bool sendCall(peer_t &_peer);
+        bool sendCallStatus(peer_t &_peer);
+        bool sendSdp(peer_t &_peer, bool _offer);
+        bool sendJoin(peer_t &_peer);
+        bool sendBroadcast(peer_t &_peer);
+        framePtr_t candidateMsg(bool _binary, const std::string &_sdpMid, uint16_t _idx);
+
+        void report(uint64_t _now);
+        void summary();
+        static uint64_t rss(pid_t _pid);
+        /// @returns user & system CPU time (ns) of process _pid
+        static uint64_t cpuTime(pid_t _pid);
+    };
+} // namespace tgwss
+
+#endif //TGWSS_LOADGEN_H
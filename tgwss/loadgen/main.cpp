@@ -0,0 +1,188 @@
+/**
+* @file loadgen/main.cpp
+* @brief
+* @author Max Fomichev
+* @date 29.01.2020
+* @copyright Apache License v.2 (http://www.apache.org/licenses/LICENSE-2.0)
+*/
+
+#include <getopt.h>
+#include <signal.h>
+#include <sys/resource.h>
+
+#include <iostream>
+#include <atomic>
+
+#include "loadGen.h"
+
+static void usage(const char *_name) {
+    std::cout  << _name << " [options]" << std::endl
+               << "  Options:" << std::endl
+               << "    -a, --address <host>" << std::endl
+               << "      tgwss address (default 127.0.0.1)" << std::endl
+               << "    -p, --port <port>" << std::endl
+               << "      tgwss port (default 8080)" << std::endl
+               << "    -s, --ssl" << std::endl
+               << "      Use secure connections, server certificate is not verified" << std::endl
+               << "    -b, --binary" << std::endl
+               << "      Use \"tgwss-bin\" subprotocol instead of \"tgwss\"" << std::endl
+               << "    -r, --rate <calls>" << std::endl
+               << "      New calls (broadcasts in room mode) per second (default 10)" << std::endl
+               << "    -n, --calls <calls>" << std::endl
+               << "      Total number of calls (broadcasts in room mode), 0 - until the duration is over "
+                  "(default 100)" << std::endl
+               << "    -t, --duration <sec>" << std::endl
+               << "      Max test duration, 0 - until all the calls are done (default 0)" << std::endl
+               << "    -m, --concurrency <calls>" << std::endl
+               << "      Max number of active calls, two connections each (default 1000)" << std::endl
+               << "    -i, --candidates <number>" << std::endl
+               << "      ICE candidates sent by each side of a call (default 4)" << std::endl
+               << "    -z, --sdp-size <bytes>" << std::endl
+               << "      Size of SDP offers & answers (default 2048)" << std::endl
+               << "    -l, --hold <ms>" << std::endl
+               << "      Established calls are hung up after (default 1000)" << std::endl
+               << "    -w, --timeout <ms>" << std::endl
+               << "      Calls not established within are failed (default 10000)" << std::endl
+               << "    -g, --room-size <members>" << std::endl
+               << "      Room mode: the members join one room, the first one broadcasts ICE candidates to the "
+                  "others (default 0 - calls)" << std::endl
+               << "    -I, --idle <peers>" << std::endl
+               << "      Idle mode: the peers log on & stay idle for the hold time, server RSS per connection "
+                  "is reported (default 0 - calls)" << std::endl
+               << "    -P, --server-pid <pid>" << std::endl
+               << "      tgwss process to report RSS (and CPU time in room mode) of" << std::endl
+               << "    -h, --help" << std::endl
+               << "      Show usage information and exit" << std::endl;
+}
+
+static struct option longopts[] = {
+        {"address",     required_argument, nullptr, 'a'},
+        {"port",        required_argument, nullptr, 'p'},
+        {"ssl",         no_argument,       nullptr, 's'},
+        {"binary",      no_argument,       nullptr, 'b'},
+        {"rate",        required_argument, nullptr, 'r'},
+        {"calls",       required_argument, nullptr, 'n'},
+        {"duration",    required_argument, nullptr, 't'},
+        {"concurrency", required_argument, nullptr, 'm'},
+        {"candidates",  required_argument, nullptr, 'i'},
+        {"sdp-size",    required_argument, nullptr, 'z'},
+        {"hold",        required_argument, nullptr, 'l'},
+        {"timeout",     required_argument, nullptr, 'w'},
+        {"room-size",   required_argument, nullptr, 'g'},
+        {"idle",        required_argument, nullptr, 'I'},
+        {"server-pid",  required_argument, nullptr, 'P'},
+        {"help",        no_argument,       nullptr, 'h'},
+        {nullptr,       0,                 nullptr, 0}
+};
+
+static std::atomic<tgwss::loadGen_t *> g_loadGen {nullptr};
+
+static void onSignal(int) {
+    auto loadGen = g_loadGen.load();
+    if (loadGen != nullptr) {
+        loadGen->interrupt();
+    }
+}
+
+int main(int argc, char *argv[]) {
+    try {
+        tgwss::loadGen_t::options_t options;
+
+        int ch;
+        while ((ch = getopt_long(argc, argv, "a:p:sbr:n:t:m:i:z:l:w:g:I:P:h", longopts, nullptr)) != -1) {
+            switch (ch) {
+                case 'a':
+                    options.host = optarg;
+                    break;
+                case 'p':
+                    options.port = static_cast<uint16_t>(std::stoul(optarg));
+                    break;
+                case 's':
+                    options.ssl = true;
+                    break;
+                case 'b':
+                    options.binary = true;
+                    break;
+                case 'r':
+                    options.rate = static_cast<uint32_t>(std::stoul(optarg));
+                    break;
+                case 'n':
+                    options.calls = static_cast<uint32_t>(std::stoul(optarg));
+                    break;
+                case 't':
+                    options.duration = static_cast<uint32_t>(std::stoul(optarg));
+                    break;
+                case 'm':
+                    options.concurrency = static_cast<uint32_t>(std::stoul(optarg));
+                    break;
+                case 'i':
+                    options.candidates = static_cast<uint16_t>(std::stoul(optarg));
+                    break;
+                case 'z':
+                    options.sdpSize = static_cast<uint32_t>(std::stoul(optarg));
+                    break;
+                case 'l':
+                    options.holdTime = static_cast<uint32_t>(std::stoul(optarg));
+                    break;
+                case 'w':
+                    options.timeout = static_cast<uint32_t>(std::stoul(optarg));
+                    break;
+                case 'g':
+                    options.roomSize = static_cast<uint32_t>(std::stoul(optarg));
+                    break;
+                case 'I':
+                    options.idlePeers = static_cast<uint32_t>(std::stoul(optarg));
+                    break;
+                case 'P':
+                    options.serverPid = static_cast<pid_t>(std::stol(optarg));
+                    break;
+                case ':':
+                case '?':
+                case 'h':
+                    usage(argv[0]);
+                    return EXIT_SUCCESS;
+                default:
+                    usage(argv[0]);
+                    return EXIT_FAILURE;
+            }
+        }
+
+        if ((options.rate == 0) || (options.concurrency == 0) || ((options.calls == 0) && (options.duration == 0))) {
+            std::cerr << "rate & concurrency must be positive, calls or duration must be set" << std::endl;
+            return EXIT_FAILURE;
+        }
+        if ((options.roomSize > 0) && (options.idlePeers > 0)) {
+            std::cerr << "room & idle modes can't be combined" << std::endl;
+            return EXIT_FAILURE;
+        }
+        if (options.roomSize == 1) {
+            std::cerr << "a room needs two members at least" << std::endl;
+            return EXIT_FAILURE;
+        }
+
+        // thousands of connections, lws sizes its fds table by the limit
+        struct rlimit limit {};
+        if (getrlimit(RLIMIT_NOFILE, &limit) == 0) {
+            limit.rlim_cur = limit.rlim_max;
+            setrlimit(RLIMIT_NOFILE, &limit);
+        }
+        if ((signal(SIGPIPE, SIG_IGN) == SIG_ERR) ||
+            (signal(SIGINT, onSignal) == SIG_ERR) ||
+            (signal(SIGTERM, onSignal) == SIG_ERR)) {
+            throw std::runtime_error("failed to set signal handlers");
+        }
+
+        tgwss::loadGen_t loadGen(options);
+        g_loadGen = &loadGen;
+        auto succeeded = loadGen.run();
+        g_loadGen = nullptr;
+
+        return succeeded ? EXIT_SUCCESS : EXIT_FAILURE;
+    } catch (const std::exception &_e) {
+        std::cerr << _e.what() << std::endl;
+    } catch (...) {
+        std::cerr << "unknown error" << std::endl;
+    }
+
+    return EXIT_FAILURE;
+}
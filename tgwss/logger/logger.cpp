@@ -7,31 +7,56 @@
 */
 
 #include <syslog.h>
+#include <fcntl.h>
+#include <unistd.h>
 
-#include <iomanip>
-#include <iostream>
+#include <cstring>
 
 #include "logger.h"
 
 namespace tgwss {
     logger_t::~logger_t() {
-        if (m_logDst == logDst_t::LD_SYSLOG) {
-            closelog();
-        } else if (m_logDst == logDst_t::LD_FILE) {
-            m_ofs.close();
-        }
-
-        m_workFlag = false;
         {
             std::unique_lock<std::mutex> lck(m_mtxLog);
-            m_checkQueueFlag = true;
+            m_workFlag = false;
             m_cvLog.notify_one();
         }
         m_workerThread.join();
+
+        if (m_logDst == logDst_t::LD_SYSLOG) {
+            closelog();
+        } else if ((m_logDst == logDst_t::LD_FILE) && (m_fd >= 0)) {
+            close(m_fd);
+        }
     }
 
-    void logger_t::init(const std::string &_logPrefix, const std::string &_logTo, const std::string &_logLevel) {
+    void logger_t::init(const std::string &_logPrefix, const std::string &_logTo, const std::string &_logLevel,
+                        uint32_t _flushInterval, uint32_t _maxLatency) {
         m_logPrefix = _logPrefix;
+        m_flushInterval = std::chrono::milliseconds(_flushInterval);
+        m_maxLatency = std::chrono::milliseconds(_maxLatency);
+        m_batch.reserve(m_batchSize + logRecord_t::m_textSize * 2);
+        level(_logLevel);
+
+        if (_logTo == "syslog") {
+            m_logDst = logDst_t::LD_SYSLOG;
+            openlog(m_logPrefix.c_str(), 0, 0);
+        } else if (_logTo == "console") {
+            m_logDst = logDst_t::LD_CONSOLE;
+            m_fd = STDOUT_FILENO;
+        } else if (_logTo.length() > 0) {
+            m_fd = open(_logTo.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+            if (m_fd < 0) {
+                throw std::runtime_error("failed to open " + _logTo);
+            }
+            m_fileName = _logTo;
+            m_logDst = logDst_t::LD_FILE;
+        } else {
+            throw std::runtime_error("wrong logging destination");
+        }
+    }
+
+    void logger_t::level(const std::string &_logLevel) {
         if (_logLevel == "critical") {
             m_logLevel = logLevel_t::LL_CRITICAL;
         } else if (_logLevel == "error") {
@@ -45,26 +70,8 @@ namespace tgwss {
         } else if (_logLevel == "debug") {
             m_logLevel = logLevel_t::LL_DEBUG;
         } else {
-            std::cout << _logLevel << std::endl;
             throw std::runtime_error("wrong logging level");
         }
-
-        if (_logTo == "syslog") {
-            m_logDst = logDst_t::LD_SYSLOG;
-            openlog(m_logPrefix.c_str(), 0, 0);
-        } else if (_logTo == "console") {
-            m_logDst = logDst_t::LD_CONSOLE;
-        } else if (_logTo.length() > 0) {
-//            m_ofs.open(_logTo, std::ios_base::out | std::ios_base::app);
-            m_ofs.open(_logTo, std::ofstream::out | std::ofstream::ate | std::ofstream::app);
-            if (!m_ofs.is_open()) {
-                throw std::runtime_error("failed to open " + _logTo);
-            }
-            m_fileName = _logTo;
-            m_logDst = logDst_t::LD_FILE;
-        } else {
-            throw std::runtime_error("wrong logging destination");
-        }
     }
 
     int logger_t::levelMapper(logLevel_t _logLevel) const noexcept {
@@ -87,77 +94,176 @@ namespace tgwss {
     }
 
 
+    logger_t::threadRing_t *logger_t::threadRing() noexcept {
+        static thread_local threadRingHolder_t holder;
+        if (holder.ring != nullptr) {
+            return holder.ring;
+        }
+
+        // first record of the thread, take a released ring or create a new one
+        try {
+            std::unique_lock<std::mutex> lck(m_mtxRings);
+            for (auto &i:m_threadRings) {
+                bool released = true;
+                if (i->released.compare_exchange_strong(released, false, std::memory_order_acq_rel)) {
+                    holder.ring = i.get();
+                    return holder.ring;
+                }
+            }
+            m_threadRings.emplace_back(std::make_unique<threadRing_t>());
+            m_threadRings.back()->threadNum = m_threadRings.size() - 1;
+            holder.ring = m_threadRings.back().get();
+        } catch (...) {}
+
+        return holder.ring;
+    }
+
     void logger_t::worker() noexcept {
-        while (m_workFlag) {
-            logRecord_t logRecord;
+        std::vector<threadRing_t *> rings;
+        std::vector<uint64_t> heads;
+        while (true) {
+            bool working;
             {
                 std::unique_lock<std::mutex> lck(m_mtxLog);
-                while (!m_checkQueueFlag) {
-                    m_cvLog.wait(lck);
+                m_cvLog.wait_for(lck, m_flushInterval, [this] {return !m_workFlag;});
+                working = m_workFlag;
+            }
+
+            try {
+                {
+                    std::unique_lock<std::mutex> lck(m_mtxRings);
+                    rings.clear();
+                    for (const auto &i:m_threadRings) {
+                        rings.push_back(i.get());
+                    }
                 }
+                heads.resize(rings.size());
+                for (std::size_t i = 0; i < rings.size(); ++i) {
+                    heads[i] = rings[i]->head.load(std::memory_order_acquire);
 
-                if (!m_logQueue.empty()) {
-                    try {
-                        logRecord = m_logQueue.front();
-                        m_logQueue.pop();
-                    } catch (...) {
-                        continue;
+                    auto dropped = rings[i]->dropped.exchange(0, std::memory_order_relaxed);
+                    if (dropped > 0) {
+                        logRecord_t logRecord;
+                        logRecord.timeStamp = std::chrono::system_clock::now();
+                        logRecord.logLevel = logLevel_t::LL_WARNING;
+                        logRecord.size = std::min(fmt::format_to_n(logRecord.text, logRecord_t::m_textSize,
+                                                                   "logger: {:d} record(s) dropped",
+                                                                   dropped).size,
+                                                  logRecord_t::m_textSize);
+                        output(*rings[i], logRecord);
                     }
-                } else {
-                    m_checkQueueFlag = false;
-                    continue;
                 }
-                if (m_logQueue.empty()) {
-                    m_checkQueueFlag = false;
+
+                // merge the rings in timestamps order
+                while (true) {
+                    threadRing_t *next = nullptr;
+                    for (std::size_t i = 0; i < rings.size(); ++i) {
+                        auto tail = rings[i]->tail.load(std::memory_order_relaxed);
+                        if (tail == heads[i]) {
+                            continue;
+                        }
+                        if ((next == nullptr) ||
+                            (rings[i]->slots[tail % threadRing_t::m_slotsNum].timeStamp <
+                             next->slots[next->tail.load(std::memory_order_relaxed) %
+                                         threadRing_t::m_slotsNum].timeStamp)) {
+                            next = rings[i];
+                        }
+                    }
+                    if (next == nullptr) {
+                        break;
+                    }
+                    auto tail = next->tail.load(std::memory_order_relaxed);
+                    output(*next, next->slots[tail % threadRing_t::m_slotsNum]);
+                    next->tail.store(tail + 1, std::memory_order_release);
                 }
+            } catch (...) {}
+
+            if (!m_batch.empty() &&
+                (!working || (m_batch.size() >= m_batchSize) ||
+                 (std::chrono::steady_clock::now() - m_batchStarted >= m_maxLatency))) {
+                flush();
             }
-            try {
-                auto recTime = std::chrono::duration_cast<std::chrono::milliseconds>(
-                        std::get<0>(logRecord).time_since_epoch()).count();
 
-                auto recTimeInSec = static_cast<long>(recTime / 1000);
-                auto restMS = static_cast<uint16_t>(recTime % 1000);
+            if (!working) {
+                break;
+            }
+        }
+    }
+
+    void logger_t::output(const threadRing_t &_ring, const logRecord_t &_logRecord) noexcept {
+        try {
+            auto recTime = std::chrono::duration_cast<std::chrono::milliseconds>(
+                    _logRecord.timeStamp.time_since_epoch()).count();
 
+            auto recTimeInSec = static_cast<long>(recTime / 1000);
+            auto restMS = static_cast<uint16_t>(recTime % 1000);
+
+            if (recTimeInSec != m_cachedSec) {
                 struct tm timeInfo{};
                 localtime_r(&recTimeInSec, &timeInfo);
+                std::snprintf(m_cachedDateTime, sizeof(m_cachedDateTime), "%04d.%02d.%02d %02d:%02d:%02d",
+                              1900 + timeInfo.tm_year, timeInfo.tm_mon + 1, timeInfo.tm_mday,
+                              timeInfo.tm_hour, timeInfo.tm_min, timeInfo.tm_sec);
+                m_cachedSec = recTimeInSec;
+            }
+
+            if (m_batch.empty()) {
+                m_batchStarted = std::chrono::steady_clock::now();
+            }
+            auto lineStart = m_batch.size();
+            if (m_logDst != logDst_t::LD_SYSLOG) {
+                char ms[] = {'.',
+                             static_cast<char>('0' + restMS / 100),
+                             static_cast<char>('0' + restMS / 10 % 10),
+                             static_cast<char>('0' + restMS % 10),
+                             ':', ' '};
+                m_batch.append(m_cachedDateTime).append(ms, sizeof(ms));
+            }
+            m_batch.append("[").append(m_logPrefix).append("] ");
+            if (m_logLevel == logLevel_t::LL_DEBUG) {
+                m_batch.append("[THR#").append(std::to_string(_ring.threadNum)).append("] ");
+            }
+            m_batch.append("[").append(m_logLevelStrs.at(_logRecord.logLevel)).append("] ");
+            m_batch.append(_logRecord.text, _logRecord.size);
+
+            if (m_logDst == logDst_t::LD_SYSLOG) {
+                // syslog takes records one by one
+                syslog(levelMapper(_logRecord.logLevel), "%.*s",
+                       static_cast<int>(m_batch.size() - lineStart), m_batch.data() + lineStart);
+                m_batch.resize(lineStart);
+            } else {
+                m_batch.push_back('\n');
+            }
+        } catch (...) {}
+    }
 
-                if (m_logDst == logDst_t::LD_SYSLOG) {
-                    syslog(levelMapper(std::get<1>(logRecord)), "%s", std::get<2>(logRecord).c_str());
-                } else if (m_logDst == logDst_t::LD_CONSOLE) {
-                    std::unique_lock<std::mutex> lck(m_mtxIO);
-                    std::cout <<
-                              1900 + timeInfo.tm_year << "." <<
-                              std::setfill('0') << std::setw(2) << timeInfo.tm_mon + 1 << "." <<
-                              std::setfill('0') << std::setw(2) << timeInfo.tm_mday << " " <<
-                              std::setfill('0') << std::setw(2) << timeInfo.tm_hour << ":" <<
-                              std::setfill('0') << std::setw(2) << timeInfo.tm_min << ":" <<
-                              std::setfill('0') << std::setw(2) << timeInfo.tm_sec << "." <<
-                              std::setfill('0') << std::setw(3) << restMS << ": " <<
-                              std::get<2>(logRecord) <<
-                              std::endl << std::flush;
-                } else if (m_logDst == logDst_t::LD_FILE) {
-                    std::unique_lock<std::mutex> lck(m_mtxIO);
-                    m_ofs <<
-                          1900 + timeInfo.tm_year << "." <<
-                          std::setfill('0') << std::setw(2) << timeInfo.tm_mon + 1 << "." <<
-                          std::setfill('0') << std::setw(2) << timeInfo.tm_mday << " " <<
-                          std::setfill('0') << std::setw(2) << timeInfo.tm_hour << ":" <<
-                          std::setfill('0') << std::setw(2) << timeInfo.tm_min << ":" <<
-                          std::setfill('0') << std::setw(2) << timeInfo.tm_sec << "." <<
-                          std::setfill('0') << std::setw(3) << restMS << ": " <<
-                          std::get<2>(logRecord) <<
-                          std::endl << std::flush;
+    void logger_t::flush() noexcept {
+        std::unique_lock<std::mutex> lck(m_mtxIO);
+        const char *data = m_batch.data();
+        std::size_t size = m_batch.size();
+        while ((size > 0) && (m_fd >= 0)) {
+            auto written = ::write(m_fd, data, size);
+            if (written < 0) {
+                if (errno == EINTR) {
+                    continue;
                 }
-            } catch (...) {}
+                break;
+            }
+            data += written;
+            size -= static_cast<std::size_t>(written);
         }
+        m_batch.clear();
     }
 
     void logger_t::reopen() noexcept {
         if (m_logDst == logDst_t::LD_FILE) {
             try {
                 std::unique_lock<std::mutex> lck(m_mtxIO);
-                m_ofs.close();
-                m_ofs.open(m_fileName, std::ofstream::out | std::ofstream::ate | std::ofstream::app);
+                auto fd = open(m_fileName.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+                if (fd >= 0) {
+                    close(m_fd);
+                    m_fd = fd;
+                }
             } catch (...) {}
         }
     }
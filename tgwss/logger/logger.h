@@ -11,14 +11,14 @@
 #define TGWSS_LOGGER_H
 
 #include <string>
-#include <fstream>
+#include <algorithm>
 #include <mutex>
-#include <queue>
-#include <tuple>
+#include <vector>
 #include <chrono>
 #include <thread>
 #include <condition_variable>
 #include <map>
+#include <memory>
 #include <atomic>
 
 #include "fmt/format.h"
@@ -51,22 +51,63 @@ namespace tgwss {
         };
         std::string m_logPrefix;
         logDst_t m_logDst = logDst_t::LD_SYSLOG;
-        logLevel_t m_logLevel = logLevel_t::LL_ERROR;
-        std::ofstream m_ofs;
+        // may be changed while logging
+        std::atomic<logLevel_t> m_logLevel {logLevel_t::LL_ERROR};
+        int m_fd = -1;
         std::string m_fileName;
 
-        using logRecord_t = std::tuple<std::chrono::time_point<std::chrono::system_clock>, logLevel_t, std::string>;
-        std::queue<logRecord_t> m_logQueue;
+        // the worker drains the rings every m_flushInterval and writes the batch once it is
+        // m_maxLatency old or m_batchSize long
+        std::chrono::milliseconds m_flushInterval {20};
+        std::chrono::milliseconds m_maxLatency {100};
+        static const std::size_t m_batchSize = 64 * 1024;
+        std::string m_batch;
+        std::chrono::time_point<std::chrono::steady_clock> m_batchStarted;
+        // "YYYY.MM.DD HH:MM:SS" of the last record, sized for any int field values
+        long m_cachedSec = -1;
+        char m_cachedDateTime[80] = {};
+
+        // preallocated log record, longer messages are truncated
+        struct logRecord_t {
+            static const std::size_t m_textSize = 512;
+
+            std::chrono::time_point<std::chrono::system_clock> timeStamp;
+            logLevel_t logLevel = logLevel_t::LL_DEBUG;
+            std::size_t size = 0;
+            char text[m_textSize];
+        };
+
+        // single producer (the dispatching thread) / single consumer (the worker) ring of records
+        struct threadRing_t {
+            static const std::size_t m_slotsNum = 1024;
+
+            std::atomic<uint64_t> head {0};
+            std::atomic<uint64_t> tail {0};
+            std::atomic<uint64_t> dropped {0};
+            // the owner thread has finished, the ring may be taken by a new thread
+            std::atomic<bool> released {false};
+            uint64_t threadNum = 0;
+            std::unique_ptr<logRecord_t[]> slots {new logRecord_t[m_slotsNum]};
+        };
+        struct threadRingHolder_t {
+            threadRing_t *ring = nullptr;
+
+            ~threadRingHolder_t() {
+                if (ring != nullptr) {
+                    ring->released.store(true, std::memory_order_release);
+                }
+            }
+        };
+        std::vector<std::unique_ptr<threadRing_t>> m_threadRings;
+        std::mutex m_mtxRings;
+
         std::mutex m_mtxLog;
         std::condition_variable m_cvLog;
-        bool m_checkQueueFlag = false;
 
         std::thread m_workerThread;
         std::atomic<bool> m_workFlag;
         std::mutex m_mtxIO;
 
-        std::map<std::thread::id, uint64_t> m_dispatchThreads;
-
     public:
         static logger_t &logger() {
             static logger_t logger;
@@ -80,32 +121,40 @@ namespace tgwss {
 
         ~logger_t();
 
-        void init(const std::string &_logPrefix, const std::string &_logTo, const std::string &_logLevel);
+        void init(const std::string &_logPrefix, const std::string &_logTo, const std::string &_logLevel,
+                  uint32_t _flushInterval = 20, uint32_t _maxLatency = 100);
 
-        template<typename... args_t>
-        void log(logLevel_t _logLevel, const std::string &_fmt, const args_t &..._args) noexcept {
-            if (_logLevel > m_logLevel) {
+        bool enabled(logLevel_t _logLevel) const noexcept {
+            return _logLevel <= m_logLevel.load(std::memory_order_relaxed);
+        }
+        /// sets the logging level, "critical"..."debug"
+        void level(const std::string &_logLevel);
+
+        // never blocks, does not allocate and does not make syscalls, the record is dropped if the thread's
+        // ring is full. Use TGWSS_LOG to skip arguments evaluation for filtered out levels
+        template<typename fmt_t, typename... args_t>
+        void log(logLevel_t _logLevel, const fmt_t &_fmt, const args_t &..._args) noexcept {
+            if (!enabled(_logLevel)) {
                 return;
             }
 
-            auto timeStamp = std::chrono::system_clock::now();
-
             try {
-                std::unique_lock<std::mutex> lck(m_mtxLog);
-
-                if (m_dispatchThreads.find(std::this_thread::get_id()) == m_dispatchThreads.end()) {
-                    m_dispatchThreads[std::this_thread::get_id()] = m_dispatchThreads.size();
+                auto ring = threadRing();
+                if (ring == nullptr) {
+                    return;
+                }
+                auto head = ring->head.load(std::memory_order_relaxed);
+                if (head - ring->tail.load(std::memory_order_acquire) == threadRing_t::m_slotsNum) {
+                    ring->dropped.fetch_add(1, std::memory_order_relaxed);
+                    return;
                 }
 
-                std::string buffer = "[" + m_logPrefix + "] "
-                                     + ((m_logLevel == logLevel_t::LL_DEBUG) ?
-                                        "[THR#"
-                                        + std::to_string(m_dispatchThreads[std::this_thread::get_id()])
-                                        + "] " : "") + "[" + m_logLevelStrs.at(_logLevel) + "] " + _fmt;
-
-                m_logQueue.push(logRecord_t(timeStamp, _logLevel, fmt::format(buffer, _args...)));
-                m_checkQueueFlag = true;
-                m_cvLog.notify_one();
+                auto &record = ring->slots[head % threadRing_t::m_slotsNum];
+                record.timeStamp = std::chrono::system_clock::now();
+                record.logLevel = _logLevel;
+                record.size = std::min(fmt::format_to_n(record.text, logRecord_t::m_textSize, _fmt, _args...).size,
+                                       logRecord_t::m_textSize);
+                ring->head.store(head + 1, std::memory_order_release);
             } catch (...) {}
         }
 
@@ -118,8 +167,23 @@ namespace tgwss {
 
         inline int levelMapper(logLevel_t) const noexcept;
 
+        threadRing_t *threadRing() noexcept;
         void worker() noexcept;
+        void output(const threadRing_t &_ring, const logRecord_t &_logRecord) noexcept;
+        void flush() noexcept;
     };
 } // namespace tgwss
 
+/**
+ * Logs a record if _level (LL_DEBUG, LL_INFO, etc) is enabled, arguments are evaluated only in this case.
+ * The format string should be wrapped in FMT_STRING to be checked at compile time, e.g.
+ * TGWSS_LOG(m_logger, LL_DEBUG, FMT_STRING("peer {:p}"), fmt::ptr(_lws));
+ */
+#define TGWSS_LOG(_logger, _level, ...) \
+    do { \
+        if ((_logger)->enabled(tgwss::logger_t::logLevel_t::_level)) { \
+            (_logger)->log(tgwss::logger_t::logLevel_t::_level, __VA_ARGS__); \
+        } \
+    } while (false)
+
 #endif // TGWSS_LOGGER_H
@@ -0,0 +1,142 @@
+/**
+* @file wss/admissionControl.cpp
+* @brief incoming connections admission: global & per source IP caps, connection rate limit
+* @author Max Fomichev
+* @date 29.01.2020
+* @copyright Apache License v.2 (http://www.apache.org/licenses/LICENSE-2.0)
+*/
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include <cstring>
+#include <algorithm>
+
+#include "admissionControl.h"
+
+namespace tgwss {
+    static bool sourceAddress(int _fd, std::string &_address) {
+        struct sockaddr_storage addr {};
+        socklen_t addrLen = sizeof(addr);
+        if (getpeername(_fd, reinterpret_cast<struct sockaddr *>(&addr), &addrLen) != 0) {
+            return false;
+        }
+
+        char bytes[16] = {0};
+        if (addr.ss_family == AF_INET) {
+            bytes[10] = static_cast<char>(0xff);
+            bytes[11] = static_cast<char>(0xff);
+            std::memcpy(bytes + 12, &reinterpret_cast<struct sockaddr_in *>(&addr)->sin_addr, 4);
+        } else if (addr.ss_family == AF_INET6) {
+            std::memcpy(bytes, &reinterpret_cast<struct sockaddr_in6 *>(&addr)->sin6_addr, 16);
+        } else {
+            return false;
+        }
+        _address.assign(bytes, sizeof(bytes));
+
+        return true;
+    }
+
+    admissionControl_t::admissionControl_t(uint32_t _connLimit, uint32_t _ipLimit, uint32_t _rate, uint32_t _burst):
+            m_connLimit(_connLimit), m_ipLimit(_ipLimit), m_rate(_rate), m_burst(std::max(_burst, _rate)),
+            m_tokens(m_burst), m_refilled(std::chrono::steady_clock::now()) {
+        m_addresses.reserve(_connLimit);
+        m_sockets.reserve(_connLimit);
+        m_connectionObjects.reserve(_connLimit);
+    }
+
+    void admissionControl_t::limits(uint32_t _connLimit, uint32_t _ipLimit, uint32_t _rate, uint32_t _burst) noexcept {
+        std::unique_lock<std::mutex> lck(m_mtx);
+        m_connLimit = _connLimit;
+        m_ipLimit = _ipLimit;
+        m_rate = _rate;
+        m_burst = std::max(_burst, _rate);
+        m_tokens = std::min<double>(m_tokens, m_burst);
+    }
+
+    admissionControl_t::verdict_t admissionControl_t::admit(int _fd) noexcept {
+        try {
+            std::string address;
+            if (!sourceAddress(_fd, address)) {
+                address.assign(16, 0);
+            }
+
+            std::unique_lock<std::mutex> lck(m_mtx);
+            if (m_connections >= m_connLimit) {
+                ++m_stats.rejectedConnLimit;
+                return verdict_t::CONN_LIMIT;
+            }
+            auto &ipConnections = m_addresses[address];
+            if ((m_ipLimit > 0) && (ipConnections >= m_ipLimit)) {
+                ++m_stats.rejectedIpLimit;
+                return verdict_t::IP_LIMIT;
+            }
+            if (m_rate > 0) {
+                auto now = std::chrono::steady_clock::now();
+                std::chrono::duration<double> elapsed = now - m_refilled;
+                m_refilled = now;
+                m_tokens = std::min<double>(m_burst, m_tokens + elapsed.count() * m_rate);
+                if (m_tokens < 1.0) {
+                    if (ipConnections == 0) {
+                        m_addresses.erase(address);
+                    }
+                    ++m_stats.rejectedRateLimit;
+                    return verdict_t::RATE_LIMIT;
+                }
+                m_tokens -= 1.0;
+            }
+
+            // the socket might be closed by lws before its connection object was created
+            auto socket = m_sockets.find(_fd);
+            if (socket != m_sockets.end()) {
+                release(socket->second);
+                socket->second = address;
+            } else {
+                m_sockets.emplace(_fd, address);
+            }
+            ++ipConnections;
+            ++m_connections;
+            ++m_stats.admitted;
+        } catch (...) {
+            ++m_stats.rejectedConnLimit;
+            return verdict_t::CONN_LIMIT;
+        }
+
+        return verdict_t::ADMITTED;
+    }
+
+    void admissionControl_t::attach(int _fd, const struct lws *_lws) noexcept {
+        try {
+            std::unique_lock<std::mutex> lck(m_mtx);
+            auto socket = m_sockets.find(_fd);
+            if (socket == m_sockets.end()) {
+                return;
+            }
+            m_connectionObjects[_lws] = std::move(socket->second);
+            m_sockets.erase(socket);
+        } catch (...) {}
+    }
+
+    void admissionControl_t::release(const struct lws *_lws) noexcept {
+        std::unique_lock<std::mutex> lck(m_mtx);
+        auto connectionObject = m_connectionObjects.find(_lws);
+        if (connectionObject == m_connectionObjects.end()) {
+            return;
+        }
+        release(connectionObject->second);
+        m_connectionObjects.erase(connectionObject);
+    }
+
+    uint32_t admissionControl_t::connections() noexcept {
+        std::unique_lock<std::mutex> lck(m_mtx);
+        return m_connections;
+    }
+
+    void admissionControl_t::release(const std::string &_address) noexcept {
+        auto address = m_addresses.find(_address);
+        if ((address != m_addresses.end()) && (--address->second == 0)) {
+            m_addresses.erase(address);
+        }
+        --m_connections;
+    }
+} // namespace tgwss
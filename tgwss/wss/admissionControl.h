@@ -0,0 +1,85 @@
+/**
+* @file wss/admissionControl.h
+* @brief incoming connections admission: global & per source IP caps, connection rate limit
+* @author Max Fomichev
+* @date 29.01.2020
+* @copyright Apache License v.2 (http://www.apache.org/licenses/LICENSE-2.0)
+*/
+
+#ifndef TGWSS_ADMISSIONCONTROL_H
+#define TGWSS_ADMISSIONCONTROL_H
+
+#include <string>
+#include <unordered_map>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+
+struct lws;
+
+namespace tgwss {
+    // connections are admitted right after accept(), before TLS & websocket handshakes,
+    // and released when their lws connection objects are destroyed
+    class admissionControl_t final {
+    public:
+        enum class verdict_t {
+            ADMITTED,
+            CONN_LIMIT,
+            IP_LIMIT,
+            RATE_LIMIT
+        };
+
+        struct stats_t {
+            std::atomic<uint64_t> admitted {0};
+            std::atomic<uint64_t> rejectedConnLimit {0};
+            std::atomic<uint64_t> rejectedIpLimit {0};
+            std::atomic<uint64_t> rejectedRateLimit {0};
+        };
+
+    private:
+        std::mutex m_mtx;
+        uint32_t m_connLimit;
+        uint32_t m_ipLimit;
+        // token bucket, tokens per second & bucket size, 0 - unlimited rate
+        uint32_t m_rate;
+        uint32_t m_burst;
+
+        uint32_t m_connections = 0;
+        double m_tokens;
+        std::chrono::steady_clock::time_point m_refilled;
+        // source address (16 bytes, IPv4 addresses are IPv6 mapped) -> number of connections
+        std::unordered_map<std::string, uint32_t> m_addresses;
+        // admitted sockets waiting for their lws connection objects
+        std::unordered_map<int, std::string> m_sockets;
+        std::unordered_map<const struct lws *, std::string> m_connectionObjects;
+
+        stats_t m_stats;
+
+    public:
+        admissionControl_t(uint32_t _connLimit, uint32_t _ipLimit, uint32_t _rate, uint32_t _burst);
+        ~admissionControl_t() = default;
+
+        admissionControl_t(const admissionControl_t &) = delete;
+        void operator=(const admissionControl_t &) = delete;
+        admissionControl_t(const admissionControl_t &&) = delete;
+        void operator=(const admissionControl_t &&) = delete;
+
+        /// replaces the limits, connections above the new caps are kept
+        void limits(uint32_t _connLimit, uint32_t _ipLimit, uint32_t _rate, uint32_t _burst) noexcept;
+
+        /// decides on accepted socket _fd
+        verdict_t admit(int _fd) noexcept;
+        /// binds admitted socket _fd to its lws connection object
+        void attach(int _fd, const struct lws *_lws) noexcept;
+        /// releases the connection of _lws, if any
+        void release(const struct lws *_lws) noexcept;
+
+        uint32_t connections() noexcept;
+        const stats_t &stats() const noexcept {return m_stats;}
+
+    private:
+        void release(const std::string &_address) noexcept;
+    };
+} // namespace tgwss
+
+#endif //TGWSS_ADMISSIONCONTROL_H
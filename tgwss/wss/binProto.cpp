@@ -0,0 +1,285 @@
+/**
+* @file wss/binProto.cpp
+* @brief compact binary signaling protocol ("tgwss-bin")
+* @author Max Fomichev
+* @date 29.01.2020
+* @copyright Apache License v.2 (http://www.apache.org/licenses/LICENSE-2.0)
+*/
+
+#include <cstring>
+
+#include <rapidjson/document.h>
+#include <rapidjson/writer.h>
+
+#include "binProto.h"
+
+namespace tgwss {
+    static const std::size_t g_fieldSizeLimit = 0xffffffff;
+
+    binProto_t::writer_t::writer_t(framePool_t &_framePool, msgType_t _type, std::size_t _sizeHint):
+            writer_t(_framePool, static_cast<uint8_t>(_type), _sizeHint) {}
+
+    binProto_t::writer_t::writer_t(framePool_t &_framePool, uint8_t _type, std::size_t _sizeHint):
+            m_framePool(_framePool), m_frame(_framePool.get(1 + _sizeHint)) {
+        m_frame->append(&_type, 1);
+    }
+
+    binProto_t::writer_t &binProto_t::writer_t::field(const void *_data, std::size_t _size) {
+        if (_size > g_fieldSizeLimit) {
+            m_good = false;
+            return *this;
+        }
+        // 0xffff is the escape of 32 bit length
+        const bool longField = (_size >= 0xffff);
+        const std::size_t shortSize = longField ? 0xffff : _size;
+        const unsigned char size[6] = {static_cast<unsigned char>(shortSize >> 8),
+                                       static_cast<unsigned char>(shortSize & 0xff),
+                                       static_cast<unsigned char>((_size >> 24) & 0xff),
+                                       static_cast<unsigned char>((_size >> 16) & 0xff),
+                                       static_cast<unsigned char>((_size >> 8) & 0xff),
+                                       static_cast<unsigned char>(_size & 0xff)};
+        const std::size_t sizeBytes = longField ? sizeof(size) : 2;
+        m_framePool.reserve(m_frame, sizeBytes + _size);
+        m_frame->append(size, sizeBytes);
+        m_frame->append(_data, _size);
+        return *this;
+    }
+
+    binProto_t::writer_t &binProto_t::writer_t::number(int32_t _value) {
+        auto value = static_cast<uint32_t>(_value);
+        const unsigned char bytes[4] = {static_cast<unsigned char>(value >> 24),
+                                        static_cast<unsigned char>((value >> 16) & 0xff),
+                                        static_cast<unsigned char>((value >> 8) & 0xff),
+                                        static_cast<unsigned char>(value & 0xff)};
+        return field(bytes, sizeof(bytes));
+    }
+
+    binProto_t::writer_t &binProto_t::writer_t::flag(bool _value) {
+        const unsigned char byte = _value ? 1 : 0;
+        return field(&byte, 1);
+    }
+
+    static bool isString(const rapidjson::Value &_object, const char *_name) {
+        return _object.HasMember(_name) && _object[_name].IsString();
+    }
+
+    static bool isBool(const rapidjson::Value &_object, const char *_name) {
+        return _object.HasMember(_name) && _object[_name].IsBool();
+    }
+
+    static void stringField(binProto_t::writer_t &_writer, const rapidjson::Value &_object, const char *_name) {
+        const auto &value = _object[_name];
+        _writer.field(value.GetString(), value.GetStringLength());
+    }
+
+    bool binProto_t::jsonToBin(const frame_t &_src, framePool_t &_framePool, framePtr_t &_dst) {
+        rapidjson::Document json;
+        json.Parse(reinterpret_cast<const char *>(_src.data()), _src.size());
+        if (json.HasParseError() || !json.IsObject()) {
+            return false;
+        }
+
+        if (isString(json, "error")) {
+            writer_t writer(_framePool, msgType_t::MT_ERROR, _src.size());
+            stringField(writer, json, "error");
+            _dst = writer.frame();
+            return static_cast<bool>(_dst);
+        }
+        if (isString(json, "type")) {
+            const std::string type = json["type"].GetString();
+            if ((type == "logon") && isString(json, "token")) {
+                writer_t writer(_framePool, msgType_t::MT_LOGON, _src.size());
+                stringField(writer, json, "token");
+                _dst = writer.frame();
+            } else if ((type == "logon") && isBool(json, "status")) {
+                _dst = writer_t(_framePool, msgType_t::MT_LOGON_STATUS).flag(json["status"].GetBool()).frame();
+            } else if ((type == "call") && isString(json, "to")) {
+                writer_t writer(_framePool, msgType_t::MT_CALL, _src.size());
+                stringField(writer, json, "to");
+                _dst = writer.frame();
+            } else if ((type == "call") && isString(json, "from")) {
+                writer_t writer(_framePool, msgType_t::MT_CALL_FROM, _src.size());
+                stringField(writer, json, "from");
+                _dst = writer.frame();
+            } else if ((type == "call") && isBool(json, "status")) {
+                _dst = writer_t(_framePool, msgType_t::MT_CALL_STATUS).flag(json["status"].GetBool()).frame();
+            } else if (((type == "offer") || (type == "answer")) && isString(json, "sdp")) {
+                writer_t writer(_framePool, (type == "offer") ? msgType_t::MT_OFFER : msgType_t::MT_ANSWER,
+                                _src.size());
+                stringField(writer, json, "sdp");
+                _dst = writer.frame();
+            } else if ((type == "info") && isString(json, "subscriber")) {
+                writer_t writer(_framePool, msgType_t::MT_INFO, _src.size());
+                stringField(writer, json, "subscriber");
+                _dst = writer.frame();
+            } else if ((type == "join") && isString(json, "room")) {
+                writer_t writer(_framePool, msgType_t::MT_JOIN, _src.size());
+                stringField(writer, json, "room");
+                _dst = writer.frame();
+            } else if ((type == "join") && isString(json, "from")) {
+                writer_t writer(_framePool, msgType_t::MT_JOIN_FROM, _src.size());
+                stringField(writer, json, "from");
+                _dst = writer.frame();
+            } else if ((type == "join") && isBool(json, "status")) {
+                _dst = writer_t(_framePool, msgType_t::MT_JOIN_STATUS).flag(json["status"].GetBool()).frame();
+            } else if ((type == "leave") && isString(json, "from")) {
+                writer_t writer(_framePool, msgType_t::MT_LEAVE_FROM, _src.size());
+                stringField(writer, json, "from");
+                _dst = writer.frame();
+            } else if (type == "leave") {
+                _dst = writer_t(_framePool, msgType_t::MT_LEAVE).frame();
+            } else {
+                return false;
+            }
+            return static_cast<bool>(_dst);
+        }
+        if (json.HasMember("candidate")) {
+            // the candidate is either flat or nested into "candidate" object
+            const rapidjson::Value &candidate = json["candidate"].IsObject() ? json["candidate"] : json;
+            if (!isString(candidate, "sdpMid") || !isString(candidate, "candidate") ||
+                !candidate.HasMember("sdpMLineIndex") || !candidate["sdpMLineIndex"].IsInt()) {
+                return false;
+            }
+            writer_t writer(_framePool, msgType_t::MT_CANDIDATE, _src.size());
+            stringField(writer, candidate, "sdpMid");
+            writer.number(candidate["sdpMLineIndex"].GetInt());
+            stringField(writer, candidate, "candidate");
+            _dst = writer.frame();
+            return static_cast<bool>(_dst);
+        }
+
+        return false;
+    }
+
+    bool binProto_t::binToJson(const frame_t &_src, framePool_t &_framePool, framePtr_t &_dst) {
+        reader_t reader(_src.data(), _src.size());
+        msgType_t type;
+        if (!reader.type(type)) {
+            return false;
+        }
+
+        rapidjson::StringBuffer jsonStr;
+        rapidjson::Writer<rapidjson::StringBuffer> writer(jsonStr);
+        const char *data;
+        std::size_t size;
+        bool flag;
+        // {"type": _type, _key: <string field>}
+        auto stringMsg = [&](const char *_type, const char *_key) {
+            if (!reader.field(data, size)) {
+                return false;
+            }
+            writer.Key("type");
+            writer.String(_type);
+            writer.Key(_key);
+            writer.String(data, static_cast<rapidjson::SizeType>(size));
+            return true;
+        };
+        // {"type": _type, "status": <flag>}
+        auto statusMsg = [&](const char *_type) {
+            if (!reader.flag(flag)) {
+                return false;
+            }
+            writer.Key("type");
+            writer.String(_type);
+            writer.Key("status");
+            writer.Bool(flag);
+            return true;
+        };
+
+        bool result = false;
+        writer.StartObject();
+        switch (type) {
+            case msgType_t::MT_LOGON: {
+                result = stringMsg("logon", "token");
+                break;
+            }
+            case msgType_t::MT_LOGON_STATUS: {
+                result = statusMsg("logon");
+                break;
+            }
+            case msgType_t::MT_CALL: {
+                result = stringMsg("call", "to");
+                break;
+            }
+            case msgType_t::MT_CALL_FROM: {
+                result = stringMsg("call", "from");
+                break;
+            }
+            case msgType_t::MT_CALL_STATUS: {
+                result = statusMsg("call");
+                break;
+            }
+            case msgType_t::MT_OFFER: {
+                result = stringMsg("offer", "sdp");
+                break;
+            }
+            case msgType_t::MT_ANSWER: {
+                result = stringMsg("answer", "sdp");
+                break;
+            }
+            case msgType_t::MT_INFO: {
+                result = stringMsg("info", "subscriber");
+                break;
+            }
+            case msgType_t::MT_JOIN: {
+                result = stringMsg("join", "room");
+                break;
+            }
+            case msgType_t::MT_JOIN_FROM: {
+                result = stringMsg("join", "from");
+                break;
+            }
+            case msgType_t::MT_JOIN_STATUS: {
+                result = statusMsg("join");
+                break;
+            }
+            case msgType_t::MT_LEAVE: {
+                writer.Key("type");
+                writer.String("leave");
+                result = true;
+                break;
+            }
+            case msgType_t::MT_LEAVE_FROM: {
+                result = stringMsg("leave", "from");
+                break;
+            }
+            case msgType_t::MT_CANDIDATE: {
+                int32_t sdpMLineIndex;
+                if (!reader.field(data, size)) {
+                    return false;
+                }
+                writer.Key("sdpMid");
+                writer.String(data, static_cast<rapidjson::SizeType>(size));
+                if (!reader.number(sdpMLineIndex) || !reader.field(data, size)) {
+                    return false;
+                }
+                writer.Key("sdpMLineIndex");
+                writer.Int(sdpMLineIndex);
+                writer.Key("candidate");
+                writer.String(data, static_cast<rapidjson::SizeType>(size));
+                result = true;
+                break;
+            }
+            case msgType_t::MT_ERROR: {
+                if (!reader.field(data, size)) {
+                    return false;
+                }
+                writer.Key("error");
+                writer.String(data, static_cast<rapidjson::SizeType>(size));
+                result = true;
+                break;
+            }
+            default: {
+                return false;
+            }
+        }
+        writer.EndObject();
+        if (!result || !reader.end()) {
+            return false;
+        }
+
+        _dst = _framePool.get(jsonStr.GetSize());
+        _dst->append(jsonStr.GetString(), jsonStr.GetSize());
+        return true;
+    }
+} // namespace tgwss
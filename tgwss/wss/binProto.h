@@ -0,0 +1,153 @@
+/**
+* @file wss/binProto.h
+* @brief compact binary signaling protocol ("tgwss-bin")
+* @author Max Fomichev
+* @date 29.01.2020
+* @copyright Apache License v.2 (http://www.apache.org/licenses/LICENSE-2.0)
+*/
+
+#ifndef TGWSS_BINPROTO_H
+#define TGWSS_BINPROTO_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+#include "frameBuffer.h"
+
+namespace tgwss {
+
+    /**
+     * Binary message: message type byte followed by fields, each field is 16 bit big endian length
+     * and the field's bytes. Fields of 0xffff bytes & longer (SDPs & relayed messages above the 16 bit
+     * limit) have 0xffff length followed by 32 bit big endian length. Integers are 4 bytes big endian
+     * fields, booleans are 1 byte fields.
+     * The message types and the fields must be kept in sync with wsClient/binProto.h of tgvoip.
+     */
+    class binProto_t final {
+    public:
+        enum class msgType_t: uint8_t {
+            MT_LOGON = 1,       // token
+            MT_LOGON_STATUS,    // status
+            MT_CALL,            // to
+            MT_CALL_FROM,       // from
+            MT_CALL_STATUS,     // status
+            MT_OFFER,           // sdp
+            MT_ANSWER,          // sdp
+            MT_CANDIDATE,       // sdpMid, sdpMLineIndex, candidate
+            MT_INFO,            // subscriber
+            MT_ERROR,           // error
+            MT_JOIN,            // room
+            MT_JOIN_FROM,       // from
+            MT_JOIN_STATUS,     // status
+            MT_LEAVE,           // no fields
+            MT_LEAVE_FROM       // from
+        };
+
+        class reader_t final {
+        private:
+            const unsigned char *m_data;
+            std::size_t m_size;
+            std::size_t m_pos = 0;
+
+        public:
+            reader_t(const void *_data, std::size_t _size):
+                    m_data(static_cast<const unsigned char *>(_data)), m_size(_size) {}
+
+            bool type(msgType_t &_type) noexcept {
+                if (m_pos + 1 > m_size) {
+                    return false;
+                }
+                _type = static_cast<msgType_t>(m_data[m_pos++]);
+                return true;
+            }
+
+            // type byte of another protocol with the same fields encoding
+            bool type(uint8_t &_type) noexcept {
+                if (m_pos + 1 > m_size) {
+                    return false;
+                }
+                _type = m_data[m_pos++];
+                return true;
+            }
+
+            bool field(const char *&_field, std::size_t &_size) noexcept {
+                if (m_pos + 2 > m_size) {
+                    return false;
+                }
+                _size = (static_cast<std::size_t>(m_data[m_pos]) << 8) | m_data[m_pos + 1];
+                m_pos += 2;
+                if (_size == 0xffff) {
+                    if (m_pos + 4 > m_size) {
+                        return false;
+                    }
+                    _size = (static_cast<std::size_t>(m_data[m_pos]) << 24) |
+                            (static_cast<std::size_t>(m_data[m_pos + 1]) << 16) |
+                            (static_cast<std::size_t>(m_data[m_pos + 2]) << 8) |
+                            static_cast<std::size_t>(m_data[m_pos + 3]);
+                    m_pos += 4;
+                }
+                if (_size > m_size - m_pos) {
+                    return false;
+                }
+                _field = reinterpret_cast<const char *>(m_data + m_pos);
+                m_pos += _size;
+                return true;
+            }
+
+            bool number(int32_t &_value) noexcept {
+                const char *data;
+                std::size_t size;
+                if (!field(data, size) || (size != 4)) {
+                    return false;
+                }
+                auto bytes = reinterpret_cast<const unsigned char *>(data);
+                _value = static_cast<int32_t>((static_cast<uint32_t>(bytes[0]) << 24) |
+                                              (static_cast<uint32_t>(bytes[1]) << 16) |
+                                              (static_cast<uint32_t>(bytes[2]) << 8) |
+                                              static_cast<uint32_t>(bytes[3]));
+                return true;
+            }
+
+            bool flag(bool &_value) noexcept {
+                const char *data;
+                std::size_t size;
+                if (!field(data, size) || (size != 1)) {
+                    return false;
+                }
+                _value = (data[0] != 0);
+                return true;
+            }
+
+            bool end() const noexcept {return m_pos == m_size;}
+        };
+
+        // builds a binary message right in a pooled frame
+        class writer_t final {
+        private:
+            framePool_t &m_framePool;
+            framePtr_t m_frame;
+            bool m_good = true;
+
+        public:
+            writer_t(framePool_t &_framePool, msgType_t _type, std::size_t _sizeHint = 0);
+            // type byte of another protocol with the same fields encoding
+            writer_t(framePool_t &_framePool, uint8_t _type, std::size_t _sizeHint = 0);
+
+            writer_t &field(const void *_data, std::size_t _size);
+            writer_t &field(const std::string &_value) {return field(_value.data(), _value.size());}
+            writer_t &number(int32_t _value);
+            writer_t &flag(bool _value);
+
+            /// @returns empty pointer if some field is too long to be encoded
+            framePtr_t frame() {return m_good ? std::move(m_frame) : framePtr_t();}
+        };
+
+        /// re-encodes the JSON message of _src, @returns false if the message has no binary form
+        static bool jsonToBin(const frame_t &_src, framePool_t &_framePool, framePtr_t &_dst);
+        /// re-encodes the binary message of _src, @returns false if the message is malformed
+        static bool binToJson(const frame_t &_src, framePool_t &_framePool, framePtr_t &_dst);
+    };
+} // namespace tgwss
+
+#endif //TGWSS_BINPROTO_H
@@ -0,0 +1,350 @@
+/**
+* @file wss/cluster.cpp
+* @brief tgwss cluster: token -> node directory & inter-node links
+* @author Max Fomichev
+* @date 29.01.2020
+* @copyright Apache License v.2 (http://www.apache.org/licenses/LICENSE-2.0)
+*/
+
+#include <cstring>
+
+#include "cluster.h"
+
+namespace tgwss {
+    // max number of messages queued to a link
+    static const uint32_t g_linkQueueLimit = 16384;
+    // max number of messages sent at once per link writeable callback
+    static const uint32_t g_linkWriteBatch = 64;
+    // relayed message of the max network.msg_size_limit with its routing fields, nodes may differ in the limit
+    static const std::size_t g_linkMsgSizeLimit = 16 * 1024 * 1024 + 1024;
+    // size of announce messages of the tokens snapshot
+    static const std::size_t g_announceSize = 32 * 1024;
+
+    cluster_t::cluster_t(uint16_t _nodeId, const std::vector<node_t> &_nodes, framePool_t &_framePool):
+            m_nodeId(_nodeId), m_framePool(_framePool) {
+        for (const auto &i:_nodes) {
+            m_links.emplace_back(std::make_unique<link_t>(i, g_linkQueueLimit));
+        }
+    }
+
+    bool cluster_t::find(const std::string &_token, uint16_t &_node) {
+        std::unique_lock<std::mutex> lck(m_directoryMtx);
+        auto i = m_directory.find(_token);
+        if (i == m_directory.end()) {
+            return false;
+        }
+        _node = i->second;
+
+        return true;
+    }
+
+    std::size_t cluster_t::size() {
+        std::unique_lock<std::mutex> lck(m_directoryMtx);
+        return m_directory.size();
+    }
+
+    void cluster_t::insert(const std::string &_token, uint16_t _node) {
+        std::unique_lock<std::mutex> lck(m_directoryMtx);
+        m_directory[_token] = _node;
+    }
+
+    void cluster_t::remove(const std::string &_token, uint16_t _node) noexcept {
+        std::unique_lock<std::mutex> lck(m_directoryMtx);
+        auto i = m_directory.find(_token);
+        if ((i != m_directory.end()) && (i->second == _node)) {
+            m_directory.erase(i);
+        }
+    }
+
+    void cluster_t::removeNode(uint16_t _node) noexcept {
+        std::unique_lock<std::mutex> lck(m_directoryMtx);
+        for (auto i = m_directory.begin(); i != m_directory.end();) {
+            if (i->second == _node) {
+                i = m_directory.erase(i);
+            } else {
+                ++i;
+            }
+        }
+    }
+
+    void cluster_t::connect(struct lws_context *_context, struct lws_vhost *_vhost, const char *_protocol) noexcept {
+        for (auto &i:m_links) {
+            {
+                std::unique_lock<std::mutex> lck(i->mtx);
+                if ((i->lws != nullptr) || i->connecting) {
+                    continue;
+                }
+                i->connecting = true;
+            }
+
+            struct lws_client_connect_info connectInfo {};
+            std::memset(&connectInfo, 0, sizeof(connectInfo));
+            connectInfo.context = _context;
+            connectInfo.vhost = _vhost;
+            connectInfo.address = i->node.address.c_str();
+            connectInfo.port = i->node.port;
+            connectInfo.path = "/";
+            connectInfo.host = connectInfo.address;
+            connectInfo.origin = connectInfo.address;
+            connectInfo.protocol = _protocol;
+            connectInfo.local_protocol_name = _protocol;
+            connectInfo.ietf_version_or_minus_one = -1;
+            connectInfo.userdata = i.get();
+            if (lws_client_connect_via_info(&connectInfo) == nullptr) {
+                std::unique_lock<std::mutex> lck(i->mtx);
+                i->connecting = false;
+            }
+        }
+    }
+
+    bool cluster_t::send(uint16_t _node, framePtr_t _frame, std::size_t _tsi) noexcept {
+        if (!_frame) {
+            return false;
+        }
+        for (auto &i:m_links) {
+            if (i->node.id != _node) {
+                continue;
+            }
+            std::unique_lock<std::mutex> lck(i->mtx);
+            if ((i->lws == nullptr) || !i->writeQueue.push(std::move(_frame))) {
+                return false;
+            }
+            if (static_cast<std::size_t>(lws_get_tsi(i->lws)) == _tsi) {
+                lws_callback_on_writable(i->lws);
+            } else {
+                // the link is served by another thread, wake it up
+                lws_cancel_service_pt(i->lws);
+            }
+            return true;
+        }
+
+        return false;
+    }
+
+    void cluster_t::broadcast(const framePtr_t &_frame, std::size_t _tsi) noexcept {
+        if (!_frame || m_links.empty()) {
+            return;
+        }
+        // lws_write() masks the payload of a client frame in place, so every link takes its own frame.
+        // The copies are made before the frame is queued, after that its bytes belong to the link
+        for (std::size_t i = 0; i + 1 < m_links.size(); ++i) {
+            try {
+                auto copy = m_framePool.get(_frame->size());
+                copy->append(_frame->data(), _frame->size());
+                send(m_links[i]->node.id, std::move(copy), _tsi);
+            } catch (...) {
+                // out of memory, the link misses the message as on its queue overflow
+            }
+        }
+        send(m_links.back()->node.id, _frame, _tsi);
+    }
+
+    void cluster_t::wakeup(std::size_t _tsi) noexcept {
+        for (auto &i:m_links) {
+            std::unique_lock<std::mutex> lck(i->mtx);
+            if ((i->lws != nullptr) && !i->writeQueue.empty() &&
+                (static_cast<std::size_t>(lws_get_tsi(i->lws)) == _tsi)) {
+                lws_callback_on_writable(i->lws);
+            }
+        }
+    }
+
+    void cluster_t::established(void *_link, struct lws *_lws, tokenDirectory_t &_tokenDirectory) {
+        auto link = static_cast<link_t *>(_link);
+        std::unique_lock<std::mutex> lck(link->mtx);
+        link->lws = _lws;
+        link->connecting = false;
+        link->writeQueue.clear();
+
+        link->writeQueue.push(binProto_t::writer_t(m_framePool, static_cast<uint8_t>(msgType_t::NM_HELLO), 6)
+                                      .number(m_nodeId).frame());
+        // the receiver may have missed announces & withdrawals while the link was down, so all the tokens
+        // online on this node are announced again. The snapshot is taken under the link lock, so a token
+        // logged on or off meanwhile is broadcasted after it
+        std::vector<std::string> tokens;
+        _tokenDirectory.tokens(tokens);
+        std::unique_ptr<binProto_t::writer_t> writer;
+        std::size_t size = 0;
+        for (const auto &i:tokens) {
+            if (!writer || (size + 2 + i.length() > g_announceSize)) {
+                if (writer) {
+                    link->writeQueue.push(writer->frame());
+                }
+                writer = std::make_unique<binProto_t::writer_t>(m_framePool,
+                                                                static_cast<uint8_t>(msgType_t::NM_ANNOUNCE),
+                                                                g_announceSize);
+                size = 1;
+            }
+            writer->field(i);
+            size += 2 + i.length();
+        }
+        if (writer) {
+            link->writeQueue.push(writer->frame());
+        }
+
+        lws_callback_on_writable(_lws);
+    }
+
+    int cluster_t::writeable(void *_link, struct lws *_lws) noexcept {
+        auto link = static_cast<link_t *>(_link);
+        for (uint32_t i = 0; i < g_linkWriteBatch; ++i) {
+            framePtr_t frame;
+            bool lastMsg;
+            {
+                std::unique_lock<std::mutex> lck(link->mtx);
+                if (link->writeQueue.empty()) {
+                    break;
+                }
+                frame = link->writeQueue.pop();
+                lastMsg = link->writeQueue.empty();
+            }
+            if (!frame) {
+                continue;
+            }
+            if (lws_write(_lws, frame->data(), frame->size(), LWS_WRITE_BINARY) < 0) {
+                return -1;
+            }
+            if (lastMsg) {
+                break;
+            }
+            if ((i + 1 == g_linkWriteBatch) || lws_send_pipe_choked(_lws)) {
+                lws_callback_on_writable(_lws);
+                break;
+            }
+        }
+
+        return 0;
+    }
+
+    void cluster_t::closed(void *_link) noexcept {
+        auto link = static_cast<link_t *>(_link);
+        std::unique_lock<std::mutex> lck(link->mtx);
+        link->lws = nullptr;
+        link->connecting = false;
+        link->writeQueue.clear();
+    }
+
+    bool cluster_t::receive(struct lws *_lws, const void *_data, std::size_t _size, bool _final,
+                            framePtr_t &_msg, uint16_t &_node, std::vector<std::string> *_announced) {
+        framePtr_t frame;
+        uint16_t node;
+        {
+            std::unique_lock<std::mutex> lck(m_inboundMtx);
+            auto &inbound = m_inbound[_lws];
+            if ((inbound.readFrame ? inbound.readFrame->size() : 0) + _size > g_linkMsgSizeLimit) {
+                return false;
+            }
+            m_framePool.reserve(inbound.readFrame, _size);
+            inbound.readFrame->append(_data, _size);
+            if (!_final) {
+                return true;
+            }
+            frame = std::move(inbound.readFrame);
+            node = inbound.node;
+        }
+
+        binProto_t::reader_t reader(frame->data(), frame->size());
+        uint8_t type;
+        if (!reader.type(type)) {
+            return false;
+        }
+        if (type == static_cast<uint8_t>(msgType_t::NM_HELLO)) {
+            int32_t id;
+            if (!reader.number(id) || (id <= 0) || (id > 0xffff) || (id == m_nodeId)) {
+                return false;
+            }
+            std::unique_lock<std::mutex> lck(m_inboundMtx);
+            m_inbound[_lws].node = static_cast<uint16_t>(id);
+            return true;
+        }
+        if (node == 0) {
+            return false; // the link is not introduced
+        }
+        if ((type == static_cast<uint8_t>(msgType_t::NM_ANNOUNCE)) ||
+            (type == static_cast<uint8_t>(msgType_t::NM_WITHDRAW))) {
+            _node = node;
+            return directory(node, *frame, _announced);
+        }
+
+        _msg = std::move(frame);
+        _node = node;
+        return true;
+    }
+
+    bool cluster_t::directory(uint16_t _node, const frame_t &_frame, std::vector<std::string> *_announced) {
+        binProto_t::reader_t reader(_frame.data(), _frame.size());
+        uint8_t type;
+        reader.type(type);
+        while (!reader.end()) {
+            const char *token;
+            std::size_t size;
+            if (!reader.field(token, size)) {
+                return false;
+            }
+            if (type == static_cast<uint8_t>(msgType_t::NM_ANNOUNCE)) {
+                insert(std::string(token, size), _node);
+                if (_announced != nullptr) {
+                    _announced->emplace_back(token, size);
+                }
+            } else {
+                remove(std::string(token, size), _node);
+            }
+        }
+
+        return true;
+    }
+
+    uint16_t cluster_t::inboundClosed(struct lws *_lws) noexcept {
+        std::unique_lock<std::mutex> lck(m_inboundMtx);
+        auto i = m_inbound.find(_lws);
+        if (i == m_inbound.end()) {
+            return 0;
+        }
+        auto node = i->second.node;
+        m_inbound.erase(i);
+        for (const auto &j:m_inbound) {
+            if (j.second.node == node) {
+                return 0; // the node has reconnected already
+            }
+        }
+
+        return node;
+    }
+
+    framePtr_t cluster_t::tokenMsg(msgType_t _type, const std::string &_token) {
+        return binProto_t::writer_t(m_framePool, static_cast<uint8_t>(_type), 2 + _token.length())
+                .field(_token).frame();
+    }
+
+    framePtr_t cluster_t::callMsg(msgType_t _type, const char *_from, std::size_t _fromSize,
+                                  const char *_to, std::size_t _toSize) {
+        return binProto_t::writer_t(m_framePool, static_cast<uint8_t>(_type), 4 + _fromSize + _toSize)
+                .field(_from, _fromSize).field(_to, _toSize).frame();
+    }
+
+    framePtr_t cluster_t::relayMsg(const char *_from, std::size_t _fromSize, const char *_to, std::size_t _toSize,
+                                   bool _binary, const frame_t &_msg) {
+        return binProto_t::writer_t(m_framePool, static_cast<uint8_t>(msgType_t::NM_RELAY),
+                                    13 + _fromSize + _toSize + _msg.size())
+                .field(_from, _fromSize).field(_to, _toSize).flag(_binary).field(_msg.data(), _msg.size()).frame();
+    }
+
+    bool cluster_t::decode(const frame_t &_frame, msg_t &_msg) noexcept {
+        binProto_t::reader_t reader(_frame.data(), _frame.size());
+        uint8_t type;
+        if (!reader.type(type) ||
+            (type < static_cast<uint8_t>(msgType_t::NM_CALL)) || (type > static_cast<uint8_t>(msgType_t::NM_HANGUP))) {
+            return false;
+        }
+        _msg.type = static_cast<msgType_t>(type);
+        if (!reader.field(_msg.from, _msg.fromSize) || !reader.field(_msg.to, _msg.toSize)) {
+            return false;
+        }
+        if ((_msg.type == msgType_t::NM_RELAY) &&
+            (!reader.flag(_msg.binary) || !reader.field(_msg.data, _msg.dataSize))) {
+            return false;
+        }
+
+        return reader.end();
+    }
+} // namespace tgwss
@@ -0,0 +1,150 @@
+/**
+* @file wss/cluster.h
+* @brief tgwss cluster: token -> node directory & inter-node links
+* @author Max Fomichev
+* @date 29.01.2020
+* @copyright Apache License v.2 (http://www.apache.org/licenses/LICENSE-2.0)
+*/
+
+#ifndef TGWSS_CLUSTER_H
+#define TGWSS_CLUSTER_H
+
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <mutex>
+#include <memory>
+
+#include <libwebsockets.h>
+
+#include "frameBuffer.h"
+#include "writeQueue.h"
+#include "binProto.h"
+#include "tokenDirectory.h"
+
+namespace tgwss {
+    /**
+     * Every node keeps a persistent outbound websocket link ("tgwss-node" subprotocol) to every other node
+     * and sends its messages over it, messages of other nodes are received by inbound links. A node announces
+     * its online tokens to the others, so every node knows where a token is online.
+     * Node messages are encoded as binary protocol messages (see binProto.h) with their own types.
+     */
+    class cluster_t final {
+    public:
+        enum class msgType_t: uint8_t {
+            NM_HELLO = 1,       // node id, the first message of a link
+            NM_ANNOUNCE,        // token, the token is online on the sender node
+            NM_WITHDRAW,        // token, the token is offline
+            NM_CALL,            // from, to - call request of the sender's peer "from"
+            NM_PAIRED,          // from, to - reply to NM_CALL, "to" is paired with "from"
+            NM_OFFLINE,         // from, to - reply to NM_CALL, "to" is offline
+            NM_RELAY,           // from, to, binary, message - message of "from" to its subscriber "to"
+            NM_HANGUP           // from, to - "from" is gone, "to" is notified
+        };
+
+        struct node_t {
+            uint16_t id = 0;
+            std::string address;
+            uint16_t port = 0;
+        };
+
+        // decoded call routing message, strings point to the message frame
+        struct msg_t {
+            msgType_t type;
+            const char *from = nullptr;
+            std::size_t fromSize = 0;
+            const char *to = nullptr;
+            std::size_t toSize = 0;
+            bool binary = false;
+            const char *data = nullptr;
+            std::size_t dataSize = 0;
+        };
+
+    private:
+        // outbound link to another node
+        struct link_t {
+            node_t node;
+            std::mutex mtx;
+            struct lws *lws = nullptr;
+            bool connecting = false;
+            writeQueue_t writeQueue;
+
+            link_t(node_t _node, uint32_t _queueMsgLimit): node(std::move(_node)), writeQueue(_queueMsgLimit) {}
+        };
+
+        // inbound link from another node
+        struct inbound_t {
+            uint16_t node = 0;
+            framePtr_t readFrame;
+        };
+
+        const uint16_t m_nodeId;
+        framePool_t &m_framePool;
+        std::vector<std::unique_ptr<link_t>> m_links;
+
+        std::mutex m_inboundMtx;
+        std::unordered_map<struct lws *, inbound_t> m_inbound;
+
+        // tokens online on other nodes
+        std::mutex m_directoryMtx;
+        std::unordered_map<std::string, uint16_t> m_directory;
+
+    public:
+        cluster_t(uint16_t _nodeId, const std::vector<node_t> &_nodes, framePool_t &_framePool);
+        ~cluster_t() = default;
+
+        cluster_t(const cluster_t &) = delete;
+        void operator=(const cluster_t &) = delete;
+        cluster_t(const cluster_t &&) = delete;
+        void operator=(const cluster_t &&) = delete;
+
+        uint16_t nodeId() const noexcept {return m_nodeId;}
+        /// number of tokens online on other nodes
+        std::size_t size();
+
+        /// @returns false if _token is not online on other nodes
+        bool find(const std::string &_token, uint16_t &_node);
+        void insert(const std::string &_token, uint16_t _node);
+        void remove(const std::string &_token, uint16_t _node) noexcept;
+        /// removes all the tokens of _node
+        void removeNode(uint16_t _node) noexcept;
+
+        /// starts connecting links which are down
+        void connect(struct lws_context *_context, struct lws_vhost *_vhost, const char *_protocol) noexcept;
+        /// queues _frame to the link of _node, @returns false if the link is down or overflowed
+        bool send(uint16_t _node, framePtr_t _frame, std::size_t _tsi) noexcept;
+        /// queues a copy of _frame to each of the links
+        void broadcast(const framePtr_t &_frame, std::size_t _tsi) noexcept;
+        /// requests writeable callbacks of the links with queued messages served by service thread _tsi
+        void wakeup(std::size_t _tsi) noexcept;
+
+        /// outbound link callbacks, _link is lws user data of the link, the hello message & announces of
+        /// all the tokens of _tokenDirectory are queued to the established link
+        void established(void *_link, struct lws *_lws, tokenDirectory_t &_tokenDirectory);
+        /// @returns lws_callback return value
+        int writeable(void *_link, struct lws *_lws) noexcept;
+        void closed(void *_link) noexcept;
+
+        /// inbound link data, directory messages are applied right away (announced tokens are appended
+        /// to _announced, if set), _msg is set when a complete call routing message is received, _node is
+        /// the sender of a complete message, @returns false if the data is malformed
+        bool receive(struct lws *_lws, const void *_data, std::size_t _size, bool _final,
+                     framePtr_t &_msg, uint16_t &_node, std::vector<std::string> *_announced = nullptr);
+        /// @returns the node of the closed link if it has no other inbound links, 0 otherwise
+        uint16_t inboundClosed(struct lws *_lws) noexcept;
+
+        framePtr_t tokenMsg(msgType_t _type, const std::string &_token);
+        framePtr_t callMsg(msgType_t _type, const char *_from, std::size_t _fromSize,
+                           const char *_to, std::size_t _toSize);
+        framePtr_t relayMsg(const char *_from, std::size_t _fromSize, const char *_to, std::size_t _toSize,
+                            bool _binary, const frame_t &_msg);
+
+        /// @returns false if _frame is not a valid call routing message
+        static bool decode(const frame_t &_frame, msg_t &_msg) noexcept;
+
+    private:
+        bool directory(uint16_t _node, const frame_t &_frame, std::vector<std::string> *_announced);
+    };
+} // namespace tgwss
+
+#endif //TGWSS_CLUSTER_H
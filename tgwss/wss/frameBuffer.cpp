@@ -0,0 +1,83 @@
+/**
+* @file wss/frameBuffer.cpp
+* @brief pooled, reference counted websocket frame buffers with LWS_PRE headroom
+* @author Max Fomichev
+* @date 29.01.2020
+* @copyright Apache License v.2 (http://www.apache.org/licenses/LICENSE-2.0)
+*/
+
+#include "frameBuffer.h"
+
+namespace tgwss {
+    framePool_t::framePool_t() {
+        std::size_t capacity = 256;
+        for (auto &i:m_classes) {
+            i.capacity = capacity;
+            capacity *= 4; // 256 B ... 64 KB
+        }
+    }
+
+    framePool_t::~framePool_t() {
+        for (auto &i:m_classes) {
+            for (auto j:i.idle) {
+                delete j;
+            }
+        }
+    }
+
+    framePtr_t framePool_t::get(std::size_t _capacity) {
+        for (std::size_t i = 0; i < m_classesNum; ++i) {
+            auto &sizeClass = m_classes[i];
+            if (sizeClass.capacity < _capacity) {
+                continue;
+            }
+            frame_t *frame = nullptr;
+            {
+                std::unique_lock<std::mutex> lck(sizeClass.mtx);
+                if (!sizeClass.idle.empty()) {
+                    frame = sizeClass.idle.back();
+                    sizeClass.idle.pop_back();
+                }
+            }
+            if (frame == nullptr) {
+                frame = new frame_t(sizeClass.capacity, i, this);
+            }
+            frame->m_size = 0;
+            frame->stamp(0, 0);
+            frame->fragment(frame_t::FR_MESSAGE, nullptr);
+
+            return framePtr_t(frame);
+        }
+
+        // oversized frames are not pooled
+        return framePtr_t(new frame_t(_capacity, m_classesNum, this));
+    }
+
+    void framePool_t::reserve(framePtr_t &_frame, std::size_t _size) {
+        if (!_frame) {
+            _frame = get(_size);
+            return;
+        }
+        if (_frame->size() + _size <= _frame->capacity()) {
+            return;
+        }
+        auto frame = get(_frame->size() + _size);
+        frame->append(_frame->data(), _frame->size());
+        frame->stamp(_frame->rxTime(), _frame->msgClass());
+        _frame = std::move(frame);
+    }
+
+    void framePool_t::release(frame_t *_frame) noexcept {
+        if (_frame->m_class < m_classesNum) {
+            auto &sizeClass = m_classes[_frame->m_class];
+            try {
+                std::unique_lock<std::mutex> lck(sizeClass.mtx);
+                if (sizeClass.idle.size() < m_idleLimit) {
+                    sizeClass.idle.push_back(_frame);
+                    return;
+                }
+            } catch (...) {}
+        }
+        delete _frame;
+    }
+} // namespace tgwss
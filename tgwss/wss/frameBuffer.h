@@ -0,0 +1,165 @@
+/**
+* @file wss/frameBuffer.h
+* @brief pooled, reference counted websocket frame buffers with LWS_PRE headroom
+* @author Max Fomichev
+* @date 29.01.2020
+* @copyright Apache License v.2 (http://www.apache.org/licenses/LICENSE-2.0)
+*/
+
+#ifndef TGWSS_FRAMEBUFFER_H
+#define TGWSS_FRAMEBUFFER_H
+
+#include <cstring>
+#include <memory>
+#include <vector>
+#include <array>
+#include <mutex>
+#include <atomic>
+
+#include <libwebsockets.h>
+
+namespace tgwss {
+    class framePool_t;
+
+    class frame_t final {
+        friend class framePool_t;
+        friend class framePtr_t;
+
+    public:
+        // a whole message or a part of a message relayed as it's received
+        enum fragment_t: uint8_t {
+            FR_MESSAGE,
+            FR_FIRST,
+            FR_MIDDLE,
+            FR_LAST
+        };
+
+    private:
+        std::atomic<uint32_t> m_refs {0};
+        std::size_t m_size = 0;
+        // receive time (steady clock, ns) of the message the frame relays or answers, 0 - not timed
+        uint64_t m_rxTime = 0;
+        // message class of the latency accounting
+        uint8_t m_msgClass = 0;
+        fragment_t m_fragment = FR_MESSAGE;
+        // the sender of the message the fragment belongs to
+        const void *m_source = nullptr;
+        const std::size_t m_capacity;
+        const std::size_t m_class;
+        framePool_t *m_pool;
+        // LWS_PRE headroom followed by payload
+        std::unique_ptr<unsigned char[]> m_buf;
+
+    public:
+        frame_t(const frame_t &) = delete;
+        void operator=(const frame_t &) = delete;
+        frame_t(const frame_t &&) = delete;
+        void operator=(const frame_t &&) = delete;
+
+        unsigned char *data() noexcept {return m_buf.get() + LWS_PRE;}
+        const unsigned char *data() const noexcept {return m_buf.get() + LWS_PRE;}
+        std::size_t size() const noexcept {return m_size;}
+        std::size_t capacity() const noexcept {return m_capacity;}
+        uint64_t rxTime() const noexcept {return m_rxTime;}
+        uint8_t msgClass() const noexcept {return m_msgClass;}
+        fragment_t fragment() const noexcept {return m_fragment;}
+        const void *source() const noexcept {return m_source;}
+
+        void stamp(uint64_t _rxTime, uint8_t _msgClass) noexcept {
+            m_rxTime = _rxTime;
+            m_msgClass = _msgClass;
+        }
+
+        void fragment(fragment_t _fragment, const void *_source) noexcept {
+            m_fragment = _fragment;
+            m_source = _source;
+        }
+
+        /// @returns false if there is no room for _size bytes
+        bool append(const void *_data, std::size_t _size) noexcept {
+            if (m_size + _size > m_capacity) {
+                return false;
+            }
+            std::memcpy(data() + m_size, _data, _size);
+            m_size += _size;
+            return true;
+        }
+
+    private:
+        frame_t(std::size_t _capacity, std::size_t _class, framePool_t *_pool):
+                m_capacity(_capacity), m_class(_class), m_pool(_pool),
+                m_buf(new unsigned char[LWS_PRE + _capacity]) {}
+        ~frame_t() = default;
+    };
+
+    // intrusive shared pointer, the frame returns to its pool with the last reference
+    class framePtr_t final {
+    private:
+        frame_t *m_frame = nullptr;
+
+    public:
+        framePtr_t() = default;
+        explicit framePtr_t(frame_t *_frame) noexcept: m_frame(_frame) {
+            if (m_frame != nullptr) {
+                m_frame->m_refs.fetch_add(1, std::memory_order_relaxed);
+            }
+        }
+        framePtr_t(const framePtr_t &_other) noexcept: framePtr_t(_other.m_frame) {}
+        framePtr_t(framePtr_t &&_other) noexcept: m_frame(_other.m_frame) {_other.m_frame = nullptr;}
+        ~framePtr_t() {reset();}
+
+        framePtr_t &operator=(framePtr_t _other) noexcept {
+            std::swap(m_frame, _other.m_frame);
+            return *this;
+        }
+
+        void reset() noexcept;
+
+        frame_t *get() const noexcept {return m_frame;}
+        frame_t *operator->() const noexcept {return m_frame;}
+        frame_t &operator*() const noexcept {return *m_frame;}
+        explicit operator bool() const noexcept {return m_frame != nullptr;}
+    };
+
+    class framePool_t final {
+        friend class framePtr_t;
+
+    private:
+        static const std::size_t m_classesNum = 5;
+        // max number of idle frames kept per size class
+        static const std::size_t m_idleLimit = 4096;
+
+        struct sizeClass_t {
+            std::size_t capacity = 0;
+            std::mutex mtx;
+            std::vector<frame_t *> idle;
+        };
+        std::array<sizeClass_t, m_classesNum> m_classes;
+
+    public:
+        framePool_t();
+        ~framePool_t();
+
+        framePool_t(const framePool_t &) = delete;
+        void operator=(const framePool_t &) = delete;
+        framePool_t(const framePool_t &&) = delete;
+        void operator=(const framePool_t &&) = delete;
+
+        /// @returns empty frame with room for at least _capacity bytes
+        framePtr_t get(std::size_t _capacity);
+        /// moves _frame content to a larger frame if it has no room for _size more bytes
+        void reserve(framePtr_t &_frame, std::size_t _size);
+
+    private:
+        void release(frame_t *_frame) noexcept;
+    };
+
+    inline void framePtr_t::reset() noexcept {
+        if ((m_frame != nullptr) && (m_frame->m_refs.fetch_sub(1, std::memory_order_acq_rel) == 1)) {
+            m_frame->m_pool->release(m_frame);
+        }
+        m_frame = nullptr;
+    }
+} // namespace tgwss
+
+#endif //TGWSS_FRAMEBUFFER_H
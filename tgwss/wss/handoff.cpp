@@ -0,0 +1,232 @@
+/**
+* @file wss/handoff.cpp
+* @brief tgwss listening socket hand-off to a new process
+* @author Max Fomichev
+* @date 29.01.2020
+* @copyright Apache License v.2 (http://www.apache.org/licenses/LICENSE-2.0)
+*/
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+
+#include "handoff.h"
+
+namespace tgwss {
+    // hand-off thread checks its stop flag every
+    static const int g_pollTimeout = 200; // ms
+    // max time to wait for the listening socket from a predecessor
+    static const int g_receiveTimeout = 5; // sec
+
+    static bool unixAddress(const std::string &_path, struct sockaddr_un &_addr) noexcept {
+        std::memset(&_addr, 0, sizeof(_addr));
+        _addr.sun_family = AF_UNIX;
+        if (_path.length() >= sizeof(_addr.sun_path)) {
+            return false;
+        }
+        std::memcpy(_addr.sun_path, _path.c_str(), _path.length());
+
+        return true;
+    }
+
+    /// @returns false if there is no predecessor listening on _path
+    static bool receiveFd(const std::string &_path, int &_fd) {
+        struct sockaddr_un addr {};
+        if (!unixAddress(_path, addr)) {
+            throw std::runtime_error("handoff: Unix socket path is too long");
+        }
+        int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (sock < 0) {
+            throw std::runtime_error("handoff: failed to create Unix socket");
+        }
+        if (connect(sock, reinterpret_cast<struct sockaddr *>(&addr), sizeof(addr)) != 0) {
+            auto err = errno;
+            close(sock);
+            if ((err == ENOENT) || (err == ECONNREFUSED)) {
+                return false;
+            }
+            throw std::runtime_error("handoff: failed to connect to " + _path + ": " + std::strerror(err));
+        }
+
+        struct timeval tv {};
+        tv.tv_sec = g_receiveTimeout;
+        setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+        char byte;
+        struct iovec iov {};
+        iov.iov_base = &byte;
+        iov.iov_len = sizeof(byte);
+        union {
+            struct cmsghdr align;
+            char buf[CMSG_SPACE(sizeof(int))];
+        } control {};
+        struct msghdr msg {};
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control.buf;
+        msg.msg_controllen = sizeof(control.buf);
+        auto size = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+        close(sock);
+
+        auto cmsg = (size > 0) ? CMSG_FIRSTHDR(&msg) : nullptr;
+        if ((cmsg == nullptr) || (cmsg->cmsg_level != SOL_SOCKET) || (cmsg->cmsg_type != SCM_RIGHTS) ||
+            (cmsg->cmsg_len != CMSG_LEN(sizeof(int)))) {
+            throw std::runtime_error("handoff: no listening socket is received from " + _path);
+        }
+        std::memcpy(&_fd, CMSG_DATA(cmsg), sizeof(int));
+
+        return true;
+    }
+
+    static bool sendFd(int _sock, int _fd) noexcept {
+        char byte = 0;
+        struct iovec iov {};
+        iov.iov_base = &byte;
+        iov.iov_len = sizeof(byte);
+        union {
+            struct cmsghdr align;
+            char buf[CMSG_SPACE(sizeof(int))];
+        } control {};
+        struct msghdr msg {};
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control.buf;
+        msg.msg_controllen = sizeof(control.buf);
+        auto cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+        std::memcpy(CMSG_DATA(cmsg), &_fd, sizeof(int));
+
+        return sendmsg(_sock, &msg, MSG_NOSIGNAL) == 1;
+    }
+
+    // dual stack listening socket, the same as lws creates for the vhost port
+    static int listenTcp(uint16_t _port) {
+        bool ipv6 = true;
+        int fd = socket(AF_INET6, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (fd < 0) {
+            ipv6 = false;
+            fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        }
+        if (fd < 0) {
+            throw std::runtime_error("handoff: failed to create listening socket");
+        }
+
+        int on = 1;
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+        int rc;
+        if (ipv6) {
+            int off = 0;
+            setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &off, sizeof(off));
+            struct sockaddr_in6 addr {};
+            addr.sin6_family = AF_INET6;
+            addr.sin6_addr = in6addr_any;
+            addr.sin6_port = htons(_port);
+            rc = bind(fd, reinterpret_cast<struct sockaddr *>(&addr), sizeof(addr));
+        } else {
+            struct sockaddr_in addr {};
+            addr.sin_family = AF_INET;
+            addr.sin_addr.s_addr = htonl(INADDR_ANY);
+            addr.sin_port = htons(_port);
+            rc = bind(fd, reinterpret_cast<struct sockaddr *>(&addr), sizeof(addr));
+        }
+        if ((rc != 0) || (listen(fd, SOMAXCONN) != 0)) {
+            auto err = errno;
+            close(fd);
+            throw std::runtime_error("handoff: failed to listen on port " + std::to_string(_port) + ": " +
+                                     std::strerror(err));
+        }
+
+        return fd;
+    }
+
+    handoff_t::handoff_t(const std::string &_path, uint16_t _port): m_path(_path) {
+        m_inherited = receiveFd(m_path, m_listenFd);
+        if (m_inherited) {
+            // the file status flags are shared with the predecessor, just make sure
+            fcntl(m_listenFd, F_SETFL, fcntl(m_listenFd, F_GETFL) | O_NONBLOCK);
+        } else {
+            m_listenFd = listenTcp(_port);
+        }
+
+        struct sockaddr_un addr {};
+        unixAddress(m_path, addr);
+        m_socketFd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (m_socketFd >= 0) {
+            // the predecessor doesn't listen on the path anymore
+            unlink(m_path.c_str());
+            if ((bind(m_socketFd, reinterpret_cast<struct sockaddr *>(&addr), sizeof(addr)) == 0) &&
+                (listen(m_socketFd, 1) == 0)) {
+                return;
+            }
+        }
+
+        auto err = errno;
+        if (m_socketFd >= 0) {
+            close(m_socketFd);
+        }
+        close(m_listenFd);
+        throw std::runtime_error("handoff: failed to listen on " + m_path + ": " + std::strerror(err));
+    }
+
+    handoff_t::~handoff_t() {
+        stop();
+        if (m_socketFd >= 0) {
+            close(m_socketFd);
+            unlink(m_path.c_str());
+        }
+        close(m_listenFd);
+    }
+
+    int handoff_t::listenFd() const noexcept {
+        return fcntl(m_listenFd, F_DUPFD_CLOEXEC, 0);
+    }
+
+    void handoff_t::start(std::function<void()> _onHandoff) {
+        m_onHandoff = std::move(_onHandoff);
+        m_thread = std::thread(&handoff_t::worker, this);
+    }
+
+    void handoff_t::stop() noexcept {
+        m_stopFlag = true;
+        if (m_thread.joinable()) {
+            m_thread.join();
+        }
+    }
+
+    void handoff_t::worker() noexcept {
+        while (!m_stopFlag) {
+            struct pollfd pfd {};
+            pfd.fd = m_socketFd;
+            pfd.events = POLLIN;
+            if (poll(&pfd, 1, g_pollTimeout) <= 0) {
+                continue;
+            }
+            int sock = accept4(m_socketFd, nullptr, nullptr, SOCK_CLOEXEC);
+            if (sock < 0) {
+                continue;
+            }
+            auto sent = sendFd(sock, m_listenFd);
+            close(sock);
+            if (!sent) {
+                continue;
+            }
+
+            // the path belongs to the successor now
+            close(m_socketFd);
+            m_socketFd = -1;
+            if (m_onHandoff) {
+                m_onHandoff();
+            }
+            return;
+        }
+    }
+} // namespace tgwss
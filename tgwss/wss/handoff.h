@@ -0,0 +1,61 @@
+/**
+* @file wss/handoff.h
+* @brief tgwss listening socket hand-off to a new process
+* @author Max Fomichev
+* @date 29.01.2020
+* @copyright Apache License v.2 (http://www.apache.org/licenses/LICENSE-2.0)
+*/
+
+#ifndef TGWSS_HANDOFF_H
+#define TGWSS_HANDOFF_H
+
+#include <string>
+#include <thread>
+#include <atomic>
+#include <functional>
+
+namespace tgwss {
+    /**
+     * Passes the websocket listening socket from a running tgwss process to a new one over a Unix socket,
+     * so the new process accepts connections on the same socket and no connection attempt is refused during
+     * an upgrade. A new process connects to the Unix socket first and receives the listening socket of its
+     * predecessor (SCM_RIGHTS), if nobody is listening it creates the listening socket by itself.
+     * Then it listens on the Unix socket for its own successor.
+     */
+    class handoff_t final {
+    private:
+        const std::string m_path;
+        int m_listenFd = -1;
+        bool m_inherited = false;
+        int m_socketFd = -1;
+
+        std::function<void()> m_onHandoff;
+        std::atomic<bool> m_stopFlag {false};
+        std::thread m_thread;
+
+    public:
+        /// @throws std::runtime_error
+        handoff_t(const std::string &_path, uint16_t _port);
+        ~handoff_t();
+
+        handoff_t(const handoff_t &) = delete;
+        void operator=(const handoff_t &) = delete;
+        handoff_t(const handoff_t &&) = delete;
+        void operator=(const handoff_t &&) = delete;
+
+        /// @returns a new descriptor of the nonblocking listening socket, the caller owns it
+        int listenFd() const noexcept;
+        /// @returns true if the listening socket is received from a predecessor
+        bool inherited() const noexcept {return m_inherited;}
+
+        /// starts waiting for a successor, _onHandoff is called by the hand-off thread once
+        /// the listening socket is passed to the successor
+        void start(std::function<void()> _onHandoff);
+        void stop() noexcept;
+
+    private:
+        void worker() noexcept;
+    };
+} // namespace tgwss
+
+#endif //TGWSS_HANDOFF_H
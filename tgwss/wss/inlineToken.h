@@ -0,0 +1,53 @@
+/**
+* @file wss/inlineToken.h
+* @brief peer token stored in place, with no heap allocation
+* @author Max Fomichev
+* @date 29.01.2020
+* @copyright Apache License v.2 (http://www.apache.org/licenses/LICENSE-2.0)
+*/
+
+#ifndef TGWSS_INLINETOKEN_H
+#define TGWSS_INLINETOKEN_H
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+
+namespace tgwss {
+    class inlineToken_t final {
+    public:
+        // max token length, longer tokens are rejected on logon
+        static const std::size_t capacity = 64;
+
+    private:
+        uint8_t m_size = 0;
+        char m_data[capacity];
+
+    public:
+        inlineToken_t() = default;
+
+        const char *data() const noexcept {return m_data;}
+        std::size_t size() const noexcept {return m_size;}
+        bool empty() const noexcept {return m_size == 0;}
+        std::string str() const {return std::string(m_data, m_size);}
+
+        /// @returns false (and the token is cleared) if _size exceeds the capacity
+        bool assign(const char *_data, std::size_t _size) noexcept {
+            if (_size > capacity) {
+                m_size = 0;
+                return false;
+            }
+            std::memcpy(m_data, _data, _size);
+            m_size = static_cast<uint8_t>(_size);
+            return true;
+        }
+        bool assign(const std::string &_token) noexcept {return assign(_token.data(), _token.size());}
+        void clear() noexcept {m_size = 0;}
+
+        bool equals(const char *_data, std::size_t _size) const noexcept {
+            return (_size == m_size) && (std::memcmp(m_data, _data, _size) == 0);
+        }
+    };
+} // namespace tgwss
+
+#endif //TGWSS_INLINETOKEN_H
@@ -9,8 +9,18 @@
 #include <unistd.h>
 #include <getopt.h>
 #include <signal.h>
+#include <sys/wait.h>
+#include <sysexits.h>
+#if defined(__linux__)
+#include <sys/prctl.h>
+#endif
 
 #include <iostream>
+#include <fstream>
+#include <vector>
+#include <algorithm>
+#include <chrono>
+#include <thread>
 
 #include "json/confParser.h"
 #include "logger/logger.h"
@@ -36,8 +46,141 @@ static struct option longopts[] = {
 
 static const char *pidFileName = "/var/run/tgwss.pid";
 
+// after an upgrade the pid file holds the pid of the successor, it's left as is
+static void removePidFile() {
+    pid_t pid = 0;
+    std::ifstream ifs(pidFileName);
+    if ((ifs >> pid) && (pid == getpid())) {
+        unlink(pidFileName);
+    }
+}
+
+// forks the worker processes and restarts the crashed ones, returns in the worker processes (with their index)
+// or when all the workers have exited on a stop signal or have been stopped on a worker's failure to start (_failed)
+static bool supervise(uint16_t _workers, uint16_t &_idx, bool &_failed) {
+    sigset_t sigSet;
+    if ((sigemptyset(&sigSet) != 0) ||
+        (sigaddset(&sigSet, SIGINT) != 0) || //stop workers & exit
+        (sigaddset(&sigSet, SIGQUIT) != 0) || //stop workers & exit
+        (sigaddset(&sigSet, SIGTERM) != 0) || //stop workers & exit
+        (sigaddset(&sigSet, SIGHUP) != 0) || //forwarded to workers
+        (sigaddset(&sigSet, SIGUSR1) != 0) || //forwarded to workers
+        (sigaddset(&sigSet, SIGCHLD) != 0) || //worker exited
+        (sigprocmask(SIG_BLOCK, &sigSet, nullptr) != 0)) {
+
+        throw std::runtime_error("failed to set signal handlers");
+    }
+
+    // a worker exiting this soon after its start so many times in a row won't start at all
+    const auto quickExitTime = std::chrono::seconds(10);
+    const unsigned quickExitsLimit = 5;
+
+    std::vector<pid_t> pids(_workers, 0);
+    std::vector<std::chrono::steady_clock::time_point> started(_workers);
+    std::vector<unsigned> quickExits(_workers, 0);
+    std::size_t running = 0;
+    bool stopping = false;
+    _failed = false;
+    while (true) {
+        for (uint16_t i = 0; !stopping && (i < _workers); ++i) {
+            if (pids[i] != 0) {
+                continue;
+            }
+            // a worker crashing at start is restarted once a second at most
+            std::this_thread::sleep_until(started[i] + std::chrono::seconds(1));
+            started[i] = std::chrono::steady_clock::now();
+            auto pid = fork();
+            if (pid == 0) {
+#if defined(__linux__)
+                prctl(PR_SET_PDEATHSIG, SIGTERM);
+#endif
+                _idx = i;
+                return true;
+            }
+            if (pid < 0) {
+                throw std::runtime_error("failed to fork worker process");
+            }
+            pids[i] = pid;
+            ++running;
+        }
+        if (running == 0) {
+            return false;
+        }
+
+        int sign = 0;
+        if (sigwait(&sigSet, &sign) != 0) {
+            throw std::runtime_error("sigwait failed");
+        }
+        switch (sign) {
+            case SIGCHLD: {
+                pid_t pid;
+                int status;
+                while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+                    auto i = std::find(pids.begin(), pids.end(), pid);
+                    if (i == pids.end()) {
+                        continue;
+                    }
+                    *i = 0;
+                    --running;
+                    if (stopping) {
+                        continue;
+                    }
+                    auto idx = static_cast<std::size_t>(i - pids.begin());
+                    if (std::chrono::steady_clock::now() - started[idx] < quickExitTime) {
+                        ++quickExits[idx];
+                    } else {
+                        quickExits[idx] = 0;
+                    }
+                    // a worker failed to start with the configuration (can't bind its ports, etc)
+                    // is not restarted as well as a worker crashing right after the start
+                    bool failed = (WIFEXITED(status) && (WEXITSTATUS(status) == EX_CONFIG)) ||
+                                  (quickExits[idx] >= quickExitsLimit);
+                    // the supervisor forks, so it has no logger (the writer thread doesn't survive fork())
+                    std::cerr << "worker " << idx << " (pid " << pid << ") "
+                              << (WIFSIGNALED(status) ? "killed by signal " : "exited with status ")
+                              << (WIFSIGNALED(status) ? WTERMSIG(status) : WEXITSTATUS(status))
+                              << (failed ? ", stopping" : ", restarting") << std::endl;
+                    if (failed) {
+                        stopping = true;
+                        _failed = true;
+                        for (auto j:pids) {
+                            if (j != 0) {
+                                kill(j, SIGTERM);
+                            }
+                        }
+                    }
+                }
+                break;
+            }
+            case SIGINT:
+            case SIGQUIT:
+            case SIGTERM: {
+                stopping = true;
+                for (auto i:pids) {
+                    if (i != 0) {
+                        kill(i, SIGTERM);
+                    }
+                }
+                break;
+            }
+            default: {
+                for (auto i:pids) {
+                    if (i != 0) {
+                        kill(i, sign);
+                    }
+                }
+                break;
+            }
+        }
+    }
+}
+
 int main(int argc, char *argv[]) {
     bool daemonize = false;
+    // errors go to the log once it's set up, stderr is closed in daemon mode
+    bool logging = false;
+    // a worker failing before it serves exits with EX_CONFIG, so the supervisor doesn't restart it
+    bool starting = false;
     try {
         std::string confFile;
 
@@ -115,9 +258,33 @@ int main(int argc, char *argv[]) {
             ofs.close();
         }
 
+        bool worker = false;
+        uint16_t workerIdx = 0;
+        if (confParser->workers() > 1) {
+            bool failed = false;
+            if (!supervise(confParser->workers(), workerIdx, failed)) {
+                if (daemonize) {
+                    removePidFile();
+                }
+                return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+            }
+            // worker process, the pid file belongs to the supervisor
+            daemonize = false;
+            worker = true;
+            starting = true;
+            confParser->worker(workerIdx);
+        }
+
         // create logger insrance
         auto &logger = tgwss::logger_t::logger();
-        logger.init("tgwss", confParser->logDst(), confParser->logLevel());
+        logger.init("tgwss", confParser->logDst(), confParser->logLevel(),
+                    confParser->logFlushInterval(), confParser->logMaxLatency());
+        logging = true;
+        if (worker) {
+            TGWSS_LOG(&logger, LL_NOTICE, FMT_STRING("worker {:d} started, pid {:d}"), workerIdx, getpid());
+        } else {
+            TGWSS_LOG(&logger, LL_NOTICE, FMT_STRING("started, pid {:d}"), getpid());
+        }
 
         { // run server
             sigset_t sigSet;
@@ -125,7 +292,8 @@ int main(int argc, char *argv[]) {
                 (sigaddset(&sigSet, SIGINT) != 0) || //exit
                 (sigaddset(&sigSet, SIGQUIT) != 0) || //exit
                 (sigaddset(&sigSet, SIGTERM) != 0) || //exit
-                (sigaddset(&sigSet, SIGHUP) != 0) || //reopen log file
+                (sigaddset(&sigSet, SIGHUP) != 0) || //reopen log file & reload config
+                (sigaddset(&sigSet, SIGUSR1) != 0) || //log latency quantiles
                 (sigprocmask(SIG_BLOCK, &sigSet, nullptr) != 0) ||
                 (signal(SIGPIPE, SIG_IGN) == SIG_ERR)) { // ignore
 
@@ -134,6 +302,7 @@ int main(int argc, char *argv[]) {
 
             tgwss::wsServer_t wsServer(confParser, &logger);
             wsServer.start();
+            starting = false;
             int sign = 0;
             while (true) {
                 if (sigwait(&sigSet, &sign) != 0) {
@@ -147,29 +316,53 @@ int main(int argc, char *argv[]) {
                         break;
                     case SIGHUP:
                         logger.reopen();
+                        try {
+                            // connections stay up, settings which can't be changed on the fly are logged
+                            confParser->init(confFile);
+                            if (worker) {
+                                confParser->worker(workerIdx);
+                            }
+                            logger.level(confParser->logLevel());
+                            wsServer.reload(confParser);
+                            TGWSS_LOG(&logger, LL_NOTICE, FMT_STRING("config reloaded"));
+                        } catch (const std::exception &_e) {
+                            TGWSS_LOG(&logger, LL_ERROR, FMT_STRING("config reload failed: {:s}"), _e.what());
+                        }
+                        continue;
+                    case SIGUSR1:
+                        wsServer.dumpLatency();
                         continue;
                     default:
                         continue;
                 }
+                TGWSS_LOG(&logger, LL_NOTICE, FMT_STRING("stopping on signal {:d}"), sign);
                 wsServer.stop();
                 break;
             }
         }
 
         if (daemonize) {
-            unlink(pidFileName);
+            removePidFile();
         }
 
         return EXIT_SUCCESS;
     } catch (const std::exception &_e) {
-        std::cerr << _e.what() << std::endl;
+        if (logging) {
+            TGWSS_LOG(&tgwss::logger_t::logger(), LL_CRITICAL, FMT_STRING("{:s}"), _e.what());
+        } else {
+            std::cerr << _e.what() << std::endl;
+        }
     } catch (...) {
-        std::cerr << "unknown error" << std::endl;
+        if (logging) {
+            TGWSS_LOG(&tgwss::logger_t::logger(), LL_CRITICAL, FMT_STRING("unknown error"));
+        } else {
+            std::cerr << "unknown error" << std::endl;
+        }
     }
 
     if (daemonize) {
-        unlink(pidFileName);
+        removePidFile();
     }
 
-    return EXIT_FAILURE;
+    return starting ? EX_CONFIG : EXIT_FAILURE;
 }
@@ -0,0 +1,294 @@
+/**
+* @file wss/metrics.cpp
+* @brief lock free server counters, exported in Prometheus text format
+* @author Max Fomichev
+* @date 29.01.2020
+* @copyright Apache License v.2 (http://www.apache.org/licenses/LICENSE-2.0)
+*/
+
+#include <cstring>
+#include <algorithm>
+#include <limits>
+#include <cmath>
+
+#include "frameBuffer.h"
+#include "binProto.h"
+#include "metrics.h"
+
+namespace tgwss {
+    // bytes of a JSON message inspected to guess its type
+    static const std::size_t g_headSize = 64;
+
+    const std::array<uint64_t, histogram_t::m_bucketsNum> histogram_t::m_bounds = {
+            10, 50, 100, 250, 500, 1000, 2500, 5000, 10000, 50000, 250000, 1000000
+    };
+
+    void histogram_t::observe(uint64_t _us) noexcept {
+        auto bound = std::lower_bound(m_bounds.begin(), m_bounds.end(), _us);
+        m_buckets[static_cast<std::size_t>(bound - m_bounds.begin())].fetch_add(1, std::memory_order_relaxed);
+        m_sumUs.fetch_add(_us, std::memory_order_relaxed);
+    }
+
+    void hdrHistogram_t::observe(uint64_t _us) noexcept {
+        m_buckets[bucketIdx(_us)].fetch_add(1, std::memory_order_relaxed);
+        m_sumUs.fetch_add(_us, std::memory_order_relaxed);
+        // the histogram is updated by its own thread only
+        if (_us > m_maxUs.load(std::memory_order_relaxed)) {
+            m_maxUs.store(_us, std::memory_order_relaxed);
+        }
+    }
+
+    uint64_t hdrHistogram_t::count() const noexcept {
+        uint64_t count = 0;
+        for (const auto &i:m_buckets) {
+            count += i.load(std::memory_order_relaxed);
+        }
+        return count;
+    }
+
+    void hdrHistogram_t::add(const hdrHistogram_t &_other) noexcept {
+        for (std::size_t i = 0; i < m_bucketsNum; ++i) {
+            m_buckets[i].fetch_add(_other.bucket(i), std::memory_order_relaxed);
+        }
+        m_sumUs.fetch_add(_other.sumUs(), std::memory_order_relaxed);
+        if (_other.maxUs() > maxUs()) {
+            m_maxUs.store(_other.maxUs(), std::memory_order_relaxed);
+        }
+    }
+
+    uint64_t hdrHistogram_t::quantile(double _quantile) const noexcept {
+        auto total = count();
+        if (total == 0) {
+            return 0;
+        }
+        // rank of the quantile value, 1...total
+        auto rank = std::max<uint64_t>(static_cast<uint64_t>(std::ceil(_quantile * static_cast<double>(total))), 1);
+        uint64_t cumulative = 0;
+        for (std::size_t i = 0; i < m_bucketsNum; ++i) {
+            cumulative += bucket(i);
+            if (cumulative >= rank) {
+                return std::min(bucketMax(i), maxUs());
+            }
+        }
+        return maxUs();
+    }
+
+    std::size_t hdrHistogram_t::bucketIdx(uint64_t _us) noexcept {
+        if (_us < m_subBucketsNum) {
+            return static_cast<std::size_t>(_us);
+        }
+        // power of two range of the value, 4...31
+        auto range = static_cast<std::size_t>(63 - __builtin_clzll(_us));
+        if (range > m_rangesNum + 3) {
+            return m_bucketsNum - 1;
+        }
+        return m_subBucketsNum * (range - 3) + static_cast<std::size_t>(_us >> (range - 4)) - m_subBucketsNum;
+    }
+
+    uint64_t hdrHistogram_t::bucketMax(std::size_t _idx) noexcept {
+        if (_idx < m_subBucketsNum) {
+            return _idx;
+        }
+        auto range = _idx / m_subBucketsNum + 3;
+        auto subBucket = _idx % m_subBucketsNum;
+        return ((m_subBucketsNum + subBucket + 1) << (range - 4)) - 1;
+    }
+
+    const std::array<double, 4> metrics_t::m_quantiles = {0.5, 0.9, 0.99, 0.999};
+
+    metrics_t::metrics_t(std::size_t _threads) {
+        for (std::size_t i = 0; i < _threads; ++i) {
+            m_counters.emplace_back(std::make_unique<counters_t>());
+        }
+    }
+
+    static const char *find(const char *_begin, const char *_end, const char *_str) noexcept {
+        auto found = std::search(_begin, _end, _str, _str + std::strlen(_str));
+        return (found == _end) ? nullptr : found;
+    }
+
+    metrics_t::relayType_t metrics_t::relayType(const frame_t &_frame, bool _binary) noexcept {
+        if (_frame.size() == 0) {
+            return RT_OTHER;
+        }
+        if (_binary) {
+            switch (static_cast<binProto_t::msgType_t>(_frame.data()[0])) {
+                case binProto_t::msgType_t::MT_OFFER: return RT_OFFER;
+                case binProto_t::msgType_t::MT_ANSWER: return RT_ANSWER;
+                case binProto_t::msgType_t::MT_CANDIDATE: return RT_CANDIDATE;
+                case binProto_t::msgType_t::MT_CALL_STATUS: return RT_CALL;
+                default: return RT_OTHER;
+            }
+        }
+
+        auto begin = reinterpret_cast<const char *>(_frame.data());
+        auto end = begin + std::min(_frame.size(), g_headSize);
+        auto type = find(begin, end, "\"type\"");
+        if (type != nullptr) {
+            // skip to the value
+            auto value = type + 6;
+            while ((value < end) && ((*value == ' ') || (*value == ':') || (*value == '"'))) {
+                ++value;
+            }
+            auto starts = [value, end](const char *_str) {
+                auto size = std::strlen(_str);
+                return (static_cast<std::size_t>(end - value) >= size) && (std::memcmp(value, _str, size) == 0);
+            };
+            if (starts("offer")) {
+                return RT_OFFER;
+            } else if (starts("answer")) {
+                return RT_ANSWER;
+            } else if (starts("call")) {
+                return RT_CALL;
+            }
+            return RT_OTHER;
+        }
+        if ((find(begin, end, "\"candidate\"") != nullptr) || (find(begin, end, "\"sdpMid\"") != nullptr)) {
+            return RT_CANDIDATE;
+        }
+
+        return RT_OTHER;
+    }
+
+    metrics_t::latencyType_t metrics_t::latencyType(relayType_t _relayType) noexcept {
+        switch (_relayType) {
+            case RT_OFFER: return LT_OFFER;
+            case RT_ANSWER: return LT_ANSWER;
+            case RT_CANDIDATE: return LT_CANDIDATE;
+            case RT_CALL: return LT_CALL;
+            default: return LT_OTHER;
+        }
+    }
+
+    const char *metrics_t::latencyTypeName(latencyType_t _type) noexcept {
+        static const char *names[LT_NUM] = {"logon", "call", "offer", "answer", "candidate", "other"};
+        return (_type < LT_NUM) ? names[_type] : "unknown";
+    }
+
+    metrics_t::latencySummary_t metrics_t::latency(latencyType_t _type) const {
+        hdrHistogram_t merged;
+        for (const auto &i:m_counters) {
+            merged.add(i->latency[_type]);
+        }
+
+        latencySummary_t summary;
+        summary.count = merged.count();
+        summary.sumUs = merged.sumUs();
+        summary.maxUs = merged.maxUs();
+        for (std::size_t i = 0; i < m_quantiles.size(); ++i) {
+            summary.quantilesUs[i] = merged.quantile(m_quantiles[i]);
+        }
+
+        return summary;
+    }
+
+    void metrics_t::gauge(std::string &_out, const char *_name, const char *_help, uint64_t _value) {
+        _out.append("# HELP ").append(_name).append(" ").append(_help).append("\n");
+        _out.append("# TYPE ").append(_name).append(" gauge\n");
+        _out.append(_name).append(" ").append(std::to_string(_value)).append("\n");
+    }
+
+    void metrics_t::counter(std::string &_out, const char *_name, const char *_help, uint64_t _value) {
+        _out.append("# HELP ").append(_name).append(" ").append(_help).append("\n");
+        _out.append("# TYPE ").append(_name).append(" counter\n");
+        _out.append(_name).append(" ").append(std::to_string(_value)).append("\n");
+    }
+
+    void metrics_t::render(std::string &_out) const {
+        static const char *relayTypes[RT_NUM] = {"offer", "answer", "candidate", "call", "other"};
+        static const char *closeReasons[CR_NUM] = {"peer", "invalid_payload", "policy_violation",
+                                                   "unexpected_condition"};
+        // labels of m_quantiles
+        static const char *quantiles[] = {"0.5", "0.9", "0.99", "0.999"};
+
+        auto sum = [this](const std::atomic<uint64_t> counters_t::*_counter) {
+            uint64_t value = 0;
+            for (const auto &i:m_counters) {
+                value += ((*i).*_counter).load(std::memory_order_relaxed);
+            }
+            return value;
+        };
+        auto sumArray = [this](std::array<std::atomic<uint64_t>, RT_NUM> counters_t::*_counters, std::size_t _idx) {
+            uint64_t value = 0;
+            for (const auto &i:m_counters) {
+                value += ((*i).*_counters)[_idx].load(std::memory_order_relaxed);
+            }
+            return value;
+        };
+
+        auto callsStarted = sum(&counters_t::callsStarted);
+        auto callsEnded = sum(&counters_t::callsEnded);
+        gauge(_out, "tgwss_call_pairs", "Active call pairs.", (callsStarted > callsEnded) ? callsStarted - callsEnded : 0);
+        counter(_out, "tgwss_logons_total", "Successful logons.", sum(&counters_t::logons));
+        counter(_out, "tgwss_logon_failures_total", "Rejected logons.", sum(&counters_t::logonFailures));
+        counter(_out, "tgwss_parse_failures_total", "Malformed messages.", sum(&counters_t::parseFailures));
+        counter(_out, "tgwss_calls_total", "Paired calls.", callsStarted);
+        counter(_out, "tgwss_connections_closed_total", "Closed websocket connections.",
+                sum(&counters_t::closedConnections));
+
+        _out.append("# HELP tgwss_relayed_messages_total Relayed messages by type.\n"
+                    "# TYPE tgwss_relayed_messages_total counter\n");
+        for (std::size_t i = 0; i < RT_NUM; ++i) {
+            _out.append("tgwss_relayed_messages_total{type=\"").append(relayTypes[i]).append("\"} ")
+                    .append(std::to_string(sumArray(&counters_t::relayedMsgs, i))).append("\n");
+        }
+        _out.append("# HELP tgwss_relayed_bytes_total Relayed bytes by message type.\n"
+                    "# TYPE tgwss_relayed_bytes_total counter\n");
+        for (std::size_t i = 0; i < RT_NUM; ++i) {
+            _out.append("tgwss_relayed_bytes_total{type=\"").append(relayTypes[i]).append("\"} ")
+                    .append(std::to_string(sumArray(&counters_t::relayedBytes, i))).append("\n");
+        }
+        _out.append("# HELP tgwss_closes_total Closed connections by reason.\n"
+                    "# TYPE tgwss_closes_total counter\n");
+        for (std::size_t i = 0; i < CR_NUM; ++i) {
+            uint64_t value = 0;
+            for (const auto &j:m_counters) {
+                value += j->closeReasons[i].load(std::memory_order_relaxed);
+            }
+            _out.append("tgwss_closes_total{reason=\"").append(closeReasons[i]).append("\"} ")
+                    .append(std::to_string(value)).append("\n");
+        }
+
+        _out.append("# HELP tgwss_loop_iteration_cpu_seconds Service thread CPU time per event loop "
+                    "iteration, waiting for events excluded.\n"
+                    "# TYPE tgwss_loop_iteration_cpu_seconds histogram\n");
+        uint64_t cumulative = 0;
+        uint64_t sumUs = 0;
+        for (std::size_t i = 0; i <= histogram_t::m_bucketsNum; ++i) {
+            for (const auto &j:m_counters) {
+                cumulative += j->loopCpuTime.bucket(i);
+                if (i == 0) {
+                    sumUs += j->loopCpuTime.sumUs();
+                }
+            }
+            _out.append("tgwss_loop_iteration_cpu_seconds_bucket{le=\"")
+                    .append((i < histogram_t::m_bucketsNum) ?
+                            std::to_string(histogram_t::m_bounds[i] / 1e6) : std::string("+Inf"))
+                    .append("\"} ").append(std::to_string(cumulative)).append("\n");
+        }
+        _out.append("tgwss_loop_iteration_cpu_seconds_sum ").append(std::to_string(sumUs / 1e6)).append("\n");
+        _out.append("tgwss_loop_iteration_cpu_seconds_count ").append(std::to_string(cumulative)).append("\n");
+
+        _out.append("# HELP tgwss_relay_latency_seconds Time from message receive to write of the relayed message "
+                    "or the reply, by message type.\n"
+                    "# TYPE tgwss_relay_latency_seconds summary\n");
+        std::string maxValues;
+        for (std::size_t i = 0; i < LT_NUM; ++i) {
+            auto type = static_cast<latencyType_t>(i);
+            auto summary = latency(type);
+            for (std::size_t j = 0; j < m_quantiles.size(); ++j) {
+                _out.append("tgwss_relay_latency_seconds{type=\"").append(latencyTypeName(type))
+                        .append("\",quantile=\"").append(quantiles[j]).append("\"} ")
+                        .append(std::to_string(summary.quantilesUs[j] / 1e6)).append("\n");
+            }
+            _out.append("tgwss_relay_latency_seconds_sum{type=\"").append(latencyTypeName(type)).append("\"} ")
+                    .append(std::to_string(summary.sumUs / 1e6)).append("\n");
+            _out.append("tgwss_relay_latency_seconds_count{type=\"").append(latencyTypeName(type)).append("\"} ")
+                    .append(std::to_string(summary.count)).append("\n");
+            maxValues.append("tgwss_relay_latency_max_seconds{type=\"").append(latencyTypeName(type)).append("\"} ")
+                    .append(std::to_string(summary.maxUs / 1e6)).append("\n");
+        }
+        _out.append("# HELP tgwss_relay_latency_max_seconds Max time from message receive to write, by message type.\n"
+                    "# TYPE tgwss_relay_latency_max_seconds gauge\n").append(maxValues);
+    }
+} // namespace tgwss
@@ -0,0 +1,179 @@
+/**
+* @file wss/metrics.h
+* @brief lock free server counters, exported in Prometheus text format
+* @author Max Fomichev
+* @date 29.01.2020
+* @copyright Apache License v.2 (http://www.apache.org/licenses/LICENSE-2.0)
+*/
+
+#ifndef TGWSS_METRICS_H
+#define TGWSS_METRICS_H
+
+#include <ctime>
+#include <string>
+#include <vector>
+#include <array>
+#include <atomic>
+#include <memory>
+#include <chrono>
+
+namespace tgwss {
+    class frame_t;
+
+    // histogram of durations, bucket bounds are in microseconds
+    class histogram_t final {
+    public:
+        static const std::size_t m_bucketsNum = 12;
+        static const std::array<uint64_t, m_bucketsNum> m_bounds;
+
+    private:
+        std::array<std::atomic<uint64_t>, m_bucketsNum + 1> m_buckets {}; // the last one is +Inf
+        std::atomic<uint64_t> m_sumUs {0};
+
+    public:
+        void observe(uint64_t _us) noexcept;
+
+        uint64_t bucket(std::size_t _idx) const noexcept {return m_buckets[_idx].load(std::memory_order_relaxed);}
+        uint64_t sumUs() const noexcept {return m_sumUs.load(std::memory_order_relaxed);}
+    };
+
+    /**
+     * HdrHistogram-like log-linear histogram of durations (microseconds). Every power of two range is split
+     * into 16 linear buckets, so a value is counted with no more than 1/16 relative error.
+     * Values above 2^32 us (~71 min) are counted in the last bucket.
+     */
+    class hdrHistogram_t final {
+    public:
+        static const std::size_t m_subBucketsNum = 16;
+        // power of two ranges above the linear one, 2^4...2^31
+        static const std::size_t m_rangesNum = 28;
+        static const std::size_t m_bucketsNum = m_subBucketsNum * (m_rangesNum + 1);
+
+    private:
+        std::array<std::atomic<uint64_t>, m_bucketsNum> m_buckets {};
+        std::atomic<uint64_t> m_sumUs {0};
+        std::atomic<uint64_t> m_maxUs {0};
+
+    public:
+        void observe(uint64_t _us) noexcept;
+
+        uint64_t bucket(std::size_t _idx) const noexcept {return m_buckets[_idx].load(std::memory_order_relaxed);}
+        uint64_t sumUs() const noexcept {return m_sumUs.load(std::memory_order_relaxed);}
+        uint64_t maxUs() const noexcept {return m_maxUs.load(std::memory_order_relaxed);}
+        uint64_t count() const noexcept;
+
+        /// adds values of _other histogram to this one, _other may be updated by another thread meanwhile
+        void add(const hdrHistogram_t &_other) noexcept;
+        /// @returns the value _quantile (0...1) of values are not greater than, 0 if the histogram is empty
+        uint64_t quantile(double _quantile) const noexcept;
+
+        static std::size_t bucketIdx(uint64_t _us) noexcept;
+        /// @returns the highest value counted in the bucket
+        static uint64_t bucketMax(std::size_t _idx) noexcept;
+    };
+
+    // every lws service thread updates its own counters, so updates are never contended
+    class metrics_t final {
+    public:
+        enum relayType_t: std::size_t {
+            RT_OFFER,
+            RT_ANSWER,
+            RT_CANDIDATE,
+            RT_CALL,
+            RT_OTHER,
+            RT_NUM
+        };
+
+        enum closeReason_t: std::size_t {
+            CR_PEER,                    // close frame received from the peer
+            CR_INVALID_PAYLOAD,         // closed by the server, malformed or wrong messages
+            CR_POLICY_VIOLATION,        // closed by the server, write queue overflow
+            CR_UNEXPECTED_CONDITION,    // closed by the server, unexpected messages & internal errors
+            CR_NUM
+        };
+
+        // message types of the receive to write latency accounting
+        enum latencyType_t: std::size_t {
+            LT_LOGON,       // logon request -> logon status
+            LT_CALL,        // call request -> incoming call notification or call status
+            LT_OFFER,
+            LT_ANSWER,
+            LT_CANDIDATE,
+            LT_OTHER,
+            LT_NUM
+        };
+
+        struct latencySummary_t {
+            uint64_t count = 0;
+            uint64_t sumUs = 0;
+            uint64_t maxUs = 0;
+            // values of m_quantiles
+            std::array<uint64_t, 4> quantilesUs {};
+        };
+        static const std::array<double, 4> m_quantiles;
+
+        struct counters_t {
+            std::atomic<uint64_t> logons {0};
+            std::atomic<uint64_t> logonFailures {0};
+            std::atomic<uint64_t> parseFailures {0};
+            std::atomic<uint64_t> callsStarted {0};
+            std::atomic<uint64_t> callsEnded {0};
+            std::atomic<uint64_t> closedConnections {0};
+            std::array<std::atomic<uint64_t>, RT_NUM> relayedMsgs {};
+            std::array<std::atomic<uint64_t>, RT_NUM> relayedBytes {};
+            std::array<std::atomic<uint64_t>, CR_NUM> closeReasons {};
+            // service thread CPU time of an event loop iteration, waiting for events is not counted
+            histogram_t loopCpuTime;
+            // from LWS_CALLBACK_RECEIVE of a message to lws_write() of the relayed message or the reply,
+            // counted by the writing thread
+            std::array<hdrHistogram_t, LT_NUM> latency;
+        };
+
+    private:
+        std::vector<std::unique_ptr<counters_t>> m_counters;
+
+    public:
+        explicit metrics_t(std::size_t _threads);
+        ~metrics_t() = default;
+
+        metrics_t(const metrics_t &) = delete;
+        void operator=(const metrics_t &) = delete;
+        metrics_t(const metrics_t &&) = delete;
+        void operator=(const metrics_t &&) = delete;
+
+        counters_t &counters(std::size_t _thread) noexcept {return *m_counters[_thread];}
+
+        static void inc(std::atomic<uint64_t> &_counter, uint64_t _value = 1) noexcept {
+            _counter.fetch_add(_value, std::memory_order_relaxed);
+        }
+
+        /// cheap relayed message type guess, only the message head is inspected
+        static relayType_t relayType(const frame_t &_frame, bool _binary) noexcept;
+
+        static latencyType_t latencyType(relayType_t _relayType) noexcept;
+        static const char *latencyTypeName(latencyType_t _type) noexcept;
+        /// steady clock time (ns), frames are stamped with it on receive
+        static uint64_t now() noexcept {
+            return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                    std::chrono::steady_clock::now().time_since_epoch()).count());
+        }
+        /// CPU time of the calling thread (ns)
+        static uint64_t threadCpuNow() noexcept {
+            struct timespec ts {};
+            clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+            return static_cast<uint64_t>(ts.tv_sec) * 1000000000 + static_cast<uint64_t>(ts.tv_nsec);
+        }
+
+        /// latency histograms of all threads merged, quantiles are reported since the start
+        latencySummary_t latency(latencyType_t _type) const;
+
+        /// appends counters summed over all threads to _out
+        void render(std::string &_out) const;
+
+        /// appends metric header and value to _out
+        static void gauge(std::string &_out, const char *_name, const char *_help, uint64_t _value);
+        static void counter(std::string &_out, const char *_name, const char *_help, uint64_t _value);
+    };
+} // namespace tgwss
+
+#endif //TGWSS_METRICS_H
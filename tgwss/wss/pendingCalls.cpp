@@ -0,0 +1,89 @@
+/**
+* @file wss/pendingCalls.cpp
+* @brief call requests to offline tokens, parked until the callee logs on or the request expires
+* @author Max Fomichev
+* @date 29.01.2020
+* @copyright Apache License v.2 (http://www.apache.org/licenses/LICENSE-2.0)
+*/
+
+#include "pendingCalls.h"
+
+namespace tgwss {
+    void pendingCalls_t::park(const std::string &_callee, call_t _call, std::vector<call_t> &_dropped) {
+        std::unique_lock<std::mutex> lck(m_mtx);
+        // the caller's previous call is replaced
+        auto caller = m_callers.find(_call.caller);
+        if (caller != m_callers.end()) {
+            m_calls.erase(caller->second);
+            m_callers.erase(caller);
+        }
+        auto i = m_calls.find(_callee);
+        if (i != m_calls.end()) {
+            m_callers.erase(i->second.caller);
+            _dropped.emplace_back(std::move(i->second));
+            m_calls.erase(i);
+        }
+
+        auto callerLws = _call.caller;
+        m_calls.emplace(_callee, std::move(_call));
+        try {
+            m_callers.emplace(callerLws, _callee);
+        } catch (...) {
+            m_calls.erase(_callee);
+            m_size = m_calls.size();
+            throw;
+        }
+        m_size = m_calls.size();
+        ++m_stats.parked;
+    }
+
+    bool pendingCalls_t::take(const std::string &_callee, call_t &_call) {
+        if (m_size == 0) {
+            return false;
+        }
+        std::unique_lock<std::mutex> lck(m_mtx);
+        auto i = m_calls.find(_callee);
+        if (i == m_calls.end()) {
+            return false;
+        }
+        _call = std::move(i->second);
+        m_callers.erase(_call.caller);
+        m_calls.erase(i);
+        m_size = m_calls.size();
+        ++m_stats.delivered;
+
+        return true;
+    }
+
+    void pendingCalls_t::cancel(const struct lws *_caller) noexcept {
+        if (m_size == 0) {
+            return;
+        }
+        std::unique_lock<std::mutex> lck(m_mtx);
+        auto caller = m_callers.find(_caller);
+        if (caller == m_callers.end()) {
+            return;
+        }
+        m_calls.erase(caller->second);
+        m_callers.erase(caller);
+        m_size = m_calls.size();
+    }
+
+    void pendingCalls_t::expire(std::chrono::steady_clock::time_point _now, std::vector<call_t> &_expired) {
+        if (m_size == 0) {
+            return;
+        }
+        std::unique_lock<std::mutex> lck(m_mtx);
+        for (auto i = m_calls.begin(); i != m_calls.end();) {
+            if (i->second.expires > _now) {
+                ++i;
+                continue;
+            }
+            m_callers.erase(i->second.caller);
+            _expired.emplace_back(std::move(i->second));
+            i = m_calls.erase(i);
+            ++m_stats.expired;
+        }
+        m_size = m_calls.size();
+    }
+} // namespace tgwss
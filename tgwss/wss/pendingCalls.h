@@ -0,0 +1,79 @@
+/**
+* @file wss/pendingCalls.h
+* @brief call requests to offline tokens, parked until the callee logs on or the request expires
+* @author Max Fomichev
+* @date 29.01.2020
+* @copyright Apache License v.2 (http://www.apache.org/licenses/LICENSE-2.0)
+*/
+
+#ifndef TGWSS_PENDINGCALLS_H
+#define TGWSS_PENDINGCALLS_H
+
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+
+struct lws;
+
+namespace tgwss {
+    // one call is pending per callee token (the latest one, as a call to an online peer drops its previous
+    // call) and per caller
+    class pendingCalls_t final {
+    public:
+        struct call_t {
+            struct lws *caller = nullptr;
+            std::size_t callerShard = 0;
+            // connection id of caller
+            uint64_t callerId = 0;
+            std::string callerToken;
+            // the caller's subprotocol
+            bool binary = false;
+            // receive time of the call request
+            uint64_t rxTime = 0;
+            std::chrono::steady_clock::time_point expires;
+        };
+
+        struct stats_t {
+            std::atomic<uint64_t> parked {0};
+            std::atomic<uint64_t> delivered {0};
+            std::atomic<uint64_t> expired {0};
+        };
+
+    private:
+        std::mutex m_mtx;
+        // callee token -> call
+        std::unordered_map<std::string, call_t> m_calls;
+        // caller -> callee token
+        std::unordered_map<const struct lws *, std::string> m_callers;
+        std::atomic<std::size_t> m_size {0};
+
+        stats_t m_stats;
+
+    public:
+        pendingCalls_t() = default;
+        ~pendingCalls_t() = default;
+
+        pendingCalls_t(const pendingCalls_t &) = delete;
+        void operator=(const pendingCalls_t &) = delete;
+        pendingCalls_t(const pendingCalls_t &&) = delete;
+        void operator=(const pendingCalls_t &&) = delete;
+
+        /// parks _call to _callee, replaces the previous call of the caller, the previous call to _callee
+        /// (of another caller) is moved to _dropped
+        void park(const std::string &_callee, call_t _call, std::vector<call_t> &_dropped);
+        /// @returns false if no call to _callee is pending
+        bool take(const std::string &_callee, call_t &_call);
+        /// drops the call of _caller, if any
+        void cancel(const struct lws *_caller) noexcept;
+        /// moves the calls expired by _now to _expired
+        void expire(std::chrono::steady_clock::time_point _now, std::vector<call_t> &_expired);
+
+        std::size_t size() const noexcept {return m_size;}
+        const stats_t &stats() const noexcept {return m_stats;}
+    };
+} // namespace tgwss
+
+#endif //TGWSS_PENDINGCALLS_H
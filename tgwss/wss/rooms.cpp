@@ -0,0 +1,95 @@
+/**
+* @file wss/rooms.cpp
+* @brief group call rooms, members of a room get the messages of each other
+* @author Max Fomichev
+* @date 29.01.2020
+* @copyright Apache License v.2 (http://www.apache.org/licenses/LICENSE-2.0)
+*/
+
+#include <algorithm>
+
+#include "rooms.h"
+
+namespace tgwss {
+    bool rooms_t::join(const std::string &_room, const member_t &_member, std::size_t _sizeLimit,
+                       members_t &_members) {
+        std::unique_lock<std::mutex> lck(m_mtx);
+        auto &room = m_rooms[_room];
+        std::size_t size = room ? room->size() : 0;
+        if (size >= _sizeLimit) {
+            if (size == 0) {
+                m_rooms.erase(_room);
+            }
+            return false;
+        }
+
+        // the fan-out of a message in progress keeps the list it has taken
+        auto members = std::make_shared<std::vector<member_t>>();
+        members->reserve(size + 1);
+        if (room) {
+            members->assign(room->begin(), room->end());
+        }
+        auto pos = std::upper_bound(members->begin(), members->end(), _member.shard,
+                                    [](std::size_t _shard, const member_t &_i) {return _shard < _i.shard;});
+        members->insert(pos, _member);
+        try {
+            m_membership.emplace(_member.lws, _room);
+        } catch (...) {
+            if (!room) {
+                m_rooms.erase(_room);
+            }
+            throw;
+        }
+        room = std::move(members);
+        _members = room;
+
+        m_size = m_rooms.size();
+        ++m_members;
+        return true;
+    }
+
+    void rooms_t::leave(const struct lws *_lws, members_t &_members) {
+        _members.reset();
+        if (m_members == 0) {
+            return;
+        }
+        std::unique_lock<std::mutex> lck(m_mtx);
+        auto membership = m_membership.find(_lws);
+        if (membership == m_membership.end()) {
+            return;
+        }
+        auto room = m_rooms.find(membership->second);
+        if (room != m_rooms.end()) {
+            if (room->second->size() <= 1) {
+                m_rooms.erase(room);
+            } else {
+                auto members = std::make_shared<std::vector<member_t>>();
+                members->reserve(room->second->size() - 1);
+                for (const auto &i:*room->second) {
+                    if (i.lws != _lws) {
+                        members->push_back(i);
+                    }
+                }
+                room->second = std::move(members);
+                _members = room->second;
+            }
+        }
+        m_membership.erase(membership);
+
+        m_size = m_rooms.size();
+        --m_members;
+    }
+
+    rooms_t::members_t rooms_t::members(const struct lws *_lws) {
+        if (m_members == 0) {
+            return members_t();
+        }
+        std::unique_lock<std::mutex> lck(m_mtx);
+        auto membership = m_membership.find(_lws);
+        if (membership == m_membership.end()) {
+            return members_t();
+        }
+        auto room = m_rooms.find(membership->second);
+        return (room != m_rooms.end()) ? room->second : members_t();
+    }
+} // namespace tgwss
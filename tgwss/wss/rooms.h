@@ -0,0 +1,79 @@
+/**
+* @file wss/rooms.h
+* @brief group call rooms, members of a room get the messages of each other
+* @author Max Fomichev
+* @date 29.01.2020
+* @copyright Apache License v.2 (http://www.apache.org/licenses/LICENSE-2.0)
+*/
+
+#ifndef TGWSS_ROOMS_H
+#define TGWSS_ROOMS_H
+
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <mutex>
+#include <atomic>
+#include <memory>
+
+struct lws;
+
+namespace tgwss {
+    // a peer is a member of one room at most. The members list of a room is immutable, join & leave replace it,
+    // so a message is fanned out over a snapshot without holding the lock
+    class rooms_t final {
+    public:
+        struct member_t {
+            struct lws *lws = nullptr;
+            std::size_t shard = 0;
+            // connection id of lws
+            uint64_t id = 0;
+            // the member's subprotocol
+            bool binary = false;
+        };
+        // ordered by shard, the members of one service thread are adjacent
+        using members_t = std::shared_ptr<const std::vector<member_t>>;
+
+        struct stats_t {
+            // messages fanned out, deliveries to members & frames they took
+            std::atomic<uint64_t> messages {0};
+            std::atomic<uint64_t> deliveries {0};
+            std::atomic<uint64_t> frames {0};
+        };
+
+    private:
+        std::mutex m_mtx;
+        // room name -> members
+        std::unordered_map<std::string, members_t> m_rooms;
+        // member -> room name
+        std::unordered_map<const struct lws *, std::string> m_membership;
+        std::atomic<std::size_t> m_size {0};
+        std::atomic<std::size_t> m_members {0};
+
+        stats_t m_stats;
+
+    public:
+        rooms_t() = default;
+        ~rooms_t() = default;
+
+        rooms_t(const rooms_t &) = delete;
+        void operator=(const rooms_t &) = delete;
+        rooms_t(const rooms_t &&) = delete;
+        void operator=(const rooms_t &&) = delete;
+
+        /// adds _member (which is not a member of any room) to _room, @returns false if the room has _sizeLimit
+        /// members already, _members is set to the members after join
+        bool join(const std::string &_room, const member_t &_member, std::size_t _sizeLimit, members_t &_members);
+        /// removes _lws from its room, _members is set to the members left, empty if _lws is not a member
+        void leave(const struct lws *_lws, members_t &_members);
+        /// @returns the members of the room of _lws, empty if _lws is not a member
+        members_t members(const struct lws *_lws);
+
+        std::size_t size() const noexcept {return m_size;}
+        std::size_t membersNum() const noexcept {return m_members;}
+        stats_t &stats() noexcept {return m_stats;}
+        const stats_t &stats() const noexcept {return m_stats;}
+    };
+} // namespace tgwss
+
+#endif //TGWSS_ROOMS_H
@@ -0,0 +1,95 @@
+/**
+* @file wss/slabPool.h
+* @brief fixed-size objects allocated from slabs, for per-connection state of many connections
+* @author Max Fomichev
+* @date 29.01.2020
+* @copyright Apache License v.2 (http://www.apache.org/licenses/LICENSE-2.0)
+*/
+
+#ifndef TGWSS_SLABPOOL_H
+#define TGWSS_SLABPOOL_H
+
+#include <new>
+#include <memory>
+#include <vector>
+#include <atomic>
+#include <utility>
+#include <type_traits>
+
+namespace tgwss {
+    /**
+     * Objects are placed in slabs of _slabSize slots, freed slots are linked into a free list and reused.
+     * Slabs are kept till the pool is destroyed. Not thread safe, objects are created & destroyed
+     * by one thread (the stats may be read by any).
+     */
+    template<typename T, std::size_t _slabSize = 256>
+    class slabPool_t final {
+    private:
+        union slot_t {
+            slot_t *next;
+            typename std::aligned_storage<sizeof(T), alignof(T)>::type obj;
+        };
+
+        std::vector<std::unique_ptr<slot_t[]>> m_slabs;
+        slot_t *m_free = nullptr;
+        std::atomic<std::size_t> m_used {0};
+        std::atomic<std::size_t> m_capacity {0};
+
+    public:
+        static const std::size_t slotSize = sizeof(slot_t);
+
+        slabPool_t() = default;
+        /// objects still in use must be destroyed before
+        ~slabPool_t() = default;
+
+        slabPool_t(const slabPool_t &) = delete;
+        void operator=(const slabPool_t &) = delete;
+        slabPool_t(const slabPool_t &&) = delete;
+        void operator=(const slabPool_t &&) = delete;
+
+        template<typename... args_t>
+        T *create(args_t &&... _args) {
+            if (m_free == nullptr) {
+                grow();
+            }
+            slot_t *slot = m_free;
+            slot_t *next = slot->next;
+            T *obj;
+            try {
+                obj = new(&slot->obj) T(std::forward<args_t>(_args)...);
+            } catch (...) {
+                slot->next = next;
+                throw;
+            }
+            m_free = next;
+            ++m_used;
+
+            return obj;
+        }
+
+        void destroy(T *_obj) noexcept {
+            _obj->~T();
+            auto slot = reinterpret_cast<slot_t *>(_obj);
+            slot->next = m_free;
+            m_free = slot;
+            --m_used;
+        }
+
+        std::size_t used() const noexcept {return m_used;}
+        /// @returns memory allocated for the slots
+        std::size_t bytes() const noexcept {return m_capacity * sizeof(slot_t);}
+
+    private:
+        void grow() {
+            std::unique_ptr<slot_t[]> slab(new slot_t[_slabSize]);
+            for (std::size_t i = 0; i < _slabSize; ++i) {
+                slab[i].next = (i + 1 < _slabSize) ? &slab[i + 1] : m_free;
+            }
+            m_slabs.emplace_back(std::move(slab));
+            m_free = m_slabs.back().get();
+            m_capacity += _slabSize;
+        }
+    };
+} // namespace tgwss
+
+#endif //TGWSS_SLABPOOL_H
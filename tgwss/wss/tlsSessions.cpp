@@ -0,0 +1,269 @@
+/**
+* @file wss/tlsSessions.cpp
+* @brief tgwss TLS session resumption, kernel TLS & handshake accounting
+* @author Max Fomichev
+* @date 29.01.2020
+* @copyright Apache License v.2 (http://www.apache.org/licenses/LICENSE-2.0)
+*/
+
+#include <ctime>
+#include <cstring>
+#include <new>
+#include <stdexcept>
+
+#include <openssl/rand.h>
+#include <openssl/crypto.h>
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+#include <openssl/core_names.h>
+#include <openssl/params.h>
+#endif
+
+#include "tlsSessions.h"
+
+namespace tgwss {
+    // handshake state of a connection, kept in its SSL object
+    struct handshake_t {
+        uint64_t cpuNs = 0;
+        // thread CPU time when the current SSL_accept() call has started processing handshake data
+        uint64_t started = 0;
+        bool inCall = false;
+        bool done = false;
+    };
+
+    static void freeHandshake(void *, void *_ptr, CRYPTO_EX_DATA *, int, long, void *) {
+        delete static_cast<handshake_t *>(_ptr);
+    }
+
+    static int ctxIndex() noexcept {
+        static int idx = SSL_CTX_get_ex_new_index(0, nullptr, nullptr, nullptr, nullptr);
+        return idx;
+    }
+
+    static int sslIndex() noexcept {
+        static int idx = SSL_get_ex_new_index(0, nullptr, nullptr, nullptr, freeHandshake);
+        return idx;
+    }
+
+    static uint64_t threadCpuNs() noexcept {
+        struct timespec ts {};
+        clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+        return static_cast<uint64_t>(ts.tv_sec) * 1000000000 + static_cast<uint64_t>(ts.tv_nsec);
+    }
+
+    static handshake_t *handshake(const SSL *_ssl) noexcept {
+        auto state = static_cast<handshake_t *>(SSL_get_ex_data(_ssl, sslIndex()));
+        if (state == nullptr) {
+            state = new(std::nothrow) handshake_t;
+            if ((state != nullptr) && (SSL_set_ex_data(const_cast<SSL *>(_ssl), sslIndex(), state) != 1)) {
+                delete state;
+                state = nullptr;
+            }
+        }
+
+        return state;
+    }
+
+    // handshake CPU time is accounted from the moment a handshake message is received (or the handshake
+    // is started) till SSL_accept() returns, time spent waiting for the client is excluded
+    static void handshakeEnter(handshake_t &_state) noexcept {
+        if (!_state.inCall) {
+            _state.inCall = true;
+            _state.started = threadCpuNs();
+        }
+    }
+
+    static void handshakeLeave(handshake_t &_state) noexcept {
+        if (_state.inCall) {
+            _state.inCall = false;
+            _state.cpuNs += threadCpuNs() - _state.started;
+        }
+    }
+
+    tlsSessions_t::tlsSessions_t(uint32_t _cacheSize, uint32_t _lifetime, bool _tickets, uint32_t _keyRotation,
+                                 bool _ktls):
+            m_cacheSize(_cacheSize), m_lifetime(_lifetime), m_tickets(_tickets), m_keyRotation(_keyRotation),
+            m_ktls(_ktls) {
+        if ((ctxIndex() < 0) || (sslIndex() < 0)) {
+            throw std::runtime_error("tlsSessions: failed to allocate SSL ex data indexes");
+        }
+        if (m_tickets && !newKey(m_keys[0])) {
+            throw std::runtime_error("tlsSessions: failed to generate session ticket key");
+        }
+    }
+
+    tlsSessions_t::~tlsSessions_t() {
+        OPENSSL_cleanse(m_keys, sizeof(m_keys));
+    }
+
+    bool tlsSessions_t::init(SSL_CTX *_sslCtx) noexcept {
+        SSL_CTX_set_ex_data(_sslCtx, ctxIndex(), this);
+
+        static const unsigned char sessionIdContext[] = "tgwss";
+        SSL_CTX_set_session_id_context(_sslCtx, sessionIdContext, sizeof(sessionIdContext) - 1);
+        SSL_CTX_set_timeout(_sslCtx, static_cast<long>(m_lifetime));
+        if (m_cacheSize > 0) {
+            SSL_CTX_set_session_cache_mode(_sslCtx, SSL_SESS_CACHE_SERVER);
+            SSL_CTX_sess_set_cache_size(_sslCtx, static_cast<long>(m_cacheSize));
+        } else {
+            SSL_CTX_set_session_cache_mode(_sslCtx, SSL_SESS_CACHE_OFF);
+        }
+        if (m_tickets) {
+            SSL_CTX_clear_options(_sslCtx, SSL_OP_NO_TICKET);
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+            SSL_CTX_set_tlsext_ticket_key_evp_cb(_sslCtx, tlsSessions_t::ticketKeyCallback);
+#else
+            SSL_CTX_set_tlsext_ticket_key_cb(_sslCtx, tlsSessions_t::ticketKeyCallback);
+#endif
+        } else {
+            SSL_CTX_set_options(_sslCtx, SSL_OP_NO_TICKET);
+        }
+
+        SSL_CTX_set_info_callback(_sslCtx, tlsSessions_t::infoCallback);
+        SSL_CTX_set_msg_callback(_sslCtx, tlsSessions_t::msgCallback);
+
+        if (m_ktls) {
+#if defined(SSL_OP_ENABLE_KTLS) && !defined(OPENSSL_NO_KTLS)
+            // OpenSSL falls back to user space encryption if the kernel or the cipher doesn't support it
+            SSL_CTX_set_options(_sslCtx, SSL_OP_ENABLE_KTLS);
+#else
+            return false;
+#endif
+        }
+
+        return true;
+    }
+
+    void tlsSessions_t::msgCallback(int _writeP, int, int _contentType, const void *, size_t, SSL *_ssl, void *) {
+        if ((_writeP != 0) || (_contentType != SSL3_RT_HANDSHAKE)) {
+            return;
+        }
+        auto state = handshake(_ssl);
+        if ((state != nullptr) && !state->done) {
+            handshakeEnter(*state);
+        }
+    }
+
+    void tlsSessions_t::infoCallback(const SSL *_ssl, int _where, int) {
+        if ((_where & (SSL_CB_HANDSHAKE_START | SSL_CB_HANDSHAKE_DONE | SSL_CB_EXIT)) == 0) {
+            return;
+        }
+        auto state = handshake(_ssl);
+        if ((state == nullptr) || state->done) {
+            return;
+        }
+
+        if ((_where & SSL_CB_HANDSHAKE_START) != 0) {
+            handshakeEnter(*state);
+        } else if ((_where & SSL_CB_HANDSHAKE_DONE) != 0) {
+            handshakeLeave(*state);
+            state->done = true;
+            auto tlsSessions = static_cast<tlsSessions_t *>(SSL_CTX_get_ex_data(SSL_get_SSL_CTX(_ssl), ctxIndex()));
+            if (tlsSessions != nullptr) {
+                tlsSessions->handshakeDone(_ssl, state->cpuNs);
+            }
+        } else {
+            // SSL_accept() returns, it's waiting for more data
+            handshakeLeave(*state);
+        }
+    }
+
+    void tlsSessions_t::handshakeDone(const SSL *_ssl, uint64_t _cpuNs) noexcept {
+        if (SSL_session_reused(const_cast<SSL *>(_ssl)) != 0) {
+            ++m_stats.resumedHandshakes;
+        } else {
+            ++m_stats.fullHandshakes;
+        }
+        m_stats.handshakeCpuNs += _cpuNs;
+#if defined(BIO_get_ktls_send)
+        if (m_ktls && (BIO_get_ktls_send(SSL_get_wbio(_ssl)) > 0)) {
+            ++m_stats.ktlsConnections;
+        }
+#endif
+        // records are not accounted anymore
+        SSL_set_msg_callback(const_cast<SSL *>(_ssl), nullptr);
+    }
+
+    bool tlsSessions_t::newKey(ticketKey_t &_key) noexcept {
+        if ((RAND_bytes(_key.name, sizeof(_key.name)) != 1) ||
+            (RAND_bytes(_key.aesKey, sizeof(_key.aesKey)) != 1) ||
+            (RAND_bytes(_key.hmacKey, sizeof(_key.hmacKey)) != 1)) {
+            return false;
+        }
+        _key.created = std::chrono::steady_clock::now();
+
+        return true;
+    }
+
+    bool tlsSessions_t::rotate() noexcept {
+        auto age = std::chrono::steady_clock::now() - m_keys[0].created;
+        if (age < std::chrono::seconds(m_keyRotation)) {
+            return true;
+        }
+        ticketKey_t key {};
+        if (!newKey(key)) {
+            return false;
+        }
+        m_keys[1] = m_keys[0];
+        m_keys[0] = key;
+        // tickets of a key expired more than a period ago are not accepted
+        m_previousKey = (age < std::chrono::seconds(m_keyRotation) * 2);
+        ++m_stats.keyRotations;
+
+        return true;
+    }
+
+    bool tlsSessions_t::hmacInit(macCtx_t *_macCtx, const ticketKey_t &_key) noexcept {
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+        OSSL_PARAM params[3];
+        params[0] = OSSL_PARAM_construct_octet_string(OSSL_MAC_PARAM_KEY, const_cast<unsigned char *>(_key.hmacKey),
+                                                      sizeof(_key.hmacKey));
+        params[1] = OSSL_PARAM_construct_utf8_string(OSSL_MAC_PARAM_DIGEST, const_cast<char *>("SHA256"), 0);
+        params[2] = OSSL_PARAM_construct_end();
+
+        return EVP_MAC_CTX_set_params(_macCtx, params) == 1;
+#else
+        return HMAC_Init_ex(_macCtx, _key.hmacKey, sizeof(_key.hmacKey), EVP_sha256(), nullptr) == 1;
+#endif
+    }
+
+    int tlsSessions_t::ticketKeyCallback(SSL *_ssl, unsigned char *_name, unsigned char *_iv,
+                                         EVP_CIPHER_CTX *_cipherCtx, macCtx_t *_macCtx, int _enc) {
+        auto tlsSessions = static_cast<tlsSessions_t *>(SSL_CTX_get_ex_data(SSL_get_SSL_CTX(_ssl), ctxIndex()));
+        if (tlsSessions == nullptr) {
+            return -1;
+        }
+        std::unique_lock<std::mutex> lck(tlsSessions->m_keysMtx);
+        if (!tlsSessions->rotate()) {
+            return -1;
+        }
+
+        if (_enc == 1) {
+            const auto &key = tlsSessions->m_keys[0];
+            if (RAND_bytes(_iv, EVP_CIPHER_iv_length(EVP_aes_256_cbc())) != 1) {
+                return -1;
+            }
+            std::memcpy(_name, key.name, sizeof(key.name));
+            if ((EVP_EncryptInit_ex(_cipherCtx, EVP_aes_256_cbc(), nullptr, key.aesKey, _iv) != 1) ||
+                !hmacInit(_macCtx, key)) {
+                return -1;
+            }
+            return 1;
+        }
+
+        for (std::size_t i = 0; i < (tlsSessions->m_previousKey ? 2 : 1); ++i) {
+            const auto &key = tlsSessions->m_keys[i];
+            if (std::memcmp(_name, key.name, sizeof(key.name)) != 0) {
+                continue;
+            }
+            if ((EVP_DecryptInit_ex(_cipherCtx, EVP_aes_256_cbc(), nullptr, key.aesKey, _iv) != 1) ||
+                !hmacInit(_macCtx, key)) {
+                return -1;
+            }
+            // a ticket of the previous key is accepted & renewed with the current one
+            return (i == 0) ? 1 : 2;
+        }
+
+        // unknown key, full handshake
+        return 0;
+    }
+} // namespace tgwss
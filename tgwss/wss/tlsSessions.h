@@ -0,0 +1,96 @@
+/**
+* @file wss/tlsSessions.h
+* @brief tgwss TLS session resumption, kernel TLS & handshake accounting
+* @author Max Fomichev
+* @date 29.01.2020
+* @copyright Apache License v.2 (http://www.apache.org/licenses/LICENSE-2.0)
+*/
+
+#ifndef TGWSS_TLSSESSIONS_H
+#define TGWSS_TLSSESSIONS_H
+
+#include <atomic>
+#include <mutex>
+#include <chrono>
+
+#include <openssl/ssl.h>
+#include <openssl/evp.h>
+#if OPENSSL_VERSION_NUMBER < 0x30000000L
+#include <openssl/hmac.h>
+#endif
+
+namespace tgwss {
+    /**
+     * Sets up the SSL context of the websocket vhost: server side session cache, session tickets encrypted by
+     * keys rotated every key rotation period (tickets of the previous key are still accepted and renewed)
+     * and optional kernel TLS. Counts full & resumed handshakes and CPU time spent in them.
+     */
+    class tlsSessions_t final {
+    public:
+        struct stats_t {
+            std::atomic<uint64_t> fullHandshakes {0};
+            std::atomic<uint64_t> resumedHandshakes {0};
+            // service threads CPU time spent in handshakes
+            std::atomic<uint64_t> handshakeCpuNs {0};
+            // connections with kernel TLS record encryption
+            std::atomic<uint64_t> ktlsConnections {0};
+            std::atomic<uint64_t> keyRotations {0};
+        };
+
+    private:
+        // HMAC context of session tickets
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+        using macCtx_t = EVP_MAC_CTX;
+#else
+        using macCtx_t = HMAC_CTX;
+#endif
+
+        struct ticketKey_t {
+            unsigned char name[16];
+            unsigned char aesKey[32];
+            unsigned char hmacKey[32];
+            std::chrono::steady_clock::time_point created;
+        };
+
+        const uint32_t m_cacheSize;
+        const uint32_t m_lifetime;
+        const bool m_tickets;
+        const uint32_t m_keyRotation;
+        const bool m_ktls;
+
+        // the current & the previous ticket keys
+        std::mutex m_keysMtx;
+        ticketKey_t m_keys[2] {};
+        bool m_previousKey = false;
+
+        stats_t m_stats;
+
+    public:
+        /// @throws std::runtime_error
+        tlsSessions_t(uint32_t _cacheSize, uint32_t _lifetime, bool _tickets, uint32_t _keyRotation, bool _ktls);
+        ~tlsSessions_t();
+
+        tlsSessions_t(const tlsSessions_t &) = delete;
+        void operator=(const tlsSessions_t &) = delete;
+        tlsSessions_t(const tlsSessions_t &&) = delete;
+        void operator=(const tlsSessions_t &&) = delete;
+
+        /// sets up _sslCtx, @returns false if kernel TLS is requested but not supported by OpenSSL
+        bool init(SSL_CTX *_sslCtx) noexcept;
+        const stats_t &stats() const noexcept {return m_stats;}
+
+    private:
+        static void infoCallback(const SSL *_ssl, int _where, int _ret);
+        static void msgCallback(int _writeP, int _version, int _contentType, const void *_buf, size_t _len,
+                                SSL *_ssl, void *_arg);
+        static int ticketKeyCallback(SSL *_ssl, unsigned char *_name, unsigned char *_iv,
+                                     EVP_CIPHER_CTX *_cipherCtx, macCtx_t *_macCtx, int _enc);
+        static bool hmacInit(macCtx_t *_macCtx, const ticketKey_t &_key) noexcept;
+        static bool newKey(ticketKey_t &_key) noexcept;
+        /// rotates the keys if the current one is expired, m_keysMtx must be held
+        bool rotate() noexcept;
+        void handshakeDone(const SSL *_ssl, uint64_t _cpuNs) noexcept;
+    };
+} // namespace tgwss
+
+#endif //TGWSS_TLSSESSIONS_H
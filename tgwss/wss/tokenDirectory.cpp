@@ -0,0 +1,64 @@
+/**
+* @file wss/tokenDirectory.cpp
+* @brief token -> peer index, shared by all lws service threads
+* @author Max Fomichev
+* @date 29.01.2020
+* @copyright Apache License v.2 (http://www.apache.org/licenses/LICENSE-2.0)
+*/
+
+#include "tokenDirectory.h"
+
+namespace tgwss {
+    void tokenDirectory_t::reserve(std::size_t _size) {
+        for (auto &i:m_stripes) {
+            std::unique_lock<std::mutex> lck(i.mtx);
+            i.entries.reserve(_size / m_stripesNum + 1);
+        }
+    }
+
+    bool tokenDirectory_t::insert(const std::string &_token, const entry_t &_entry) {
+        auto &s = stripe(_token);
+        std::unique_lock<std::mutex> lck(s.mtx);
+        if (!s.entries.emplace(_token, _entry).second) {
+            return false;
+        }
+        ++m_size;
+
+        return true;
+    }
+
+    bool tokenDirectory_t::remove(const std::string &_token, const struct lws *_lws) noexcept {
+        auto &s = stripe(_token);
+        std::unique_lock<std::mutex> lck(s.mtx);
+        auto i = s.entries.find(_token);
+        if ((i == s.entries.end()) || (i->second.lws != _lws)) {
+            return false;
+        }
+        s.entries.erase(i);
+        --m_size;
+
+        return true;
+    }
+
+    bool tokenDirectory_t::find(const std::string &_token, entry_t &_entry) {
+        auto &s = stripe(_token);
+        std::unique_lock<std::mutex> lck(s.mtx);
+        auto i = s.entries.find(_token);
+        if (i == s.entries.end()) {
+            return false;
+        }
+        _entry = i->second;
+
+        return true;
+    }
+
+    void tokenDirectory_t::tokens(std::vector<std::string> &_tokens) {
+        _tokens.reserve(_tokens.size() + m_size);
+        for (auto &i:m_stripes) {
+            std::unique_lock<std::mutex> lck(i.mtx);
+            for (const auto &j:i.entries) {
+                _tokens.emplace_back(j.first);
+            }
+        }
+    }
+} // namespace tgwss
@@ -0,0 +1,78 @@
+/**
+* @file wss/tokenDirectory.h
+* @brief token -> peer index, shared by all lws service threads
+* @author Max Fomichev
+* @date 29.01.2020
+* @copyright Apache License v.2 (http://www.apache.org/licenses/LICENSE-2.0)
+*/
+
+#ifndef TGWSS_TOKENDIRECTORY_H
+#define TGWSS_TOKENDIRECTORY_H
+
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <mutex>
+#include <atomic>
+#include <array>
+
+struct lws;
+
+namespace tgwss {
+    class tokenDirectory_t final {
+    public:
+        struct entry_t {
+            struct lws *lws = nullptr;
+            std::size_t shard = 0;
+            // connection id of lws
+            uint64_t id = 0;
+            // the peer's subprotocol
+            bool binary = false;
+        };
+
+    private:
+        // lock striping, the stripe is selected by token hash
+        static const std::size_t m_stripesNum = 64;
+
+        struct stripe_t {
+            std::mutex mtx;
+            std::unordered_map<std::string, entry_t> entries;
+        };
+        std::array<stripe_t, m_stripesNum> m_stripes;
+        std::atomic<std::size_t> m_size {0};
+
+    public:
+        tokenDirectory_t() = default;
+        ~tokenDirectory_t() = default;
+
+        tokenDirectory_t(const tokenDirectory_t &) = delete;
+        void operator=(const tokenDirectory_t &) = delete;
+        tokenDirectory_t(const tokenDirectory_t &&) = delete;
+        void operator=(const tokenDirectory_t &&) = delete;
+
+        /// preallocates buckets for _size tokens
+        void reserve(std::size_t _size);
+
+        /// @returns false if _token is already online
+        bool insert(const std::string &_token, const entry_t &_entry);
+        /// removes _token if it is still owned by _lws
+        bool remove(const std::string &_token, const struct lws *_lws) noexcept;
+        bool find(const std::string &_token, entry_t &_entry);
+        bool online(const std::string &_token) {
+            entry_t entry;
+            return find(_token, entry);
+        }
+
+        /// appends all the online tokens to _tokens
+        void tokens(std::vector<std::string> &_tokens);
+
+        std::size_t size() const noexcept {return m_size;}
+
+    private:
+        stripe_t &stripe(const std::string &_token) {
+            return m_stripes[std::hash<std::string>()(_token) % m_stripesNum];
+        }
+    };
+} // namespace tgwss
+
+#endif //TGWSS_TOKENDIRECTORY_H
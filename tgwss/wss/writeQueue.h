@@ -0,0 +1,121 @@
+/**
+* @file wss/writeQueue.h
+* @brief per-peer bounded queue of outgoing frames
+* @author Max Fomichev
+* @date 29.01.2020
+* @copyright Apache License v.2 (http://www.apache.org/licenses/LICENSE-2.0)
+*/
+
+#ifndef TGWSS_WRITEQUEUE_H
+#define TGWSS_WRITEQUEUE_H
+
+#include <memory>
+
+#include "frameBuffer.h"
+
+namespace tgwss {
+    // bounded ring buffer, a couple of frames are kept in place; when more frames are queued the ring moves to
+    // the heap and grows by doubling up to the limit. The storage outlives the drain, so the bursts of a call
+    // (an SDP & its ICE candidates) allocate only while the ring grows, it's released by trim() of an idle queue
+    class writeQueue_t final {
+    private:
+        static const uint32_t m_inlineCapacity = 2;
+        static const uint32_t m_minRingCapacity = 8;
+
+        framePtr_t m_inline[m_inlineCapacity];
+        std::unique_ptr<framePtr_t[]> m_ring;
+        uint32_t m_ringCapacity = 0;
+        uint32_t m_limit;
+        uint32_t m_head = 0;
+        uint32_t m_size = 0;
+        std::size_t m_bytes = 0;
+        // a frame is pushed since the previous trim()
+        bool m_pushed = false;
+
+    public:
+        explicit writeQueue_t(uint32_t _limit): m_limit(_limit) {}
+
+        writeQueue_t(const writeQueue_t &) = delete;
+        void operator=(const writeQueue_t &) = delete;
+        writeQueue_t(const writeQueue_t &&) = delete;
+        void operator=(const writeQueue_t &&) = delete;
+
+        bool empty() const noexcept {return m_size == 0;}
+        bool full() const noexcept {return m_size >= m_limit;}
+        uint32_t size() const noexcept {return m_size;}
+        std::size_t bytes() const noexcept {return m_bytes;}
+
+        /// sets the max number of queued frames (reloaded queue_msg_limit), frames queued above a lowered limit
+        /// are kept, the next push is refused until the queue is below it
+        void limit(uint32_t _limit) noexcept {m_limit = _limit;}
+
+        /// releases the heap ring if the queue has stayed empty since the previous call, called periodically
+        /// @returns the released bytes
+        std::size_t trim() noexcept {
+            std::size_t released = 0;
+            if (m_ring && (m_size == 0) && !m_pushed) {
+                released = m_ringCapacity * sizeof(framePtr_t);
+                m_ring.reset();
+                m_ringCapacity = 0;
+                m_head = 0;
+            }
+            m_pushed = false;
+            return released;
+        }
+
+        /// @returns false if the queue is full
+        bool push(framePtr_t _frame) {
+            if (full()) {
+                return false;
+            }
+            if (m_size == slotsNum()) {
+                grow();
+            }
+            m_bytes += _frame->size();
+            m_pushed = true;
+            slots()[(m_head + m_size) % slotsNum()] = std::move(_frame);
+            ++m_size;
+            return true;
+        }
+
+        framePtr_t pop() noexcept {
+            framePtr_t frame = std::move(slots()[m_head]);
+            m_head = (m_head + 1) % slotsNum();
+            --m_size;
+            m_bytes -= frame->size();
+            if (m_size == 0) {
+                m_head = 0;
+            }
+            return frame;
+        }
+
+        void clear() noexcept {
+            while (!empty()) {
+                pop();
+            }
+        }
+
+    private:
+        framePtr_t *slots() noexcept {return m_ring ? m_ring.get() : m_inline;}
+        uint32_t slotsNum() const noexcept {return m_ring ? m_ringCapacity : m_inlineCapacity;}
+
+        void grow() {
+            uint32_t capacity = (m_size * 2 > m_minRingCapacity) ? m_size * 2 : m_minRingCapacity;
+            if (capacity > m_limit) {
+                // push() grows the queue below the limit only
+                capacity = m_limit;
+            }
+            std::unique_ptr<framePtr_t[]> ring(new framePtr_t[capacity]);
+            auto *from = slots();
+            auto fromNum = slotsNum();
+            for (uint32_t i = 0; i < m_size; ++i) {
+                ring[i] = std::move(from[(m_head + i) % fromNum]);
+            }
+            m_ring = std::move(ring);
+            m_ringCapacity = capacity;
+            m_head = 0;
+        }
+    };
+} // namespace tgwss
+
+#endif //TGWSS_WRITEQUEUE_H
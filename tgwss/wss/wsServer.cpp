@@ -6,32 +6,107 @@
 * @copyright Apache License v.2 (http://www.apache.org/licenses/LICENSE-2.0)
 */
 
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <unistd.h>
+#include <signal.h>
+
 #include <cstring>
 #include <vector>
 #include <algorithm>
-
-#include <rapidjson/document.h>
-#include <rapidjson/error/en.h>
-#include <rapidjson/writer.h>
+#include <chrono>
+#include <thread>
 
 #include "json/confParser.h"
+#include "json/msgClassifier.h"
 #include "logger/logger.h"
 #include "wsServer.h"
 
 namespace tgwss {
-    static uint32_t g_msgSizeLimit = 64 * 1024;
     static uint32_t g_packetSize = 1024;
+    // lws_protocols::id of the binary subprotocol
+    static const unsigned int g_binProtoId = 1;
+    // inter-node links subprotocol & reconnect interval (sec) of the links which are down
+    static const char *g_clusterProtocol = "tgwss-node";
+    static const int g_clusterReconnectInterval = 1;
+    // raw protocol of the adopted listening socket
+    static const char *g_listenProtocol = "tgwss-listen";
+    // pending calls expiration check interval (sec)
+    static const int g_callsExpireInterval = 1;
+    // max number of connections accepted per listening socket event
+    static const int g_acceptBatch = 64;
+
+    // index of the lws service thread (and of its peers shard) the current callback runs on
+    static thread_local std::size_t g_shardIdx = 0;
+    static thread_local std::string g_tokenBuf;
+
+    // holds TCP_CORK on the connection's socket while a batch of frames is written, so the frames leave in full
+    // TCP segments; with ssl each frame is still its own SSL_write() & TLS record
+    class corkGuard_t {
+    private:
+        int m_fd = -1;
+
+    public:
+        corkGuard_t(struct lws *_lws, bool _enable) noexcept {
+#if defined(TCP_CORK)
+            if (_enable) {
+                m_fd = lws_get_socket_fd(_lws);
+                int opt = 1;
+                if ((m_fd >= 0) && (setsockopt(m_fd, IPPROTO_TCP, TCP_CORK, &opt, sizeof(opt)) != 0)) {
+                    m_fd = -1;
+                }
+            }
+#else
+            (void) _lws;
+            (void) _enable;
+#endif
+        }
+        ~corkGuard_t() {
+#if defined(TCP_CORK)
+            if (m_fd >= 0) {
+                int opt = 0;
+                setsockopt(m_fd, IPPROTO_TCP, TCP_CORK, &opt, sizeof(opt));
+            }
+#endif
+        }
 
-    wsServer_t::wsServer_t(const confParser_t *_confParser, logger_t *_logger) : m_logger(_logger) {
-        m_logger->log(logger_t::logLevel_t::LL_DEBUG, "wsServer: launching...");
+        corkGuard_t(const corkGuard_t &) = delete;
+        void operator=(const corkGuard_t &) = delete;
+    };
+
+    wsServer_t::wsServer_t(const confParser_t *_confParser, logger_t *_logger) :
+            m_logger(_logger),
+            m_deflate(_confParser->deflate()),
+            m_deflateWindowBits(std::to_string(_confParser->deflateWindowBits())),
+            m_deflateMemLevel(std::to_string(_confParser->deflateMemLevel())),
+            m_admissionControl(_confParser->connLimit(), _confParser->connLimitPerIp(),
+                               _confParser->connRate(), _confParser->connBurst()),
+            m_metrics(std::min<unsigned int>(_confParser->threads(), LWS_MAX_SMP)),
+            m_bindPort(_confParser->bindPort()),
+            m_drainTimeout(_confParser->drainTimeout()),
+            m_queueMsgLimit(_confParser->queueMsgLimit()),
+            m_queueSizeLimit(_confParser->queueSizeLimit()),
+            m_queueDropOldest(_confParser->queueDropOldest()),
+            m_writeBatch(_confParser->writeBatch()),
+            m_ioTimeout(_confParser->ioTimeout()),
+            m_callTtl(_confParser->callTtl()),
+            m_msgSizeLimit(_confParser->msgSizeLimit()),
+            m_cutThrough(_confParser->cutThrough()),
+            m_roomSizeLimit(_confParser->roomSizeLimit()) {
+        TGWSS_LOG(m_logger, LL_DEBUG, FMT_STRING("wsServer: launching..."));
 
         lws_set_log_level(0, nullptr);
 
-        std::memset(&m_wsProtocol, 0, sizeof(m_wsProtocol));
-        m_wsProtocol.name = "tgwss";
-        m_wsProtocol.callback = wsServer_t::wscbService;
-        m_wsProtocol.tx_packet_size = g_packetSize;
-        m_wsProtocol.rx_buffer_size = g_packetSize;
+        std::memset(&m_wsProtocols, 0, sizeof(m_wsProtocols));
+        m_wsProtocols[0].name = "tgwss";
+        m_wsProtocols[0].callback = wsServer_t::wscbService;
+        m_wsProtocols[0].tx_packet_size = g_packetSize;
+        m_wsProtocols[0].rx_buffer_size = g_packetSize;
+        m_wsProtocols[0].per_session_data_size = sizeof(sessionData_t);
+        m_wsProtocols[1] = m_wsProtocols[0];
+        m_wsProtocols[1].name = "tgwss-bin";
+        m_wsProtocols[1].id = g_binProtoId;
 
         std::memset(&m_wsInfo, 0, sizeof(m_wsInfo));
         m_wsInfo.port = _confParser->bindPort();
@@ -43,118 +118,557 @@ namespace tgwss {
         m_wsInfo.gid = -1;
         m_wsInfo.uid = -1;
         m_wsInfo.user = reinterpret_cast<void *>(this);
+        // the context is created with no vhosts, the websocket & the metrics vhosts are added to it
+        m_wsInfo.options = LWS_SERVER_OPTION_EXPLICIT_VHOSTS;
+        if (_confParser->workers() > 1) {
+            // all the worker processes listen on the same port (SO_REUSEPORT), the kernel spreads connections
+            m_wsInfo.options |= LWS_SERVER_OPTION_ALLOW_LISTEN_SHARE;
+        }
+        if (!_confParser->upgradeSocket().empty()) {
+            // the listening socket is inherited from the predecessor or created by the hand-off, lws doesn't
+            // listen by itself but serves the connections accepted from the adopted socket
+            m_handoff = std::make_unique<handoff_t>(_confParser->upgradeSocket(), m_bindPort);
+            m_wsInfo.port = CONTEXT_PORT_NO_LISTEN_SERVER;
+        }
         if (_confParser->ssl()) {
-            m_wsInfo.options = LWS_SERVER_OPTION_DO_SSL_GLOBAL_INIT;
-            m_wsInfo.ssl_cert_filepath = _confParser->certFile().c_str();
-            m_wsInfo.ssl_private_key_filepath = _confParser->pkeyFile().c_str();
+            m_wsInfo.options |= LWS_SERVER_OPTION_DO_SSL_GLOBAL_INIT;
+            m_certFile = _confParser->certFile();
+            m_pkeyFile = _confParser->pkeyFile();
+            m_wsInfo.ssl_cert_filepath = m_certFile.c_str();
+            m_wsInfo.ssl_private_key_filepath = m_pkeyFile.c_str();
+            // set up by wscbService when lws creates the SSL context of the vhost
+            m_tlsSessions = std::make_unique<tlsSessions_t>(_confParser->tlsSessionCache(),
+                                                            _confParser->tlsSessionLifetime(),
+                                                            _confParser->tlsSessionTickets(),
+                                                            _confParser->tlsTicketKeyRotation(),
+                                                            _confParser->ktls());
+        }
+        m_wsInfo.protocols = m_wsProtocols;
+        if (m_deflate) {
+#if !defined(LWS_WITHOUT_EXTENSIONS)
+            std::memset(&m_wsExtensions, 0, sizeof(m_wsExtensions));
+            m_wsExtensions[0].name = "permessage-deflate";
+            m_wsExtensions[0].callback = wsServer_t::wscbDeflate;
+            m_wsExtensions[0].client_offer = "permessage-deflate";
+            m_wsInfo.extensions = m_wsExtensions;
+#else
+            m_deflate = false;
+            TGWSS_LOG(m_logger, LL_WARNING,
+                      FMT_STRING("wsServer: libwebsockets is built without extensions, deflate is disabled"));
+#endif
+        }
+        m_wsInfo.count_threads = std::min<unsigned int>(_confParser->threads(), LWS_MAX_SMP);
+
+        for (unsigned int i = 0; i < m_wsInfo.count_threads; ++i) {
+            m_shards.emplace_back(std::make_unique<shard_t>());
+            m_shards.back()->peers.reserve(_confParser->connLimit() / m_wsInfo.count_threads);
         }
-        m_wsInfo.protocols = &m_wsProtocol;
+        m_tokenDirectory.reserve(_confParser->connLimit());
+        TGWSS_LOG(m_logger, LL_INFO, FMT_STRING("wsServer: {:d} bytes of peer state per logged on peer (estimate)"),
+                  peerStateSize());
 
         m_wsContext = lws_create_context(&m_wsInfo);
         if (m_wsContext == nullptr) {
             throw std::runtime_error("WS context create failed");
         }
+        m_wsVhost = lws_create_vhost(m_wsContext, &m_wsInfo);
+        if (m_wsVhost == nullptr) {
+            lws_context_destroy(m_wsContext);
+            throw std::runtime_error("WS vhost create failed");
+        }
+
+        if (m_handoff) {
+            std::memset(&m_listenProtocols, 0, sizeof(m_listenProtocols));
+            m_listenProtocols[0].name = g_listenProtocol;
+            m_listenProtocols[0].callback = wsServer_t::wscbListen;
+
+            std::memset(&m_listenInfo, 0, sizeof(m_listenInfo));
+            m_listenInfo.port = CONTEXT_PORT_NO_LISTEN;
+            m_listenInfo.vhost_name = "listen";
+            m_listenInfo.protocols = m_listenProtocols;
+            auto listenVhost = lws_create_vhost(m_wsContext, &m_listenInfo);
+            lws_sock_file_fd_type fd {};
+            fd.filefd = m_handoff->listenFd();
+            if ((listenVhost == nullptr) || (fd.filefd < 0)) {
+                lws_context_destroy(m_wsContext);
+                throw std::runtime_error("listen vhost create failed");
+            }
+            // a raw file descriptor, lws just polls it & the connections are accepted by wscbListen
+            m_listenWsi = lws_adopt_descriptor_vhost(listenVhost, LWS_ADOPT_RAW_FILE_DESC, fd,
+                                                     g_listenProtocol, nullptr);
+            if (m_listenWsi == nullptr) {
+                close(fd.filefd);
+                lws_context_destroy(m_wsContext);
+                throw std::runtime_error("listening socket adoption failed");
+            }
+            TGWSS_LOG(m_logger, LL_NOTICE, FMT_STRING("wsServer: listening socket is {:s}, upgrades via {:s}"),
+                      m_handoff->inherited() ? "inherited" : "created", _confParser->upgradeSocket());
+        }
+
+        if (_confParser->metricsPort() != 0) {
+            std::memset(&m_metricsProtocols, 0, sizeof(m_metricsProtocols));
+            m_metricsProtocols[0].name = "http";
+            m_metricsProtocols[0].callback = wsServer_t::wscbMetrics;
+            m_metricsProtocols[0].per_session_data_size = sizeof(metricsSession_t);
+
+            std::memset(&m_metricsInfo, 0, sizeof(m_metricsInfo));
+            m_metricsInfo.port = _confParser->metricsPort();
+            m_metricsInfo.vhost_name = "metrics";
+            m_metricsInfo.timeout_secs = _confParser->ioTimeout();
+            if (m_handoff) {
+                // the port is bound by both processes during an upgrade
+                m_metricsInfo.options |= LWS_SERVER_OPTION_ALLOW_LISTEN_SHARE;
+            }
+            m_metricsInfo.protocols = m_metricsProtocols;
+            if (lws_create_vhost(m_wsContext, &m_metricsInfo) == nullptr) {
+                lws_context_destroy(m_wsContext);
+                throw std::runtime_error("metrics vhost create failed");
+            }
+        }
+
+        if (_confParser->clusterNodeId() != 0) {
+            std::vector<cluster_t::node_t> nodes;
+            for (const auto &i:_confParser->clusterNodes()) {
+                cluster_t::node_t node;
+                node.id = i.id;
+                node.address = i.address;
+                node.port = i.port;
+                nodes.emplace_back(std::move(node));
+            }
+            m_cluster = std::make_unique<cluster_t>(_confParser->clusterNodeId(), nodes, m_framePool);
+
+            std::memset(&m_clusterProtocols, 0, sizeof(m_clusterProtocols));
+            m_clusterProtocols[0].name = g_clusterProtocol;
+            m_clusterProtocols[0].callback = wsServer_t::wscbCluster;
+            m_clusterProtocols[0].tx_packet_size = g_packetSize * 16;
+            m_clusterProtocols[0].rx_buffer_size = g_packetSize * 16;
+
+            // inbound & outbound links of the nodes, plain websockets - trusted network only
+            std::memset(&m_clusterInfo, 0, sizeof(m_clusterInfo));
+            m_clusterInfo.port = _confParser->clusterPort();
+            m_clusterInfo.vhost_name = "cluster";
+            m_clusterInfo.timeout_secs = _confParser->ioTimeout();
+            m_clusterInfo.ws_ping_pong_interval = _confParser->ioTimeout() / 2;
+            m_clusterInfo.protocols = m_clusterProtocols;
+            if (lws_create_vhost(m_wsContext, &m_clusterInfo) == nullptr) {
+                lws_context_destroy(m_wsContext);
+                throw std::runtime_error("cluster vhost create failed");
+            }
+            TGWSS_LOG(m_logger, LL_NOTICE, FMT_STRING("wsServer: cluster node {:d}, {:d} other node(s)"),
+                      m_cluster->nodeId(), nodes.size());
+        }
 
-        m_logger->log(logger_t::logLevel_t::LL_NOTICE, "wsServer: launched");
+        TGWSS_LOG(m_logger, LL_NOTICE, FMT_STRING("wsServer: launched, {:d} service thread(s)"),
+                  m_shards.size());
     }
 
     wsServer_t::~wsServer_t() {
-        m_logger->log(logger_t::logLevel_t::LL_DEBUG, "wsServer: stopping...");
+        TGWSS_LOG(m_logger, LL_DEBUG, FMT_STRING("wsServer: stopping..."));
         stop();
         lws_context_destroy(m_wsContext);
 
-        m_logger->log(logger_t::logLevel_t::LL_NOTICE, "wsServer: stopped");
+        TGWSS_LOG(m_logger, LL_NOTICE, FMT_STRING("wsServer: stopped"));
     }
 
-    void wsServer_t::eventProcessingWorker(wsServer_t *_wsServer) {
+    void wsServer_t::eventProcessingWorker(wsServer_t *_wsServer, std::size_t _tsi) {
+        g_shardIdx = _tsi;
+        auto &loopCpuTime = _wsServer->m_metrics.counters(_tsi).loopCpuTime;
         while (!_wsServer->m_stopFlag) {
-            // process lws events
-            lws_service(_wsServer->m_wsContext, 0);
+            // process lws events; the thread's CPU time is the work done on the events, blocking in poll
+            // takes none of it, so a saturated loop shows up as iterations of its full wall time
+            auto started = metrics_t::threadCpuNow();
+            lws_service_tsi(_wsServer->m_wsContext, 0, static_cast<int>(_tsi));
+            loopCpuTime.observe((metrics_t::threadCpuNow() - started) / 1000);
         }
     }
 
     void wsServer_t::start() {
-        m_eventProcessingThread = std::make_unique<std::thread>(wsServer_t::eventProcessingWorker, this);
+        for (std::size_t i = 0; i < m_shards.size(); ++i) {
+            m_eventProcessingThreads.emplace_back(wsServer_t::eventProcessingWorker, this, i);
+        }
+        if (m_handoff) {
+            m_handoff->start([this]() {handedOff();});
+        }
     }
 
     void wsServer_t::stop() {
         m_stopFlag = true;
-        if (m_eventProcessingThread) {
-            m_eventProcessingThread->join();
+        if (m_handoff) {
+            m_handoff->stop();
+        }
+        lws_cancel_service(m_wsContext);
+        for (auto &i:m_eventProcessingThreads) {
+            i.join();
+        }
+        m_eventProcessingThreads.clear();
+    }
+
+    void wsServer_t::wakeup() noexcept {
+        try {
+            auto &shard = *m_shards[g_shardIdx];
+            std::vector<struct lws *> wakeups;
+            {
+                std::unique_lock<std::mutex> lck(shard.mtx);
+                wakeups.swap(shard.wakeups);
+                for (auto i:wakeups) {
+                    // the peer may be gone since its data was queued
+                    if (shard.peers.find(i) != shard.peers.end()) {
+                        lws_callback_on_writable(i);
+                    }
+                }
+            }
+        } catch (...) {
+            TGWSS_LOG(m_logger, LL_ERROR, FMT_STRING("wakeup: internal error"));
+        }
+    }
+
+    int wsServer_t::wscbMetrics(struct lws *_lws, enum lws_callback_reasons _reason,
+                                void *_user, void *_data, size_t) noexcept {
+        auto wsServer = static_cast<wsServer_t *>(lws_context_user(lws_get_context(_lws)));
+        auto session = static_cast<metricsSession_t *>(_user);
+        if ((wsServer == nullptr) || (session == nullptr)) {
+            return 0;
+        }
+
+        try {
+            switch (_reason) {
+                case LWS_CALLBACK_HTTP: {
+                    if (std::strcmp(static_cast<const char *>(_data), "/metrics") != 0) {
+                        if (lws_return_http_status(_lws, HTTP_STATUS_NOT_FOUND, nullptr) != 0) {
+                            return -1;
+                        }
+                        return (lws_http_transaction_completed(_lws) != 0) ? -1 : 0;
+                    }
+
+                    // the body is rendered at once, so all the values are of the same moment
+                    delete session->body;
+                    session->body = new std::string;
+                    session->sent = 0;
+                    wsServer->metrics(*session->body);
+
+                    unsigned char headers[LWS_PRE + 512];
+                    unsigned char *start = headers + LWS_PRE;
+                    unsigned char *pos = start;
+                    unsigned char *end = headers + sizeof(headers) - 1;
+                    if ((lws_add_http_common_headers(_lws, HTTP_STATUS_OK, "text/plain; version=0.0.4",
+                                                     session->body->size(), &pos, end) != 0) ||
+                        (lws_finalize_write_http_header(_lws, start, &pos, end) != 0)) {
+                        return -1;
+                    }
+                    lws_callback_on_writable(_lws);
+                    break;
+                }
+                case LWS_CALLBACK_HTTP_WRITEABLE: {
+                    if (session->body == nullptr) {
+                        break;
+                    }
+                    auto size = std::min<std::size_t>(session->body->size() - session->sent, g_packetSize * 4);
+                    bool final = (session->sent + size == session->body->size());
+                    std::vector<unsigned char> buf(LWS_PRE + size);
+                    std::memcpy(buf.data() + LWS_PRE, session->body->data() + session->sent, size);
+                    if (lws_write(_lws, buf.data() + LWS_PRE, size, final ? LWS_WRITE_HTTP_FINAL : LWS_WRITE_HTTP) !=
+                        static_cast<int>(size)) {
+                        return -1;
+                    }
+                    session->sent += size;
+                    if (!final) {
+                        lws_callback_on_writable(_lws);
+                        break;
+                    }
+                    delete session->body;
+                    session->body = nullptr;
+                    return (lws_http_transaction_completed(_lws) != 0) ? -1 : 0;
+                }
+                case LWS_CALLBACK_CLOSED_HTTP: {
+                    delete session->body;
+                    session->body = nullptr;
+                    break;
+                }
+                default: {
+                    break;
+                }
+            }
+        } catch (...) {
+            TGWSS_LOG(wsServer->m_logger, LL_ERROR, FMT_STRING("wscbMetrics: internal error"));
+            return -1;
+        }
+
+        return 0;
+    }
+
+    void wsServer_t::metrics(std::string &_out) {
+        metrics_t::gauge(_out, "tgwss_online_peers", "Logged on peers.", m_tokenDirectory.size());
+        metrics_t::gauge(_out, "tgwss_connections", "Admitted connections.", m_admissionControl.connections());
+        std::size_t peersBytes = 0;
+        for (const auto &i:m_shards) {
+            peersBytes += i->peersPool.bytes();
+        }
+        metrics_t::gauge(_out, "tgwss_peer_slab_bytes", "Memory of peer state slabs.", peersBytes);
+        metrics_t::gauge(_out, "tgwss_peer_state_estimate_bytes",
+                         "Peer state memory per idle logged on peer computed from type sizes, not measured.",
+                         peerStateSize());
+        metrics_t::gauge(_out, "tgwss_queued_messages", "Messages in write queues.", m_queueStats.queuedMsgs);
+        metrics_t::gauge(_out, "tgwss_queued_bytes", "Bytes in write queues.", m_queueStats.queuedBytes);
+        metrics_t::counter(_out, "tgwss_dropped_messages_total", "Messages dropped on write queue overflow.",
+                           m_queueStats.droppedMsgs);
+        metrics_t::counter(_out, "tgwss_evicted_peers_total", "Peers closed on write queue overflow.",
+                           m_queueStats.evictedPeers);
+        metrics_t::counter(_out, "tgwss_written_messages_total", "Messages written to sockets.",
+                           m_queueStats.writtenMsgs);
+        metrics_t::counter(_out, "tgwss_write_batches_total", "Socket writeable events served.",
+                           m_queueStats.writeBatches);
+
+        const auto &admission = m_admissionControl.stats();
+        metrics_t::counter(_out, "tgwss_admitted_connections_total", "Admitted connections.", admission.admitted);
+        _out.append("# HELP tgwss_rejected_connections_total Rejected connections by reason.\n"
+                    "# TYPE tgwss_rejected_connections_total counter\n");
+        _out.append("tgwss_rejected_connections_total{reason=\"conn_limit\"} ")
+                .append(std::to_string(admission.rejectedConnLimit)).append("\n");
+        _out.append("tgwss_rejected_connections_total{reason=\"ip_limit\"} ")
+                .append(std::to_string(admission.rejectedIpLimit)).append("\n");
+        _out.append("tgwss_rejected_connections_total{reason=\"rate_limit\"} ")
+                .append(std::to_string(admission.rejectedRateLimit)).append("\n");
+
+        if (m_deflate) {
+            metrics_t::counter(_out, "tgwss_deflate_peers_total", "Closed connections with permessage-deflate.",
+                               m_deflateStats.peers);
+            metrics_t::counter(_out, "tgwss_deflate_tx_raw_bytes_total", "Bytes before compression.",
+                               m_deflateStats.txRawBytes);
+            metrics_t::counter(_out, "tgwss_deflate_tx_deflated_bytes_total", "Bytes after compression.",
+                               m_deflateStats.txDeflatedBytes);
+            metrics_t::counter(_out, "tgwss_deflate_rx_deflated_bytes_total", "Bytes before decompression.",
+                               m_deflateStats.rxDeflatedBytes);
+            metrics_t::counter(_out, "tgwss_deflate_rx_raw_bytes_total", "Bytes after decompression.",
+                               m_deflateStats.rxRawBytes);
+            metrics_t::counter(_out, "tgwss_deflate_microseconds_total", "Time spent in compression.",
+                               m_deflateStats.deflateNs / 1000);
+            metrics_t::counter(_out, "tgwss_inflate_microseconds_total", "Time spent in decompression.",
+                               m_deflateStats.inflateNs / 1000);
+        }
+
+        const auto &pending = m_pendingCalls.stats();
+        metrics_t::gauge(_out, "tgwss_pending_calls", "Calls waiting for the callee to log on.", m_pendingCalls.size());
+        metrics_t::counter(_out, "tgwss_pending_calls_total", "Calls to offline tokens parked.", pending.parked);
+        metrics_t::counter(_out, "tgwss_pending_calls_delivered_total", "Parked calls taken by the callee's logon.",
+                           pending.delivered);
+        metrics_t::counter(_out, "tgwss_pending_calls_expired_total", "Parked calls expired.", pending.expired);
+
+        const auto &rooms = m_rooms.stats();
+        metrics_t::gauge(_out, "tgwss_rooms", "Group call rooms.", m_rooms.size());
+        metrics_t::gauge(_out, "tgwss_room_members", "Members of group call rooms.", m_rooms.membersNum());
+        metrics_t::counter(_out, "tgwss_room_messages_total", "Messages fanned out to rooms.", rooms.messages);
+        metrics_t::counter(_out, "tgwss_room_deliveries_total", "Messages queued to room members.", rooms.deliveries);
+        metrics_t::counter(_out, "tgwss_room_frames_total", "Frames the fanned out messages took.", rooms.frames);
+
+        if (m_tlsSessions) {
+            const auto &tls = m_tlsSessions->stats();
+            metrics_t::counter(_out, "tgwss_tls_full_handshakes_total", "Full TLS handshakes.", tls.fullHandshakes);
+            metrics_t::counter(_out, "tgwss_tls_resumed_handshakes_total", "Resumed TLS sessions.",
+                               tls.resumedHandshakes);
+            metrics_t::counter(_out, "tgwss_tls_handshake_cpu_microseconds_total", "CPU time spent in TLS handshakes.",
+                               tls.handshakeCpuNs / 1000);
+            metrics_t::counter(_out, "tgwss_tls_ktls_connections_total", "TLS connections with kernel encryption.",
+                               tls.ktlsConnections);
+            metrics_t::counter(_out, "tgwss_tls_ticket_key_rotations_total", "Session ticket key rotations.",
+                               tls.keyRotations);
+        }
+
+        if (m_cluster) {
+            metrics_t::gauge(_out, "tgwss_cluster_remote_peers", "Peers online on other nodes.", m_cluster->size());
+        }
+
+        m_metrics.render(_out);
+    }
+
+    int wsServer_t::wscbDeflate(struct lws_context *_context, const struct lws_extension *_ext, struct lws *_lws,
+                                enum lws_extension_callback_reasons _reason,
+                                void *_user, void *_data, size_t _size) noexcept {
+#if !defined(LWS_WITHOUT_EXTENSIONS)
+        if ((_reason != LWS_EXT_CB_PAYLOAD_TX) && (_reason != LWS_EXT_CB_PAYLOAD_RX)) {
+            return lws_extension_callback_pm_deflate(_context, _ext, _lws, _reason, _user, _data, _size);
+        }
+
+        // account bytes consumed & produced by zlib and the time spent there
+        auto pmdrx = static_cast<struct lws_ext_pm_deflate_rx_ebufs *>(_data);
+        int inLen = pmdrx->eb_in.len;
+        auto started = std::chrono::steady_clock::now();
+        int ret = lws_extension_callback_pm_deflate(_context, _ext, _lws, _reason, _user, _data, _size);
+        auto elapsed = static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now() - started).count());
+
+        auto sessionData = static_cast<sessionData_t *>(lws_wsi_user(_lws));
+        if ((sessionData != nullptr) && (ret >= 0)) {
+            auto consumed = static_cast<uint64_t>(inLen - pmdrx->eb_in.len);
+            auto produced = static_cast<uint64_t>(std::max(pmdrx->eb_out.len, 0));
+            if (_reason == LWS_EXT_CB_PAYLOAD_TX) {
+                sessionData->txRawBytes += consumed;
+                sessionData->txDeflatedBytes += produced;
+                sessionData->deflateNs += elapsed;
+            } else {
+                sessionData->rxDeflatedBytes += consumed;
+                sessionData->rxRawBytes += produced;
+                sessionData->inflateNs += elapsed;
+            }
         }
-        m_eventProcessingThread = nullptr;
+
+        return ret;
+#else
+        (void) _context;
+        (void) _ext;
+        (void) _lws;
+        (void) _reason;
+        (void) _user;
+        (void) _data;
+        (void) _size;
+        return 0;
+#endif
     }
 
     int wsServer_t::wscbService(struct lws *_lws, enum lws_callback_reasons _reason,
-                                void *, void *_data, size_t _size) noexcept {
+                                void *_user, void *_data, size_t _size) noexcept {
         auto wsServer = static_cast<wsServer_t *>(lws_context_user(lws_get_context(_lws)));
         if (wsServer == nullptr) {
             return -1;
         }
 
         switch (_reason) {
+            case LWS_CALLBACK_PROTOCOL_INIT: {
+                // both subprotocols share the callback, the timer is run by one of them
+                if ((lws_get_protocol(_lws) != nullptr) && (lws_get_protocol(_lws)->id != g_binProtoId)) {
+                    lws_timed_callback_vh_protocol(lws_get_vhost(_lws), lws_get_protocol(_lws), LWS_CALLBACK_USER,
+                                                   g_callsExpireInterval);
+                }
+                break;
+            }
+            case LWS_CALLBACK_USER: {
+                if (!wsServer->m_stopFlag) {
+                    wsServer->expireCalls();
+                    lws_timed_callback_vh_protocol(lws_get_vhost(_lws), lws_get_protocol(_lws), LWS_CALLBACK_USER,
+                                                   g_callsExpireInterval);
+                }
+                break;
+            }
+            case LWS_CALLBACK_EVENT_WAIT_CANCELLED: {
+                // another service thread has queued data for peers of this thread
+                wsServer->wakeup();
+                if ((g_shardIdx == 0) && wsServer->m_reloadCerts.exchange(false)) {
+                    wsServer->reloadCerts();
+                }
+                break;
+            }
+
+            case LWS_CALLBACK_OPENSSL_LOAD_EXTRA_SERVER_VERIFY_CERTS: {
+                // _user is the SSL context of the websocket vhost
+                if (wsServer->m_tlsSessions && (_user != nullptr) &&
+                    !wsServer->m_tlsSessions->init(static_cast<SSL_CTX *>(_user))) {
+                    TGWSS_LOG(wsServer->m_logger, LL_WARNING,
+                              FMT_STRING("wscbService: OpenSSL is built without kernel TLS, ktls is disabled"));
+                }
+                break;
+            }
+
+            case LWS_CALLBACK_FILTER_NETWORK_CONNECTION: {
+                // just accepted socket, neither TLS nor websocket handshake is done yet
+                if (!wsServer->admit(static_cast<int>(reinterpret_cast<intptr_t>(_data)))) {
+                    return -1;
+                }
+                break;
+            }
+            case LWS_CALLBACK_SERVER_NEW_CLIENT_INSTANTIATED: {
+                wsServer->m_admissionControl.attach(lws_get_socket_fd(_lws), _lws);
+                break;
+            }
+            case LWS_CALLBACK_WSI_DESTROY: {
+                wsServer->m_admissionControl.release(_lws);
+                break;
+            }
+
+            case LWS_CALLBACK_WS_PEER_INITIATED_CLOSE: {
+                metrics_t::inc(wsServer->m_metrics.counters(g_shardIdx).closeReasons[metrics_t::CR_PEER]);
+                break;
+            }
+
             case LWS_CALLBACK_ESTABLISHED: {
-                wsServer->m_logger->log(logger_t::logLevel_t::LL_NOTICE,
-                                        "wscbService: connection established, client {:p}",
-                                        fmt::ptr(_lws));
+                TGWSS_LOG(wsServer->m_logger, LL_NOTICE,
+                          FMT_STRING("wscbService: connection established, client {:p}"),
+                          fmt::ptr(_lws));
+                wsServer->deflateInit(_lws);
+                lws_set_timeout(_lws, PENDING_TIMEOUT_USER_OK, wsServer->m_ioTimeout);
+                break;
+            }
+            case LWS_CALLBACK_RECEIVE_PONG: {
+                lws_set_timeout(_lws, PENDING_TIMEOUT_USER_OK, wsServer->m_ioTimeout);
+                // pongs come every io_timeout / 2, a write queue idle for that long gives its storage back
+                wsServer->trim(_lws);
                 break;
             }
 
             case LWS_CALLBACK_CLIENT_CONNECTION_ERROR: {
 //            atomicGuard_t atomicGuard(&wsServer->m_atomicLock);
-                wsServer->m_logger->log(logger_t::logLevel_t::LL_NOTICE,
-                                        "wscbService: client connection error, client {:p}",
-                                        fmt::ptr(_lws));
+                TGWSS_LOG(wsServer->m_logger, LL_NOTICE,
+                          FMT_STRING("wscbService: client connection error, client {:p}"),
+                          fmt::ptr(_lws));
                 wsServer->remove(_lws);
                 break;
             }
             case LWS_CALLBACK_CLOSED: {
 //            atomicGuard_t atomicGuard(&wsServer->m_atomicLock);
-                wsServer->m_logger->log(logger_t::logLevel_t::LL_NOTICE,
-                                        "wscbService: connection closed, client {:p}",
-                                        fmt::ptr(_lws));
+                TGWSS_LOG(wsServer->m_logger, LL_NOTICE,
+                          FMT_STRING("wscbService: connection closed, client {:p}"),
+                          fmt::ptr(_lws));
+                metrics_t::inc(wsServer->m_metrics.counters(g_shardIdx).closedConnections);
+                wsServer->deflateDone(_lws);
                 wsServer->remove(_lws);
                 break;
             }
             case LWS_CALLBACK_CLIENT_CLOSED: {
 //            atomicGuard_t atomicGuard(&wsServer->m_atomicLock);
-                wsServer->m_logger->log(logger_t::logLevel_t::LL_NOTICE,
-                                        "wscbService: client's connection closed, client {:p}",
-                                        fmt::ptr(_lws));
+                TGWSS_LOG(wsServer->m_logger, LL_NOTICE,
+                          FMT_STRING("wscbService: client's connection closed, client {:p}"),
+                          fmt::ptr(_lws));
                 wsServer->remove(_lws);
                 break;
             }
 
             case LWS_CALLBACK_RECEIVE: {
 //            atomicGuard_t atomicGuard(&wsServer->m_atomicLock);
-                wsServer->m_logger->log(logger_t::logLevel_t::LL_DEBUG,
-                                        "wscbService: data received, client {:p}, message: {:s}, "
-                                        "size {:d}, remaining size: {:d}",
-                                        fmt::ptr(_lws),
-                                        std::string(static_cast<char *>(_data), _size),
-                                        _size,
-                                        lws_remaining_packet_payload(_lws));
-
-                // is it a new peer?
-                auto p = wsServer->m_peers.find(_lws);
-                if (p == wsServer->m_peers.end()) {
+                TGWSS_LOG(wsServer->m_logger, LL_DEBUG,
+                          FMT_STRING("wscbService: data received, client {:p}, message: {:s}, "
+                                     "size {:d}, remaining size: {:d}"),
+                          fmt::ptr(_lws),
+                          fmt::string_view(static_cast<char *>(_data), _size),
+                          _size,
+                          lws_remaining_packet_payload(_lws));
+
+                // inactivity timeout is restarted by any data or pong, its value may be changed by reload
+                lws_set_timeout(_lws, PENDING_TIMEOUT_USER_OK, wsServer->m_ioTimeout);
+
+                // is it a new peer? peers are added and removed by their own service thread only
+                auto &shard = *wsServer->m_shards[g_shardIdx];
+                bool known;
+                {
+                    std::unique_lock<std::mutex> lck(shard.mtx);
+                    known = (shard.peers.find(_lws) != shard.peers.end());
+                }
+                if (!known) {
                     // new peer, try to authorize
                     if (!wsServer->logon(_lws, static_cast<char *>(_data), _size)) {
-                        wsServer->m_logger->log(logger_t::logLevel_t::LL_WARNING,
-                                                "wscbService: auth failed, client {:p}",
-                                                fmt::ptr(_lws));
+                        metrics_t::inc(wsServer->m_metrics.counters(g_shardIdx).logonFailures);
+                        TGWSS_LOG(wsServer->m_logger, LL_WARNING,
+                                  FMT_STRING("wscbService: auth failed, client {:p}"),
+                                  fmt::ptr(_lws));
                         return -1;
                     } else {
-                        wsServer->m_logger->log(logger_t::logLevel_t::LL_DEBUG,
-                                                "wscbService: auth processed, client {:p}",
-                                                fmt::ptr(_lws));
+                        TGWSS_LOG(wsServer->m_logger, LL_DEBUG,
+                                  FMT_STRING("wscbService: auth processed, client {:p}"),
+                                  fmt::ptr(_lws));
                     }
                 } else {
                     // known peer, retransmit message
                     if (!wsServer->retransmit(_lws, static_cast<char *>(_data), _size)) {
-                        wsServer->m_logger->log(logger_t::logLevel_t::LL_WARNING,
-                                                "wscbService: data retransmission failed, client {:p}",
-                                                fmt::ptr(_lws));
+                        TGWSS_LOG(wsServer->m_logger, LL_WARNING,
+                                  FMT_STRING("wscbService: data retransmission failed, client {:p}"),
+                                  fmt::ptr(_lws));
                         return -1;
                     }
                 }
@@ -164,39 +678,98 @@ namespace tgwss {
 
             case LWS_CALLBACK_SERVER_WRITEABLE: {
                 try {
-                    auto cl = wsServer->m_peers.find(_lws);
-                    if (cl == wsServer->m_peers.end() || cl->second->writeQueue.empty()) {
-                        break;
-                    }
-                    std::vector<unsigned char> buf = std::move(cl->second->writeQueue.front());
-                    cl->second->writeQueue.pop();
+                    auto &shard = *wsServer->m_shards[g_shardIdx];
+                    // drain as many frames as the socket takes, corked to coalesce them into full segments
+                    const uint16_t writeBatch = wsServer->m_writeBatch;
+                    corkGuard_t corkGuard(_lws, writeBatch > 1);
+                    // all frames queued to the peer are encoded for its subprotocol
+                    const bool binaryProto = wsServer->binary(_lws);
+                    auto sessionData = static_cast<sessionData_t *>(_user);
+                    for (uint16_t i = 0; i < writeBatch; ++i) {
+                        framePtr_t frame;
+                        bool lastMsg;
+                        lws_close_status closeStatus;
+                        {
+                            std::unique_lock<std::mutex> lck(shard.mtx);
+                            auto cl = shard.peers.find(_lws);
+                            if (cl == shard.peers.end() || cl->second->writeQueue.empty()) {
+                                break;
+                            }
+                            frame = cl->second->writeQueue.pop();
+                            wsServer->m_queueStats.queuedBytes -= frame->size();
+                            --wsServer->m_queueStats.queuedMsgs;
+                            lastMsg = cl->second->writeQueue.empty();
+                            closeStatus = cl->second->closeStatus;
+                        }
 
-                    wsServer->m_logger->log(logger_t::logLevel_t::LL_DEBUG,
-                                            "write: client {:p}, message: {:s}, size {:d}",
-                                            fmt::ptr(_lws),
-                                            std::string(reinterpret_cast<char *>(buf.data()) + LWS_PRE,
-                                                        buf.size() - LWS_PRE),
-                                            buf.size());
+                        TGWSS_LOG(wsServer->m_logger, LL_DEBUG,
+                                  FMT_STRING("write: client {:p}, message: {:s}, size {:d}"),
+                                  fmt::ptr(_lws),
+                                  binaryProto ? fmt::string_view("<binary>") :
+                                  fmt::string_view(reinterpret_cast<char *>(frame->data()), frame->size()),
+                                  frame->size());
 
-                    if (lws_write(_lws, buf.data() + LWS_PRE, buf.size() - LWS_PRE, LWS_WRITE_TEXT) < 0) {
-                        wsServer->m_logger->log(logger_t::logLevel_t::LL_WARNING,
-                                                "write: client {:p}, failed",
-                                                fmt::ptr(_lws));
-                        return -1;
-                    }
-
-                    if (!cl->second->writeQueue.empty()) {
-                        lws_callback_on_writable(_lws);
-                    } else {
-                        if (cl->second->closeStatus != LWS_CLOSE_STATUS_NO_STATUS) {
-                            lws_close_reason(_lws, cl->second->closeStatus, buf.data() + LWS_PRE, buf.size() - LWS_PRE);
+                        int writeProtocol = binaryProto ? LWS_WRITE_BINARY : LWS_WRITE_TEXT;
+                        if (sessionData != nullptr) {
+                            auto fragment = frame->fragment();
+                            if ((sessionData->fragmentSource != nullptr) &&
+                                ((fragment == frame_t::FR_MESSAGE) || (fragment == frame_t::FR_FIRST))) {
+                                // the sender of the message being written is gone or re-paired, the message
+                                // is closed by an empty final part to keep the stream valid
+                                unsigned char last[LWS_PRE];
+                                if (lws_write(_lws, last + LWS_PRE, 0, LWS_WRITE_CONTINUATION) < 0) {
+                                    TGWSS_LOG(wsServer->m_logger, LL_WARNING,
+                                              FMT_STRING("write: client {:p}, failed"),
+                                              fmt::ptr(_lws));
+                                    return -1;
+                                }
+                                sessionData->fragmentSource = nullptr;
+                            }
+                            if ((fragment == frame_t::FR_MIDDLE) || (fragment == frame_t::FR_LAST)) {
+                                if (sessionData->fragmentSource != frame->source()) {
+                                    // the message head has been dropped or the message is closed already
+                                    continue;
+                                }
+                                writeProtocol = LWS_WRITE_CONTINUATION;
+                            }
+                            if (fragment != frame_t::FR_MESSAGE) {
+                                if (fragment != frame_t::FR_LAST) {
+                                    writeProtocol |= LWS_WRITE_NO_FIN;
+                                }
+                                sessionData->fragmentSource = (fragment == frame_t::FR_LAST) ? nullptr :
+                                                              frame->source();
+                            }
+                        }
+                        if (lws_write(_lws, frame->data(), frame->size(),
+                                      static_cast<enum lws_write_protocol>(writeProtocol)) < 0) {
+                            TGWSS_LOG(wsServer->m_logger, LL_WARNING,
+                                      FMT_STRING("write: client {:p}, failed"),
+                                      fmt::ptr(_lws));
                             return -1;
                         }
+                        ++wsServer->m_queueStats.writtenMsgs;
+                        if ((frame->rxTime() != 0) && (frame->msgClass() < metrics_t::LT_NUM)) {
+                            wsServer->m_metrics.counters(g_shardIdx).latency[frame->msgClass()].observe(
+                                    (metrics_t::now() - frame->rxTime()) / 1000);
+                        }
+
+                        if (lastMsg) {
+                            if (closeStatus != LWS_CLOSE_STATUS_NO_STATUS) {
+                                lws_close_reason(_lws, closeStatus, frame->data(), frame->size());
+                                return -1;
+                            }
+                            break;
+                        }
+                        if ((i + 1 == writeBatch) || lws_send_pipe_choked(_lws)) {
+                            lws_callback_on_writable(_lws);
+                            break;
+                        }
                     }
+                    ++wsServer->m_queueStats.writeBatches;
                 } catch (...) {
-                    wsServer->m_logger->log(logger_t::logLevel_t::LL_ERROR,
-                                            "write: client {:p}, failed (out of memory?)",
-                                            fmt::ptr(_lws));
+                    TGWSS_LOG(wsServer->m_logger, LL_ERROR,
+                              FMT_STRING("write: client {:p}, failed (out of memory?)"),
+                              fmt::ptr(_lws));
                     return -1;
                 }
 
@@ -211,110 +784,718 @@ namespace tgwss {
         return 0;
     }
 
+    int wsServer_t::wscbCluster(struct lws *_lws, enum lws_callback_reasons _reason,
+                                void *_user, void *_data, size_t _size) noexcept {
+        auto wsServer = static_cast<wsServer_t *>(lws_context_user(lws_get_context(_lws)));
+        if ((wsServer == nullptr) || !wsServer->m_cluster) {
+            return 0;
+        }
+        auto &cluster = *wsServer->m_cluster;
+
+        try {
+            switch (_reason) {
+                case LWS_CALLBACK_PROTOCOL_INIT: {
+                    lws_timed_callback_vh_protocol(lws_get_vhost(_lws), lws_get_protocol(_lws), LWS_CALLBACK_USER, 0);
+                    break;
+                }
+                case LWS_CALLBACK_USER: {
+                    // (re)connect the links which are down
+                    if (!wsServer->m_stopFlag) {
+                        cluster.connect(lws_get_context(_lws), lws_get_vhost(_lws), g_clusterProtocol);
+                        lws_timed_callback_vh_protocol(lws_get_vhost(_lws), lws_get_protocol(_lws), LWS_CALLBACK_USER,
+                                                       g_clusterReconnectInterval);
+                    }
+                    break;
+                }
+                case LWS_CALLBACK_EVENT_WAIT_CANCELLED: {
+                    // other service threads have queued messages to the links of this thread
+                    cluster.wakeup(g_shardIdx);
+                    break;
+                }
+
+                // outbound links
+                case LWS_CALLBACK_CLIENT_ESTABLISHED: {
+                    if (_user == nullptr) {
+                        return -1;
+                    }
+                    TGWSS_LOG(wsServer->m_logger, LL_NOTICE, FMT_STRING("wscbCluster: link established, link {:p}"),
+                              fmt::ptr(_lws));
+                    cluster.established(_user, _lws, wsServer->m_tokenDirectory);
+                    break;
+                }
+                case LWS_CALLBACK_CLIENT_WRITEABLE: {
+                    if (_user == nullptr) {
+                        return -1;
+                    }
+                    return cluster.writeable(_user, _lws);
+                }
+                case LWS_CALLBACK_CLIENT_CONNECTION_ERROR:
+                case LWS_CALLBACK_CLIENT_CLOSED: {
+                    TGWSS_LOG(wsServer->m_logger, LL_NOTICE, FMT_STRING("wscbCluster: link is down, link {:p}"),
+                              fmt::ptr(_lws));
+                    if (_user != nullptr) {
+                        cluster.closed(_user);
+                    }
+                    break;
+                }
+
+                // inbound links
+                case LWS_CALLBACK_RECEIVE: {
+                    framePtr_t msg;
+                    uint16_t node = 0;
+                    // announces are checked for callees of pending calls
+                    std::vector<std::string> announced;
+                    if (!cluster.receive(_lws, _data, _size,
+                                         lws_is_final_fragment(_lws) && (lws_remaining_packet_payload(_lws) == 0),
+                                         msg, node, (wsServer->m_pendingCalls.size() > 0) ? &announced : nullptr)) {
+                        TGWSS_LOG(wsServer->m_logger, LL_WARNING,
+                                  FMT_STRING("wscbCluster: malformed node message, link {:p}"),
+                                  fmt::ptr(_lws));
+                        return -1;
+                    }
+                    if (msg) {
+                        wsServer->clusterReceive(node, *msg);
+                    }
+                    if (!announced.empty()) {
+                        wsServer->clusterAnnounced(node, announced);
+                    }
+                    break;
+                }
+                case LWS_CALLBACK_CLOSED: {
+                    auto node = cluster.inboundClosed(_lws);
+                    if (node != 0) {
+                        TGWSS_LOG(wsServer->m_logger, LL_WARNING, FMT_STRING("wscbCluster: node {:d} is down"), node);
+                        wsServer->clusterNodeDown(node);
+                    }
+                    break;
+                }
+                default: {
+                    break;
+                }
+            }
+        } catch (...) {
+            TGWSS_LOG(wsServer->m_logger, LL_ERROR, FMT_STRING("wscbCluster: internal error"));
+            return -1;
+        }
+
+        return 0;
+    }
+
     bool wsServer_t::write(struct lws *_lws,
-                           const void *_message,
-                           std::size_t _size,
+                           std::size_t _shard,
+                           uint64_t _id,
+                           framePtr_t _frame,
                            lws_close_status _closeStatus) noexcept {
+        if (!_frame) {
+            return false;
+        }
         try {
-            std::vector<unsigned char> buf(LWS_PRE + _size, 0);
-            std::memmove(buf.data() + LWS_PRE, _message, _size);
-
-            auto cl = m_peers.find(_lws);
-            if (cl != m_peers.end()) {
-                cl->second->writeQueue.emplace(buf);
-                cl->second->closeStatus = _closeStatus;
-                lws_callback_on_writable(_lws);
+            auto &shard = *m_shards[_shard];
+            std::unique_lock<std::mutex> lck(shard.mtx);
+            auto cl = shard.peers.find(_lws);
+            // _lws may be gone & reused by another connection since the caller has looked it up
+            if ((cl != shard.peers.end()) && ((_id == 0) || (cl->second->id == _id))) {
+                if (!enqueue(_lws, *cl->second, std::move(_frame), _closeStatus)) {
+                    return true; // closing, the last message is already queued
+                }
+                if (_shard == g_shardIdx) {
+                    lws_callback_on_writable(_lws);
+                } else {
+                    // _lws is served by another thread, hand it over and wake that thread up
+                    shard.wakeups.push_back(_lws);
+                    lws_cancel_service_pt(_lws);
+                }
 
                 return true;
             }
-            m_logger->log(logger_t::logLevel_t::LL_ERROR,
-                          "write: unknown client {:p}",
-                          fmt::ptr(_lws));
+            TGWSS_LOG(m_logger, LL_ERROR,
+                      FMT_STRING("write: unknown client {:p}"),
+                      fmt::ptr(_lws));
         } catch (...) {
-            m_logger->log(logger_t::logLevel_t::LL_ERROR,
-                          "write: client {:p}, failed",
-                          fmt::ptr(_lws));
+            TGWSS_LOG(m_logger, LL_ERROR,
+                      FMT_STRING("write: client {:p}, failed"),
+                      fmt::ptr(_lws));
         }
 
         return false;
     }
 
+    bool wsServer_t::enqueue(struct lws *_lws, peerData_t &_peerData, framePtr_t _frame,
+                             lws_close_status _closeStatus) {
+        if (_peerData.closeStatus != LWS_CLOSE_STATUS_NO_STATUS) {
+            return false;
+        }
+
+        auto &writeQueue = _peerData.writeQueue;
+        // queue_msg_limit may be reloaded since the peer has connected
+        writeQueue.limit(m_queueMsgLimit);
+        const uint32_t queueSizeLimit = m_queueSizeLimit;
+        std::size_t dropped = 0;
+        if (m_queueDropOldest) {
+            // slow consumer, outdated messages (trickle ICE candidates mostly) are dropped
+            while (!writeQueue.empty() &&
+                   (writeQueue.full() || (writeQueue.bytes() + _frame->size() > queueSizeLimit))) {
+                m_queueStats.queuedBytes -= writeQueue.pop()->size();
+                --m_queueStats.queuedMsgs;
+                ++dropped;
+            }
+        } else if (writeQueue.full() || (writeQueue.bytes() + _frame->size() > queueSizeLimit)) {
+            // slow consumer, close it with the error message
+            m_queueStats.queuedBytes -= writeQueue.bytes();
+            m_queueStats.queuedMsgs -= writeQueue.size();
+            writeQueue.clear();
+            ++m_queueStats.evictedPeers;
+            _frame = stringMsg(_peerData.binary, binProto_t::msgType_t::MT_ERROR, "write queue overflow");
+            _closeStatus = LWS_CLOSE_STATUS_POLICY_VIOLATION;
+            metrics_t::inc(m_metrics.counters(g_shardIdx).closeReasons[metrics_t::CR_POLICY_VIOLATION]);
+            TGWSS_LOG(m_logger, LL_WARNING,
+                      FMT_STRING("write: client {:p}, write queue overflow, closing"),
+                      fmt::ptr(_lws));
+        }
+        if (dropped > 0) {
+            m_queueStats.droppedMsgs += dropped;
+            TGWSS_LOG(m_logger, LL_WARNING,
+                      FMT_STRING("write: client {:p}, write queue overflow, {:d} message(s) dropped"),
+                      fmt::ptr(_lws), dropped);
+        }
+
+        m_queueStats.queuedBytes += _frame->size();
+        ++m_queueStats.queuedMsgs;
+        writeQueue.push(std::move(_frame));
+        _peerData.closeStatus = _closeStatus;
+
+        return true;
+    }
+
+    void wsServer_t::fanOut(struct lws *_lws, const rooms_t::members_t &_members, framePtr_t _message) noexcept {
+        try {
+            if (!_members || !_message) {
+                return;
+            }
+            // the message is encoded once per subprotocol, when a member of it is met. lws_write() puts the frame
+            // header into the headroom of the frame, so a frame is shared by the members of one thread only
+            framePtr_t encoded[2];
+            bool encodeFailed[2] = {false, false};
+            bool taken[2] = {false, false};
+            encoded[binary(_lws)] = std::move(_message);
+            std::size_t deliveries = 0;
+            std::size_t frames = 0;
+            auto shardFrame = [&](bool _binary) {
+                auto &frame = encoded[_binary];
+                if (!frame) {
+                    if (encodeFailed[_binary]) {
+                        return framePtr_t();
+                    }
+                    const auto &src = *encoded[!_binary];
+                    if (!(_binary ? binProto_t::jsonToBin(src, m_framePool, frame) :
+                          binProto_t::binToJson(src, m_framePool, frame))) {
+                        encodeFailed[_binary] = true;
+                        metrics_t::inc(m_metrics.counters(g_shardIdx).parseFailures);
+                        TGWSS_LOG(m_logger, LL_WARNING,
+                                  FMT_STRING("fanOut: message can't be re-encoded, dropped, client peer {:p}"),
+                                  fmt::ptr(_lws));
+                        return framePtr_t();
+                    }
+                    frame->stamp(src.rxTime(), src.msgClass());
+                }
+                ++frames;
+                if (!taken[_binary]) {
+                    taken[_binary] = true;
+                    return frame;
+                }
+                auto copy = m_framePool.get(frame->size());
+                copy->append(frame->data(), frame->size());
+                copy->stamp(frame->rxTime(), frame->msgClass());
+                return copy;
+            };
+
+            const auto &members = *_members;
+            for (auto group = members.begin(); group != members.end();) {
+                // the members of one service thread are adjacent
+                auto shardIdx = group->shard;
+                auto groupEnd = std::find_if(group, members.end(),
+                                             [shardIdx](const rooms_t::member_t &_i) {return _i.shard != shardIdx;});
+                framePtr_t frame[2];
+                for (auto i = group; i != groupEnd; ++i) {
+                    if ((i->lws != _lws) && !frame[i->binary]) {
+                        frame[i->binary] = shardFrame(i->binary);
+                    }
+                }
+
+                {
+                    auto &shard = *m_shards[shardIdx];
+                    std::unique_lock<std::mutex> lck(shard.mtx);
+                    struct lws *wakeup = nullptr;
+                    for (auto i = group; i != groupEnd; ++i) {
+                        if ((i->lws == _lws) || !frame[i->binary]) {
+                            continue;
+                        }
+                        auto cl = shard.peers.find(i->lws);
+                        // the member may be gone meanwhile, its lws may be reused by another connection
+                        if ((cl == shard.peers.end()) || (cl->second->id != i->id) ||
+                            !enqueue(i->lws, *cl->second, frame[i->binary], LWS_CLOSE_STATUS_NO_STATUS)) {
+                            continue;
+                        }
+                        ++deliveries;
+                        if (shardIdx == g_shardIdx) {
+                            lws_callback_on_writable(i->lws);
+                        } else {
+                            shard.wakeups.push_back(i->lws);
+                            wakeup = i->lws;
+                        }
+                    }
+                    if (wakeup != nullptr) {
+                        // one wakeup of another service thread serves all its members, the lws stays valid
+                        // while the lock is held
+                        lws_cancel_service_pt(wakeup);
+                    }
+                }
+                group = groupEnd;
+            }
+
+            auto &stats = m_rooms.stats();
+            ++stats.messages;
+            stats.deliveries += deliveries;
+            stats.frames += frames;
+        } catch (...) {
+            TGWSS_LOG(m_logger, LL_ERROR,
+                      FMT_STRING("fanOut: client peer {:p}, failed (out of memory?)"),
+                      fmt::ptr(_lws));
+        }
+    }
+
+    void wsServer_t::leaveRoom(struct lws *_lws, const inlineToken_t &_token) noexcept {
+        try {
+            rooms_t::members_t members;
+            m_rooms.leave(_lws, members);
+            if (members) {
+                fanOut(_lws, members, stringMsg(_lws, binProto_t::msgType_t::MT_LEAVE_FROM, _token.str()));
+            }
+        } catch (...) {
+            TGWSS_LOG(m_logger, LL_ERROR, FMT_STRING("leaveRoom: internal error"));
+        }
+    }
+
+    bool wsServer_t::admit(int _fd) noexcept {
+        auto verdict = m_admissionControl.admit(_fd);
+        if (verdict != admissionControl_t::verdict_t::ADMITTED) {
+            TGWSS_LOG(m_logger, LL_DEBUG, FMT_STRING("wsServer: connection rejected ({:s}), socket {:d}"),
+                      (verdict == admissionControl_t::verdict_t::CONN_LIMIT) ? "connections limit" :
+                      (verdict == admissionControl_t::verdict_t::IP_LIMIT) ? "source IP limit" : "rate limit",
+                      _fd);
+            return false;
+        }
+
+        return true;
+    }
+
+    int wsServer_t::wscbListen(struct lws *_lws, enum lws_callback_reasons _reason,
+                               void *, void *, size_t) noexcept {
+        auto wsServer = static_cast<wsServer_t *>(lws_context_user(lws_get_context(_lws)));
+        if ((wsServer == nullptr) || !wsServer->m_handoff) {
+            return 0;
+        }
+
+        switch (_reason) {
+            case LWS_CALLBACK_RAW_RX_FILE: {
+                if (!wsServer->m_accepting) {
+                    return -1;
+                }
+                wsServer->accept(_lws);
+                break;
+            }
+            case LWS_CALLBACK_RAW_CLOSE_FILE: {
+                wsServer->m_listenWsi = nullptr;
+                break;
+            }
+            case LWS_CALLBACK_EVENT_WAIT_CANCELLED: {
+                // the listening socket is handed off, it's closed by its service thread
+                auto listenWsi = wsServer->m_listenWsi.load();
+                if (!wsServer->m_accepting && (listenWsi != nullptr) &&
+                    (static_cast<std::size_t>(lws_get_tsi(listenWsi)) == g_shardIdx)) {
+                    lws_set_timeout(listenWsi, PENDING_TIMEOUT_USER_OK, LWS_TO_KILL_ASYNC);
+                }
+                break;
+            }
+            default: {
+                break;
+            }
+        }
+
+        return 0;
+    }
+
+    void wsServer_t::accept(struct lws *_lws) noexcept {
+        auto listenFd = lws_get_socket_fd(_lws);
+        for (int i = 0; i < g_acceptBatch; ++i) {
+            int fd = accept4(listenFd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+            if (fd < 0) {
+                // EAGAIN, the successor may have taken the connections
+                break;
+            }
+            // lws filters & tunes the sockets it accepts by itself only
+            if (!admit(fd)) {
+                close(fd);
+                continue;
+            }
+            int opt = 1;
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt));
+            setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &opt, sizeof(opt));
+#if defined(TCP_KEEPIDLE)
+            opt = m_wsInfo.ka_time;
+            setsockopt(fd, IPPROTO_TCP, TCP_KEEPIDLE, &opt, sizeof(opt));
+            opt = m_wsInfo.ka_interval;
+            setsockopt(fd, IPPROTO_TCP, TCP_KEEPINTVL, &opt, sizeof(opt));
+            opt = m_wsInfo.ka_probes;
+            setsockopt(fd, IPPROTO_TCP, TCP_KEEPCNT, &opt, sizeof(opt));
+#endif
+            if (lws_adopt_socket_vhost(m_wsVhost, fd) == nullptr) {
+                // the socket is closed by lws
+                TGWSS_LOG(m_logger, LL_WARNING, FMT_STRING("wsServer: socket {:d} adoption failed"), fd);
+            }
+        }
+    }
+
+    void wsServer_t::handedOff() noexcept {
+        m_accepting = false;
+        lws_cancel_service(m_wsContext);
+        TGWSS_LOG(m_logger, LL_NOTICE,
+                  FMT_STRING("wsServer: listening socket is handed off, draining {:d} connection(s)"),
+                  m_admissionControl.connections());
+
+        // the peers of the old process are served until they leave or the drain timeout is expired
+        auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(m_drainTimeout);
+        while (!m_stopFlag && (m_admissionControl.connections() > 0) &&
+               (std::chrono::steady_clock::now() < deadline)) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        }
+        if (!m_stopFlag) {
+            TGWSS_LOG(m_logger, LL_NOTICE, FMT_STRING("wsServer: drained, {:d} connection(s) left, stopping"),
+                      m_admissionControl.connections());
+            kill(getpid(), SIGTERM);
+        }
+    }
+
+    void wsServer_t::reload(const confParser_t *_confParser) noexcept {
+        try {
+            m_admissionControl.limits(_confParser->connLimit(), _confParser->connLimitPerIp(),
+                                      _confParser->connRate(), _confParser->connBurst());
+            m_queueMsgLimit = _confParser->queueMsgLimit();
+            m_queueSizeLimit = _confParser->queueSizeLimit();
+            m_queueDropOldest = _confParser->queueDropOldest();
+            m_writeBatch = _confParser->writeBatch();
+            m_ioTimeout = _confParser->ioTimeout();
+            m_callTtl = _confParser->callTtl();
+            m_msgSizeLimit = _confParser->msgSizeLimit();
+            m_cutThrough = _confParser->cutThrough();
+            m_roomSizeLimit = _confParser->roomSizeLimit();
+
+            if ((_confParser->bindPort() != m_bindPort) ||
+                (_confParser->upgradeSocket().empty() == static_cast<bool>(m_handoff)) ||
+                (std::min<unsigned int>(_confParser->threads(), LWS_MAX_SMP) != m_shards.size()) ||
+                (_confParser->ssl() == m_certFile.empty()) ||
+                (_confParser->metricsPort() != m_metricsInfo.port) ||
+                (_confParser->clusterNodeId() != (m_cluster ? m_cluster->nodeId() : 0))) {
+                TGWSS_LOG(m_logger, LL_WARNING,
+                          FMT_STRING("wsServer: ports, threads, ssl, upgrade & cluster settings are applied on "
+                                     "restart only"));
+            }
+            if (!m_certFile.empty()) {
+                if ((_confParser->certFile() != m_certFile) || (_confParser->pkeyFile() != m_pkeyFile)) {
+                    TGWSS_LOG(m_logger, LL_WARNING,
+                              FMT_STRING("wsServer: new certificate locations are applied on restart only, "
+                                         "reloading {:s}"), m_certFile);
+                }
+                // lws vhosts are not thread safe, the certificate is reloaded by a service thread
+                m_reloadCerts = true;
+                lws_cancel_service(m_wsContext);
+            }
+
+            TGWSS_LOG(m_logger, LL_NOTICE, FMT_STRING("wsServer: configuration reloaded"));
+        } catch (...) {
+            TGWSS_LOG(m_logger, LL_ERROR, FMT_STRING("reload: internal error"));
+        }
+    }
+
+    void wsServer_t::reloadCerts() noexcept {
+#if defined(LWS_WITH_TLS)
+        // the SSL context of the vhost is reloaded, new connections get the new certificate while
+        // established sessions keep theirs
+        if (lws_tls_cert_updated(m_wsContext, m_certFile.c_str(), m_pkeyFile.c_str(),
+                                 nullptr, 0, nullptr, 0) != 0) {
+            TGWSS_LOG(m_logger, LL_ERROR, FMT_STRING("wsServer: failed to reload {:s}"), m_certFile);
+            return;
+        }
+        TGWSS_LOG(m_logger, LL_NOTICE, FMT_STRING("wsServer: {:s} reloaded"), m_certFile);
+#endif
+    }
+
+    void wsServer_t::dumpLatency() noexcept {
+        try {
+            for (std::size_t i = 0; i < metrics_t::LT_NUM; ++i) {
+                auto type = static_cast<metrics_t::latencyType_t>(i);
+                auto summary = m_metrics.latency(type);
+                TGWSS_LOG(m_logger, LL_NOTICE,
+                          FMT_STRING("latency: {:s}, messages {:d}, p50 {:d} us, p90 {:d} us, p99 {:d} us, "
+                                     "p99.9 {:d} us, max {:d} us"),
+                          metrics_t::latencyTypeName(type), summary.count,
+                          summary.quantilesUs[0], summary.quantilesUs[1], summary.quantilesUs[2],
+                          summary.quantilesUs[3], summary.maxUs);
+            }
+        } catch (...) {
+            TGWSS_LOG(m_logger, LL_ERROR, FMT_STRING("latency: internal error"));
+        }
+    }
+
+    void wsServer_t::deflateInit(struct lws *_lws) noexcept {
+        auto sessionData = static_cast<sessionData_t *>(lws_wsi_user(_lws));
+        if (sessionData == nullptr) {
+            return;
+        }
+        *sessionData = sessionData_t();
+        if (!m_deflate) {
+            return;
+        }
+        // fails if the client has not negotiated the extension,
+        // the compressor is initialized with the first frame sent, so the options are still applicable
+        sessionData->deflate = (lws_set_extension_option(_lws, "permessage-deflate", "server_max_window_bits",
+                                                         m_deflateWindowBits.c_str()) == 0) &&
+                               (lws_set_extension_option(_lws, "permessage-deflate", "mem_level",
+                                                         m_deflateMemLevel.c_str()) == 0);
+    }
+
+    void wsServer_t::deflateDone(struct lws *_lws) noexcept {
+        auto sessionData = static_cast<sessionData_t *>(lws_wsi_user(_lws));
+        if ((sessionData == nullptr) || !sessionData->deflate) {
+            return;
+        }
+        ++m_deflateStats.peers;
+        m_deflateStats.txRawBytes += sessionData->txRawBytes;
+        m_deflateStats.txDeflatedBytes += sessionData->txDeflatedBytes;
+        m_deflateStats.rxDeflatedBytes += sessionData->rxDeflatedBytes;
+        m_deflateStats.rxRawBytes += sessionData->rxRawBytes;
+        m_deflateStats.deflateNs += sessionData->deflateNs;
+        m_deflateStats.inflateNs += sessionData->inflateNs;
+
+        TGWSS_LOG(m_logger, LL_INFO,
+                  FMT_STRING("deflate: client {:p}, tx {:d}/{:d} bytes, rx {:d}/{:d} bytes (deflated/raw), "
+                             "deflate {:d} us, inflate {:d} us"),
+                  fmt::ptr(_lws),
+                  sessionData->txDeflatedBytes, sessionData->txRawBytes,
+                  sessionData->rxDeflatedBytes, sessionData->rxRawBytes,
+                  sessionData->deflateNs / 1000, sessionData->inflateNs / 1000);
+        sessionData->deflate = false;
+    }
+
+    bool wsServer_t::binary(struct lws *_lws) const noexcept {
+        auto protocol = lws_get_protocol(_lws);
+        return (protocol != nullptr) && (protocol->id == g_binProtoId);
+    }
+
+    void wsServer_t::trim(struct lws *_lws) noexcept {
+        auto &shard = *m_shards[g_shardIdx];
+        std::unique_lock<std::mutex> lck(shard.mtx);
+        auto peer = shard.peers.find(_lws);
+        if (peer != shard.peers.end()) {
+            peer->second->writeQueue.trim();
+        }
+    }
+
+    framePtr_t wsServer_t::statusMsg(struct lws *_lws, binProto_t::msgType_t _type, bool _status) {
+        return statusMsg(binary(_lws), _type, _status);
+    }
+
+    framePtr_t wsServer_t::statusMsg(bool _binary, binProto_t::msgType_t _type, bool _status) {
+        if (_binary) {
+            return binProto_t::writer_t(m_framePool, _type).flag(_status).frame();
+        }
+
+        // {"type": "logon", "status":true}, {"type": "call", "status": false}, {"type": "join", "status": true}
+        std::string msg;
+        switch (_type) {
+            case binProto_t::msgType_t::MT_LOGON_STATUS: {
+                msg = R"({"type": "logon", "status":)";
+                break;
+            }
+            case binProto_t::msgType_t::MT_JOIN_STATUS: {
+                msg = R"({"type": "join", "status": )";
+                break;
+            }
+            default: {
+                msg = R"({"type": "call", "status": )";
+                break;
+            }
+        }
+        msg += _status ? "true}" : "false}";
+        auto frame = m_framePool.get(msg.length());
+        frame->append(msg.data(), msg.length());
+        return frame;
+    }
+
+    framePtr_t wsServer_t::stringMsg(struct lws *_lws, binProto_t::msgType_t _type, const std::string &_value) {
+        return stringMsg(binary(_lws), _type, _value);
+    }
+
+    framePtr_t wsServer_t::stringMsg(bool _binary, binProto_t::msgType_t _type, const std::string &_value) {
+        if (_binary) {
+            return binProto_t::writer_t(m_framePool, _type, 2 + _value.length()).field(_value).frame();
+        }
+
+        std::string msg;
+        switch (_type) {
+            case binProto_t::msgType_t::MT_CALL_FROM: {
+                msg = R"({"type": "call", "from": ")" + _value + R"("})";
+                break;
+            }
+            case binProto_t::msgType_t::MT_INFO: {
+                msg = R"({"type": "info", "subscriber": ")" + _value + R"("})";
+                break;
+            }
+            case binProto_t::msgType_t::MT_JOIN_FROM: {
+                msg = R"({"type": "join", "from": ")" + _value + R"("})";
+                break;
+            }
+            case binProto_t::msgType_t::MT_LEAVE_FROM: {
+                msg = R"({"type": "leave", "from": ")" + _value + R"("})";
+                break;
+            }
+            default: {
+                msg = R"({"error": ")" + _value + R"("})";
+                break;
+            }
+        }
+        auto frame = m_framePool.get(msg.length());
+        frame->append(msg.data(), msg.length());
+        return frame;
+    }
+
+    framePtr_t wsServer_t::stamped(framePtr_t _frame, uint64_t _rxTime, metrics_t::latencyType_t _type) noexcept {
+        if (_frame) {
+            _frame->stamp(_rxTime, static_cast<uint8_t>(_type));
+        }
+        return _frame;
+    }
+
     void wsServer_t::closeWithErrMsg(struct lws *_lws, lws_close_status _status, const std::string &_errMsg) noexcept {
         try {
-            m_logger->log(logger_t::logLevel_t::LL_DEBUG,
-                          "closeWithErrMsg: {:s}",
-                          _errMsg);
+            TGWSS_LOG(m_logger, LL_DEBUG,
+                      FMT_STRING("closeWithErrMsg: {:s}"),
+                      _errMsg);
 
-            write(_lws, _errMsg.c_str(), _errMsg.length(), _status);
+            auto &counters = m_metrics.counters(g_shardIdx);
+            switch (_status) {
+                case LWS_CLOSE_STATUS_INVALID_PAYLOAD: {
+                    metrics_t::inc(counters.closeReasons[metrics_t::CR_INVALID_PAYLOAD]);
+                    break;
+                }
+                case LWS_CLOSE_STATUS_POLICY_VIOLATION: {
+                    metrics_t::inc(counters.closeReasons[metrics_t::CR_POLICY_VIOLATION]);
+                    break;
+                }
+                default: {
+                    metrics_t::inc(counters.closeReasons[metrics_t::CR_UNEXPECTED_CONDITION]);
+                    break;
+                }
+            }
+
+            write(_lws, g_shardIdx, 0, stringMsg(_lws, binProto_t::msgType_t::MT_ERROR, _errMsg), _status);
 //            std::vector<unsigned char> errBuf(_errMsg.length());
 //            std::memcpy(errBuf.data(), _errMsg.data(), _errMsg.length());
 //            lws_close_reason(_lws, _status, errBuf.data(), errBuf.size());
         } catch (...) {
-            m_logger->log(logger_t::logLevel_t::LL_ERROR, "close: unknown error");
+            TGWSS_LOG(m_logger, LL_ERROR, FMT_STRING("close: unknown error"));
         }
     }
 
     bool wsServer_t::logon(struct lws *_lws, const void *_data, std::size_t _size) noexcept {
+        auto rxTime = metrics_t::now();
         try {
             // parse _data
-            // client: {"type": "logon", token: "token_value"}
-            // server: {"type": "logon", "status":true}
-            rapidjson::Document json;
-            json.Parse(static_cast<const char *>(_data), _size);
-            if (json.HasParseError()) {
-                auto errStr = std::string(R"({"error": "failed to parse JSON. )")
-                              + rapidjson::GetParseError_En(json.GetParseError())
-                              + " Offset " + std::to_string(json.GetErrorOffset()) + "\"}";
+            // client: {"type": "logon", token: "token_value"} or LOGON [token]
+            // server: {"type": "logon", "status":true} or LOGON_STATUS [true]
+            msgClassifier_t msg;
+            if (!(binary(_lws) ? msg.parseBin(_data, _size) : msg.parse(static_cast<const char *>(_data), _size))) {
+                auto errStr = msg.error();
+                metrics_t::inc(m_metrics.counters(g_shardIdx).parseFailures);
                 closeWithErrMsg(_lws, LWS_CLOSE_STATUS_INVALID_PAYLOAD, errStr);
-                m_logger->log(logger_t::logLevel_t::LL_WARNING,
-                              "logon: failed to parse message - {:s}",
-                              std::string(reinterpret_cast<const char *>(_data), _size));
+                TGWSS_LOG(m_logger, LL_WARNING,
+                          FMT_STRING("logon: failed to parse message - {:s}"),
+                          fmt::string_view(reinterpret_cast<const char *>(_data), _size));
                 return false;
             }
             // check message type
-            if (json.HasMember("type") && json["type"].IsString() && std::string(json["type"].GetString()) == "logon") {
+            if (msg.msgType() == msgClassifier_t::msgType_t::MT_LOGON) {
                 // client peer registration request
-                if (!json.HasMember("token") || !json["token"].IsString()) {
-                    std::string errStr = R"({"error": "'token' missed"})";
+                if (!msg.token().present()) {
+                    std::string errStr = "'token' missed";
                     closeWithErrMsg(_lws, LWS_CLOSE_STATUS_INVALID_PAYLOAD, errStr);
-                    m_logger->log(logger_t::logLevel_t::LL_WARNING,
-                                  "logon: 'token' missed - {:s}",
-                                  std::string(reinterpret_cast<const char *>(_data), _size));
+                    TGWSS_LOG(m_logger, LL_WARNING,
+                              FMT_STRING("logon: 'token' missed - {:s}"),
+                              fmt::string_view(reinterpret_cast<const char *>(_data), _size));
                     return false;
                 }
-                std::string token = json["token"].GetString();
-                if (token.length() < 10) {
-                    std::string errStr = R"({"error": "wrong 'token' format"})";
+                std::string token = msg.token().str();
+                if ((token.length() < 10) || (token.length() > inlineToken_t::capacity)) {
+                    std::string errStr = "wrong 'token' format";
                     closeWithErrMsg(_lws, LWS_CLOSE_STATUS_INVALID_PAYLOAD, errStr);
-                    m_logger->log(logger_t::logLevel_t::LL_WARNING,
-                                  "logon: wrong 'token' format - {:s}",
-                                  std::string(reinterpret_cast<const char *>(_data), _size));
+                    TGWSS_LOG(m_logger, LL_WARNING,
+                              FMT_STRING("logon: wrong 'token' format - {:s}"),
+                              fmt::string_view(reinterpret_cast<const char *>(_data), _size));
                     return false;
                 }
-                for (const auto &i:m_peers) {
-                    if (i.second->token == token) {
-                        std::string errStr = R"({"error": "'token' is already online"})";
-                        closeWithErrMsg(_lws, LWS_CLOSE_STATUS_INVALID_PAYLOAD, errStr);
-                        m_logger->log(logger_t::logLevel_t::LL_WARNING,
-                                      "logon: 'token' is already online - {:s}",
-                                      token);
-                        return false;
-                    }
+                tokenDirectory_t::entry_t self;
+                self.lws = _lws;
+                self.shard = g_shardIdx;
+                self.id = ++m_peerIds;
+                self.binary = binary(_lws);
+                uint16_t node;
+                if ((m_cluster && m_cluster->find(token, node)) || !m_tokenDirectory.insert(token, self)) {
+                    std::string errStr = "'token' is already online";
+                    closeWithErrMsg(_lws, LWS_CLOSE_STATUS_INVALID_PAYLOAD, errStr);
+                    TGWSS_LOG(m_logger, LL_WARNING,
+                              FMT_STRING("logon: 'token' is already online - {:s}"),
+                              token);
+                    return false;
                 }
 
-                m_peers.emplace(_lws, std::make_unique<peerData_t>(token));
-                const std::string reply = R"({"type": "logon", "status":true})";
-                return write(_lws, reply.data(), reply.size());
+                try {
+                    auto &shard = *m_shards[g_shardIdx];
+                    std::unique_lock<std::mutex> lck(shard.mtx);
+                    auto peerData = shard.peersPool.create(token, self.id, self.binary, m_queueMsgLimit);
+                    try {
+                        shard.peers.emplace(_lws, peerData);
+                    } catch (...) {
+                        shard.peersPool.destroy(peerData);
+                        throw;
+                    }
+                } catch (...) {
+                    m_tokenDirectory.remove(token, _lws);
+                    throw;
+                }
+                metrics_t::inc(m_metrics.counters(g_shardIdx).logons);
+                if (m_cluster) {
+                    m_cluster->broadcast(m_cluster->tokenMsg(cluster_t::msgType_t::NM_ANNOUNCE, token), g_shardIdx);
+                }
+                if (!write(_lws, g_shardIdx, 0, stamped(statusMsg(_lws, binProto_t::msgType_t::MT_LOGON_STATUS, true),
+                                                        rxTime, metrics_t::LT_LOGON))) {
+                    return false;
+                }
+                // a call may be waiting for this token
+                pendingCalls_t::call_t call;
+                if (m_pendingCalls.take(token, call)) {
+                    deliverCall(call, self);
+                }
+                return true;
             }
-            std::string errStr = R"({"error": "unexpected message"})";
+            std::string errStr = "unexpected message";
             closeWithErrMsg(_lws, LWS_CLOSE_STATUS_UNEXPECTED_CONDITION, errStr);
-            m_logger->log(logger_t::logLevel_t::LL_WARNING,
-                          "logon: unexpected message - {:s}",
-                          std::string(reinterpret_cast<const char *>(_data), _size));
+            TGWSS_LOG(m_logger, LL_WARNING,
+                      FMT_STRING("logon: unexpected message - {:s}"),
+                      fmt::string_view(reinterpret_cast<const char *>(_data), _size));
         } catch (...) {
-            std::string errStr = R"({"error": "internal error"})";
+            std::string errStr = "internal error";
             closeWithErrMsg(_lws, LWS_CLOSE_STATUS_UNEXPECTED_CONDITION, errStr);
-            m_logger->log(logger_t::logLevel_t::LL_ERROR, "logon: internal error");
+            TGWSS_LOG(m_logger, LL_ERROR, FMT_STRING("logon: internal error"));
         }
 
         return false;
@@ -322,122 +1503,729 @@ namespace tgwss {
 
     bool wsServer_t::retransmit(struct lws *_lws, const void *_data, std::size_t _size) noexcept {
         try {
-            auto peer = m_peers.find(_lws);
-            if (peer != m_peers.end()) {
-                peer->second->readBuf.insert(peer->second->readBuf.end(),
-                                             static_cast<const char *>(_data),
-                                             static_cast<const char *>(_data) + _size);
-                if (peer->second->readBuf.size() > g_msgSizeLimit) {
-                    m_logger->log(logger_t::logLevel_t::LL_WARNING,
-                                  "retransmit: message size is out of limits, client peer {:p}, message size {:d}",
-                                  fmt::ptr(_lws), peer->second->readBuf.size());
+            auto &shard = *m_shards[g_shardIdx];
+            std::unique_lock<std::mutex> lck(shard.mtx);
+            auto peer = shard.peers.find(_lws);
+            if (peer != shard.peers.end()) {
+                // the entry is erased by this thread only, so it stays valid while unlocked
+                auto peerData = peer->second;
+                bool finalPart = lws_is_final_fragment(_lws) && (lws_remaining_packet_payload(_lws) == 0);
+                if ((peerData->cutThrough != nullptr) ||
+                    (!peerData->readFrame && !finalPart && m_cutThrough && (peerData->subscriber != nullptr) &&
+                     (peerData->binary == peerData->subscriberBinary))) {
+                    // the payload of paired peers is opaque, no need to wait for the whole message
+                    return relayFragment(_lws, *peerData, lck, _data, _size, finalPart);
+                }
+                // assemble the message right in the frame buffer, it will be queued to the subscriber as is;
+                // the rest of the frame is the length declared by the client, it's checked before it's reserved
+                std::size_t remaining = lws_remaining_packet_payload(_lws);
+                std::size_t msgSize = (peerData->readFrame ? peerData->readFrame->size() : 0) + _size + remaining;
+                if (msgSize > m_msgSizeLimit) {
+                    lck.unlock();
+                    TGWSS_LOG(m_logger, LL_WARNING,
+                              FMT_STRING("retransmit: message size is out of limits, client peer {:p}, message size {:d}"),
+                              fmt::ptr(_lws), msgSize);
                     return false;
                 }
+                bool firstFragment = !peerData->readFrame;
+                m_framePool.reserve(peerData->readFrame, _size + remaining);
+                if (firstFragment) {
+                    // the message type is known when the message is complete
+                    peerData->readFrame->stamp(metrics_t::now(), metrics_t::LT_OTHER);
+                }
+                peerData->readFrame->append(_data, _size);
 
                 // is it final part of message?
-                if (!lws_is_final_fragment(_lws) || (lws_remaining_packet_payload(_lws) > 0)) {
-                    m_logger->log(logger_t::logLevel_t::LL_DEBUG,
-                                  "retransmit: waiting for more data, client peer {:p}",
-                                  fmt::ptr(_lws));
+                if (!finalPart) {
+                    TGWSS_LOG(m_logger, LL_DEBUG,
+                              FMT_STRING("retransmit: waiting for more data, client peer {:p}"),
+                              fmt::ptr(_lws));
                     return true; // no, waiting for more data
                 }
 
                 // complete message received
-                std::vector<char> message = std::move(peer->second->readBuf);
+                framePtr_t message = std::move(peerData->readFrame);
+                struct lws *subscriber = peerData->subscriber;
+                uint64_t subscriberId = peerData->subscriberId;
+                std::size_t subscriberShard = peerData->subscriberShard;
+                bool subscriberBinary = peerData->subscriberBinary;
+                uint16_t subscriberNode = peerData->subscriberNode;
+                inlineToken_t subscriberToken;
+                if (subscriberNode != 0) {
+                    subscriberToken = peerData->subscriberToken;
+                }
+                lck.unlock();
 
-                if (peer->second->subscriber == nullptr) { // new call
+                if ((subscriber == nullptr) && (subscriberNode == 0)) { // new call or group call
                     // parse message
-                    // client: {"type": "call", token: "token_value"}
-                    // server: {"type": "call", "status":true}
-                    rapidjson::Document json;
-                    json.Parse(static_cast<const char *>(_data), _size);
-                    if (json.HasParseError()) {
-                        auto errStr = std::string(R"({"error": "failed to parse JSON. )")
-                                      + rapidjson::GetParseError_En(json.GetParseError())
-                                      + " Offset " + std::to_string(json.GetErrorOffset()) + "\"}";
+                    // client: {"type": "call", token: "token_value"} or CALL [token]
+                    // server: {"type": "call", "status":true} or CALL_STATUS [true]
+                    msgClassifier_t msg;
+                    if (!(binary(_lws) ? msg.parseBin(message->data(), message->size()) :
+                          msg.parse(reinterpret_cast<const char *>(message->data()), message->size()))) {
+                        auto errStr = msg.error();
+                        metrics_t::inc(m_metrics.counters(g_shardIdx).parseFailures);
                         closeWithErrMsg(_lws, LWS_CLOSE_STATUS_INVALID_PAYLOAD, errStr);
-                        m_logger->log(logger_t::logLevel_t::LL_WARNING,
-                                      "retransmit: failed to parse message - {:s}",
-                                      std::string(reinterpret_cast<const char *>(_data), _size));
+                        TGWSS_LOG(m_logger, LL_WARNING,
+                                  FMT_STRING("retransmit: failed to parse message - {:s}"),
+                                  fmt::string_view(reinterpret_cast<const char *>(message->data()),
+                                                   message->size()));
                         return false;
                     }
                     // check message type
-                    if (json.HasMember("type") && json["type"].IsString() &&
-                        std::string(json["type"].GetString()) == "call") {
+                    if (msg.msgType() == msgClassifier_t::msgType_t::MT_CALL) {
                         // client peer call request
-                        if (!json.HasMember("to") || !json["to"].IsString()) {
-                            std::string errStr = R"({"error": "'to' missed"})";
+                        if (!msg.to().present()) {
+                            std::string errStr = "'to' missed";
                             closeWithErrMsg(_lws, LWS_CLOSE_STATUS_INVALID_PAYLOAD, errStr);
-                            m_logger->log(logger_t::logLevel_t::LL_WARNING,
-                                          "retransmit: 'to' missed - {:s}",
-                                          std::string(reinterpret_cast<const char *>(_data), _size));
+                            TGWSS_LOG(m_logger, LL_WARNING,
+                                      FMT_STRING("retransmit: 'to' missed - {:s}"),
+                                      fmt::string_view(reinterpret_cast<const char *>(message->data()),
+                                                       message->size()));
                             return false;
                         }
-                        std::string token = json["to"].GetString();
-                        if (token.length() < 10) {
-                            std::string errStr = R"({"error": "wrong 'to' format"})";
+                        if ((msg.to().size() < 10) || (msg.to().size() > inlineToken_t::capacity)) {
+                            std::string errStr = "wrong 'to' format";
                             closeWithErrMsg(_lws, LWS_CLOSE_STATUS_INVALID_PAYLOAD, errStr);
-                            m_logger->log(logger_t::logLevel_t::LL_WARNING,
-                                          "retransmit: wrong 'to' format - {:s}",
-                                          std::string(reinterpret_cast<const char *>(_data), _size));
+                            TGWSS_LOG(m_logger, LL_WARNING,
+                                      FMT_STRING("retransmit: wrong 'to' format - {:s}"),
+                                      fmt::string_view(reinterpret_cast<const char *>(message->data()),
+                                                       message->size()));
                             return false;
                         }
-                        for (const auto &i:m_peers) {
-                            if (i.second->token == token) {
-                                peer->second->subscriber = i.first;
-                                i.second->subscriber = _lws;
-                                std::string reply = R"({"type": "call", "from": ")" + peer->second->token + R"("})";
-                                return write(i.first, reply.c_str(), reply.length());
+                        // a new call replaces the pending one
+                        m_pendingCalls.cancel(_lws);
+                        // the lookup key buffer keeps its capacity between calls
+                        auto &token = g_tokenBuf;
+                        token.assign(msg.to().data(), msg.to().size());
+                        tokenDirectory_t::entry_t callee;
+                        if (m_tokenDirectory.find(token, callee)) {
+                            bool paired = false;
+                            {
+                                auto &calleeShard = *m_shards[callee.shard];
+                                std::unique_lock<std::mutex> calleeLck(calleeShard.mtx);
+                                auto i = calleeShard.peers.find(callee.lws);
+                                if ((i != calleeShard.peers.end()) && (i->second->id == callee.id)) {
+                                    if ((i->second->subscriber != nullptr) || i->second->caller) {
+                                        // the callee drops its previous call
+                                        metrics_t::inc(m_metrics.counters(g_shardIdx).callsEnded);
+                                    }
+                                    i->second->subscriber = _lws;
+                                    i->second->subscriberId = peerData->id;
+                                    i->second->subscriberShard = static_cast<uint32_t>(g_shardIdx);
+                                    i->second->subscriberBinary = peerData->binary;
+                                    i->second->subscriberNode = 0;
+                                    i->second->subscriberToken.clear();
+                                    i->second->caller = false;
+                                    paired = true;
+                                }
                             }
+                            if (paired) {
+                                // the callee's own pending call is answered by this one
+                                m_pendingCalls.cancel(callee.lws);
+                                {
+                                    std::unique_lock<std::mutex> ownLck(shard.mtx);
+                                    peerData->subscriber = callee.lws;
+                                    peerData->subscriberId = callee.id;
+                                    peerData->subscriberShard = static_cast<uint32_t>(callee.shard);
+                                    peerData->subscriberBinary = callee.binary;
+                                }
+                                metrics_t::inc(m_metrics.counters(g_shardIdx).callsStarted);
+                                // token is immutable, no lock required
+                                return write(callee.lws, callee.shard, callee.id,
+                                             stamped(stringMsg(callee.binary, binProto_t::msgType_t::MT_CALL_FROM,
+                                                               peerData->token.str()),
+                                                     message->rxTime(), metrics_t::LT_CALL));
+                            }
+                        }
+                        uint16_t node;
+                        if (m_cluster && m_cluster->find(token, node) &&
+                            m_cluster->send(node, m_cluster->callMsg(cluster_t::msgType_t::NM_CALL,
+                                                                     peerData->token.data(), peerData->token.size(),
+                                                                     token.data(), token.size()),
+                                            g_shardIdx)) {
+                            // the callee is online on another node, which replies with NM_PAIRED or NM_OFFLINE
+                            return true;
                         }
-                        std::string errStr = R"({"type": "call", "status": false})";
-                        m_logger->log(logger_t::logLevel_t::LL_WARNING,
-                                      "retransmit: 'token' is offline - {:s}",
+                        if (m_callTtl > 0) {
+                            // the call waits for the callee to log on, the caller is answered if it expires
+                            pendingCalls_t::call_t call;
+                            call.caller = _lws;
+                            call.callerShard = g_shardIdx;
+                            call.callerId = peerData->id;
+                            call.callerToken = peerData->token.str();
+                            call.binary = peerData->binary;
+                            call.rxTime = message->rxTime();
+                            call.expires = std::chrono::steady_clock::now() + std::chrono::seconds(m_callTtl);
+                            std::vector<pendingCalls_t::call_t> dropped;
+                            m_pendingCalls.park(token, std::move(call), dropped);
+                            for (const auto &i:dropped) {
+                                rejectCall(i);
+                            }
+                            TGWSS_LOG(m_logger, LL_DEBUG,
+                                      FMT_STRING("retransmit: 'token' is offline, the call is pending - {:s}"),
                                       token);
-//                        closeWithErrMsg(_lws, LWS_CLOSE_STATUS_INVALID_PAYLOAD, errStr);
-                        return write(_lws, errStr.c_str(), errStr.length());
-                    } else {
-                        std::string errStr = R"({"error": "unexpected message"})";
-                        closeWithErrMsg(_lws, LWS_CLOSE_STATUS_UNEXPECTED_CONDITION, errStr);
-                        m_logger->log(logger_t::logLevel_t::LL_WARNING,
-                                      "retransmit: unexpected message - {:s}",
-                                      std::string(reinterpret_cast<const char *>(_data), _size));
+                            // the callee may have logged on since the lookup
+                            if (m_tokenDirectory.find(token, callee) && m_pendingCalls.take(token, call)) {
+                                deliverCall(call, callee);
+                            }
+                            return true;
+                        }
+                        TGWSS_LOG(m_logger, LL_WARNING,
+                                  FMT_STRING("retransmit: 'token' is offline - {:s}"),
+                                  token);
+                        return write(_lws, g_shardIdx, 0,
+                                     stamped(statusMsg(_lws, binProto_t::msgType_t::MT_CALL_STATUS, false),
+                                             message->rxTime(), metrics_t::LT_CALL));
+                    } else if (msg.msgType() == msgClassifier_t::msgType_t::MT_JOIN) {
+                        // client: {"type": "join", "room": "room_name"} or JOIN [room]
+                        // server: {"type": "join", "status": true} or JOIN_STATUS [true]
+                        if (!msg.room().present()) {
+                            std::string errStr = "'room' missed";
+                            closeWithErrMsg(_lws, LWS_CLOSE_STATUS_INVALID_PAYLOAD, errStr);
+                            TGWSS_LOG(m_logger, LL_WARNING,
+                                      FMT_STRING("retransmit: 'room' missed - {:s}"),
+                                      fmt::string_view(reinterpret_cast<const char *>(message->data()),
+                                                       message->size()));
+                            return false;
+                        }
+                        if ((msg.room().size() == 0) || (msg.room().size() > inlineToken_t::capacity)) {
+                            std::string errStr = "wrong 'room' format";
+                            closeWithErrMsg(_lws, LWS_CLOSE_STATUS_INVALID_PAYLOAD, errStr);
+                            TGWSS_LOG(m_logger, LL_WARNING,
+                                      FMT_STRING("retransmit: wrong 'room' format - {:s}"),
+                                      fmt::string_view(reinterpret_cast<const char *>(message->data()),
+                                                       message->size()));
+                            return false;
+                        }
+                        // a peer is a member of one room at most
+                        leaveRoom(_lws, peerData->token);
+                        rooms_t::members_t members;
+                        bool joined = false;
+                        const uint16_t roomSizeLimit = m_roomSizeLimit;
+                        if (roomSizeLimit > 0) {
+                            rooms_t::member_t member;
+                            member.lws = _lws;
+                            member.shard = g_shardIdx;
+                            member.id = peerData->id;
+                            member.binary = peerData->binary;
+                            joined = m_rooms.join(msg.room().str(), member, roomSizeLimit, members);
+                        }
+                        if (!write(_lws, g_shardIdx, 0,
+                                   stamped(statusMsg(_lws, binProto_t::msgType_t::MT_JOIN_STATUS, joined),
+                                           message->rxTime(), metrics_t::LT_OTHER))) {
+                            return false;
+                        }
+                        if (!joined) {
+                            TGWSS_LOG(m_logger, LL_WARNING,
+                                      FMT_STRING("retransmit: room is full or rooms are disabled - {:s}"),
+                                      fmt::string_view(msg.room().data(), msg.room().size()));
+                            return true;
+                        }
+                        // the other members learn the token of the new one
+                        fanOut(_lws, members, stringMsg(_lws, binProto_t::msgType_t::MT_JOIN_FROM,
+                                                        peerData->token.str()));
+                        return true;
+                    } else if (msg.msgType() == msgClassifier_t::msgType_t::MT_LEAVE) {
+                        // client: {"type": "leave"} or LEAVE, no reply
+                        leaveRoom(_lws, peerData->token);
+                        return true;
+                    } else if (msg.msgType() != msgClassifier_t::msgType_t::MT_LOGON) {
+                        // group call, the message is relayed to all the other members of the room as is
+                        auto members = m_rooms.members(_lws);
+                        if (members) {
+                            auto &counters = m_metrics.counters(g_shardIdx);
+                            auto relayType = metrics_t::relayType(*message, binary(_lws));
+                            metrics_t::inc(counters.relayedMsgs[relayType]);
+                            metrics_t::inc(counters.relayedBytes[relayType], message->size());
+                            message->stamp(message->rxTime(), metrics_t::latencyType(relayType));
+                            fanOut(_lws, members, std::move(message));
+                            return true;
+                        }
                     }
 
+                    std::string errStr = "unexpected message";
+                    closeWithErrMsg(_lws, LWS_CLOSE_STATUS_UNEXPECTED_CONDITION, errStr);
+                    TGWSS_LOG(m_logger, LL_WARNING,
+                              FMT_STRING("retransmit: unexpected message - {:s}"),
+                              fmt::string_view(reinterpret_cast<const char *>(message->data()),
+                                               message->size()));
                     return false;
                 }
 
-                return write(peer->second->subscriber, message.data(), message.size());
+                auto &counters = m_metrics.counters(g_shardIdx);
+                auto relayType = metrics_t::relayType(*message, binary(_lws));
+                metrics_t::inc(counters.relayedMsgs[relayType]);
+                metrics_t::inc(counters.relayedBytes[relayType], message->size());
+                message->stamp(message->rxTime(), metrics_t::latencyType(relayType));
+
+                if (subscriberNode != 0) {
+                    // the subscriber's node re-encodes the message if their subprotocols differ
+                    if (!m_cluster->send(subscriberNode,
+                                         m_cluster->relayMsg(peerData->token.data(), peerData->token.size(),
+                                                             subscriberToken.data(), subscriberToken.size(),
+                                                             binary(_lws), *message),
+                                         g_shardIdx)) {
+                        TGWSS_LOG(m_logger, LL_WARNING,
+                                  FMT_STRING("retransmit: node {:d} is unreachable, message dropped, client peer {:p}"),
+                                  subscriberNode, fmt::ptr(_lws));
+                    }
+                    return true;
+                }
+
+                if (binary(_lws) != subscriberBinary) {
+                    // peers of different subprotocols, the message is re-encoded for the subscriber
+                    framePtr_t transcoded;
+                    if (!(binary(_lws) ? binProto_t::binToJson(*message, m_framePool, transcoded) :
+                          binProto_t::jsonToBin(*message, m_framePool, transcoded))) {
+                        metrics_t::inc(counters.parseFailures);
+                        TGWSS_LOG(m_logger, LL_WARNING,
+                                  FMT_STRING("retransmit: message can't be re-encoded, dropped, client peer {:p}"),
+                                  fmt::ptr(_lws));
+                        return true;
+                    }
+                    transcoded->stamp(message->rxTime(), message->msgClass());
+                    message = std::move(transcoded);
+                }
+
+                return write(subscriber, subscriberShard, subscriberId, std::move(message));
             }
-            m_logger->log(logger_t::logLevel_t::LL_WARNING,
-                          "retransmit: unknown client peer {:p}",
-                          fmt::ptr(_lws));
+            lck.unlock();
+            TGWSS_LOG(m_logger, LL_WARNING,
+                      FMT_STRING("retransmit: unknown client peer {:p}"),
+                      fmt::ptr(_lws));
         } catch (...) {
-            m_logger->log(logger_t::logLevel_t::LL_ERROR, "retransmit: internal error");
+            TGWSS_LOG(m_logger, LL_ERROR, FMT_STRING("retransmit: internal error"));
         }
 
         return false;
     }
 
+    bool wsServer_t::relayFragment(struct lws *_lws, peerData_t &_peerData, std::unique_lock<std::mutex> &_lck,
+                                   const void *_data, std::size_t _size, bool _final) {
+        // all the parts go to the subscriber of the first one, even if the peers are re-paired meanwhile
+        bool first = (_peerData.cutThrough == nullptr);
+        if (first) {
+            _peerData.cutThrough = _peerData.subscriber;
+            _peerData.cutThroughId = _peerData.subscriberId;
+            _peerData.cutThroughShard = _peerData.subscriberShard;
+            _peerData.cutThroughSize = 0;
+        }
+        std::size_t msgSize = _peerData.cutThroughSize + _size;
+        if (msgSize > m_msgSizeLimit) {
+            _lck.unlock();
+            TGWSS_LOG(m_logger, LL_WARNING,
+                      FMT_STRING("retransmit: message size is out of limits, client peer {:p}, message size {:d}"),
+                      fmt::ptr(_lws), msgSize);
+            // the subscriber's part of the message is closed on removal
+            return false;
+        }
+        _peerData.cutThroughSize = static_cast<uint32_t>(msgSize);
+        struct lws *subscriber = _peerData.cutThrough;
+        uint64_t subscriberId = _peerData.cutThroughId;
+        std::size_t subscriberShard = _peerData.cutThroughShard;
+        if (_final) {
+            _peerData.cutThrough = nullptr;
+        }
+        _lck.unlock();
+
+        auto frame = m_framePool.get(_size);
+        frame->append(_data, _size);
+        frame->fragment(first ? frame_t::FR_FIRST : (_final ? frame_t::FR_LAST : frame_t::FR_MIDDLE), _lws);
+        auto &counters = m_metrics.counters(g_shardIdx);
+        if (first) {
+            // the message type is in its head, the latency is accounted till the first part is written
+            auto relayType = metrics_t::relayType(*frame, binary(_lws));
+            _peerData.cutThroughType = static_cast<uint8_t>(relayType);
+            metrics_t::inc(counters.relayedMsgs[relayType]);
+            frame->stamp(metrics_t::now(), metrics_t::latencyType(relayType));
+        }
+        metrics_t::inc(counters.relayedBytes[_peerData.cutThroughType], _size);
+
+        return write(subscriber, subscriberShard, subscriberId, std::move(frame));
+    }
+
     void wsServer_t::remove(struct lws *_lws) noexcept {
         try {
-            auto peer = m_peers.find(_lws);
-            if (peer == m_peers.end()) {
-                m_logger->log(logger_t::logLevel_t::LL_WARNING,
-                              "remove: unknown client peer {:p}",
-                              fmt::ptr(_lws));
+            m_pendingCalls.cancel(_lws);
+            auto &shard = *m_shards[g_shardIdx];
+            peerData_t *peerData = nullptr;
+            {
+                std::unique_lock<std::mutex> lck(shard.mtx);
+                auto peer = shard.peers.find(_lws);
+                if (peer != shard.peers.end()) {
+                    peerData = peer->second;
+                    shard.peers.erase(peer);
+                }
+            }
+            if (peerData == nullptr) {
+                TGWSS_LOG(m_logger, LL_WARNING,
+                          FMT_STRING("remove: unknown client peer {:p}"),
+                          fmt::ptr(_lws));
                 return;
             }
-            auto subscriber = m_peers.find(peer->second->subscriber);
-            if (subscriber != m_peers.end()) {
-                std::string msgToPeer = R"({"type": "info", "subscriber": "disconnected"})";
-                write(subscriber->first, msgToPeer.data(), msgToPeer.length());
-                subscriber->second->subscriber = nullptr;
+            m_queueStats.queuedBytes -= peerData->writeQueue.bytes();
+            m_queueStats.queuedMsgs -= peerData->writeQueue.size();
+            // the peer is not reachable by other threads anymore, its slot is released by this thread
+            struct peerDeleter_t {
+                shard_t *shard;
+                void operator()(peerData_t *_peerData) const noexcept {shard->peersPool.destroy(_peerData);}
+            };
+            std::unique_ptr<peerData_t, peerDeleter_t> peerSlot(peerData, peerDeleter_t {&shard});
+            leaveRoom(_lws, peerData->token);
+            if (peerData->cutThrough != nullptr) {
+                // the subscriber gets the message received so far
+                auto frame = m_framePool.get(0);
+                frame->fragment(frame_t::FR_LAST, _lws);
+                write(peerData->cutThrough, peerData->cutThroughShard, peerData->cutThroughId, std::move(frame));
+            }
+            auto token = peerData->token.str();
+            if (m_tokenDirectory.remove(token, _lws) && m_cluster) {
+                m_cluster->broadcast(m_cluster->tokenMsg(cluster_t::msgType_t::NM_WITHDRAW, token), g_shardIdx);
+            }
+            if (peerData->subscriberNode != 0) {
+                // the subscriber's node notifies it
+                if (peerData->caller) {
+                    metrics_t::inc(m_metrics.counters(g_shardIdx).callsEnded);
+                }
+                m_cluster->send(peerData->subscriberNode,
+                                m_cluster->callMsg(cluster_t::msgType_t::NM_HANGUP,
+                                                   peerData->token.data(), peerData->token.size(),
+                                                   peerData->subscriberToken.data(), peerData->subscriberToken.size()),
+                                g_shardIdx);
+            }
+            if (peerData->subscriber != nullptr) {
+                auto &subscriberShard = *m_shards[peerData->subscriberShard];
+                bool notify = false;
+                {
+                    std::unique_lock<std::mutex> lck(subscriberShard.mtx);
+                    auto subscriber = subscriberShard.peers.find(peerData->subscriber);
+                    if ((subscriber != subscriberShard.peers.end()) &&
+                        (subscriber->second->id == peerData->subscriberId) &&
+                        (subscriber->second->subscriberId == peerData->id)) {
+                        subscriber->second->subscriber = nullptr;
+                        subscriber->second->subscriberId = 0;
+                        notify = true;
+                    }
+                }
+                if (notify) {
+                    metrics_t::inc(m_metrics.counters(g_shardIdx).callsEnded);
+                    write(peerData->subscriber, peerData->subscriberShard, peerData->subscriberId,
+                          stringMsg(peerData->subscriberBinary, binProto_t::msgType_t::MT_INFO, "disconnected"));
+                }
+            }
+            TGWSS_LOG(m_logger, LL_DEBUG, FMT_STRING("remove: peer {:p}"), fmt::ptr(_lws));
+        } catch (...) {
+            TGWSS_LOG(m_logger, LL_ERROR, FMT_STRING("remove: internal error"));
+        }
+    }
+
+    std::size_t wsServer_t::peerStateSize() noexcept {
+        // a hash table node is the next pointer & the value (& the cached hash of string keys) plus the malloc
+        // header, the bucket is one more pointer (max load factor is 1). Tokens longer than the short string
+        // buffer add their length to the directory key
+        static const std::size_t nodeOverhead = 3 * sizeof(void *);
+        return slabPool_t<peerData_t>::slotSize +
+               sizeof(std::pair<struct lws *const, peerData_t *>) + nodeOverhead +
+               sizeof(std::pair<const std::string, tokenDirectory_t::entry_t>) + sizeof(std::size_t) + nodeOverhead +
+               sizeof(sessionData_t);
+    }
+
+    void wsServer_t::deliverCall(const pendingCalls_t::call_t &_call,
+                                 const tokenDirectory_t::entry_t &_callee) noexcept {
+        try {
+            // the callee first, as for a call to an online peer, then the caller which may be gone or called
+            // by another peer meanwhile
+            bool paired = false;
+            {
+                auto &shard = *m_shards[_callee.shard];
+                std::unique_lock<std::mutex> lck(shard.mtx);
+                auto i = shard.peers.find(_callee.lws);
+                if ((i != shard.peers.end()) && (i->second->id == _callee.id) && !i->second->paired()) {
+                    i->second->subscriber = _call.caller;
+                    i->second->subscriberId = _call.callerId;
+                    i->second->subscriberShard = static_cast<uint32_t>(_call.callerShard);
+                    i->second->subscriberBinary = _call.binary;
+                    i->second->caller = false;
+                    paired = true;
+                }
+            }
+            if (paired) {
+                auto &shard = *m_shards[_call.callerShard];
+                std::unique_lock<std::mutex> lck(shard.mtx);
+                auto i = shard.peers.find(_call.caller);
+                paired = (i != shard.peers.end()) && (i->second->id == _call.callerId) && !i->second->paired();
+                if (paired) {
+                    i->second->subscriber = _callee.lws;
+                    i->second->subscriberId = _callee.id;
+                    i->second->subscriberShard = static_cast<uint32_t>(_callee.shard);
+                    i->second->subscriberBinary = _callee.binary;
+                }
+            }
+            if (!paired) {
+                auto &shard = *m_shards[_callee.shard];
+                std::unique_lock<std::mutex> lck(shard.mtx);
+                auto i = shard.peers.find(_callee.lws);
+                if ((i != shard.peers.end()) && (i->second->id == _callee.id) &&
+                    (i->second->subscriberId == _call.callerId)) {
+                    i->second->subscriber = nullptr;
+                    i->second->subscriberId = 0;
+                }
+                lck.unlock();
+                rejectCall(_call);
+                return;
+            }
+
+            metrics_t::inc(m_metrics.counters(g_shardIdx).callsStarted);
+            write(_callee.lws, _callee.shard, _callee.id,
+                  stamped(stringMsg(_callee.binary, binProto_t::msgType_t::MT_CALL_FROM, _call.callerToken),
+                          _call.rxTime, metrics_t::LT_CALL));
+        } catch (...) {
+            TGWSS_LOG(m_logger, LL_ERROR, FMT_STRING("deliverCall: internal error"));
+        }
+    }
+
+    void wsServer_t::rejectCall(const pendingCalls_t::call_t &_call) noexcept {
+        try {
+            // the caller's subprotocol is saved with the call, its lws may be gone already or reused
+            write(_call.caller, _call.callerShard, _call.callerId,
+                  stamped(statusMsg(_call.binary, binProto_t::msgType_t::MT_CALL_STATUS, false),
+                          _call.rxTime, metrics_t::LT_CALL));
+        } catch (...) {
+            TGWSS_LOG(m_logger, LL_ERROR, FMT_STRING("rejectCall: internal error"));
+        }
+    }
+
+    void wsServer_t::expireCalls() noexcept {
+        try {
+            std::vector<pendingCalls_t::call_t> expired;
+            m_pendingCalls.expire(std::chrono::steady_clock::now(), expired);
+            for (const auto &i:expired) {
+                TGWSS_LOG(m_logger, LL_DEBUG, FMT_STRING("expireCalls: call of {:s} is expired"), i.callerToken);
+                rejectCall(i);
+            }
+        } catch (...) {
+            TGWSS_LOG(m_logger, LL_ERROR, FMT_STRING("expireCalls: internal error"));
+        }
+    }
+
+    void wsServer_t::clusterAnnounced(uint16_t _node, const std::vector<std::string> &_tokens) noexcept {
+        try {
+            for (const auto &i:_tokens) {
+                pendingCalls_t::call_t call;
+                if (!m_pendingCalls.take(i, call)) {
+                    continue;
+                }
+                // the callee's node replies with NM_PAIRED or NM_OFFLINE as to any other call
+                if (!m_cluster->send(_node, m_cluster->callMsg(cluster_t::msgType_t::NM_CALL,
+                                                               call.callerToken.data(), call.callerToken.size(),
+                                                               i.data(), i.size()),
+                                     g_shardIdx)) {
+                    rejectCall(call);
+                }
+            }
+        } catch (...) {
+            TGWSS_LOG(m_logger, LL_ERROR, FMT_STRING("clusterAnnounced: internal error"));
+        }
+    }
+
+    void wsServer_t::clusterReceive(uint16_t _node, const frame_t &_frame) noexcept {
+        try {
+            cluster_t::msg_t msg;
+            if (!cluster_t::decode(_frame, msg) ||
+                (msg.fromSize > inlineToken_t::capacity) || (msg.toSize > inlineToken_t::capacity)) {
+                TGWSS_LOG(m_logger, LL_WARNING, FMT_STRING("clusterReceive: malformed message, node {:d}"), _node);
+                return;
+            }
+            auto rxTime = metrics_t::now();
+
+            // the peer of this node is the callee of NM_CALL, NM_RELAY & NM_HANGUP and the caller of the replies
+            bool reply = (msg.type == cluster_t::msgType_t::NM_PAIRED) || (msg.type == cluster_t::msgType_t::NM_OFFLINE);
+            const char *remote = reply ? msg.to : msg.from;
+            std::size_t remoteSize = reply ? msg.toSize : msg.fromSize;
+            auto &token = g_tokenBuf;
+            if (reply) {
+                token.assign(msg.from, msg.fromSize);
+            } else {
+                token.assign(msg.to, msg.toSize);
+            }
+            tokenDirectory_t::entry_t peer;
+            bool found = m_tokenDirectory.find(token, peer);
+            // is the peer paired with the remote peer?
+            auto pairedWith = [_node, remote, remoteSize](const peerData_t &_peerData) {
+                return (_peerData.subscriberNode == _node) &&
+                       _peerData.subscriberToken.equals(remote, remoteSize);
+            };
+
+            auto &counters = m_metrics.counters(g_shardIdx);
+            switch (msg.type) {
+                case cluster_t::msgType_t::NM_CALL: {
+                    bool paired = false;
+                    if (found) {
+                        auto &shard = *m_shards[peer.shard];
+                        std::unique_lock<std::mutex> lck(shard.mtx);
+                        auto i = shard.peers.find(peer.lws);
+                        if ((i != shard.peers.end()) && (i->second->id == peer.id)) {
+                            if ((i->second->subscriber != nullptr) || i->second->caller) {
+                                // the callee drops its previous call
+                                metrics_t::inc(counters.callsEnded);
+                            }
+                            i->second->subscriber = nullptr;
+                            i->second->subscriberId = 0;
+                            i->second->subscriberNode = _node;
+                            i->second->subscriberToken.assign(remote, remoteSize);
+                            i->second->caller = false;
+                            paired = true;
+                        }
+                    }
+                    if (paired) {
+                        m_pendingCalls.cancel(peer.lws);
+                    }
+                    // queued ahead of the callee's messages relayed over the same link
+                    m_cluster->send(_node, m_cluster->callMsg(paired ? cluster_t::msgType_t::NM_PAIRED :
+                                                              cluster_t::msgType_t::NM_OFFLINE,
+                                                              msg.from, msg.fromSize, msg.to, msg.toSize),
+                                    g_shardIdx);
+                    if (paired) {
+                        write(peer.lws, peer.shard, peer.id,
+                              stamped(stringMsg(peer.binary, binProto_t::msgType_t::MT_CALL_FROM,
+                                                std::string(remote, remoteSize)),
+                                      rxTime, metrics_t::LT_CALL));
+                    }
+                    break;
+                }
+                case cluster_t::msgType_t::NM_PAIRED: {
+                    bool paired = false;
+                    if (found) {
+                        auto &shard = *m_shards[peer.shard];
+                        std::unique_lock<std::mutex> lck(shard.mtx);
+                        auto i = shard.peers.find(peer.lws);
+                        if ((i != shard.peers.end()) && (i->second->id == peer.id) && !i->second->paired()) {
+                            i->second->subscriberNode = _node;
+                            i->second->subscriberToken.assign(remote, remoteSize);
+                            i->second->caller = true;
+                            paired = true;
+                        }
+                    }
+                    if (paired) {
+                        metrics_t::inc(counters.callsStarted);
+                    } else {
+                        // the caller is gone or has been called meanwhile
+                        m_cluster->send(_node, m_cluster->callMsg(cluster_t::msgType_t::NM_HANGUP,
+                                                                  msg.from, msg.fromSize, msg.to, msg.toSize),
+                                        g_shardIdx);
+                    }
+                    break;
+                }
+                case cluster_t::msgType_t::NM_OFFLINE: {
+                    TGWSS_LOG(m_logger, LL_WARNING,
+                              FMT_STRING("clusterReceive: 'token' is offline - {:s}"),
+                              fmt::string_view(remote, remoteSize));
+                    if (found) {
+                        write(peer.lws, peer.shard, peer.id,
+                              stamped(statusMsg(peer.binary, binProto_t::msgType_t::MT_CALL_STATUS, false),
+                                      rxTime, metrics_t::LT_CALL));
+                    }
+                    break;
+                }
+                case cluster_t::msgType_t::NM_RELAY: {
+                    bool paired = false;
+                    if (found) {
+                        auto &shard = *m_shards[peer.shard];
+                        std::unique_lock<std::mutex> lck(shard.mtx);
+                        auto i = shard.peers.find(peer.lws);
+                        paired = (i != shard.peers.end()) && (i->second->id == peer.id) && pairedWith(*i->second);
+                    }
+                    if (!paired) {
+                        TGWSS_LOG(m_logger, LL_DEBUG,
+                                  FMT_STRING("clusterReceive: no subscriber, message dropped - {:s}"), token);
+                        break;
+                    }
+
+                    auto message = m_framePool.get(msg.dataSize);
+                    message->append(msg.data, msg.dataSize);
+                    auto relayType = metrics_t::relayType(*message, msg.binary);
+                    if (msg.binary != peer.binary) {
+                        framePtr_t transcoded;
+                        if (!(msg.binary ? binProto_t::binToJson(*message, m_framePool, transcoded) :
+                              binProto_t::jsonToBin(*message, m_framePool, transcoded))) {
+                            metrics_t::inc(counters.parseFailures);
+                            TGWSS_LOG(m_logger, LL_WARNING,
+                                      FMT_STRING("clusterReceive: message can't be re-encoded, dropped - {:s}"),
+                                      token);
+                            break;
+                        }
+                        message = std::move(transcoded);
+                    }
+                    message->stamp(rxTime, metrics_t::latencyType(relayType));
+                    write(peer.lws, peer.shard, peer.id, std::move(message));
+                    break;
+                }
+                case cluster_t::msgType_t::NM_HANGUP: {
+                    bool notify = false;
+                    bool caller = false;
+                    if (found) {
+                        auto &shard = *m_shards[peer.shard];
+                        std::unique_lock<std::mutex> lck(shard.mtx);
+                        auto i = shard.peers.find(peer.lws);
+                        if ((i != shard.peers.end()) && (i->second->id == peer.id) && pairedWith(*i->second)) {
+                            caller = i->second->caller;
+                            i->second->subscriberNode = 0;
+                            i->second->subscriberToken.clear();
+                            i->second->caller = false;
+                            notify = true;
+                        }
+                    }
+                    if (notify) {
+                        if (caller) {
+                            metrics_t::inc(counters.callsEnded);
+                        }
+                        write(peer.lws, peer.shard, peer.id,
+                              stringMsg(peer.binary, binProto_t::msgType_t::MT_INFO, "disconnected"));
+                    }
+                    break;
+                }
+                default: {
+                    break;
+                }
+            }
+        } catch (...) {
+            TGWSS_LOG(m_logger, LL_ERROR, FMT_STRING("clusterReceive: internal error"));
+        }
+    }
+
+    void wsServer_t::clusterNodeDown(uint16_t _node) noexcept {
+        try {
+            m_cluster->removeNode(_node);
+
+            struct unpaired_t {
+                struct lws *lws;
+                std::size_t shard;
+                uint64_t id;
+                bool binary;
+                bool caller;
+            };
+            std::vector<unpaired_t> unpaired;
+            for (std::size_t i = 0; i < m_shards.size(); ++i) {
+                auto &shard = *m_shards[i];
+                std::unique_lock<std::mutex> lck(shard.mtx);
+                for (auto &j:shard.peers) {
+                    if (j.second->subscriberNode == _node) {
+                        unpaired.push_back(unpaired_t {j.first, i, j.second->id, j.second->binary, j.second->caller});
+                        j.second->subscriberNode = 0;
+                        j.second->subscriberToken.clear();
+                        j.second->caller = false;
+                    }
+                }
+            }
+            for (const auto &i:unpaired) {
+                if (i.caller) {
+                    metrics_t::inc(m_metrics.counters(g_shardIdx).callsEnded);
+                }
+                write(i.lws, i.shard, i.id, stringMsg(i.binary, binProto_t::msgType_t::MT_INFO, "disconnected"));
             }
-            m_peers.erase(peer);
-            m_logger->log(logger_t::logLevel_t::LL_DEBUG, "remove: peer {:p}", fmt::ptr(_lws));
         } catch (...) {
-            m_logger->log(logger_t::logLevel_t::LL_ERROR, "remove: internal error");
+            TGWSS_LOG(m_logger, LL_ERROR, FMT_STRING("clusterNodeDown: internal error"));
         }
     }
 } // namespace tgwss
@@ -15,38 +15,218 @@
 #include <unordered_set>
 #include <queue>
 #include <atomic>
+#include <mutex>
+#include <thread>
+#include <memory>
 
 #include <libwebsockets.h>
 #include <libwebsockets/lws-network-helper.h>
 
+#include "admissionControl.h"
+#include "tokenDirectory.h"
+#include "frameBuffer.h"
+#include "writeQueue.h"
+#include "slabPool.h"
+#include "inlineToken.h"
+#include "binProto.h"
+#include "metrics.h"
+#include "cluster.h"
+#include "handoff.h"
+#include "tlsSessions.h"
+#include "pendingCalls.h"
+#include "rooms.h"
+
 namespace tgwss {
     class confParser_t;
     class logger_t;
 
     class wsServer_t {
     private:
-        struct lws_protocols m_wsProtocol {};
+        // "tgwss" (JSON) & "tgwss-bin" (binary) subprotocols, null terminated
+        struct lws_protocols m_wsProtocols[3] {};
+        // permessage-deflate, null terminated
+        struct lws_extension m_wsExtensions[2] {};
         struct lws_context_creation_info m_wsInfo {};
         struct lws_context *m_wsContext = nullptr;
 
+        // plain HTTP vhost serving /metrics, null terminated
+        struct lws_protocols m_metricsProtocols[2] {};
+        struct lws_context_creation_info m_metricsInfo {};
+        // lws per session data of /metrics requests
+        struct metricsSession_t {
+            std::string *body;
+            std::size_t sent;
+        };
+
+        // inter-node links vhost, null terminated
+        struct lws_protocols m_clusterProtocols[2] {};
+        struct lws_context_creation_info m_clusterInfo {};
+
+        // vhost of the listening socket adopted as a raw descriptor, null terminated
+        struct lws_protocols m_listenProtocols[2] {};
+        struct lws_context_creation_info m_listenInfo {};
+
         logger_t *m_logger = nullptr;
 
-        // basic client data
+        // permessage-deflate settings, in the form lws_set_extension_option() takes them
+        bool m_deflate;
+        std::string m_deflateWindowBits;
+        std::string m_deflateMemLevel;
+
+        // lws per session data, owned by the peer's service thread
+        struct sessionData_t {
+            bool deflate;
+            uint64_t txRawBytes;
+            uint64_t txDeflatedBytes;
+            uint64_t rxDeflatedBytes;
+            uint64_t rxRawBytes;
+            uint64_t deflateNs;
+            uint64_t inflateNs;
+            // the sender of the message whose fragments are being written, null if none
+            const void *fragmentSource;
+        };
+
+        // basic client data, an idle peer holds no heap memory (frames are taken from the pool while
+        // a message is read or queued)
         struct peerData_t {
-            lws_close_status closeStatus = LWS_CLOSE_STATUS_NO_STATUS;
-            std::string token;
-            std::vector<char> readBuf;
-            std::queue<std::vector<unsigned char>> writeQueue;
+            framePtr_t readFrame;
+            writeQueue_t writeQueue;
+            // unique per connection, an lws is reused by later connections, so another peer is referred to
+            // by its lws & id, which is checked under the lock of its shard before anything is queued to it
+            uint64_t id = 0;
             struct lws *subscriber = nullptr;
+            uint64_t subscriberId = 0;
+            uint32_t subscriberShard = 0;
+            lws_close_status closeStatus = LWS_CLOSE_STATUS_NO_STATUS;
+            // the subscriber is online on another node
+            uint16_t subscriberNode = 0;
+            // the call started by this peer with a remote subscriber is accounted by this node
+            bool caller = false;
+            // relay type of the message being relayed as it's received
+            uint8_t cutThroughType = 0;
+            // subprotocols of the peer & its subscriber, the lws of another thread's peer is never dereferenced
+            bool binary = false;
+            bool subscriberBinary = false;
+            // the subscriber of the message being relayed as it's received (cut-through), null if none
+            struct lws *cutThrough = nullptr;
+            uint64_t cutThroughId = 0;
+            uint32_t cutThroughShard = 0;
+            uint32_t cutThroughSize = 0;
+            inlineToken_t token;
+            inlineToken_t subscriberToken;
+
+            peerData_t(const std::string &_token, uint64_t _id, bool _binary, uint32_t _queueMsgLimit):
+                    writeQueue(_queueMsgLimit), id(_id), binary(_binary) {
+                token.assign(_token);
+            }
 
-            explicit peerData_t(std::string _token): token(std::move(_token)) {}
+            bool paired() const noexcept {return (subscriber != nullptr) || (subscriberNode != 0);}
         };
 
-        // pairs of peer's lws & their data
-        std::unordered_map<struct lws *, std::unique_ptr<peerData_t>> m_peers;
+        // must outlive the frames held by peers
+        framePool_t m_framePool;
+
+        // peers served by one lws service thread, the lock is held for short sections only and
+        // never together with the lock of another shard
+        struct shard_t {
+            std::mutex mtx;
+            // pairs of peer's lws & their data
+            std::unordered_map<struct lws *, peerData_t *> peers;
+            // peers data, created & destroyed by the service thread of the shard
+            slabPool_t<peerData_t> peersPool;
+            // peers with data queued by other service threads
+            std::vector<struct lws *> wakeups;
+
+            ~shard_t() {
+                for (auto &i:peers) {
+                    peersPool.destroy(i.second);
+                }
+            }
+        };
+        std::vector<std::unique_ptr<shard_t>> m_shards;
+
+        // connection ids, 0 is none
+        std::atomic<uint64_t> m_peerIds {0};
+
+        // online peers by token
+        tokenDirectory_t m_tokenDirectory;
+
+        // calls to offline tokens waiting for the callee
+        pendingCalls_t m_pendingCalls;
+
+        // group call rooms
+        rooms_t m_rooms;
+
+        // connection caps & rate limit
+        admissionControl_t m_admissionControl;
+
+        // tokens online on other nodes & links to them, null if cluster mode is disabled
+        std::unique_ptr<cluster_t> m_cluster;
+
+        // per service thread counters
+        metrics_t m_metrics;
+
+        // listening socket hand-off to a new process, null if upgrades are disabled
+        std::unique_ptr<handoff_t> m_handoff;
+        const uint16_t m_bindPort;
+        const uint16_t m_drainTimeout;
+        struct lws_vhost *m_wsVhost = nullptr;
+        // the adopted listening socket, null once it's closed
+        std::atomic<struct lws *> m_listenWsi {nullptr};
+        // cleared when the listening socket is handed off
+        std::atomic<bool> m_accepting {true};
+
+        // reloadable settings: write queue limits & overflow policy
+        std::atomic<uint16_t> m_queueMsgLimit;
+        std::atomic<uint32_t> m_queueSizeLimit;
+        std::atomic<bool> m_queueDropOldest;
+        // max number of frames written per writeable callback
+        std::atomic<uint16_t> m_writeBatch;
+        // peers inactivity timeout (sec)
+        std::atomic<uint16_t> m_ioTimeout;
+        // pending calls lifetime (sec), 0 - calls to offline tokens are rejected at once
+        std::atomic<uint16_t> m_callTtl;
+        // max size of a client's message
+        std::atomic<uint32_t> m_msgSizeLimit;
+        // relay messages of paired peers of the same subprotocol as they are received
+        std::atomic<bool> m_cutThrough;
+        // max number of members of a room, 0 - rooms are disabled
+        std::atomic<uint16_t> m_roomSizeLimit;
+
+        // TLS certificate & key, reloaded by service thread 0 when the flag is set
+        std::string m_certFile;
+        std::string m_pkeyFile;
+        std::atomic<bool> m_reloadCerts {false};
+        // session resumption & handshake counters of TLS connections, null if ssl is disabled
+        std::unique_ptr<tlsSessions_t> m_tlsSessions;
+
+    public:
+        struct queueStats_t {
+            std::atomic<uint64_t> queuedMsgs {0};
+            std::atomic<uint64_t> queuedBytes {0};
+            std::atomic<uint64_t> droppedMsgs {0};
+            std::atomic<uint64_t> evictedPeers {0};
+            std::atomic<uint64_t> writtenMsgs {0};
+            std::atomic<uint64_t> writeBatches {0};
+        };
+
+        struct deflateStats_t {
+            // closed connections with negotiated permessage-deflate
+            std::atomic<uint64_t> peers {0};
+            std::atomic<uint64_t> txRawBytes {0};
+            std::atomic<uint64_t> txDeflatedBytes {0};
+            std::atomic<uint64_t> rxDeflatedBytes {0};
+            std::atomic<uint64_t> rxRawBytes {0};
+            std::atomic<uint64_t> deflateNs {0};
+            std::atomic<uint64_t> inflateNs {0};
+        };
+
+    private:
+        queueStats_t m_queueStats;
+        deflateStats_t m_deflateStats;
 
         std::atomic<bool> m_stopFlag {false};
-        std::unique_ptr<std::thread> m_eventProcessingThread;
+        std::vector<std::thread> m_eventProcessingThreads;
 
     public:
         wsServer_t(const confParser_t *_confParser, logger_t *_logger);
@@ -55,19 +235,84 @@ namespace tgwss {
         void start();
         void stop();
 
+        const queueStats_t &queueStats() const noexcept {return m_queueStats;}
+        const deflateStats_t &deflateStats() const noexcept {return m_deflateStats;}
+        const admissionControl_t::stats_t &admissionStats() const noexcept {return m_admissionControl.stats();}
+        /// appends all the server metrics in Prometheus text format to _out
+        void metrics(std::string &_out);
+        /// logs receive to write latency quantiles by message type
+        void dumpLatency() noexcept;
+        /// applies the reloadable settings of _confParser, may be called from any thread
+        void reload(const confParser_t *_confParser) noexcept;
+
     private:
         static int wscbService(struct lws *_lws, enum lws_callback_reasons _reason,
                                void *_user, void *_data, size_t _size) noexcept;
-        static void eventProcessingWorker(wsServer_t *_wsServer);
+        static int wscbDeflate(struct lws_context *_context, const struct lws_extension *_ext, struct lws *_lws,
+                               enum lws_extension_callback_reasons _reason,
+                               void *_user, void *_data, size_t _size) noexcept;
+        static int wscbMetrics(struct lws *_lws, enum lws_callback_reasons _reason,
+                               void *_user, void *_data, size_t _size) noexcept;
+        static int wscbCluster(struct lws *_lws, enum lws_callback_reasons _reason,
+                               void *_user, void *_data, size_t _size) noexcept;
+        static int wscbListen(struct lws *_lws, enum lws_callback_reasons _reason,
+                              void *_user, void *_data, size_t _size) noexcept;
+        static void eventProcessingWorker(wsServer_t *_wsServer, std::size_t _tsi);
 
+        void wakeup() noexcept;
+        /// @returns false if the connection on socket _fd is rejected by admission control
+        bool admit(int _fd) noexcept;
+        /// accepts pending connections of the listening socket & adopts them to the websocket vhost
+        void accept(struct lws *_lws) noexcept;
+        /// called by the hand-off thread, waits until the connections are closed & stops the process
+        void handedOff() noexcept;
+        void reloadCerts() noexcept;
+        void deflateInit(struct lws *_lws) noexcept;
+        void deflateDone(struct lws *_lws) noexcept;
+        /// queues _frame to _lws of service thread _shard if _lws is still connection _id, _id is 0 for a peer of
+        /// the calling thread, which can't be gone meanwhile
         bool write(struct lws *_lws,
-                   const void *_message,
-                   std::size_t _size,
+                   std::size_t _shard,
+                   uint64_t _id,
+                   framePtr_t _frame,
                    lws_close_status _closeStatus = LWS_CLOSE_STATUS_NO_STATUS) noexcept;
+        /// queues _frame to _lws, the lock of its shard is held by the caller, @returns false if nothing is queued
+        /// (the peer is closing) and the peer needn't be woken up
+        bool enqueue(struct lws *_lws, peerData_t &_peerData, framePtr_t _frame, lws_close_status _closeStatus);
+        /// queues _message of _lws to all the other _members, every service thread gets one frame of each
+        /// subprotocol shared by its members
+        void fanOut(struct lws *_lws, const rooms_t::members_t &_members, framePtr_t _message) noexcept;
+        /// removes _lws from its room, the members left are notified
+        void leaveRoom(struct lws *_lws, const inlineToken_t &_token) noexcept;
+        bool binary(struct lws *_lws) const noexcept;
+        /// releases the write queue storage of _lws if it has been idle since the previous call
+        void trim(struct lws *_lws) noexcept;
+        framePtr_t statusMsg(struct lws *_lws, binProto_t::msgType_t _type, bool _status);
+        framePtr_t statusMsg(bool _binary, binProto_t::msgType_t _type, bool _status);
+        framePtr_t stringMsg(struct lws *_lws, binProto_t::msgType_t _type, const std::string &_value);
+        framePtr_t stringMsg(bool _binary, binProto_t::msgType_t _type, const std::string &_value);
+        static framePtr_t stamped(framePtr_t _frame, uint64_t _rxTime, metrics_t::latencyType_t _type) noexcept;
         void closeWithErrMsg(struct lws *_lws, enum lws_close_status _status, const std::string &_errMsg) noexcept;
         bool logon(struct lws *_lws, const void *_data, std::size_t _size) noexcept;
         bool retransmit(struct lws *_lws, const void *_data, std::size_t _size) noexcept;
+        /// relays a part of the message of _lws to its subscriber right away, _lck (of the shard of _lws) is released
+        bool relayFragment(struct lws *_lws, peerData_t &_peerData, std::unique_lock<std::mutex> &_lck,
+                           const void *_data, std::size_t _size, bool _final);
         void remove(struct lws *_lws) noexcept;
+        /// @returns estimated memory (bytes) an idle logged on peer takes besides libwebsockets' own
+        /// @returns the estimated peer state memory of an idle logged on peer, computed from type sizes
+        static std::size_t peerStateSize() noexcept;
+        /// pairs the caller of pending call _call with just logged on _callee & sends the call to the callee
+        void deliverCall(const pendingCalls_t::call_t &_call, const tokenDirectory_t::entry_t &_callee) noexcept;
+        /// answers the caller of _call that the callee is offline
+        void rejectCall(const pendingCalls_t::call_t &_call) noexcept;
+        void expireCalls() noexcept;
+        /// forwards the pending calls to _tokens just logged on to _node
+        void clusterAnnounced(uint16_t _node, const std::vector<std::string> &_tokens) noexcept;
+        /// processes call routing message _frame of _node
+        void clusterReceive(uint16_t _node, const frame_t &_frame) noexcept;
+        /// unpairs local peers from the peers of _node
+        void clusterNodeDown(uint16_t _node) noexcept;
     };
 } // namespace tgwss
 